@@ -0,0 +1,591 @@
+/*
+ * N2PK Vector Network Analyzer
+ * Copyright © 2021-2022 D Scott Guthridge <scott_guthridge@rompromity.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A11 PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+#include "n2pkvna_internal.h"
+
+/* more than the library's maximum transfers in flight */
+#define MAX_PENDING		256
+
+/*
+ * latency_t: collected transfer latencies for one direction
+ */
+typedef struct latency {
+    double	       *lat_vector;	/* latencies (s) */
+    size_t		lat_count;	/* number of latencies */
+    size_t		lat_allocation;	/* allocated entries */
+} latency_t;
+
+/*
+ * pending_t: asynchronous transfer waiting for its completion record
+ */
+typedef struct pending {
+    uint32_t		pnd_id;		/* transfer id or zero */
+    uint64_t		pnd_time;	/* submit time (ns) */
+} pending_t;
+
+/*
+ * global options
+ */
+static char *progname;
+static const char short_options[] = "f:hlLn:N:p:r:U:";
+static const struct option long_options[] = {
+    { "frequency-range",	1, NULL, 'f' },
+    { "help",			0, NULL, 'h' },
+    { "linear",			0, NULL, 'l' },
+    { "log",			0, NULL, 'L' },
+    { "points",			1, NULL, 'n' },
+    { "name",			1, NULL, 'N' },
+    { "phase-steps",		1, NULL, 'p' },
+    { "repeat",			1, NULL, 'r' },
+    { "unit",			1, NULL, 'U' },
+    { NULL,			0, NULL,  0  }
+};
+static const char *const usage[] = {
+    "[-lL] [-f fMin:fMax] [-n points,...] [-N name] [-p steps,...]",
+    "    [-r repeat] [-U unit]",
+    "-h",
+    NULL
+};
+static const char *const help[] = {
+    "Options",
+    " -f|--frequency-range=fMin:fMax  scan range in MHz (default 0.05:60)",
+    " -h|--help                       print this help message",
+    " -l|--linear                     run only linearly spaced scans",
+    " -L|--log                        run only log spaced scans",
+    " -n|--points=points,...          points per scan (default 10,100,1000)",
+    " -N|--name=name                  select the VNA configuration directory",
+    " -p|--phase-steps=steps,...      LO phase steps per point (default 8)",
+    " -r|--repeat=repeat              scans per setting (default 3)",
+    " -U|--unit=unit-address          select the device (default sim)",
+    "",
+    "Runs n2pkvna_scan over every combination of the settings and writes",
+    "points per second, retry and backoff counts and CPU time for each",
+    "scan as YAML.  The scans are timed with the USB recorder off; a",
+    "separate untimed pass per phase setting records the transfers and",
+    "reports their write and read latency percentiles in microseconds.",
+    NULL
+};
+
+/*
+ * print_error: print errors from the n2pkvna library
+ *   @message: error message (without newline)
+ *   @arg: unused
+ */
+static void print_error(const char *message, void *arg)
+{
+    (void)fprintf(stderr, "%s: %s\n", progname, message);
+}
+
+/*
+ * print_usage: print a usage message and exit
+ *   @status: exit code
+ */
+static void print_usage(int status)
+{
+    const char *const *cpp;
+
+    for (cpp = usage; *cpp != NULL; ++cpp) {
+	(void)fprintf(stderr, "usage: %s %s\n", progname, *cpp);
+    }
+    for (cpp = help; *cpp != NULL; ++cpp) {
+	(void)fprintf(stderr, "%s\n", *cpp);
+    }
+    exit(status);
+}
+
+/*
+ * parse_list: parse a comma-separated list of positive integers
+ *   @text: text to parse
+ *   @vector: returned vector of values (malloc'd)
+ */
+static int parse_list(const char *text, int **vector)
+{
+    int *values = NULL;
+    int count = 0;
+    const char *cp = text;
+
+    for (;;) {
+	char *end;
+	long value;
+	int *new_values;
+
+	errno = 0;
+	value = strtol(cp, &end, 10);
+	if (end == cp || errno != 0 || value < 1 || value > 1000000 ||
+		(*end != ',' && *end != '\000')) {
+	    (void)fprintf(stderr, "%s: invalid list: %s\n", progname, text);
+	    free((void *)values);
+	    return -1;
+	}
+	if ((new_values = realloc(values, (count + 1) *
+			sizeof(int))) == NULL) {
+	    (void)fprintf(stderr, "%s: realloc: %s\n", progname,
+		    strerror(errno));
+	    free((void *)values);
+	    return -1;
+	}
+	values = new_values;
+	values[count++] = value;
+	if (*end == '\000') {
+	    break;
+	}
+	cp = end + 1;
+    }
+    *vector = values;
+    return count;
+}
+
+/*
+ * latency_add: add a latency to the collection
+ *   @latp: latency collection
+ *   @value: latency (s)
+ */
+static int latency_add(latency_t *latp, double value)
+{
+    if (latp->lat_count >= latp->lat_allocation) {
+	size_t new_allocation = latp->lat_allocation == 0 ? 1024 :
+	    2 * latp->lat_allocation;
+	double *new_vector;
+
+	if ((new_vector = realloc(latp->lat_vector, new_allocation *
+			sizeof(double))) == NULL) {
+	    (void)fprintf(stderr, "%s: realloc: %s\n", progname,
+		    strerror(errno));
+	    return -1;
+	}
+	latp->lat_vector = new_vector;
+	latp->lat_allocation = new_allocation;
+    }
+    latp->lat_vector[latp->lat_count++] = value;
+    return 0;
+}
+
+/*
+ * load_latencies: add the write and read latencies from a transcript
+ *   @filename: transcript from n2pkvna_record_start
+ *   @write_latency: OUT transfer latencies
+ *   @read_latency: IN transfer latencies
+ *
+ * Synchronous transfers contribute their duration; asynchronous
+ * transfers the time from submit to completion.  Transfers that
+ * failed or were canceled are skipped.
+ */
+static int load_latencies(const char *filename, latency_t *write_latency,
+	latency_t *read_latency)
+{
+    FILE *fp;
+    unsigned char header[RECORD_HEADER_SIZE];
+    pending_t pending_vector[MAX_PENDING];
+    int rv = -1;
+
+    (void)memset((void *)pending_vector, 0, sizeof(pending_vector));
+    if ((fp = fopen(filename, "r")) == NULL) {
+	(void)fprintf(stderr, "%s: fopen: %s: %s\n", progname, filename,
+		strerror(errno));
+	return -1;
+    }
+    if (fread(header, RECORD_MAGIC_SIZE, 1, fp) != 1 ||
+	    memcmp(header, RECORD_MAGIC, RECORD_MAGIC_SIZE) != 0) {
+	(void)fprintf(stderr, "%s: %s: not an n2pkvna recording\n",
+		progname, filename);
+	goto out;
+    }
+    while (fread(header, sizeof(header), 1, fp) == 1) {
+	int type = header[0];
+	bool is_read = (header[1] & 0x80) != 0;
+	int32_t result = (int32_t)get32(&header[4]);
+	uint64_t time = get64(&header[8]);
+	uint32_t duration = get32(&header[16]);
+	uint32_t id = get32(&header[20]);
+	uint32_t length = get32(&header[24]);
+	latency_t *latp = is_read ? read_latency : write_latency;
+	pending_t *pndp = &pending_vector[id % MAX_PENDING];
+
+	if (length != 0 && fseek(fp, length, SEEK_CUR) == -1) {
+	    (void)fprintf(stderr, "%s: fseek: %s: %s\n", progname,
+		    filename, strerror(errno));
+	    goto out;
+	}
+	switch (type) {
+	case RECORD_BULK:
+	    if (result == 0 && latency_add(latp, duration * 1.0e-9) == -1) {
+		goto out;
+	    }
+	    break;
+
+	case RECORD_SUBMIT:
+	    if (result == 0) {
+		pndp->pnd_id = id;
+		pndp->pnd_time = time;
+	    }
+	    break;
+
+	case RECORD_COMPLETE:
+	    if (pndp->pnd_id == id && id != 0) {
+		pndp->pnd_id = 0;
+		if (result == 0 && latency_add(latp,
+			    (time - pndp->pnd_time) * 1.0e-9) == -1) {
+		    goto out;
+		}
+	    }
+	    break;
+
+	default:
+	    break;
+	}
+    }
+    if (ferror(fp)) {
+	(void)fprintf(stderr, "%s: fread: %s: %s\n", progname, filename,
+		strerror(errno));
+	goto out;
+    }
+    rv = 0;
+
+out:
+    (void)fclose(fp);
+    return rv;
+}
+
+/*
+ * compare_double: qsort comparison function for doubles
+ */
+static int compare_double(const void *p1, const void *p2)
+{
+    double d1 = *(const double *)p1;
+    double d2 = *(const double *)p2;
+
+    return d1 < d2 ? -1 : d1 > d2 ? 1 : 0;
+}
+
+/*
+ * print_latency: print count and percentiles of a latency collection
+ *   @name: YAML key
+ *   @latp: latency collection
+ */
+static void print_latency(const char *name, latency_t *latp)
+{
+    static const double percentiles[] = { 50.0, 90.0, 99.0, 100.0 };
+    static const char *const keys[] = { "p50", "p90", "p99", "max" };
+    size_t n = latp->lat_count;
+
+    (void)printf("    %s:\n", name);
+    (void)printf("      count: %zu\n", n);
+    if (n == 0) {
+	return;
+    }
+    qsort((void *)latp->lat_vector, n, sizeof(double), compare_double);
+    for (size_t i = 0; i < sizeof(keys) / sizeof(keys[0]); ++i) {
+	size_t rank = (size_t)(percentiles[i] / 100.0 * n + 0.5);
+
+	if (rank < 1) {
+	    rank = 1;
+	}
+	if (rank > n) {
+	    rank = n;
+	}
+	(void)printf("      %s: %.1f\n", keys[i],
+		latp->lat_vector[rank - 1] * 1.0e+6);
+    }
+}
+
+/*
+ * timeval_diff: return the difference between two timevals in seconds
+ */
+static double timeval_diff(const struct timeval *tv1,
+	const struct timeval *tv0)
+{
+    return (double)(tv1->tv_sec - tv0->tv_sec) +
+	(double)(tv1->tv_usec - tv0->tv_usec) * 1.0e-6;
+}
+
+/*
+ * main
+ */
+int main(int argc, char **argv)
+{
+    double f0 = 0.05e+6;
+    double ff = 60.0e+6;
+    bool opt_l = false;
+    bool opt_L = false;
+    int *points_vector = NULL;
+    int points_count = 0;
+    int *steps_vector = NULL;
+    int steps_count = 0;
+    int repeat = 3;
+    const char *opt_N = NULL;
+    const char *unit = "sim";
+    int max_points = 0;
+    double *frequency_vector = NULL;
+    double complex *detector1_vector = NULL;
+    double complex *detector2_vector = NULL;
+    latency_t write_latency = { NULL, 0, 0 };
+    latency_t read_latency = { NULL, 0, 0 };
+    char transcript[] = "/tmp/n2pkvna-bench.XXXXXX";
+    int fd = -1;
+    n2pkvna_t *vnap = NULL;
+    int exitcode = 1;
+
+    /*
+     * Parse options.
+     */
+    if ((progname = strrchr(argv[0], '/')) == NULL) {
+	progname = argv[0];
+    } else {
+	++progname;
+    }
+    for (;;) {
+	switch (getopt_long(argc, argv, short_options, long_options, NULL)) {
+	case -1:
+	    break;
+
+	case 'f':
+	    if (sscanf(optarg, "%lf:%lf", &f0, &ff) != 2 || f0 <= 0.0 ||
+		    ff < f0) {
+		(void)fprintf(stderr, "%s: invalid frequency range: %s\n",
+			progname, optarg);
+		print_usage(2);
+	    }
+	    f0 *= 1.0e+6;
+	    ff *= 1.0e+6;
+	    continue;
+
+	case 'h':
+	    print_usage(0);
+	    continue;
+
+	case 'l':
+	    opt_l = true;
+	    continue;
+
+	case 'L':
+	    opt_L = true;
+	    continue;
+
+	case 'n':
+	    free((void *)points_vector);
+	    if ((points_count = parse_list(optarg, &points_vector)) == -1) {
+		print_usage(2);
+	    }
+	    continue;
+
+	case 'N':
+	    opt_N = optarg;
+	    continue;
+
+	case 'p':
+	    free((void *)steps_vector);
+	    if ((steps_count = parse_list(optarg, &steps_vector)) == -1) {
+		print_usage(2);
+	    }
+	    continue;
+
+	case 'r':
+	    if ((repeat = atoi(optarg)) < 1) {
+		(void)fprintf(stderr, "%s: invalid repeat count: %s\n",
+			progname, optarg);
+		print_usage(2);
+	    }
+	    continue;
+
+	case 'U':
+	    unit = optarg;
+	    continue;
+
+	default:
+	    print_usage(2);
+	}
+	break;
+    }
+    if (optind != argc) {
+	print_usage(2);
+    }
+    if (!opt_l && !opt_L) {
+	opt_l = true;
+	opt_L = true;
+    }
+    if (points_count == 0 && (points_count = parse_list("10,100,1000",
+		    &points_vector)) == -1) {
+	goto out;
+    }
+    if (steps_count == 0 && (steps_count = parse_list("8",
+		    &steps_vector)) == -1) {
+	goto out;
+    }
+    for (int i = 0; i < points_count; ++i) {
+	if (points_vector[i] > max_points) {
+	    max_points = points_vector[i];
+	}
+    }
+    if ((frequency_vector = calloc(max_points, sizeof(double))) == NULL ||
+	    (detector1_vector = calloc(max_points,
+		sizeof(double complex))) == NULL ||
+	    (detector2_vector = calloc(max_points,
+		sizeof(double complex))) == NULL) {
+	(void)fprintf(stderr, "%s: calloc: %s\n", progname, strerror(errno));
+	goto out;
+    }
+
+    /*
+     * Create the transcript file used to measure transfer latencies.
+     */
+    if ((fd = mkstemp(transcript)) == -1) {
+	(void)fprintf(stderr, "%s: mkstemp: %s: %s\n", progname,
+		transcript, strerror(errno));
+	goto out;
+    }
+
+    /*
+     * Open and reset the device.
+     */
+    if ((vnap = n2pkvna_open(opt_N, /*create*/true, unit,
+		    /*config_vector*/NULL, print_error, NULL)) == NULL) {
+	goto out;
+    }
+    if (n2pkvna_reset(vnap) == -1) {
+	goto out;
+    }
+
+    /*
+     * Run each combination of settings.
+     */
+    (void)printf("unit: %s\n", unit);
+    (void)printf("frequencyRange: [%.6e, %.6e]\n", f0, ff);
+    (void)printf("phaseSettings:\n");
+    for (int s = 0; s < steps_count; ++s) {
+	if (n2pkvna_set_phase_steps(vnap, steps_vector[s]) == -1) {
+	    goto out;
+	}
+	(void)printf("  - phaseSteps: %d\n", steps_vector[s]);
+	(void)printf("    runs:\n");
+	for (int p = 0; p < points_count; ++p) {
+	    for (int spacing = 0; spacing < 2; ++spacing) {
+		bool linear = spacing == 0;
+
+		if (linear ? !opt_l : !opt_L) {
+		    continue;
+		}
+		for (int r = 0; r < repeat; ++r) {
+		    n2pkvna_stats_t stats0, stats1;
+		    struct timespec start, end;
+		    struct rusage usage0, usage1;
+		    double elapsed;
+
+		    n2pkvna_get_stats(vnap, &stats0);
+		    (void)getrusage(RUSAGE_SELF, &usage0);
+		    (void)clock_gettime(CLOCK_MONOTONIC, &start);
+		    if (n2pkvna_scan(vnap, f0, ff, points_vector[p], linear,
+				frequency_vector, detector1_vector,
+				detector2_vector) == -1) {
+			goto out;
+		    }
+		    (void)clock_gettime(CLOCK_MONOTONIC, &end);
+		    (void)getrusage(RUSAGE_SELF, &usage1);
+		    n2pkvna_get_stats(vnap, &stats1);
+		    elapsed = (double)(end.tv_sec - start.tv_sec) +
+			(double)(end.tv_nsec - start.tv_nsec) * 1.0e-9;
+		    (void)printf("      - points: %d\n", points_vector[p]);
+		    (void)printf("        spacing: %s\n",
+			    linear ? "linear" : "log");
+		    (void)printf("        repeat: %d\n", r);
+		    (void)printf("        seconds: %.6f\n", elapsed);
+		    (void)printf("        pointsPerSecond: %.3f\n",
+			    elapsed > 0.0 ? points_vector[p] / elapsed : 0.0);
+		    (void)printf("        userCPU: %.6f\n", timeval_diff(
+				&usage1.ru_utime, &usage0.ru_utime));
+		    (void)printf("        systemCPU: %.6f\n", timeval_diff(
+				&usage1.ru_stime, &usage0.ru_stime));
+		    (void)printf("        measurements: %llu\n",
+			    (unsigned long long)(stats1.ns_measurements -
+				stats0.ns_measurements));
+		    (void)printf("        misses: %llu\n",
+			    (unsigned long long)(stats1.ns_misses -
+				stats0.ns_misses));
+		    (void)printf("        retries: %llu\n",
+			    (unsigned long long)(stats1.ns_retries -
+				stats0.ns_retries));
+		    (void)printf("        backoffSleeps: %llu\n",
+			    (unsigned long long)(stats1.ns_backoff_sleeps -
+				stats0.ns_backoff_sleeps));
+		    (void)fflush(stdout);
+		}
+	    }
+	}
+
+	/*
+	 * Record one untimed scan of each point count and spacing at
+	 * this phase setting and report the transfer latencies.
+	 */
+	write_latency.lat_count = 0;
+	read_latency.lat_count = 0;
+	for (int p = 0; p < points_count; ++p) {
+	    for (int spacing = 0; spacing < 2; ++spacing) {
+		bool linear = spacing == 0;
+
+		if (linear ? !opt_l : !opt_L) {
+		    continue;
+		}
+		if (n2pkvna_record_start(vnap, transcript) == -1) {
+		    goto out;
+		}
+		if (n2pkvna_scan(vnap, f0, ff, points_vector[p], linear,
+			    frequency_vector, detector1_vector,
+			    detector2_vector) == -1) {
+		    (void)n2pkvna_record_stop(vnap);
+		    goto out;
+		}
+		if (n2pkvna_record_stop(vnap) == -1) {
+		    goto out;
+		}
+		if (load_latencies(transcript, &write_latency,
+			    &read_latency) == -1) {
+		    goto out;
+		}
+	    }
+	}
+	print_latency("writeLatency", &write_latency);
+	print_latency("readLatency", &read_latency);
+	(void)fflush(stdout);
+    }
+    exitcode = 0;
+
+out:
+    if (vnap != NULL) {
+	n2pkvna_close(vnap);
+    }
+    if (fd != -1) {
+	(void)close(fd);
+	(void)unlink(transcript);
+    }
+    free((void *)read_latency.lat_vector);
+    free((void *)write_latency.lat_vector);
+    free((void *)detector2_vector);
+    free((void *)detector1_vector);
+    free((void *)frequency_vector);
+    free((void *)steps_vector);
+    free((void *)points_vector);
+    exit(exitcode);
+}
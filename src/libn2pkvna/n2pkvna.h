@@ -56,6 +56,7 @@ typedef struct n2pkvna n2pkvna_t;
 /* values for adr_type field */
 #define N2PKVNA_ADR_ANY		0x00000000	/* unspecified interface */
 #define N2PKVNA_ADR_USB		0x75736201	/* USB (v1 struct) */
+#define N2PKVNA_ADR_SIM		0x73696d01	/* simulated device */
 
 /* n2pkvna_address_v1_t: device address information (version 1) */
 typedef struct n2pkvna_address {
@@ -90,6 +91,46 @@ typedef struct n2pkvna_config {
     size_t		nc_count;	/* number of addresses */
 } n2pkvna_config_t;
 
+/* number of buckets in the ns_transfer_histogram */
+#define N2PKVNA_STATS_BUCKETS	16
+
+/* n2pkvna_stats_t: measurement statistics */
+typedef struct n2pkvna_stats {
+    uint64_t		ns_measurements; /* results received */
+    uint64_t		ns_misses;	/* results not ready when first polled */
+    uint64_t		ns_retries;	/* polls that found no result */
+    uint64_t		ns_transfers;	/* USB bulk transfers completed */
+    uint64_t		ns_transfer_errors; /* USB bulk transfers failed */
+    uint64_t		ns_bytes_out;	/* bytes sent to the device */
+    uint64_t		ns_bytes_in;	/* bytes received from the device */
+    double		ns_transfer_time; /* sum of transfer times (s) */
+    double		ns_event_time;	/* time waiting in USB events (s) */
+    uint64_t		ns_backoff_sleeps; /* re-polls after backoff */
+    double		ns_backoff_time; /* backoff delay before re-polls (s) */
+    uint64_t		ns_discarded;	/* stale status replies discarded */
+    uint64_t		ns_flush_reads;	/* reads done to flush input */
+    double		ns_settle_time;	/* switch settle delays (s) */
+    uint64_t		ns_reconnects;	/* scans resumed after reconnecting */
+    uint64_t		ns_point_retries; /* points measured again */
+    uint64_t		ns_failed_points; /* points given up on */
+    uint64_t		ns_transfer_histogram[N2PKVNA_STATS_BUCKETS];
+					/* completed transfers by time:
+					   bucket 0 holds < 2 us, bucket i
+					   [2^i, 2^(i+1)) us and the last
+					   >= 2^15 us */
+} n2pkvna_stats_t;
+
+/* n2pkvna_open_times_t: time spent opening and resetting the device */
+typedef struct n2pkvna_open_times {
+    double		ot_config;	/* finding and parsing configs (s) */
+    double		ot_enumerate;	/* listing and matching devices (s) */
+    double		ot_lock;	/* locking and re-reading config (s) */
+    double		ot_device;	/* opening the device (s) */
+    double		ot_open;	/* all of n2pkvna_open (s) */
+    double		ot_reset;	/* the most recent reset (s) */
+    bool		ot_warm;	/* the most recent reset was skipped */
+} n2pkvna_open_times_t;
+
 /* n2pkvna_open: open and reset the n2pkvna device */
 extern n2pkvna_t *n2pkvna_open(const char *name, bool create,
 	const char *unit, n2pkvna_config_t ***config_vector,
@@ -107,6 +148,52 @@ extern double n2pkvna_get_reference_frequency(const n2pkvna_t *vnap);
 /* n2pkvna_set_reference_frequency: set the internal oscillator frequency */
 extern int n2pkvna_set_reference_frequency(n2pkvna_t *vnap, double frequency);
 
+/* n2pkvna_set_queue_depth: set how many requests the scan keeps in flight */
+extern int n2pkvna_set_queue_depth(n2pkvna_t *vnap, int commands, int reads,
+	int batch);
+
+/* n2pkvna_set_retry: set how scans recover from transient errors */
+extern int n2pkvna_set_retry(n2pkvna_t *vnap, int point_retries,
+	int scan_errors);
+
+/* n2pkvna_set_reconnect: set how long a scan waits for a lost device */
+extern int n2pkvna_set_reconnect(n2pkvna_t *vnap, double timeout);
+
+/* ADC modes: LTC2440 oversampling ratio code, optionally | N2PKVNA_ADC_2X */
+#define N2PKVNA_ADC_OSR_64	0x01	/* 3.52kHz */
+#define N2PKVNA_ADC_OSR_128	0x02	/* 1.76kHz */
+#define N2PKVNA_ADC_OSR_256	0x03	/* 880Hz */
+#define N2PKVNA_ADC_OSR_512	0x04	/* 440Hz */
+#define N2PKVNA_ADC_OSR_1024	0x05	/* 220Hz */
+#define N2PKVNA_ADC_OSR_2048	0x06	/* 110Hz */
+#define N2PKVNA_ADC_OSR_4096	0x07	/* 55Hz (default) */
+#define N2PKVNA_ADC_OSR_8192	0x08	/* 27.5Hz */
+#define N2PKVNA_ADC_OSR_16384	0x09	/* 13.75Hz */
+#define N2PKVNA_ADC_OSR_32768	0x0F	/* 6.875Hz */
+#define N2PKVNA_ADC_2X		0x20	/* double the conversion rate */
+
+/* n2pkvna_get_adc_mode: return the ADC oversampling ratio and speed mode */
+extern int n2pkvna_get_adc_mode(const n2pkvna_t *vnap);
+
+/* n2pkvna_set_adc_mode: set the ADC oversampling ratio and speed mode */
+extern int n2pkvna_set_adc_mode(n2pkvna_t *vnap, int adc_mode);
+
+/* n2pkvna_get_stats: return measurement statistics */
+extern void n2pkvna_get_stats(const n2pkvna_t *vnap, n2pkvna_stats_t *stats);
+
+/* n2pkvna_reset_stats: zero the measurement statistics */
+extern void n2pkvna_reset_stats(n2pkvna_t *vnap);
+
+/* n2pkvna_get_open_times: return how long opening and reset took */
+extern void n2pkvna_get_open_times(const n2pkvna_t *vnap,
+	n2pkvna_open_times_t *times);
+
+/* n2pkvna_record_start: log all device I/O to a transcript file */
+extern int n2pkvna_record_start(n2pkvna_t *vnap, const char *filename);
+
+/* n2pkvna_record_stop: stop recording and close the transcript file */
+extern int n2pkvna_record_stop(n2pkvna_t *vnap);
+
 /* n2pkvna_free_config_vector: free a device vector */
 extern void n2pkvna_free_config_vector(n2pkvna_config_t **ncpp);
 
@@ -115,6 +202,135 @@ extern int n2pkvna_scan(n2pkvna_t *vnap, double f0, double ff,
 	unsigned int n, bool linear, double *frequency_vector,
 	double complex *detector_vector1, double complex *detector_vector2);
 
+/* n2pkvna_scan_list: measure at each frequency of a list */
+extern int n2pkvna_scan_list(n2pkvna_t *vnap, const double *frequency_vector,
+	unsigned int n, double *actual_frequency_vector,
+	double complex *detector1_vector, double complex *detector2_vector);
+
+/* n2pkvna_point_t np_quality values */
+#define N2PKVNA_POINT_OK	0	/* measured on the first try */
+#define N2PKVNA_POINT_RETRIED	1	/* measured after retries */
+#define N2PKVNA_POINT_FAILED	2	/* retries exhausted; values are NaN */
+
+/* n2pkvna_point_t: one demodulated scan point */
+typedef struct n2pkvna_point {
+    unsigned int	np_index;	/* point number within the scan */
+    double		np_frequency;	/* frequency (Hz) */
+    double complex	np_detector1;	/* detector 1 voltage */
+    double complex	np_detector2;	/* detector 2 voltage */
+    unsigned int	np_retries;	/* times the point was measured again */
+    int			np_quality;	/* N2PKVNA_POINT_* */
+} n2pkvna_point_t;
+
+/* n2pkvna_point_fn_t: receive a scan point; return non-zero to stop */
+typedef int n2pkvna_point_fn_t(const n2pkvna_point_t *point, void *arg);
+
+/* n2pkvna_scan_stream: run a frequency scan, streaming each point */
+extern int n2pkvna_scan_stream(n2pkvna_t *vnap, double f0, double ff,
+	unsigned int n, bool linear, n2pkvna_point_fn_t *point_fn, void *arg);
+
+/* n2pkvna_plan_t: opaque precomputed scan from n2pkvna_plan_create */
+typedef struct n2pkvna_plan n2pkvna_plan_t;
+
+/* n2pkvna_plan_create: precompute the commands of a frequency scan */
+extern n2pkvna_plan_t *n2pkvna_plan_create(n2pkvna_t *vnap, double f0,
+	double ff, unsigned int n, bool linear);
+
+/* n2pkvna_plan_execute: run a planned scan and collect detector voltages */
+extern int n2pkvna_plan_execute(n2pkvna_plan_t *planp,
+	double *frequency_vector, double complex *detector1_vector,
+	double complex *detector2_vector);
+
+/* n2pkvna_plan_execute_stream: run a planned scan, streaming each point */
+extern int n2pkvna_plan_execute_stream(n2pkvna_plan_t *planp,
+	n2pkvna_point_fn_t *point_fn, void *arg);
+
+/* n2pkvna_segment_t: one segment of a segmented scan */
+typedef struct n2pkvna_segment {
+    double		seg_f0;		/* starting frequency (Hz) */
+    double		seg_ff;		/* ending frequency (Hz) */
+    unsigned int	seg_n;		/* number of points */
+    bool		seg_linear;	/* linear vs. log spacing */
+    int			seg_phase_steps; /* phase steps or 0 for default */
+    int			seg_average;	/* phase cycles per point or 0 */
+    int			seg_adc_mode;	/* N2PKVNA_ADC_* or 0 for default */
+} n2pkvna_segment_t;
+
+/* n2pkvna_plan_create_list: precompute a scan of a list of frequencies */
+extern n2pkvna_plan_t *n2pkvna_plan_create_list(n2pkvna_t *vnap,
+	const double *frequency_vector, unsigned int n);
+
+/* n2pkvna_plan_create_segments: precompute a segmented frequency scan */
+extern n2pkvna_plan_t *n2pkvna_plan_create_segments(n2pkvna_t *vnap,
+	const n2pkvna_segment_t *segment_vector, int segments);
+
+/* n2pkvna_plan_free: free a plan */
+extern void n2pkvna_plan_free(n2pkvna_plan_t *planp);
+
+/* n2pkvna_scan_segments: run a segmented frequency scan */
+extern int n2pkvna_scan_segments(n2pkvna_t *vnap,
+	const n2pkvna_segment_t *segment_vector, int segments,
+	double *frequency_vector, double complex *detector1_vector,
+	double complex *detector2_vector);
+
+/* n2pkvna_sweep_start: run a plan continuously on a background thread */
+extern int n2pkvna_sweep_start(n2pkvna_plan_t *planp);
+
+/* n2pkvna_sweep_get_latest: copy out the most recent complete sweep */
+extern int n2pkvna_sweep_get_latest(n2pkvna_t *vnap, uint64_t *sequence,
+	double *frequency_vector, double complex *detector1_vector,
+	double complex *detector2_vector);
+
+/* n2pkvna_sweep_stop: stop the background sweep */
+extern int n2pkvna_sweep_stop(n2pkvna_t *vnap);
+
+/* n2pkvna_group_t: opaque set of VNAs acquiring in parallel */
+typedef struct n2pkvna_group n2pkvna_group_t;
+
+/* n2pkvna_group_result_t: one completed sweep of a group member */
+typedef struct n2pkvna_group_result {
+    int			gr_member;	/* index of the VNA in the group */
+    uint64_t		gr_sequence;	/* sweep number for the VNA, from 1 */
+    int			gr_error;	/* 0, or errno if the sweep failed */
+    unsigned int	gr_points;	/* length of the vectors below */
+    double	       *gr_frequency_vector; /* frequencies (Hz) */
+    double complex     *gr_detector1_vector; /* detector 1 values */
+    double complex     *gr_detector2_vector; /* detector 2 values */
+} n2pkvna_group_result_t;
+
+/* n2pkvna_group_open: open several VNAs for parallel acquisition */
+extern n2pkvna_group_t *n2pkvna_group_open(int count,
+	const char *const *name_vector, const char *const *unit_vector,
+	n2pkvna_error_t *error_fn, void *error_arg);
+
+/* n2pkvna_group_get_count: return the number of VNAs in the group */
+extern int n2pkvna_group_get_count(const n2pkvna_group_t *groupp);
+
+/* n2pkvna_group_get_member: return the handle of one VNA of the group */
+extern n2pkvna_t *n2pkvna_group_get_member(n2pkvna_group_t *groupp,
+	int index);
+
+/* n2pkvna_group_start: sweep all VNAs of the group in parallel */
+extern int n2pkvna_group_start(n2pkvna_group_t *groupp,
+	const n2pkvna_segment_t *segment_vector, int segments,
+	unsigned int sweeps);
+
+/* n2pkvna_group_wait: wait for the next completed sweep of any VNA */
+extern int n2pkvna_group_wait(n2pkvna_group_t *groupp, double timeout,
+	n2pkvna_group_result_t **resultpp);
+
+/* n2pkvna_group_free_result: free a result from n2pkvna_group_wait */
+extern void n2pkvna_group_free_result(n2pkvna_group_result_t *resultp);
+
+/* n2pkvna_group_stop: stop all acquisition threads of the group */
+extern int n2pkvna_group_stop(n2pkvna_group_t *groupp);
+
+/* n2pkvna_group_close: stop acquisition and close all VNAs of the group */
+extern void n2pkvna_group_close(n2pkvna_group_t *groupp);
+
+/* n2pkvna_set_phase_steps: set the number of LO phase steps per point */
+extern int n2pkvna_set_phase_steps(n2pkvna_t *vnap, int steps);
+
 /* n2pkvna_generate: generate signals with the given frequencies and phase */
 extern int n2pkvna_generate(n2pkvna_t *vnap, double rf_frequency,
 	double lo_frequency, double phase);
@@ -126,6 +342,9 @@ extern int n2pkvna_switch(n2pkvna_t *vnap, int switch_value,
 /* n2pkvna_reset: reset and re-synchronize the RF signal generators */
 extern int n2pkvna_reset(n2pkvna_t *vnap);
 
+/* n2pkvna_reset_warm: reset only if the device isn't idle and in sync */
+extern int n2pkvna_reset_warm(n2pkvna_t *vnap);
+
 /* n2pkvna_get_property_root: return the address of the property root */
 extern vnaproperty_t **n2pkvna_get_property_root(n2pkvna_t *vnap);
 
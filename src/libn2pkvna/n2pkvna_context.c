@@ -0,0 +1,332 @@
+/*
+ * N2PK Vector Network Analyzer
+ * Copyright © 2021-2022 D Scott Guthridge <scott_guthridge@rompromity.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A11 PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "archdep.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "n2pkvna_internal.h"
+
+/*
+ * Shared libusb context
+ *
+ * All handles share one libusb context, created by the first
+ * n2pkvna_open that needs it and destroyed when the last user releases
+ * it.  A single thread handles libusb events for the context; the USB
+ * transport hands completed transfers from it back to the thread that
+ * submitted them.
+ *
+ * Where libusb supports hotplug, the context also keeps a table of the
+ * attached devices with the N2PK VNA's vendor ID, updated by hotplug
+ * callbacks from the event thread.  The table lives only as long as the
+ * context: registering the callback with LIBUSB_HOTPLUG_ENUMERATE walks
+ * the bus, so the first open in a process costs an enumeration like
+ * before, and only opens made while another handle holds the context
+ * find the device without one.
+ */
+static pthread_mutex_t context_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct libusb_context *context_ctxp = NULL;
+static int context_refcount = 0;	/* open references */
+static pthread_t context_thread;	/* event handling thread */
+
+/* context_stop_mutex protects context_stop, read by the event thread */
+static pthread_mutex_t context_stop_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool context_stop = false;	/* ask the event thread to exit */
+
+/* hotplug callback, registered holding context_mutex */
+static bool context_hotplug = false;	/* callback registered */
+static libusb_hotplug_callback_handle context_hotplug_handle;
+
+/* context_device_mutex protects the hotplug device table */
+static pthread_mutex_t context_device_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool context_device_valid = false; /* table is complete */
+static libusb_device **context_device_vector = NULL; /* referenced */
+static size_t context_device_count = 0;
+static size_t context_device_allocation = 0;
+
+/*
+ * context_hotplug_callback: add or remove a device in the device table
+ *   @ctxp: libusb context
+ *   @device: device that arrived or left
+ *   @event: LIBUSB_HOTPLUG_EVENT_DEVICE_*
+ *   @user_data: unused
+ *
+ * Called from libusb_hotplug_register_callback for devices already
+ * present, and afterward from the event thread.
+ */
+/*ARGSUSED*/
+static int LIBUSB_CALL context_hotplug_callback(struct libusb_context *ctxp,
+	libusb_device *device, libusb_hotplug_event event, void *user_data)
+{
+    (void)pthread_mutex_lock(&context_device_mutex);
+    if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
+	if (context_device_count == context_device_allocation) {
+	    size_t new_allocation = MAX(2 * context_device_allocation, 4);
+	    libusb_device **new_vector;
+
+	    if ((new_vector = realloc(context_device_vector,
+			    new_allocation * sizeof(libusb_device *))) == NULL) {
+		/* distrust the table; n2pkvna_open will enumerate the bus */
+		context_device_valid = false;
+		goto out;
+	    }
+	    context_device_vector = new_vector;
+	    context_device_allocation = new_allocation;
+	}
+	context_device_vector[context_device_count++] =
+	    libusb_ref_device(device);
+
+    } else if (event == LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT) {
+	for (size_t i = 0; i < context_device_count; ++i) {
+	    if (context_device_vector[i] == device) {
+		libusb_unref_device(device);
+		context_device_vector[i] =
+		    context_device_vector[--context_device_count];
+		break;
+	    }
+	}
+    }
+
+out:
+    (void)pthread_mutex_unlock(&context_device_mutex);
+    return 0;
+}
+
+/*
+ * context_hotplug_stop: deregister the callback and empty the device table
+ *   @ctxp: libusb context
+ */
+static void context_hotplug_stop(struct libusb_context *ctxp)
+{
+    if (context_hotplug) {
+	libusb_hotplug_deregister_callback(ctxp, context_hotplug_handle);
+	context_hotplug = false;
+    }
+    (void)pthread_mutex_lock(&context_device_mutex);
+    context_device_valid = false;
+    for (size_t i = 0; i < context_device_count; ++i) {
+	libusb_unref_device(context_device_vector[i]);
+    }
+    free((void *)context_device_vector);
+    context_device_vector = NULL;
+    context_device_count = 0;
+    context_device_allocation = 0;
+    (void)pthread_mutex_unlock(&context_device_mutex);
+}
+
+/*
+ * context_hotplug_start: register for hotplug events if libusb supports it
+ *   @ctxp: libusb context
+ *
+ * Failure isn't an error: n2pkvna_open falls back to enumerating the bus.
+ */
+static void context_hotplug_start(struct libusb_context *ctxp)
+{
+    if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+	return;
+    }
+    (void)pthread_mutex_lock(&context_device_mutex);
+    context_device_valid = true;
+    (void)pthread_mutex_unlock(&context_device_mutex);
+    if (libusb_hotplug_register_callback(ctxp,
+		LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED |
+		LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+		LIBUSB_HOTPLUG_ENUMERATE, N2PKVNA_USB_VENDOR,
+		LIBUSB_HOTPLUG_MATCH_ANY, LIBUSB_HOTPLUG_MATCH_ANY,
+		context_hotplug_callback, NULL,
+		&context_hotplug_handle) != LIBUSB_SUCCESS) {
+	context_hotplug_stop(ctxp);
+	return;
+    }
+    context_hotplug = true;
+}
+
+/*
+ * context_event_thread: handle libusb events until asked to stop
+ *   @arg: libusb context
+ *
+ * Events are handled with a short timeout so that the thread notices
+ * context_stop promptly.
+ */
+static void *context_event_thread(void *arg)
+{
+    struct libusb_context *ctxp = arg;
+
+    for (;;) {
+	struct timeval tv = { 0, CONTEXT_POLL_INTERVAL };
+	bool stop;
+
+	(void)libusb_handle_events_timeout_completed(ctxp, &tv, NULL);
+	(void)pthread_mutex_lock(&context_stop_mutex);
+	stop = context_stop;
+	(void)pthread_mutex_unlock(&context_stop_mutex);
+	if (stop) {
+	    break;
+	}
+    }
+    return NULL;
+}
+
+/*
+ * _n2pkvna_context_acquire: attach the shared libusb context to a handle
+ *   @vnap: n2pkvna handle
+ *
+ * Return:
+ *   0: success
+ *  -1: error (errno set)
+ */
+int _n2pkvna_context_acquire(n2pkvna_t *vnap)
+{
+    int rc = -1;
+    int rv;
+
+    (void)pthread_mutex_lock(&context_mutex);
+    if (context_refcount == 0) {
+	if ((rv = libusb_init(&context_ctxp)) < 0) {
+	    _n2pkvna_error(vnap, "libusb_init: %s", libusb_error_name(rv));
+	    _n2pkvna_set_usb_errno(rv);
+	    context_ctxp = NULL;
+	    goto out;
+	}
+	(void)pthread_mutex_lock(&context_stop_mutex);
+	context_stop = false;
+	(void)pthread_mutex_unlock(&context_stop_mutex);
+	context_hotplug_start(context_ctxp);
+	if ((rv = pthread_create(&context_thread, NULL, context_event_thread,
+			context_ctxp)) != 0) {
+	    _n2pkvna_error(vnap, "pthread_create: %s", strerror(rv));
+	    context_hotplug_stop(context_ctxp);
+	    libusb_exit(context_ctxp);
+	    context_ctxp = NULL;
+	    errno = rv;
+	    goto out;
+	}
+    }
+    ++context_refcount;
+    vnap->vna_ctxp = context_ctxp;
+    rc = 0;
+
+out:
+    (void)pthread_mutex_unlock(&context_mutex);
+    return rc;
+}
+
+/*
+ * _n2pkvna_context_release: detach the shared libusb context from a handle
+ *   @vnap: n2pkvna handle
+ *
+ * The last release stops the event thread and destroys the context.
+ * All device handles opened in the context must be closed first.
+ */
+void _n2pkvna_context_release(n2pkvna_t *vnap)
+{
+    if (vnap->vna_ctxp == NULL) {
+	return;
+    }
+    vnap->vna_ctxp = NULL;
+    (void)pthread_mutex_lock(&context_mutex);
+    if (--context_refcount == 0) {
+	(void)pthread_mutex_lock(&context_stop_mutex);
+	context_stop = true;
+	(void)pthread_mutex_unlock(&context_stop_mutex);
+	(void)pthread_join(context_thread, NULL);
+	context_hotplug_stop(context_ctxp);
+	libusb_exit(context_ctxp);
+	context_ctxp = NULL;
+    }
+    (void)pthread_mutex_unlock(&context_mutex);
+}
+
+/*
+ * _n2pkvna_context_get_devices: return referenced USB devices to search
+ *   @vnap: n2pkvna handle with the context attached
+ *   @vendor: USB vendor ID the caller wants, or 0 for the default
+ *   @device_vector: address of pointer to receive the device vector
+ *
+ * Returns the hotplug device table if it's active and covers @vendor;
+ * otherwise, enumerates the bus.  Free the result with
+ * _n2pkvna_context_free_devices.
+ *
+ * Return:
+ *   number of devices, or -1 on error (errno set)
+ */
+ssize_t _n2pkvna_context_get_devices(n2pkvna_t *vnap, uint16_t vendor,
+	libusb_device ***device_vector)
+{
+    libusb_device **usb_device_vector = NULL;
+    libusb_device **result = NULL;
+    ssize_t count;
+
+    if (vendor == 0 || vendor == N2PKVNA_USB_VENDOR) {
+	(void)pthread_mutex_lock(&context_device_mutex);
+	if (context_device_valid) {
+	    count = context_device_count;
+	    if ((result = calloc(count + 1,
+			    sizeof(libusb_device *))) == NULL) {
+		(void)pthread_mutex_unlock(&context_device_mutex);
+		_n2pkvna_error(vnap, "calloc: %s", strerror(errno));
+		return -1;
+	    }
+	    for (ssize_t i = 0; i < count; ++i) {
+		result[i] = libusb_ref_device(context_device_vector[i]);
+	    }
+	    (void)pthread_mutex_unlock(&context_device_mutex);
+	    *device_vector = result;
+	    return count;
+	}
+	(void)pthread_mutex_unlock(&context_device_mutex);
+    }
+    if ((count = libusb_get_device_list(vnap->vna_ctxp,
+		    &usb_device_vector)) < 0) {
+	_n2pkvna_error(vnap, "libusb_get_device_list: %s",
+		libusb_error_name(count));
+	_n2pkvna_set_usb_errno(count);
+	return -1;
+    }
+    if ((result = calloc(count + 1, sizeof(libusb_device *))) == NULL) {
+	_n2pkvna_error(vnap, "calloc: %s", strerror(errno));
+	libusb_free_device_list(usb_device_vector, /*unref_devices=*/1);
+	return -1;
+    }
+    (void)memcpy((void *)result, (void *)usb_device_vector,
+	    count * sizeof(libusb_device *));
+    libusb_free_device_list(usb_device_vector, /*unref_devices=*/0);
+    *device_vector = result;
+    return count;
+}
+
+/*
+ * _n2pkvna_context_free_devices: free a vector from _context_get_devices
+ *   @device_vector: device vector
+ *   @count: number of devices
+ */
+void _n2pkvna_context_free_devices(libusb_device **device_vector,
+	ssize_t count)
+{
+    if (device_vector != NULL) {
+	for (ssize_t i = 0; i < count; ++i) {
+	    libusb_unref_device(device_vector[i]);
+	}
+	free((void *)device_vector);
+    }
+}
@@ -107,6 +107,31 @@ void _n2pkvna_set_usb_errno(int usb_error)
     }
 }
 
+/*
+ * _n2pkvna_transfer_error: map libusb transfer status to libusb error code
+ *   @status: status from a completed asynchronous transfer
+ */
+int _n2pkvna_transfer_error(enum libusb_transfer_status status)
+{
+    switch (status) {
+    case LIBUSB_TRANSFER_COMPLETED:
+	return LIBUSB_SUCCESS;
+    case LIBUSB_TRANSFER_TIMED_OUT:
+	return LIBUSB_ERROR_TIMEOUT;
+    case LIBUSB_TRANSFER_CANCELLED:
+	return LIBUSB_ERROR_INTERRUPTED;
+    case LIBUSB_TRANSFER_STALL:
+	return LIBUSB_ERROR_PIPE;
+    case LIBUSB_TRANSFER_NO_DEVICE:
+	return LIBUSB_ERROR_NO_DEVICE;
+    case LIBUSB_TRANSFER_OVERFLOW:
+	return LIBUSB_ERROR_OVERFLOW;
+    case LIBUSB_TRANSFER_ERROR:
+    default:
+	return LIBUSB_ERROR_IO;
+    }
+}
+
 /*
  * n2pkvna_libvna_errfn: libvna compatible error function
  */
@@ -76,19 +76,14 @@ static void adjust_ratio(double x, uint32_t *rf_code, uint32_t *lo_code)
 }
 
 
-/* n2pkvna_generate: generate signals with the given frequencies and phases
+/*
+ * generate: generate signals holding the handle lock
  *   @vnap: n2pkvna handle
  *   @rf_frequency: RF frequency
  *   @lo_frequency: LO frequency
  *   @phase: phase of LO1 out relative to RF out (degrees)
- *
- * A zero value for frequency disables output.
- *
- * Return:
- *   0: success
- *  -1: error (errno set)
  */
-int n2pkvna_generate(n2pkvna_t *vnap, double rf_frequency, double lo_frequency,
+static int generate(n2pkvna_t *vnap, double rf_frequency, double lo_frequency,
 	double phase)
 {
     double f_reference = vnap->vna_config.nci_reference_frequency;
@@ -112,6 +107,9 @@ int n2pkvna_generate(n2pkvna_t *vnap, double rf_frequency, double lo_frequency,
 	    rf_frequency != lo_frequency) {
 	adjust_ratio(rf_frequency / lo_frequency, &rf_code, &lo_code);
     }
+    if (rf_code != lo_code) {
+	vnap->vna_synchronized = false;	/* the DDS phases now drift apart */
+    }
     if (_n2pkvna_set_dds(vnap, 0.0, false,
 		lo_code, rf_code, _n2pkvna_phase_to_code(phase)) < 0) {
 	return -1;
@@ -121,3 +119,28 @@ int n2pkvna_generate(n2pkvna_t *vnap, double rf_frequency, double lo_frequency,
     }
     return 0;
 }
+
+/* n2pkvna_generate: generate signals with the given frequencies and phases
+ *   @vnap: n2pkvna handle
+ *   @rf_frequency: RF frequency
+ *   @lo_frequency: LO frequency
+ *   @phase: phase of LO1 out relative to RF out (degrees)
+ *
+ * A zero value for frequency disables output.
+ *
+ * Return:
+ *   0: success
+ *  -1: error (errno set)
+ */
+int n2pkvna_generate(n2pkvna_t *vnap, double rf_frequency, double lo_frequency,
+	double phase)
+{
+    int rv;
+
+    if (_n2pkvna_lock_idle(vnap, "n2pkvna_generate") == -1) {
+	return -1;
+    }
+    rv = generate(vnap, rf_frequency, lo_frequency, phase);
+    (void)pthread_mutex_unlock(&vnap->vna_mutex);
+    return rv;
+}
@@ -0,0 +1,519 @@
+/*
+ * N2PK Vector Network Analyzer
+ * Copyright © 2021-2022 D Scott Guthridge <scott_guthridge@rompromity.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A11 PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include "archdep.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "n2pkvna_internal.h"
+
+/*
+ * group_entry_t: queued result
+ */
+typedef struct group_entry {
+    n2pkvna_group_result_t	ge_result;	/* must be first */
+    struct group_entry	       *ge_next;	/* next in queue */
+} group_entry_t;
+
+/*
+ * group_member_t: one VNA of the group and its acquisition thread
+ */
+typedef struct group_member {
+    struct n2pkvna_group       *gm_groupp;	/* parent pointer */
+    int				gm_index;	/* index within the group */
+    n2pkvna_t		       *gm_vnap;	/* device handle */
+    n2pkvna_plan_t	       *gm_planp;	/* plan while running */
+    pthread_t			gm_thread;	/* acquisition thread */
+    bool			gm_joinable;	/* gm_thread not yet joined */
+    group_entry_t	       *gm_entry;	/* sweep being filled */
+} group_member_t;
+
+/*
+ * n2pkvna_group_t: set of VNAs acquiring in parallel
+ *
+ * Each member has its own acquisition thread.  The threads append
+ * completed sweeps to a common queue that n2pkvna_group_wait drains.
+ * When the queue holds GROUP_MAX_QUEUED results, the threads wait for
+ * the caller to catch up instead of buffering without limit.
+ */
+struct n2pkvna_group {
+    n2pkvna_error_t	       *gp_error_fn;	/* error reporting function */
+    void		       *gp_error_arg;	/* argument to gp_error_fn */
+    int				gp_count;	/* number of members */
+    group_member_t	       *gp_member_vector; /* members */
+    unsigned int		gp_sweeps;	/* sweeps per member or 0 */
+    pthread_mutex_t		gp_mutex;	/* protects fields below */
+    pthread_cond_t		gp_ready_cond;	/* result queued or done */
+    pthread_cond_t		gp_space_cond;	/* result dequeued or stop */
+    bool			gp_stop;	/* stop requested */
+    int				gp_running;	/* threads still acquiring */
+    int				gp_queued;	/* length of the queue */
+    group_entry_t	       *gp_head;	/* oldest queued result */
+    group_entry_t	      **gp_tail;	/* end of the queue */
+};
+
+/*
+ * group_error: report errors not tied to a member if error_fn is non-NULL
+ *   @groupp: group
+ *   @format: printf format
+ *   @...: var args
+ */
+static void group_error(n2pkvna_group_t *groupp, const char *format, ...)
+{
+    va_list ap;
+
+    if (groupp->gp_error_fn != NULL) {
+	char *message = NULL;
+
+	va_start(ap, format);
+	if (vasprintf(&message, format, ap) == -1) {
+	    char backup[80];
+
+	    (void)snprintf(backup, sizeof(backup),
+			   "vasprintf: %s", strerror(errno));
+	    backup[sizeof(backup) - 1] = '\000';
+	    (*groupp->gp_error_fn)(backup, groupp->gp_error_arg);
+	}
+	va_end(ap);
+	(*groupp->gp_error_fn)(message, groupp->gp_error_arg);
+	free((void *)message);
+    }
+}
+
+/*
+ * group_entry_alloc: allocate a result for one sweep
+ *   @gmp: member
+ *   @points: number of frequency points
+ */
+static group_entry_t *group_entry_alloc(group_member_t *gmp,
+	unsigned int points)
+{
+    group_entry_t *gep;
+    n2pkvna_group_result_t *grp;
+
+    if ((gep = calloc(1, sizeof(group_entry_t))) == NULL) {
+	return NULL;
+    }
+    grp = &gep->ge_result;
+    grp->gr_member = gmp->gm_index;
+    grp->gr_points = points;
+    if ((grp->gr_frequency_vector = calloc(points,
+		    sizeof(double))) == NULL ||
+	    (grp->gr_detector1_vector = calloc(points,
+		    sizeof(double complex))) == NULL ||
+	    (grp->gr_detector2_vector = calloc(points,
+		    sizeof(double complex))) == NULL) {
+	n2pkvna_group_free_result(grp);
+	return NULL;
+    }
+    return gep;
+}
+
+/*
+ * group_point: store a point of the current sweep, stopping if requested
+ *   @point: completed point
+ *   @arg: member
+ */
+static int group_point(const n2pkvna_point_t *point, void *arg)
+{
+    group_member_t *gmp = arg;
+    n2pkvna_group_t *groupp = gmp->gm_groupp;
+    n2pkvna_group_result_t *grp = &gmp->gm_entry->ge_result;
+    bool stop;
+
+    grp->gr_frequency_vector[point->np_index] = point->np_frequency;
+    grp->gr_detector1_vector[point->np_index] = point->np_detector1;
+    grp->gr_detector2_vector[point->np_index] = point->np_detector2;
+    (void)pthread_mutex_lock(&groupp->gp_mutex);
+    stop = groupp->gp_stop;
+    (void)pthread_mutex_unlock(&groupp->gp_mutex);
+    return stop;
+}
+
+/*
+ * group_enqueue: append a result to the queue, waiting for space
+ *   @groupp: group
+ *   @gep: result to queue
+ *
+ * Return:
+ *   true: queued
+ *   false: stop requested; the result was freed
+ */
+static bool group_enqueue(n2pkvna_group_t *groupp, group_entry_t *gep)
+{
+    (void)pthread_mutex_lock(&groupp->gp_mutex);
+    while (groupp->gp_queued >= GROUP_MAX_QUEUED && !groupp->gp_stop) {
+	(void)pthread_cond_wait(&groupp->gp_space_cond, &groupp->gp_mutex);
+    }
+    if (groupp->gp_stop) {
+	(void)pthread_mutex_unlock(&groupp->gp_mutex);
+	n2pkvna_group_free_result(&gep->ge_result);
+	return false;
+    }
+    gep->ge_next = NULL;
+    *groupp->gp_tail = gep;
+    groupp->gp_tail = &gep->ge_next;
+    ++groupp->gp_queued;
+    (void)pthread_cond_signal(&groupp->gp_ready_cond);
+    (void)pthread_mutex_unlock(&groupp->gp_mutex);
+    return true;
+}
+
+/*
+ * group_thread: run a member's plan, queuing each sweep
+ *   @arg: member
+ *
+ * A failed sweep is queued with gr_error set and ends the member's
+ * acquisition; the other members keep going.
+ */
+static void *group_thread(void *arg)
+{
+    group_member_t *gmp = arg;
+    n2pkvna_group_t *groupp = gmp->gm_groupp;
+    unsigned int points = gmp->gm_planp->pn_points;
+
+    for (uint64_t sequence = 1; groupp->gp_sweeps == 0 ||
+	    sequence <= groupp->gp_sweeps; ++sequence) {
+	group_entry_t *gep;
+	int rv;
+
+	if ((gep = group_entry_alloc(gmp, points)) == NULL) {
+	    _n2pkvna_error(gmp->gm_vnap, "calloc: %s", strerror(errno));
+	    break;
+	}
+	gep->ge_result.gr_sequence = sequence;
+	gmp->gm_entry = gep;
+	rv = n2pkvna_plan_execute_stream(gmp->gm_planp, group_point, gmp);
+	gmp->gm_entry = NULL;
+	if (rv == 1) {
+	    n2pkvna_group_free_result(&gep->ge_result);
+	    break;
+	}
+	if (rv == -1) {
+	    gep->ge_result.gr_error = errno;
+	}
+	if (!group_enqueue(groupp, gep) || rv == -1) {
+	    break;
+	}
+    }
+    (void)pthread_mutex_lock(&groupp->gp_mutex);
+    --groupp->gp_running;
+    (void)pthread_cond_broadcast(&groupp->gp_ready_cond);
+    (void)pthread_mutex_unlock(&groupp->gp_mutex);
+    return NULL;
+}
+
+/*
+ * group_join: wait for all acquisition threads and free their plans
+ *   @groupp: group
+ */
+static void group_join(n2pkvna_group_t *groupp)
+{
+    for (int i = 0; i < groupp->gp_count; ++i) {
+	group_member_t *gmp = &groupp->gp_member_vector[i];
+
+	if (gmp->gm_joinable) {
+	    (void)pthread_join(gmp->gm_thread, NULL);
+	    gmp->gm_joinable = false;
+	}
+	n2pkvna_plan_free(gmp->gm_planp);
+	gmp->gm_planp = NULL;
+    }
+}
+
+/*
+ * n2pkvna_group_open: open several VNAs for parallel acquisition
+ *   @count: number of VNAs
+ *   @name_vector: device name of each VNA as for n2pkvna_open, or NULL
+ *   @unit_vector: unit address of each VNA as for n2pkvna_open, or NULL
+ *   @error_fn: optional error reporting function
+ *   @error_arg: optional argument to error reporting function
+ *
+ * Either vector may be NULL, and individual entries may be NULL, to
+ * leave the name or unit unspecified.
+ *
+ * Return:
+ *   new group on success; NULL on error (errno set)
+ */
+n2pkvna_group_t *n2pkvna_group_open(int count, const char *const *name_vector,
+	const char *const *unit_vector, n2pkvna_error_t *error_fn,
+	void *error_arg)
+{
+    n2pkvna_group_t *groupp;
+    pthread_condattr_t attr;
+
+    if ((groupp = calloc(1, sizeof(n2pkvna_group_t))) == NULL) {
+	if (error_fn != NULL) {
+	    char buf[80];
+
+	    (void)snprintf(buf, sizeof(buf), "n2pkvna_group_open: %s",
+		    strerror(errno));
+	    buf[sizeof(buf)-1] = '\000';
+	    (*error_fn)(buf, error_arg);
+	}
+	return NULL;
+    }
+    groupp->gp_error_fn = error_fn;
+    groupp->gp_error_arg = error_arg;
+    (void)pthread_mutex_init(&groupp->gp_mutex, NULL);
+    (void)pthread_condattr_init(&attr);
+    (void)pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    (void)pthread_cond_init(&groupp->gp_ready_cond, &attr);
+    (void)pthread_cond_init(&groupp->gp_space_cond, &attr);
+    (void)pthread_condattr_destroy(&attr);
+    groupp->gp_tail = &groupp->gp_head;
+    if (count < 1) {
+	group_error(groupp, "n2pkvna_group_open: invalid count %d", count);
+	errno = EINVAL;
+	goto error;
+    }
+    if ((groupp->gp_member_vector = calloc(count,
+		    sizeof(group_member_t))) == NULL) {
+	group_error(groupp, "calloc: %s", strerror(errno));
+	goto error;
+    }
+    for (int i = 0; i < count; ++i) {
+	group_member_t *gmp = &groupp->gp_member_vector[i];
+	const char *name = name_vector != NULL ? name_vector[i] : NULL;
+	const char *unit = unit_vector != NULL ? unit_vector[i] : NULL;
+
+	gmp->gm_groupp = groupp;
+	gmp->gm_index = i;
+	if ((gmp->gm_vnap = n2pkvna_open(name, false, unit, NULL,
+			error_fn, error_arg)) == NULL) {
+	    goto error;
+	}
+	++groupp->gp_count;
+    }
+    return groupp;
+
+error:
+    n2pkvna_group_close(groupp);
+    return NULL;
+}
+
+/*
+ * n2pkvna_group_get_count: return the number of VNAs in the group
+ *   @groupp: group
+ */
+int n2pkvna_group_get_count(const n2pkvna_group_t *groupp)
+{
+    return groupp->gp_count;
+}
+
+/*
+ * n2pkvna_group_get_member: return the handle of one VNA of the group
+ *   @groupp: group
+ *   @index: index of the VNA, in the order given to n2pkvna_group_open
+ *
+ * The handle remains owned by the group; don't close it.
+ */
+n2pkvna_t *n2pkvna_group_get_member(n2pkvna_group_t *groupp, int index)
+{
+    if (index < 0 || index >= groupp->gp_count) {
+	group_error(groupp, "n2pkvna_group_get_member: invalid index %d",
+		index);
+	errno = EINVAL;
+	return NULL;
+    }
+    return groupp->gp_member_vector[index].gm_vnap;
+}
+
+/*
+ * n2pkvna_group_start: sweep all VNAs of the group in parallel
+ *   @groupp: group
+ *   @segment_vector: vector of scan segments
+ *   @segments: number of segments
+ *   @sweeps: number of sweeps per VNA, or 0 to sweep until stopped
+ *
+ * A plan is created for each VNA, so each captures that VNA's
+ * reference frequency and defaults.
+ *
+ * Return:
+ *   0: success
+ *  -1: error (errno set)
+ */
+int n2pkvna_group_start(n2pkvna_group_t *groupp,
+	const n2pkvna_segment_t *segment_vector, int segments,
+	unsigned int sweeps)
+{
+    int rv;
+
+    (void)pthread_mutex_lock(&groupp->gp_mutex);
+    if (groupp->gp_running != 0) {
+	(void)pthread_mutex_unlock(&groupp->gp_mutex);
+	group_error(groupp, "n2pkvna_group_start: group is already running");
+	errno = EBUSY;
+	return -1;
+    }
+    groupp->gp_stop = false;
+    (void)pthread_mutex_unlock(&groupp->gp_mutex);
+    group_join(groupp);
+
+    /*
+     * Create all plans before starting any thread.
+     */
+    for (int i = 0; i < groupp->gp_count; ++i) {
+	group_member_t *gmp = &groupp->gp_member_vector[i];
+
+	if ((gmp->gm_planp = n2pkvna_plan_create_segments(gmp->gm_vnap,
+			segment_vector, segments)) == NULL) {
+	    group_join(groupp);
+	    return -1;
+	}
+    }
+    groupp->gp_sweeps = sweeps;
+    for (int i = 0; i < groupp->gp_count; ++i) {
+	group_member_t *gmp = &groupp->gp_member_vector[i];
+
+	(void)pthread_mutex_lock(&groupp->gp_mutex);
+	++groupp->gp_running;
+	(void)pthread_mutex_unlock(&groupp->gp_mutex);
+	if ((rv = pthread_create(&gmp->gm_thread, NULL, group_thread,
+			gmp)) != 0) {
+	    group_error(groupp, "pthread_create: %s", strerror(rv));
+	    (void)pthread_mutex_lock(&groupp->gp_mutex);
+	    --groupp->gp_running;
+	    (void)pthread_mutex_unlock(&groupp->gp_mutex);
+	    (void)n2pkvna_group_stop(groupp);
+	    errno = rv;
+	    return -1;
+	}
+	gmp->gm_joinable = true;
+    }
+    return 0;
+}
+
+/*
+ * n2pkvna_group_wait: wait for the next completed sweep of any VNA
+ *   @groupp: group
+ *   @timeout: maximum time to wait in seconds, or negative to wait
+ *		without limit
+ *   @resultpp: receives the result, to be freed with
+ *		n2pkvna_group_free_result
+ *
+ * Results are returned in the order the sweeps completed.
+ *
+ * Return:
+ *   1: all VNAs have finished and no results remain
+ *   0: success
+ *  -1: error (errno set); ETIMEDOUT if the timeout expired
+ */
+int n2pkvna_group_wait(n2pkvna_group_t *groupp, double timeout,
+	n2pkvna_group_result_t **resultpp)
+{
+    struct timespec deadline;
+    group_entry_t *gep;
+    int rc = -1;
+
+    if (timeout >= 0.0) {
+	(void)clock_gettime(CLOCK_MONOTONIC, &deadline);
+	_n2pkvna_timespec_add(&deadline, timeout);
+    }
+    (void)pthread_mutex_lock(&groupp->gp_mutex);
+    while (groupp->gp_head == NULL && groupp->gp_running != 0) {
+	if (timeout < 0.0) {
+	    (void)pthread_cond_wait(&groupp->gp_ready_cond,
+		    &groupp->gp_mutex);
+	} else if (pthread_cond_timedwait(&groupp->gp_ready_cond,
+		    &groupp->gp_mutex, &deadline) == ETIMEDOUT) {
+	    break;
+	}
+    }
+    if ((gep = groupp->gp_head) != NULL) {
+	if ((groupp->gp_head = gep->ge_next) == NULL) {
+	    groupp->gp_tail = &groupp->gp_head;
+	}
+	--groupp->gp_queued;
+	(void)pthread_cond_signal(&groupp->gp_space_cond);
+	*resultpp = &gep->ge_result;
+	rc = 0;
+    } else if (groupp->gp_running == 0) {
+	rc = 1;
+    } else {
+	errno = ETIMEDOUT;
+    }
+    (void)pthread_mutex_unlock(&groupp->gp_mutex);
+    return rc;
+}
+
+/*
+ * n2pkvna_group_free_result: free a result from n2pkvna_group_wait
+ *   @resultp: result, or NULL
+ */
+void n2pkvna_group_free_result(n2pkvna_group_result_t *resultp)
+{
+    if (resultp != NULL) {
+	free((void *)resultp->gr_detector2_vector);
+	free((void *)resultp->gr_detector1_vector);
+	free((void *)resultp->gr_frequency_vector);
+	free((void *)resultp);	/* ge_result is first in group_entry_t */
+    }
+}
+
+/*
+ * n2pkvna_group_stop: stop all acquisition threads of the group
+ *   @groupp: group
+ *
+ * Sweeps in progress are abandoned.  Results already queued remain
+ * available from n2pkvna_group_wait.
+ *
+ * Return:
+ *   0: success
+ */
+int n2pkvna_group_stop(n2pkvna_group_t *groupp)
+{
+    (void)pthread_mutex_lock(&groupp->gp_mutex);
+    groupp->gp_stop = true;
+    (void)pthread_cond_broadcast(&groupp->gp_space_cond);
+    (void)pthread_mutex_unlock(&groupp->gp_mutex);
+    group_join(groupp);
+    return 0;
+}
+
+/*
+ * n2pkvna_group_close: stop acquisition and close all VNAs of the group
+ *   @groupp: group
+ */
+void n2pkvna_group_close(n2pkvna_group_t *groupp)
+{
+    group_entry_t *gep;
+
+    if (groupp->gp_member_vector != NULL) {
+	(void)n2pkvna_group_stop(groupp);
+	for (int i = 0; i < groupp->gp_count; ++i) {
+	    n2pkvna_close(groupp->gp_member_vector[i].gm_vnap);
+	}
+	free((void *)groupp->gp_member_vector);
+    }
+    while ((gep = groupp->gp_head) != NULL) {
+	groupp->gp_head = gep->ge_next;
+	n2pkvna_group_free_result(&gep->ge_result);
+    }
+    (void)pthread_cond_destroy(&groupp->gp_space_cond);
+    (void)pthread_cond_destroy(&groupp->gp_ready_cond);
+    (void)pthread_mutex_destroy(&groupp->gp_mutex);
+    free((void *)groupp);
+}
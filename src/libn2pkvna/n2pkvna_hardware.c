@@ -38,9 +38,10 @@
  *   @vnap: n2pkvna handle
  *   @ucp: four byte big-endian code from LTC2240
  */
-static double _n2pkvna_decode_ltc2440(n2pkvna_t *vnap, unsigned char *ucp)
+static double _n2pkvna_decode_ltc2440(n2pkvna_t *vnap,
+	const unsigned char *ucp)
 {
-    int32_t value = ntohl(*(uint32_t *)ucp);
+    int32_t value = ntohl(*(const uint32_t *)ucp);
 
     /*
      * Fail if conversion is still in-progress.
@@ -70,6 +71,130 @@ static double _n2pkvna_decode_ltc2440(n2pkvna_t *vnap, unsigned char *ucp)
     return LTC2440_REF / 2.0 / LTC2440_FULL * value;
 }
 
+/*
+ * _n2pkvna_timespec_add: add seconds to a timespec
+ *   @tsp: time to adjust
+ *   @seconds: non-negative number of seconds to add
+ */
+void _n2pkvna_timespec_add(struct timespec *tsp, double seconds)
+{
+    long ns = (long)((seconds - floor(seconds)) * 1.0e+9);
+
+    tsp->tv_sec  += (time_t)floor(seconds);
+    tsp->tv_nsec += ns;
+    if (tsp->tv_nsec >= 1000000000) {
+	tsp->tv_nsec -= 1000000000;
+	++tsp->tv_sec;
+    }
+}
+
+/*
+ * _n2pkvna_timespec_cmp: compare two timespecs
+ *   @tsp1: first time
+ *   @tsp2: second time
+ */
+int _n2pkvna_timespec_cmp(const struct timespec *tsp1,
+	const struct timespec *tsp2)
+{
+    if (tsp1->tv_sec != tsp2->tv_sec) {
+	return tsp1->tv_sec < tsp2->tv_sec ? -1 : 1;
+    }
+    if (tsp1->tv_nsec != tsp2->tv_nsec) {
+	return tsp1->tv_nsec < tsp2->tv_nsec ? -1 : 1;
+    }
+    return 0;
+}
+
+/*
+ * _n2pkvna_timespec_diff: return tsp1 - tsp2 in seconds
+ *   @tsp1: first time
+ *   @tsp2: second time
+ */
+double _n2pkvna_timespec_diff(const struct timespec *tsp1,
+	const struct timespec *tsp2)
+{
+    return (double)(tsp1->tv_sec - tsp2->tv_sec) +
+	(double)(tsp1->tv_nsec - tsp2->tv_nsec) * 1.0e-9;
+}
+
+/*
+ * _n2pkvna_conversion_time: return the LTC2440 conversion time (s)
+ *   @adc_mode: ADC mode, or ADC mode byte of the set DDS command
+ *
+ *   The low five bits hold the LTC2440 oversampling ratio code and bit
+ *   0x20 selects double speed.  Codes 1..9 convert at 7.04kHz / 2^osr;
+ *   all others are treated as the slowest rate (6.875Hz).
+ */
+double _n2pkvna_conversion_time(uint8_t adc_mode)
+{
+    int osr = adc_mode & 0x1f;
+    double t;
+
+    if (osr < 1 || osr > 9) {
+	osr = 10;
+    }
+    t = (double)(1 << osr) / LTC2440_RATE;
+    if (adc_mode & 0x20) {
+	t /= 2.0;
+    }
+    return t;
+}
+
+/*
+ * _n2pkvna_measure_time: return the time from receipt of a set DDS
+ *			  command until its result is ready (s)
+ *   @command: encoded set DDS command
+ *
+ *   Returns zero if the command doesn't start a measurement.
+ */
+double _n2pkvna_measure_time(const unsigned char *command)
+{
+    double delay;
+
+    if (command[3] == 0) {
+	return 0.0;
+    }
+    delay = (double)command[2] * ((command[1] & 0x20) ? 8.0e-6 : 1.0e-3);
+    return delay + _n2pkvna_conversion_time(command[4]) + DEADLINE_SLACK;
+}
+
+/*
+ * _n2pkvna_command_size: return the length of the command at @data
+ *   @data: command bytes
+ *   @length: bytes available
+ *
+ * Return:
+ *   size of the command, 0 if it's truncated, -1 if the opcode is unknown
+ */
+int _n2pkvna_command_size(const unsigned char *data, int length)
+{
+    int size;
+
+    if (length < 1) {
+	return 0;
+    }
+    switch (data[0]) {
+    case 0x55:
+	if (length < 2) {
+	    return 0;
+	}
+	size = (data[1] & 0x80) ? 15 : DDS_COMMAND_SIZE;
+	break;
+
+    case 0x5A:
+	size = 7;
+	break;
+
+    case 0xA5:
+	size = 4;
+	break;
+
+    default:
+	return -1;
+    }
+    return size <= length ? size : 0;
+}
+
 /*
  * _n2pkvna_flush_input: flush unread input from the N2PK VNA
  *   @vnap: n2pkvna handle
@@ -81,7 +206,7 @@ int _n2pkvna_flush_input(n2pkvna_t *vnap)
     int rv;
 
     for (int i = 0; i < 2; ++i) {
-	if ((rv = libusb_bulk_transfer(vnap->vna_udhp, READ_ENDPOINT,
+	if ((rv = _n2pkvna_bulk_transfer(vnap, READ_ENDPOINT,
 		buffer, sizeof(buffer),
 		&transferred, USB_TIMEOUT)) < 0) {
 	   _n2pkvna_error(vnap, "%s: libusb_bulk_transfer: %s",
@@ -89,6 +214,239 @@ int _n2pkvna_flush_input(n2pkvna_t *vnap)
 	    _n2pkvna_set_usb_errno(rv);
 	    return -1;
 	}
+	++vnap->vna_stats.ns_flush_reads;
+    }
+    vnap->vna_rx_length = 0;
+    return 0;
+}
+
+/*
+ * _n2pkvna_parse_status: check a status reply and decode its values
+ *   @vnap: n2pkvna handle
+ *   @opcode: expected opcode
+ *   @buffer: reply received from the N2PK VNA
+ *   @transferred: number of bytes in buffer
+ *   @n: number of values to decode
+ *   @values: returned values
+ *
+ * Return:
+ *     1: success
+ *     0: the reply is not (yet) the one expected; poll again
+ *    -1: error (errno set)
+ */
+int _n2pkvna_parse_status(n2pkvna_t *vnap, uint8_t opcode,
+	const unsigned char *buffer, int transferred, int n, double *values)
+{
+    if (transferred < 5) {
+       _n2pkvna_error(vnap, "%s: libusb_bulk_transfer: short read",
+		vnap->vna_config.nci_basename);
+	errno = EIO;
+	return -1;
+    }
+
+    /*
+     * Check status
+     */
+    if (buffer[0] != opcode) {
+	return 0;
+    }
+    if ((buffer[1] & 0x80) != 0) {
+       _n2pkvna_error(vnap, "%s: ADC read time-out",
+		vnap->vna_config.nci_basename);
+	errno = EIO;
+	return -1;
+    }
+    if ((buffer[1] & 0x40) != 0) {
+       _n2pkvna_error(vnap, "%s: VNA powered off",
+	       vnap->vna_config.nci_basename);
+	errno = EIO;
+	return -1;
+    }
+    if (!(buffer[1] & 0x20) != !(buffer[4] > 0)) {
+       _n2pkvna_error(vnap, "%s: invalid status response",
+		vnap->vna_config.nci_basename);
+	errno = EIO;
+	return -1;
+    }
+    if (5 + 4 * buffer[4] > transferred) {
+       _n2pkvna_error(vnap, "%s: libusb_bulk_transfer: short read",
+		vnap->vna_config.nci_basename);
+	errno = EIO;
+	return -1;
+    }
+    if ((buffer[1] & 0x08) != 0) {
+       _n2pkvna_error(vnap, "%s: ADC not responding",
+	       vnap->vna_config.nci_basename);
+	errno = EIO;
+	return -1;
+    }
+
+    /*
+     * If no values are expected, return.
+     */
+    if (n == 0)
+	return 1;
+
+    /*
+     * If values aren't yet available, tell the caller to poll again.
+     */
+    if (buffer[4] == 0)
+	return 0;
+
+    /*
+     * Make sure the correct number of values were returned.
+     */
+    if (buffer[4] < n) {
+       _n2pkvna_error(vnap,
+		"%s: _n2pkvna_read_status: not enough values returned",
+		vnap->vna_config.nci_basename);
+	errno = EIO;
+	return -1;
+    }
+
+    /*
+     * Convert values.
+     */
+    for (int i = 0; i < n; ++i) {
+	values[i] = _n2pkvna_decode_ltc2440(vnap, &buffer[5 + 4 * i]);
+	if (isnan(values[i])) {
+	    errno = EIO;
+	    return -1;
+	}
+    }
+    return 1;
+}
+
+/*
+ * _n2pkvna_rx_append: add bytes read from the N2PK VNA to the status stream
+ *   @vnap: n2pkvna handle
+ *   @data: bytes received
+ *   @length: number of bytes received
+ *
+ * Return:
+ *     0: success
+ *    -1: error (errno set)
+ */
+int _n2pkvna_rx_append(n2pkvna_t *vnap, const unsigned char *data,
+	int length)
+{
+    if (length > RX_BUFSIZE - vnap->vna_rx_length) {
+	_n2pkvna_error(vnap, "%s: status stream overflow",
+		vnap->vna_config.nci_basename);
+	vnap->vna_rx_length = 0;
+	errno = EIO;
+	return -1;
+    }
+    (void)memcpy((void *)&vnap->vna_rx_buffer[vnap->vna_rx_length],
+	    (const void *)data, length);
+    vnap->vna_rx_length += length;
+
+    /*
+     * The N2PK VNA ends each IN transfer with a short packet, so a
+     * reply can only continue into the next read when this one
+     * filled the whole buffer.
+     */
+    vnap->vna_rx_continued = length >= USB_BUFSIZE;
+    return 0;
+}
+
+/*
+ * rx_valid_header: test if @buffer could start a status reply
+ *   @buffer: at least 5 bytes of the status stream
+ */
+static bool rx_valid_header(const unsigned char *buffer)
+{
+    switch (buffer[0]) {
+    case 0x55:
+    case 0x5A:
+    case 0xA5:
+	break;
+
+    default:
+	return false;
+    }
+    return !(buffer[1] & 0x20) == !(buffer[4] > 0);
+}
+
+/*
+ * rx_resync: drop a bad frame and skip to the next plausible reply
+ *   @vnap: n2pkvna handle
+ */
+static void rx_resync(n2pkvna_t *vnap)
+{
+    unsigned char *buffer = vnap->vna_rx_buffer;
+    int skip;
+
+    for (skip = 1; skip < vnap->vna_rx_length; ++skip) {
+	if (vnap->vna_rx_length - skip < 5) {
+	    if (buffer[skip] == 0x55 || buffer[skip] == 0x5A ||
+		    buffer[skip] == 0xA5) {
+		break;
+	    }
+	    continue;
+	}
+	if (rx_valid_header(&buffer[skip])) {
+	    break;
+	}
+    }
+    vnap->vna_rx_length -= skip;
+    (void)memmove((void *)buffer, (void *)&buffer[skip],
+	    vnap->vna_rx_length);
+    ++vnap->vna_stats.ns_discarded;
+}
+
+/*
+ * _n2pkvna_rx_next: return the next complete status reply from the stream
+ *   @vnap: n2pkvna handle
+ *   @opcode: expected opcode
+ *   @n: number of values to decode
+ *   @values: returned values
+ *
+ *   Replies that aren't (yet) the one expected are consumed and skipped.
+ *   A partial reply at the end of the stream is kept until the rest of
+ *   it arrives, but only if the last read could have cut it off.  Bad
+ *   headers and replies longer than the bytes actually received are
+ *   dropped and the stream is resynchronized on the next plausible
+ *   reply header.
+ *
+ * Return:
+ *     1: a reply was consumed and its values decoded
+ *     0: no complete reply with values remains; read more
+ *    -1: error (errno set)
+ */
+int _n2pkvna_rx_next(n2pkvna_t *vnap, uint8_t opcode, int n, double *values)
+{
+    unsigned char *buffer = vnap->vna_rx_buffer;
+
+    while (vnap->vna_rx_length >= 5) {
+	int length;
+	int rv;
+
+	if (!rx_valid_header(buffer)) {
+	    rx_resync(vnap);
+	    continue;
+	}
+	length = 5 + 4 * buffer[4];
+	if (length > vnap->vna_rx_length) {
+	    if (vnap->vna_rx_continued) {
+		break;
+	    }
+	    rx_resync(vnap);
+	    continue;
+	}
+	rv = _n2pkvna_parse_status(vnap, opcode, buffer, length, n, values);
+	if (rv == 0 && buffer[0] != opcode) {
+	    ++vnap->vna_stats.ns_discarded;
+	}
+	vnap->vna_rx_length -= length;
+	(void)memmove((void *)buffer, (void *)&buffer[length],
+		vnap->vna_rx_length);
+	if (rv != 0) {
+	    if (rv == -1) {
+		vnap->vna_rx_length = 0;
+	    }
+	    return rv;
+	}
     }
     return 0;
 }
@@ -107,7 +465,9 @@ int _n2pkvna_flush_input(n2pkvna_t *vnap)
 int _n2pkvna_read_status(n2pkvna_t *vnap, uint8_t opcode,
 	int n, double *values)
 {
-    uint32_t backoff = 10000;	/* microseconds */
+    struct timespec now, limit;
+    double backoff = 0.0;	/* seconds */
+    int rc = -1;
 
     /*
      * Validate arguments.
@@ -126,115 +486,111 @@ int _n2pkvna_read_status(n2pkvna_t *vnap, uint8_t opcode,
 	values[i] = NAN;
 
     /*
-     * Try the read with exponential backoff.
-     *	 max wait is 650ms
+     * Sleep until the result is expected, then poll.  If it isn't
+     * ready, retry with exponential backoff starting from a fraction
+     * of the conversion time.  Give up STATUS_TIMEOUT after the
+     * deadline.
      */
-    for (int try = 0; try < 9; ++try) {
-	int i;
+    (void)clock_gettime(CLOCK_MONOTONIC, &now);
+    if (vnap->vna_deadline.tv_sec == 0 && vnap->vna_deadline.tv_nsec == 0) {
+	vnap->vna_deadline = now;
+    }
+    limit = vnap->vna_deadline;
+    _n2pkvna_timespec_add(&limit, STATUS_TIMEOUT);
+    for (;;) {
 	unsigned char buffer[USB_BUFSIZE];
 	int transferred;
 	int rv;
 
 	/*
-	 * Read
+	 * Use a reply left over from a previous read if there is one.
 	 */
-	if ((rv = libusb_bulk_transfer(vnap->vna_udhp, READ_ENDPOINT,
-		buffer, sizeof(buffer), &transferred, USB_TIMEOUT)) < 0) {
-	   _n2pkvna_error(vnap, "%s: libusb_bulk_transfer: %s",
-		    vnap->vna_config.nci_basename, libusb_error_name(rv));
-	    _n2pkvna_set_usb_errno(rv);
-	    return -1;
-	}
-	if (transferred < 5) {
-	   _n2pkvna_error(vnap, "%s: libusb_bulk_transfer: short read",
-		    vnap->vna_config.nci_basename);
-	    _n2pkvna_set_usb_errno(rv);
-	    return -1;
+	switch (_n2pkvna_rx_next(vnap, opcode, n, values)) {
+	case -1:
+	    goto out;
+
+	case 0:
+	    break;
+
+	default:
+	    rc = 0;
+	    goto out;
 	}
 
 	/*
-	 * Check status
+	 * Wait for the deadline.
 	 */
-	if (buffer[0] != opcode) {
-	    goto backoff;
-	}
-	if ((buffer[1] & 0x80) != 0) {
-	   _n2pkvna_error(vnap, "%s: ADC read time-out",
-		    vnap->vna_config.nci_basename);
-	    errno = EIO;
-	    return -1;
-	}
-	if ((buffer[1] & 0x40) != 0) {
-	   _n2pkvna_error(vnap, "%s: VNA powered off",
-		   vnap->vna_config.nci_basename);
-	    errno = EIO;
-	    return -1;
-	}
-	if (!(buffer[1] & 0x20) != !(buffer[4] > 0)) {
-	   _n2pkvna_error(vnap, "%s: invalid status response",
-		    vnap->vna_config.nci_basename);
-	    errno = EIO;
-	    return -1;
-	}
-	if (5 + 4 * buffer[4] > transferred) {
-	   _n2pkvna_error(vnap, "%s: libusb_bulk_transfer: short read",
-		    vnap->vna_config.nci_basename);
-	    errno = EIO;
-	    return -1;
-	}
-	if ((buffer[1] & 0x08) != 0) {
-	   _n2pkvna_error(vnap, "%s: ADC not responding",
-		   vnap->vna_config.nci_basename);
-	    errno = EIO;
-	    return -1;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+		    &vnap->vna_deadline, NULL) == EINTR) {
+	    continue;
 	}
 
 	/*
-	 * If no values are expected, return.
+	 * Read
 	 */
-	if (n == 0)
-	    return 0;
+	if ((rv = _n2pkvna_bulk_transfer(vnap, READ_ENDPOINT,
+		buffer, sizeof(buffer), &transferred, USB_TIMEOUT)) < 0) {
+	   _n2pkvna_error(vnap, "%s: libusb_bulk_transfer: %s",
+		    vnap->vna_config.nci_basename, libusb_error_name(rv));
+	    _n2pkvna_set_usb_errno(rv);
+	    goto out;
+	}
 
 	/*
-	 * If values aren't yet available, back off and return.
+	 * Check status and convert values.
 	 */
-	if (buffer[4] == 0)
-	    goto backoff;
+	if (_n2pkvna_rx_append(vnap, buffer, transferred) == -1) {
+	    goto out;
+	}
+	switch (_n2pkvna_rx_next(vnap, opcode, n, values)) {
+	case -1:
+	    goto out;
 
-	/*
-	 * Make sure the correct number of values were returned.
-	 */
-	if (buffer[4] < n) {
-	   _n2pkvna_error(vnap,
-		    "%s: _n2pkvna_read_status: not enough values returned",
-		    vnap->vna_config.nci_basename);
-	    errno = EIO;
-	    return -1;
+	case 0:
+	    break;
+
+	default:
+	    rc = 0;
+	    goto out;
 	}
 
 	/*
-	 * Convert values.
+	 * Not ready: count the miss and set a new deadline.
 	 */
-	for (i = 0; i < n; ++i) {
-	    values[i] = _n2pkvna_decode_ltc2440(vnap, &buffer[5 + 4 * i]);
-	    if (isnan(values[i])) {
-		errno = EIO;
-		return -1;
+	if (n > 0) {
+	    if (backoff == 0.0) {
+		++vnap->vna_stats.ns_misses;
 	    }
+	    ++vnap->vna_stats.ns_retries;
+	}
+	if (backoff == 0.0) {
+	    backoff = MIN_RETRY;
+	}
+	(void)clock_gettime(CLOCK_MONOTONIC, &now);
+	if (_n2pkvna_timespec_cmp(&now, &limit) > 0) {
+	    break;
+	}
+	vnap->vna_deadline = now;
+	_n2pkvna_timespec_add(&vnap->vna_deadline, backoff);
+	++vnap->vna_stats.ns_backoff_sleeps;
+	vnap->vna_stats.ns_backoff_time += backoff;
+	backoff *= 2.0;
+	if (backoff > MAX_RETRY) {
+	    backoff = MAX_RETRY;
 	}
-	return 0;
-
-    backoff:
-	usleep(backoff);
-	backoff <<= 1;
-	if (backoff > 100000)	/* cap poll at 100ms */
-	    backoff = 100000;
     }
    _n2pkvna_error(vnap,
 	    "%s: _n2pkvna_read_status: too many tries",
 	    vnap->vna_config.nci_basename);
     errno = EIO;
-    return -1;
+
+out:
+    if (rc == 0 && n > 0) {
+	++vnap->vna_stats.ns_measurements;
+    }
+    vnap->vna_deadline.tv_sec  = 0;
+    vnap->vna_deadline.tv_nsec = 0;
+    return rc;
 }
 
 /*
@@ -287,23 +643,27 @@ uint8_t _n2pkvna_phase_to_code(double phase)
 }
 
 /*
- * _n2pkvna_set_dds: set the DDS
- *   @vnap: n2pkvna handle
- *   @measure: start a measurement after setting the frequency
+ * _n2pkvna_check_adc_mode: test if an ADC mode is valid
+ *   @adc_mode: LTC2440 OSR code (1..9 or 15), plus 0x20 for double speed
+ */
+bool _n2pkvna_check_adc_mode(int adc_mode)
+{
+    int osr = adc_mode & 0x1f;
+
+    if ((adc_mode & ~0x3f) != 0) {
+	return false;
+    }
+    return (osr >= 1 && osr <= 9) || osr == 15;
+}
+
+/*
+ * _n2pkvna_encode_delay: set the start delay of a set DDS command
+ *   @buffer: encoded set DDS command
  *   @start_delay: delay between DDS setting and ADC conversion (s)
- *   @lo_frequency_code: AD9851 frequency code (LO out)
- *   @rf_frequency_code: AD9851 frequency code (RF out)
- *   @phase_code: AD9851 phase code (LO out)
  */
-int _n2pkvna_set_dds(n2pkvna_t *vnap, bool measure, double start_delay,
-	uint32_t lo_frequency_code, uint32_t rf_frequency_code,
-	uint8_t phase_code)
+void _n2pkvna_encode_delay(unsigned char *buffer, double start_delay)
 {
-    uint8_t flags = measure ? 0x79 : 0x60;
-    uint8_t delay_code;
-    unsigned char buffer[25];
-    int transferred = 0;
-    int rv;
+    uint8_t flags = buffer[1] & ~0x20;
 
     /*
      * Convert start_delay.  There are two ranges:
@@ -311,7 +671,6 @@ int _n2pkvna_set_dds(n2pkvna_t *vnap, bool measure, double start_delay,
      *   1ms to 255ms
      */
     assert(start_delay >= 0.0);
-    flags &= ~0x20;
     if (start_delay <= 255.0 * 8.0e-6) {
 	start_delay = ceil((start_delay / 8.0e-6) - 0.01);
 	flags |= 0x20;
@@ -323,17 +682,32 @@ int _n2pkvna_set_dds(n2pkvna_t *vnap, bool measure, double start_delay,
     } else if (start_delay > 255.0) {
 	start_delay = 255.0;
     }
-    delay_code = (uint8_t)start_delay;
+    buffer[1] = flags;
+    buffer[2] = (uint8_t)start_delay;
+}
 
+/*
+ * _n2pkvna_encode_dds: encode a set DDS command
+ *   @buffer: DDS_COMMAND_SIZE byte buffer to receive the command
+ *   @measure: start a measurement after setting the frequency
+ *   @start_delay: delay between DDS setting and ADC conversion (s)
+ *   @adc_mode: ADC mode (see _n2pkvna_check_adc_mode)
+ *   @lo_frequency_code: AD9851 frequency code (LO out)
+ *   @rf_frequency_code: AD9851 frequency code (RF out)
+ *   @phase_code: AD9851 phase code (LO out)
+ */
+void _n2pkvna_encode_dds(unsigned char *buffer, bool measure,
+	double start_delay, int adc_mode, uint32_t lo_frequency_code,
+	uint32_t rf_frequency_code, uint8_t phase_code)
+{
     /*
-     * Send the set DDS command.
+     * Build the set DDS command.
      */
-    (void)memset((void *)buffer, 0, sizeof(buffer));
+    (void)memset((void *)buffer, 0, DDS_COMMAND_SIZE);
     buffer[0] = 0x55;
-    buffer[1] = flags;
-    buffer[2] = delay_code;
+    buffer[1] = measure ? 0x59 : 0x40;
     buffer[3] = measure ? 1 : 0;
-    buffer[4] = measure ? ADC_MODE : 0;
+    buffer[4] = measure ? ADC_MODE_FLAGS | adc_mode : 0;
     if (lo_frequency_code == 0) {
 	buffer[5] = 0x04;	/* power down */
     } else {
@@ -345,7 +719,33 @@ int _n2pkvna_set_dds(n2pkvna_t *vnap, bool measure, double start_delay,
     }
     *(uint32_t *)&buffer[11] = htonl(rf_frequency_code);
     (void)memset(&buffer[15], 0xff, 10);
-    rv = libusb_bulk_transfer(vnap->vna_udhp, WRITE_ENDPOINT,
+    _n2pkvna_encode_delay(buffer, start_delay);
+}
+
+/*
+ * _n2pkvna_set_dds: set the DDS
+ *   @vnap: n2pkvna handle
+ *   @measure: start a measurement after setting the frequency
+ *   @start_delay: delay between DDS setting and ADC conversion (s)
+ *   @lo_frequency_code: AD9851 frequency code (LO out)
+ *   @rf_frequency_code: AD9851 frequency code (RF out)
+ *   @phase_code: AD9851 phase code (LO out)
+ */
+int _n2pkvna_set_dds(n2pkvna_t *vnap, bool measure, double start_delay,
+	uint32_t lo_frequency_code, uint32_t rf_frequency_code,
+	uint8_t phase_code)
+{
+    unsigned char buffer[DDS_COMMAND_SIZE];
+    int transferred = 0;
+    int rv;
+
+    /*
+     * Send the set DDS command.
+     */
+    _n2pkvna_encode_dds(buffer, measure, start_delay,
+	    vnap->vna_config.nci_adc_mode, lo_frequency_code,
+	    rf_frequency_code, phase_code);
+    rv = _n2pkvna_bulk_transfer(vnap, WRITE_ENDPOINT,
 		buffer, sizeof(buffer), &transferred, USB_TIMEOUT);
     if (rv < 0) {
 	_n2pkvna_error(vnap,
@@ -365,5 +765,14 @@ int _n2pkvna_set_dds(n2pkvna_t *vnap, bool measure, double start_delay,
 	_n2pkvna_set_usb_errno(rv);
 	return -1;
     }
+
+    /*
+     * Record when the result should be ready.
+     */
+    if (measure) {
+	(void)clock_gettime(CLOCK_MONOTONIC, &vnap->vna_deadline);
+	_n2pkvna_timespec_add(&vnap->vna_deadline,
+		_n2pkvna_measure_time(buffer));
+    }
     return 0;
 }
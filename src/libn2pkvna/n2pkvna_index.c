@@ -0,0 +1,699 @@
+/*
+ * N2PK Vector Network Analyzer
+ * Copyright © 2021-2022 D Scott Guthridge <scott_guthridge@rompromity.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A11 PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "archdep.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "n2pkvna_internal.h"
+
+/*
+ * Configuration index
+ *
+ * ~/.n2pkvna/.index caches the list of configuration directories and
+ * the device address fields parsed from each config file, so that
+ * n2pkvna_open doesn't have to read the directory and parse every
+ * config file each time.  It still stats ~/.n2pkvna and every entry to
+ * validate the cache, so an open costs one stat per configuration.
+ * Each cached item is keyed by the stat information (modification
+ * time, inode and size) of the file it came from: the listing by that
+ * of ~/.n2pkvna, each configuration by that of its config file, and
+ * each directory without a config file by that of the directory.
+ * Anything that doesn't match is read again, and the index is
+ * rewritten.
+ *
+ * The file is INDEX_MAGIC, the entry count (32 bits), a checksum of the
+ * entries (32 bits) and the key of ~/.n2pkvna, followed by the entries.
+ * Each entry is an INDEX_ENTRY_SIZE byte header: [0] INDEX_F_* flags,
+ * [2] name length (16 bits), [4] USB vendor (16 bits), [6] USB product
+ * (16 bits), [8] N2PKVNA_ADR_* type (32 bits), [12] key; followed by
+ * the name.
+ * A key is [0] mtime seconds (64 bits), [8] nanoseconds (32 bits),
+ * [12] inode (64 bits), [20] size (64 bits).  All are big-endian.
+ */
+#define INDEX_FILENAME		".index"
+#define INDEX_MAGIC		"N2PKIDX1"
+#define INDEX_MAGIC_SIZE	8
+#define INDEX_KEY_SIZE		28
+#define INDEX_HEADER_SIZE	(INDEX_MAGIC_SIZE + 8 + INDEX_KEY_SIZE)
+#define INDEX_ENTRY_SIZE	(12 + INDEX_KEY_SIZE)
+#define INDEX_F_CONFIG		0x01		/* directory has a config */
+#define INDEX_F_PARSED		0x02		/* address fields are valid */
+
+/*
+ * index_key_t: stat information that identifies a version of a file
+ */
+typedef struct index_key {
+    uint64_t			ik_sec;		/* modification time */
+    uint32_t			ik_nsec;	/*   nanoseconds */
+    uint64_t			ik_ino;		/* inode number */
+    uint64_t			ik_size;	/* file size */
+} index_key_t;
+
+/*
+ * index_entry_t: a subdirectory of ~/.n2pkvna
+ */
+typedef struct index_entry {
+    char		       *ie_name;	/* directory basename */
+    uint8_t			ie_flags;	/* INDEX_F_* */
+    uint32_t			ie_type;	/* N2PKVNA_ADR_* */
+    uint16_t			ie_usb_vendor;	/* USB vendor ID or 0 */
+    uint16_t			ie_usb_product;	/* USB product ID or 0 */
+    index_key_t			ie_key;		/* config, or directory */
+} index_entry_t;
+
+/*
+ * n2pkvna_index_t: configuration index (see _n2pkvna_index_load)
+ */
+struct n2pkvna_index {
+    char		       *ix_dotdir;	/* path to ~/.n2pkvna */
+    char		       *ix_filename;	/* path to the index file */
+    index_key_t			ix_dir_key;	/* key of ix_dotdir */
+    index_entry_t	       *ix_entry_vector; /* sorted by name */
+    size_t			ix_entries;	/* entries in use */
+    bool			ix_dirty;	/* needs to be written */
+};
+
+/*
+ * put_key, get_key: store and load an index_key_t
+ */
+static void put_key(unsigned char *ucp, const index_key_t *keyp)
+{
+    put64(&ucp[0], keyp->ik_sec);
+    put32(&ucp[8], keyp->ik_nsec);
+    put64(&ucp[12], keyp->ik_ino);
+    put64(&ucp[20], keyp->ik_size);
+}
+
+static void get_key(const unsigned char *ucp, index_key_t *keyp)
+{
+    keyp->ik_sec  = get64(&ucp[0]);
+    keyp->ik_nsec = get32(&ucp[8]);
+    keyp->ik_ino  = get64(&ucp[12]);
+    keyp->ik_size = get64(&ucp[20]);
+}
+
+/*
+ * checksum: return the 32-bit FNV-1a hash of a buffer
+ *   @data: bytes to hash
+ *   @length: number of bytes
+ */
+static uint32_t checksum(const unsigned char *data, size_t length)
+{
+    uint32_t hash = 0x811c9dc5;
+
+    for (size_t i = 0; i < length; ++i) {
+	hash = (hash ^ data[i]) * 0x01000193;
+    }
+    return hash;
+}
+
+/*
+ * stat_key: get the key of a file
+ *   @path: pathname
+ *   @keyp: key to fill in
+ *   @stp: optional address of struct stat to receive the stat information
+ *
+ * Return:
+ *   0: success
+ *  -1: error (errno set)
+ */
+static int stat_key(const char *path, index_key_t *keyp, struct stat *stp)
+{
+    struct stat st;
+
+    if (stat(path, &st) == -1) {
+	return -1;
+    }
+    keyp->ik_sec  = st.st_mtim.tv_sec;
+    keyp->ik_nsec = st.st_mtim.tv_nsec;
+    keyp->ik_ino  = st.st_ino;
+    keyp->ik_size = st.st_size;
+    if (stp != NULL) {
+	*stp = st;
+    }
+    return 0;
+}
+
+/*
+ * key_equal: test if two keys are the same
+ */
+static bool key_equal(const index_key_t *keyp1, const index_key_t *keyp2)
+{
+    return keyp1->ik_sec  == keyp2->ik_sec  &&
+	   keyp1->ik_nsec == keyp2->ik_nsec &&
+	   keyp1->ik_ino  == keyp2->ik_ino  &&
+	   keyp1->ik_size == keyp2->ik_size;
+}
+
+/*
+ * free_entries: free an entry vector
+ *   @entry_vector: vector of index_entry_t
+ *   @entries: number of entries
+ */
+static void free_entries(index_entry_t *entry_vector, size_t entries)
+{
+    if (entry_vector != NULL) {
+	for (size_t i = 0; i < entries; ++i) {
+	    free((void *)entry_vector[i].ie_name);
+	}
+	free((void *)entry_vector);
+    }
+}
+
+/*
+ * decode: load the entries from the contents of the index file
+ *   @indexp: index to fill in
+ *   @data: file contents
+ *   @length: length of file
+ *
+ * Leaves the index empty if the file isn't a well-formed index.
+ */
+static void decode(n2pkvna_index_t *indexp, const unsigned char *data,
+	size_t length)
+{
+    index_entry_t *entry_vector = NULL;
+    size_t entries;
+    size_t offset = INDEX_HEADER_SIZE;
+
+    if (length < INDEX_HEADER_SIZE ||
+	    memcmp(data, INDEX_MAGIC, INDEX_MAGIC_SIZE) != 0 ||
+	    get32(&data[INDEX_MAGIC_SIZE + 4]) !=
+		checksum(&data[INDEX_HEADER_SIZE],
+		    length - INDEX_HEADER_SIZE)) {
+	return;
+    }
+    entries = get32(&data[INDEX_MAGIC_SIZE]);
+    if (entries > (length - INDEX_HEADER_SIZE) / INDEX_ENTRY_SIZE) {
+	return;
+    }
+    if ((entry_vector = calloc(MAX(entries, 1),
+		    sizeof(index_entry_t))) == NULL) {
+	return;
+    }
+    for (size_t i = 0; i < entries; ++i) {
+	index_entry_t *iep = &entry_vector[i];
+	const unsigned char *ucp = &data[offset];
+	size_t name_length;
+
+	if (length - offset < INDEX_ENTRY_SIZE) {
+	    goto bad;
+	}
+	name_length = get16(&ucp[2]);
+	if (name_length == 0 ||
+		length - offset - INDEX_ENTRY_SIZE < name_length) {
+	    goto bad;
+	}
+	if ((iep->ie_name = malloc(name_length + 1)) == NULL) {
+	    goto bad;
+	}
+	(void)memcpy((void *)iep->ie_name, (void *)&ucp[INDEX_ENTRY_SIZE],
+		name_length);
+	iep->ie_name[name_length] = '\000';
+	if (strchr(iep->ie_name, '/') != NULL ||
+		(i > 0 && strcmp(entry_vector[i - 1].ie_name,
+			iep->ie_name) >= 0)) {
+	    goto bad;
+	}
+	iep->ie_flags	    = ucp[0];
+	iep->ie_usb_vendor  = get16(&ucp[4]);
+	iep->ie_usb_product = get16(&ucp[6]);
+	iep->ie_type	    = get32(&ucp[8]);
+	get_key(&ucp[12], &iep->ie_key);
+	offset += INDEX_ENTRY_SIZE + name_length;
+    }
+    if (offset != length) {
+	goto bad;
+    }
+    get_key(&data[INDEX_MAGIC_SIZE + 8], &indexp->ix_dir_key);
+    indexp->ix_entry_vector = entry_vector;
+    indexp->ix_entries = entries;
+    return;
+
+bad:
+    free_entries(entry_vector, entries);
+}
+
+/*
+ * lock_file: wait for a whole-file lock
+ *   @fd: file descriptor
+ *   @type: F_RDLCK, F_WRLCK or F_UNLCK
+ */
+static int lock_file(int fd, short type)
+{
+    struct flock lck;
+
+    (void)memset((void *)&lck, 0, sizeof(lck));
+    lck.l_type = type;
+    lck.l_whence = SEEK_SET;
+    lck.l_start = 0;
+    lck.l_len = 0;
+    return fcntl(fd, F_SETLKW, &lck);
+}
+
+/*
+ * _n2pkvna_index_load: read the configuration index
+ *   @vnap: n2pkvna handle (for errors)
+ *   @dotdir: path to ~/.n2pkvna
+ *
+ * A missing or damaged index file isn't an error: the index starts
+ * out empty and is rebuilt.  If the file doesn't exist, create it now
+ * so that creating it doesn't change the key of @dotdir later.
+ *
+ * Return:
+ *   index, or NULL on error (errno set)
+ */
+n2pkvna_index_t *_n2pkvna_index_load(n2pkvna_t *vnap, const char *dotdir)
+{
+    n2pkvna_index_t *indexp;
+    unsigned char *data = NULL;
+    struct stat st;
+    int fd;
+
+    if ((indexp = calloc(1, sizeof(n2pkvna_index_t))) == NULL) {
+	_n2pkvna_error(vnap, "calloc: %s", strerror(errno));
+	return NULL;
+    }
+    if ((indexp->ix_dotdir = strdup(dotdir)) == NULL) {
+	_n2pkvna_error(vnap, "strdup: %s", strerror(errno));
+	goto error;
+    }
+    if (asprintf(&indexp->ix_filename, "%s/%s",
+		dotdir, INDEX_FILENAME) == -1) {
+	_n2pkvna_error(vnap, "asprintf: %s", strerror(errno));
+	indexp->ix_filename = NULL;
+	goto error;
+    }
+    if ((fd = open(indexp->ix_filename, O_RDONLY)) == -1) {
+	if (errno == ENOENT && (fd = open(indexp->ix_filename,
+			O_WRONLY | O_CREAT, 0666)) != -1) {
+	    (void)close(fd);
+	}
+	return indexp;
+    }
+    if (lock_file(fd, F_RDLCK) == -1 || fstat(fd, &st) == -1 ||
+	    st.st_size == 0) {
+	(void)close(fd);
+	return indexp;
+    }
+    if ((data = malloc(st.st_size)) != NULL) {
+	if (pread(fd, data, st.st_size, 0) == st.st_size) {
+	    decode(indexp, data, st.st_size);
+	}
+	free((void *)data);
+    }
+    (void)close(fd);		/* releases the lock */
+    return indexp;
+
+error:
+    _n2pkvna_index_close(indexp);
+    return NULL;
+}
+
+/*
+ * find_entry: find an entry by name
+ *   @indexp: index
+ *   @name: directory basename
+ */
+static index_entry_t *find_entry(const n2pkvna_index_t *indexp,
+	const char *name)
+{
+    size_t low = 0, high = indexp->ix_entries;
+
+    while (low < high) {
+	size_t middle = (low + high) / 2;
+	int cmp = strcmp(name, indexp->ix_entry_vector[middle].ie_name);
+
+	if (cmp == 0) {
+	    return &indexp->ix_entry_vector[middle];
+	}
+	if (cmp < 0) {
+	    high = middle;
+	} else {
+	    low = middle + 1;
+	}
+    }
+    return NULL;
+}
+
+/*
+ * check_entries: test if the cached listing still matches the directory
+ *   @indexp: index
+ *
+ * Adding or removing a config file changes the key of its directory
+ * but not that of ~/.n2pkvna.  A config file that was only rewritten
+ * doesn't change the listing; _n2pkvna_index_parse catches that.
+ */
+static bool check_entries(const n2pkvna_index_t *indexp)
+{
+    for (size_t i = 0; i < indexp->ix_entries; ++i) {
+	const index_entry_t *iep = &indexp->ix_entry_vector[i];
+	index_key_t key;
+	char *path;
+	int rv;
+
+	if (asprintf(&path, (iep->ie_flags & INDEX_F_CONFIG) ?
+		    "%s/%s/config" : "%s/%s",
+		    indexp->ix_dotdir, iep->ie_name) == -1) {
+	    return false;
+	}
+	rv = stat_key(path, &key, NULL);
+	free((void *)path);
+	if (rv == -1) {
+	    return false;
+	}
+	if (!(iep->ie_flags & INDEX_F_CONFIG) &&
+		!key_equal(&key, &iep->ie_key)) {
+	    return false;
+	}
+    }
+    return true;
+}
+
+/*
+ * scan_filter: select candidate configuration directory names
+ */
+static int scan_filter(const struct dirent *dep)
+{
+    return dep->d_name[0] != '.';
+}
+
+/*
+ * scan_compare: order directory names by strcmp
+ *
+ * Unlike alphasort, this doesn't depend on the locale, so the listing
+ * is in the same order decode checks and find_entry searches.
+ */
+static int scan_compare(const struct dirent **dep1, const struct dirent **dep2)
+{
+    return strcmp((*dep1)->d_name, (*dep2)->d_name);
+}
+
+/*
+ * rescan: rebuild the listing from the directory
+ *   @vnap: n2pkvna handle (for errors)
+ *   @indexp: index
+ *   @dir_key: key of the directory taken before reading it
+ *
+ * Keeps the parsed fields of entries whose config file hasn't changed.
+ */
+static int rescan(n2pkvna_t *vnap, n2pkvna_index_t *indexp,
+	const index_key_t *dir_key)
+{
+    struct dirent **namelist = NULL;
+    index_entry_t *entry_vector = NULL;
+    size_t entries = 0;
+    int count;
+    int rv = -1;
+
+    if ((count = scandir(indexp->ix_dotdir, &namelist, scan_filter,
+		    scan_compare)) == -1) {
+	if (errno == ENOENT || errno == ENOTDIR) {
+	    count = 0;
+	} else {
+	    _n2pkvna_error(vnap, "scandir: %s: %s",
+		    indexp->ix_dotdir, strerror(errno));
+	    return -1;
+	}
+    }
+    if ((entry_vector = calloc(MAX(count, 1),
+		    sizeof(index_entry_t))) == NULL) {
+	_n2pkvna_error(vnap, "calloc: %s", strerror(errno));
+	goto out;
+    }
+    for (int i = 0; i < count; ++i) {
+	const char *name = namelist[i]->d_name;
+	index_entry_t *iep = &entry_vector[entries];
+	const index_entry_t *old_iep;
+	struct stat st;
+	char *path;
+
+	if (asprintf(&path, "%s/%s", indexp->ix_dotdir, name) == -1) {
+	    _n2pkvna_error(vnap, "asprintf: %s", strerror(errno));
+	    goto out;
+	}
+	if (stat_key(path, &iep->ie_key, &st) == -1 || !S_ISDIR(st.st_mode)) {
+	    free((void *)path);
+	    continue;
+	}
+	free((void *)path);
+	if (asprintf(&path, "%s/%s/config", indexp->ix_dotdir, name) == -1) {
+	    _n2pkvna_error(vnap, "asprintf: %s", strerror(errno));
+	    goto out;
+	}
+	if (stat_key(path, &iep->ie_key, NULL) == 0) {
+	    iep->ie_flags = INDEX_F_CONFIG;
+	    old_iep = find_entry(indexp, name);
+	    if (old_iep != NULL &&
+		    (old_iep->ie_flags & INDEX_F_PARSED) &&
+		    key_equal(&old_iep->ie_key, &iep->ie_key)) {
+		iep->ie_flags	   |= INDEX_F_PARSED;
+		iep->ie_type	    = old_iep->ie_type;
+		iep->ie_usb_vendor  = old_iep->ie_usb_vendor;
+		iep->ie_usb_product = old_iep->ie_usb_product;
+	    }
+	}
+	free((void *)path);
+	if ((iep->ie_name = strdup(name)) == NULL) {
+	    _n2pkvna_error(vnap, "strdup: %s", strerror(errno));
+	    goto out;
+	}
+	++entries;
+    }
+    free_entries(indexp->ix_entry_vector, indexp->ix_entries);
+    indexp->ix_entry_vector = entry_vector;
+    indexp->ix_entries = entries;
+    entry_vector = NULL;
+    indexp->ix_dir_key = *dir_key;
+    indexp->ix_dirty = true;
+    rv = 0;
+
+out:
+    free_entries(entry_vector, entries);
+    if (namelist != NULL) {
+	for (int i = 0; i < count; ++i) {
+	    free((void *)namelist[i]);
+	}
+	free((void *)namelist);
+    }
+    return rv;
+}
+
+/*
+ * _n2pkvna_index_list: find the configuration directories
+ *   @vnap: n2pkvna handle
+ *   @indexp: index
+ *   @ncip_vector: address of pointer to receive the configurations
+ *   @count: address of size_t to receive the number of configurations
+ *
+ * Sets nci_directory in each configuration.  Uses the cached listing if
+ * ~/.n2pkvna and the directories in it are unchanged; otherwise reads
+ * the directory.
+ *
+ * Return:
+ *   0: success
+ *  -1: error (errno set)
+ */
+int _n2pkvna_index_list(n2pkvna_t *vnap, n2pkvna_index_t *indexp,
+	n2pkvna_config_internal_t **ncip_vector, size_t *count)
+{
+    n2pkvna_config_internal_t *result;
+    index_key_t dir_key;
+    size_t configs = 0;
+
+    *ncip_vector = NULL;
+    *count = 0;
+    if (stat_key(indexp->ix_dotdir, &dir_key, NULL) == -1) {
+	return 0;
+    }
+    if (!key_equal(&dir_key, &indexp->ix_dir_key) ||
+	    !check_entries(indexp)) {
+	if (rescan(vnap, indexp, &dir_key) == -1) {
+	    return -1;
+	}
+    }
+    for (size_t i = 0; i < indexp->ix_entries; ++i) {
+	if (indexp->ix_entry_vector[i].ie_flags & INDEX_F_CONFIG) {
+	    ++configs;
+	}
+    }
+    if (configs == 0) {
+	return 0;
+    }
+    if ((result = calloc(configs,
+		    sizeof(n2pkvna_config_internal_t))) == NULL) {
+	_n2pkvna_error(vnap, "calloc: %s", strerror(errno));
+	return -1;
+    }
+    *ncip_vector = result;
+    for (size_t i = 0; i < indexp->ix_entries; ++i) {
+	const index_entry_t *iep = &indexp->ix_entry_vector[i];
+
+	if (!(iep->ie_flags & INDEX_F_CONFIG)) {
+	    continue;
+	}
+	if (asprintf(&result[*count].nci_directory, "%s/%s",
+		    indexp->ix_dotdir, iep->ie_name) == -1) {
+	    _n2pkvna_error(vnap, "asprintf: %s", strerror(errno));
+	    result[*count].nci_directory = NULL;
+	    return -1;
+	}
+	++*count;
+    }
+    return 0;
+}
+
+/*
+ * _n2pkvna_index_parse: get a configuration's address fields
+ *   @vnap: n2pkvna handle
+ *   @indexp: index, or NULL
+ *   @ncip: configuration with nci_directory set
+ *   @create: true if it's not an error for the config file not to exist
+ *
+ * Fills in nci_type and the USB vendor and product from the index if
+ * the config file is unchanged; otherwise parses the config file.
+ * Other fields are left at their defaults: n2pkvna_open parses the
+ * config file of the device it opens again under lock.
+ *
+ * Return:
+ *   0: success
+ *  -1: error (errno set)
+ */
+int _n2pkvna_index_parse(n2pkvna_t *vnap, n2pkvna_index_t *indexp,
+	n2pkvna_config_internal_t *ncip, bool create)
+{
+    size_t dotdir_length;
+    index_entry_t *iep = NULL;
+    index_key_t key;
+    char *path = NULL;
+
+    if (indexp != NULL) {
+	dotdir_length = strlen(indexp->ix_dotdir);
+	if (strncmp(ncip->nci_directory, indexp->ix_dotdir,
+		    dotdir_length) == 0 &&
+		ncip->nci_directory[dotdir_length] == '/') {
+	    iep = find_entry(indexp, &ncip->nci_directory[dotdir_length + 1]);
+	}
+    }
+    if (iep == NULL || !(iep->ie_flags & INDEX_F_CONFIG)) {
+	return _n2pkvna_parse_config(vnap, ncip, create);
+    }
+    if (asprintf(&path, "%s/config", ncip->nci_directory) == -1) {
+	_n2pkvna_error(vnap, "asprintf: %s", strerror(errno));
+	return -1;
+    }
+    if (stat_key(path, &key, NULL) == -1) {
+	free((void *)path);
+	return _n2pkvna_parse_config(vnap, ncip, create);
+    }
+    free((void *)path);
+    if ((iep->ie_flags & INDEX_F_PARSED) && key_equal(&key, &iep->ie_key)) {
+	ncip->nci_type = iep->ie_type;
+	(void)memset((void *)&ncip->u, 0, sizeof(ncip->u));
+	ncip->nci_usb_vendor  = iep->ie_usb_vendor;
+	ncip->nci_usb_product = iep->ie_usb_product;
+	ncip->nci_reference_frequency = AD9851_CLOCK;
+	ncip->nci_adc_mode = DEFAULT_ADC_MODE;
+	return 0;
+    }
+    if (_n2pkvna_parse_config(vnap, ncip, create) == -1) {
+	return -1;
+    }
+    iep->ie_flags	|= INDEX_F_PARSED;
+    iep->ie_type	 = ncip->nci_type;
+    iep->ie_usb_vendor	 = ncip->nci_usb_vendor;
+    iep->ie_usb_product	 = ncip->nci_usb_product;
+    iep->ie_key		 = key;
+    indexp->ix_dirty = true;
+    return 0;
+}
+
+/*
+ * save: write the index file
+ *   @indexp: index
+ *
+ * The file is rewritten in place so as not to change the key of
+ * ~/.n2pkvna.  Errors are ignored: the index is only a cache.
+ */
+static void save(const n2pkvna_index_t *indexp)
+{
+    unsigned char *data;
+    size_t length = INDEX_HEADER_SIZE;
+    size_t offset = INDEX_HEADER_SIZE;
+    int fd;
+
+    for (size_t i = 0; i < indexp->ix_entries; ++i) {
+	length += INDEX_ENTRY_SIZE + strlen(indexp->ix_entry_vector[i].ie_name);
+    }
+    if ((data = calloc(1, length)) == NULL) {
+	return;
+    }
+    (void)memcpy((void *)data, INDEX_MAGIC, INDEX_MAGIC_SIZE);
+    put32(&data[INDEX_MAGIC_SIZE], indexp->ix_entries);
+    put_key(&data[INDEX_MAGIC_SIZE + 8], &indexp->ix_dir_key);
+    for (size_t i = 0; i < indexp->ix_entries; ++i) {
+	const index_entry_t *iep = &indexp->ix_entry_vector[i];
+	unsigned char *ucp = &data[offset];
+	size_t name_length = strlen(iep->ie_name);
+
+	ucp[0] = iep->ie_flags;
+	put16(&ucp[2], name_length);
+	put16(&ucp[4], iep->ie_usb_vendor);
+	put16(&ucp[6], iep->ie_usb_product);
+	put32(&ucp[8], iep->ie_type);
+	put_key(&ucp[12], &iep->ie_key);
+	(void)memcpy((void *)&ucp[INDEX_ENTRY_SIZE], (void *)iep->ie_name,
+		name_length);
+	offset += INDEX_ENTRY_SIZE + name_length;
+    }
+    put32(&data[INDEX_MAGIC_SIZE + 4], checksum(&data[INDEX_HEADER_SIZE],
+		length - INDEX_HEADER_SIZE));
+    if ((fd = open(indexp->ix_filename, O_RDWR)) != -1) {
+	if (lock_file(fd, F_WRLCK) == 0 && ftruncate(fd, 0) == 0) {
+	    (void)pwrite(fd, data, length, 0);
+	}
+	(void)close(fd);	/* releases the lock */
+    }
+    free((void *)data);
+}
+
+/*
+ * _n2pkvna_index_close: write the index if changed and free it
+ *   @indexp: index, or NULL
+ */
+void _n2pkvna_index_close(n2pkvna_index_t *indexp)
+{
+    if (indexp == NULL) {
+	return;
+    }
+    if (indexp->ix_dirty) {
+	save(indexp);
+    }
+    free_entries(indexp->ix_entry_vector, indexp->ix_entries);
+    free((void *)indexp->ix_filename);
+    free((void *)indexp->ix_dotdir);
+    free((void *)indexp);
+}
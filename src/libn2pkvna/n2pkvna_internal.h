@@ -20,8 +20,11 @@
 #define _N2PKVNA_INTERNAL_H
 
 #include <libusb-1.0/libusb.h>
+#include <pthread.h>
 #include <stdarg.h>
 #include <stdlib.h>
+#include <sys/time.h>
+#include <time.h>
 #include <vnaerr.h>
 #include <vnaproperty.h>
 
@@ -29,18 +32,64 @@
 
 #define LTC2440_REF		2.5		/* V */
 #define LTC2440_FULL		268435456.0	/* 2^28 */
+#define LTC2440_RATE		7040.0		/* max conversion rate (Hz) */
 #define MIN_CLOCK		50.0e+6		/* Hz */
 #define MAX_CLOCK		500.e+6		/* Hz */
 #define AD9851_CLOCK		156.25e+6	/* Hz */
+#define N2PKVNA_USB_VENDOR	0x0547		/* Anchor Chips */
 #define USB_BUFSIZE		512		/* bytes */
 #define WRITE_ENDPOINT		0x02
 #define READ_ENDPOINT		0x86
 #define USB_TIMEOUT		2000		/* ms */
-#define ADC_MODE		0x47
+#define ADC_MODE_FLAGS		0x40		/* always set in ADC mode byte */
+#define DEFAULT_ADC_MODE	0x07		/* OSR 7 (55Hz), normal speed */
+#define MIN_DELAY		4e-6		/* firmware minDelay (s) */
 #define HOLD_DELAY0		10e-3		/* 1st measurement (s) */
 #define HOLD_DELAY1		62e-6		/* same frequency (s) */
 #define HOLD_DELAY2		250e-6		/* new frequency (s) */
 #define SWITCH_DELAY		0.25		/* s */
+#define DDS_COMMAND_SIZE	25		/* bytes */
+#define MAX_QUEUE_DEPTH		64		/* commands */
+#define DEFAULT_COMMAND_DEPTH	8		/* commands */
+#define MAX_BATCH		(USB_BUFSIZE / DDS_COMMAND_SIZE) /* commands */
+#define FIRMWARE_BATCH		1		/* commands per OUT packet the
+						   firmware is known to parse */
+#define DEFAULT_READ_DEPTH	2		/* transfers */
+#define MAX_PHASE_STEPS		32		/* AD9851 phase codes */
+#define DEFAULT_PHASE_STEPS	8		/* 45 degree steps */
+#define RX_BUFSIZE		(4 * USB_BUFSIZE) /* status stream (bytes) */
+#define DEADLINE_SLACK		50e-6		/* poll after deadline (s) */
+#define MIN_RETRY		100e-6		/* first re-poll (s) */
+#define MAX_RETRY		100e-3		/* longest re-poll (s) */
+#define STATUS_TIMEOUT		650e-3		/* give up after deadline (s) */
+#define DEFAULT_POINT_RETRIES	2		/* re-measures of a point */
+#define DEFAULT_SCAN_ERRORS	20		/* transient errors per scan */
+#define MAX_POINT_RETRIES	100		/* re-measures of a point */
+#define MAX_RECONNECT_TIMEOUT	3600.0		/* s */
+#define RECONNECT_INTERVAL	0.1		/* poll for a lost device (s) */
+#define RECONNECT_RETRIES	3		/* reconnects without progress */
+#define WARM_TIMEOUT		100		/* warm reset drain reads (ms) */
+#define WARM_DRAIN_READS	4		/* reads to find an idle status */
+#define CONTEXT_POLL_INTERVAL	100000		/* event thread wakeup (us) */
+#define GROUP_MAX_QUEUED	64		/* unclaimed group results */
+
+/*
+ * Transcript file from n2pkvna_record_start: RECORD_MAGIC followed by
+ * records, each a RECORD_HEADER_SIZE byte header and a payload.  The
+ * header holds, all big-endian: [0] RECORD_* type, [1] endpoint,
+ * [2] bytes transferred (16 bits), [4] libusb error code or transfer
+ * status, [8] start time in ns since recording began (64 bits),
+ * [16] duration in ns, [20] asynchronous transfer id, [24] payload
+ * length.  OUT payloads hold the data sent; IN payloads the data
+ * received.
+ */
+#define RECORD_MAGIC		"N2PKREC1"
+#define RECORD_MAGIC_SIZE	8
+#define RECORD_HEADER_SIZE	28
+#define RECORD_BULK		0x01		/* synchronous transfer */
+#define RECORD_SUBMIT		0x02		/* asynchronous submit */
+#define RECORD_COMPLETE		0x03		/* asynchronous completion */
+#define RECORD_CANCEL		0x04		/* asynchronous cancel */
 
 #define SQRT2	1.41421356237309504880168872420969807856967187537694
 
@@ -78,6 +127,7 @@ typedef struct n2pkvna_config_internal {
 	} usb;
     } u;
     double nci_reference_frequency;	/* reference oscillator frequency */
+    int nci_adc_mode;			/* LTC2440 OSR code | 0x20 (2x) */
     n2pkvna_address_internal_t **nci_addresses; /* matching physical devices */
     size_t nci_count;			/* number of physical devices */
 } n2pkvna_config_internal_t;
@@ -85,29 +135,277 @@ typedef struct n2pkvna_config_internal {
 #define nci_usb_vendor	u.usb._nci_usb_vector
 #define nci_usb_product	u.usb._nci_usb_product
 
+/*
+ * n2pkvna_transport_t: device I/O operations
+ *
+ *   Every function returns 0 or a negative LIBUSB_ERROR code.  All
+ *   transports use struct libusb_transfer for asynchronous transfers,
+ *   but only the USB transport hands them to libusb.
+ */
+typedef struct n2pkvna_transport {
+    const char *nt_name;
+    int (*nt_bulk_transfer)(n2pkvna_t *vnap, unsigned char endpoint,
+	    unsigned char *data, int length, int *transferred,
+	    unsigned int timeout);
+    int (*nt_submit_transfer)(n2pkvna_t *vnap,
+	    struct libusb_transfer *transfer);
+    int (*nt_cancel_transfer)(n2pkvna_t *vnap,
+	    struct libusb_transfer *transfer);
+    int (*nt_handle_events)(n2pkvna_t *vnap, struct timeval *tv);
+    void (*nt_close)(n2pkvna_t *vnap);
+} n2pkvna_transport_t;
+
+/* n2pkvna_recorder_t: transcript recorder (see n2pkvna_record_start) */
+typedef struct n2pkvna_recorder n2pkvna_recorder_t;
+
+/* n2pkvna_replay_t: recorded device behavior loaded for playback */
+typedef struct n2pkvna_replay n2pkvna_replay_t;
+
+/* n2pkvna_index_t: cached list of configurations (see n2pkvna_index.c) */
+typedef struct n2pkvna_index n2pkvna_index_t;
+
 /*
  * n2pkvna_t: N2PK VNA device handle
  */
 struct n2pkvna {
+    pthread_mutex_t vna_mutex;		/* serializes use of the handle */
+    pthread_mutex_t vna_sweep_mutex;	/* protects vna_sweep and its data */
     n2pkvna_config_internal_t vna_config;
     n2pkvna_address_internal_t vna_address;
     int vna_lockfd;
     struct libusb_context *vna_ctxp;
     struct libusb_device_handle *vna_udhp;
+    const n2pkvna_transport_t *vna_transport; /* device I/O operations */
+    void *vna_transport_state;		/* transport private data */
+    struct n2pkvna_recorder *vna_recorder; /* transcript recorder or NULL */
     n2pkvna_error_t *vna_error_fn;
     void *vna_error_arg;
     vnaproperty_t *vna_property_root;
+    int vna_command_depth;		/* max DDS commands in flight */
+    int vna_read_depth;			/* max IN transfers in flight */
+    int vna_batch_size;			/* max DDS commands per OUT transfer */
+    int vna_phase_steps;		/* LO phase steps per point */
+    int vna_rx_length;			/* bytes in vna_rx_buffer */
+    bool vna_rx_continued;		/* last read filled its buffer */
+    unsigned char vna_rx_buffer[RX_BUFSIZE]; /* unparsed status replies */
+    struct timespec vna_deadline;	/* when the pending result is due */
+    n2pkvna_stats_t vna_stats;		/* measurement statistics */
+    n2pkvna_open_times_t vna_open_times; /* open and reset timings */
+    bool vna_synchronized;		/* DDS phases in step since reset */
+    int vna_point_retries;		/* re-measures of a failed point */
+    int vna_scan_errors;		/* transient errors a scan survives */
+    double vna_reconnect_timeout;	/* wait for a lost device (s) or 0 */
+    int vna_switch;			/* last switch setting or -1 */
+    int vna_attenuator;			/* last attenuator setting or -1 */
+    double vna_switch_delay;		/* settle delay of the above (s) */
+    struct n2pkvna_sweep *vna_sweep;	/* background sweep or NULL;
+					   changed holding both mutexes */
 };
 
+/*
+ * n2pkvna_plan_point_t: phase steps of one frequency point in a plan
+ * n2pkvna_plan: precomputed frequency scan (see n2pkvna_plan_create)
+ */
+typedef struct n2pkvna_plan_point {
+    size_t			pp_first;	/* index of first command */
+    size_t			pp_count;	/* number of commands */
+    double			pp_divisor;	/* normalizes the sum */
+} n2pkvna_plan_point_t;
+
+struct n2pkvna_plan {
+    n2pkvna_t		       *pn_vnap;	/* n2pkvna handle */
+    unsigned int		pn_points;	/* number of frequencies */
+    double		       *pn_frequency_vector; /* actual frequencies */
+    n2pkvna_plan_point_t       *pn_point_vector; /* commands per point */
+    size_t			pn_commands;	/* number of commands */
+    unsigned char	       *pn_command_vector; /* encoded commands */
+    double complex		pn_circle[MAX_PHASE_STEPS]; /* weight/code */
+};
+
+/*
+ * n2pkvna_command_fn_t: encode command @index of a pipeline run
+ *   @arg: user argument passed to _n2pkvna_pipeline_run
+ *   @index: command index
+ *   @buffer: DDS_COMMAND_SIZE byte buffer to receive the command
+ */
+typedef void n2pkvna_command_fn_t(void *arg, size_t index,
+	unsigned char *buffer);
+
+/*
+ * n2pkvna_result_fn_t: accept the detector values for command @index
+ *   @arg: user argument passed to _n2pkvna_pipeline_run
+ *   @index: command index
+ *   @values: detector 1 and detector 2 voltages
+ *
+ * Return 0 to continue or -1 (errno set) to abort the run.
+ */
+typedef int n2pkvna_result_fn_t(void *arg, size_t index,
+	const double *values);
+
+/*
+ * put16, put32, put64: store big-endian integers
+ */
+static inline void put16(unsigned char *ucp, uint16_t value)
+{
+    ucp[0] = value >> 8;
+    ucp[1] = value;
+}
+
+static inline void put32(unsigned char *ucp, uint32_t value)
+{
+    put16(&ucp[0], value >> 16);
+    put16(&ucp[2], value);
+}
+
+static inline void put64(unsigned char *ucp, uint64_t value)
+{
+    put32(&ucp[0], value >> 32);
+    put32(&ucp[4], value);
+}
+
+/*
+ * get16, get32, get64: load big-endian integers
+ */
+static inline uint16_t get16(const unsigned char *ucp)
+{
+    return (uint16_t)ucp[0] << 8 | ucp[1];
+}
+
+static inline uint32_t get32(const unsigned char *ucp)
+{
+    return (uint32_t)get16(&ucp[0]) << 16 | get16(&ucp[2]);
+}
+
+static inline uint64_t get64(const unsigned char *ucp)
+{
+    return (uint64_t)get32(&ucp[0]) << 32 | get32(&ucp[4]);
+}
+
 /* _n2pkvna_error: report errors if error_fn is non-NULL */
 extern void _n2pkvna_error(n2pkvna_t *vnap, const char *format, ...);
 
 extern void _n2pkvna_libvna_errfn(const char *message, void *error_arg,
 	vnaerr_category_t category);
 
+/* _n2pkvna_transfer_error: map libusb transfer status to libusb error code */
+extern int _n2pkvna_transfer_error(enum libusb_transfer_status status);
+
+/* _n2pkvna_bulk_transfer: perform a synchronous bulk transfer */
+extern int _n2pkvna_bulk_transfer(n2pkvna_t *vnap, unsigned char endpoint,
+	unsigned char *data, int length, int *transferred,
+	unsigned int timeout);
+
+/* _n2pkvna_count_transfer: add a finished transfer to the statistics */
+extern void _n2pkvna_count_transfer(n2pkvna_t *vnap, unsigned char endpoint,
+	int transferred, double elapsed);
+
+/* _n2pkvna_submit_transfer: submit an asynchronous transfer */
+extern int _n2pkvna_submit_transfer(n2pkvna_t *vnap,
+	struct libusb_transfer *transfer);
+
+/* _n2pkvna_cancel_transfer: cancel an asynchronous transfer */
+extern int _n2pkvna_cancel_transfer(n2pkvna_t *vnap,
+	struct libusb_transfer *transfer);
+
+/* _n2pkvna_handle_events: complete asynchronous transfers */
+extern int _n2pkvna_handle_events(n2pkvna_t *vnap, struct timeval *tv);
+
+/* _n2pkvna_context_acquire: attach the shared libusb context to a handle */
+extern int _n2pkvna_context_acquire(n2pkvna_t *vnap);
+
+/* _n2pkvna_context_release: detach the shared libusb context from a handle */
+extern void _n2pkvna_context_release(n2pkvna_t *vnap);
+
+/* _n2pkvna_context_get_devices: return referenced USB devices to search */
+extern ssize_t _n2pkvna_context_get_devices(n2pkvna_t *vnap, uint16_t vendor,
+	libusb_device ***device_vector);
+
+/* _n2pkvna_context_free_devices: free a vector from _context_get_devices */
+extern void _n2pkvna_context_free_devices(libusb_device **device_vector,
+	ssize_t count);
+
+/* _n2pkvna_usb_open: open the USB device and attach the USB transport */
+extern int _n2pkvna_usb_open(n2pkvna_t *vnap);
+
+/* _n2pkvna_sim_open: attach the simulated device transport */
+extern int _n2pkvna_sim_open(n2pkvna_t *vnap, const char *replay_file);
+
+/* _n2pkvna_record_bulk_transfer: perform and record a synchronous transfer */
+extern int _n2pkvna_record_bulk_transfer(n2pkvna_t *vnap,
+	unsigned char endpoint, unsigned char *data, int length,
+	int *transferred, unsigned int timeout);
+
+/* _n2pkvna_record_submit_transfer: record and submit an async transfer */
+extern int _n2pkvna_record_submit_transfer(n2pkvna_t *vnap,
+	struct libusb_transfer *transfer);
+
+/* _n2pkvna_record_cancel_transfer: record and cancel an async transfer */
+extern int _n2pkvna_record_cancel_transfer(n2pkvna_t *vnap,
+	struct libusb_transfer *transfer);
+
+/* _n2pkvna_replay_load: load a transcript from n2pkvna_record_start */
+extern n2pkvna_replay_t *_n2pkvna_replay_load(n2pkvna_t *vnap,
+	const char *filename);
+
+/* _n2pkvna_replay_write: check commands against the recording */
+extern int _n2pkvna_replay_write(n2pkvna_t *vnap, n2pkvna_replay_t *rp,
+	const unsigned char *data, int length, double time_scale);
+
+/* _n2pkvna_replay_read: serve the recorded replies that are due */
+extern int _n2pkvna_replay_read(n2pkvna_t *vnap, n2pkvna_replay_t *rp,
+	unsigned char *buffer, int length);
+
+/* _n2pkvna_replay_free: free a loaded recording */
+extern void _n2pkvna_replay_free(n2pkvna_replay_t *rp);
+
+/* _n2pkvna_timespec_add: add seconds to a timespec */
+extern void _n2pkvna_timespec_add(struct timespec *tsp, double seconds);
+
+/* _n2pkvna_timespec_cmp: compare two timespecs */
+extern int _n2pkvna_timespec_cmp(const struct timespec *tsp1,
+	const struct timespec *tsp2);
+
+/* _n2pkvna_timespec_diff: return tsp1 - tsp2 in seconds */
+extern double _n2pkvna_timespec_diff(const struct timespec *tsp1,
+	const struct timespec *tsp2);
+
+/* _n2pkvna_conversion_time: return the LTC2440 conversion time (s) */
+extern double _n2pkvna_conversion_time(uint8_t adc_mode);
+
+/* _n2pkvna_measure_time: return time from set DDS command to result (s) */
+extern double _n2pkvna_measure_time(const unsigned char *command);
+
+/* _n2pkvna_command_size: return the length of the command at data */
+extern int _n2pkvna_command_size(const unsigned char *data, int length);
+
 /* _n2pkvna_flush_input: flush unread input from the N2PK VNA */
 extern int _n2pkvna_flush_input(n2pkvna_t *vnap);
 
+/* _n2pkvna_reset: reset an N2PK VNA holding the handle lock */
+extern int _n2pkvna_reset(n2pkvna_t *vnap);
+
+/* _n2pkvna_save_sync_state: record in config.lck if the device is in sync */
+extern void _n2pkvna_save_sync_state(n2pkvna_t *vnap);
+
+/* _n2pkvna_set_switch: change VNA switch settings holding the handle lock */
+extern int _n2pkvna_set_switch(n2pkvna_t *vnap, int switch_value,
+	int attenuator_value, double delay);
+
+/* _n2pkvna_reconnect: reopen a lost USB device and restore its state */
+extern int _n2pkvna_reconnect(n2pkvna_t *vnap);
+
+/* _n2pkvna_parse_status: check a status reply and decode its values */
+extern int _n2pkvna_parse_status(n2pkvna_t *vnap, uint8_t opcode,
+	const unsigned char *buffer, int transferred, int n, double *values);
+
+/* _n2pkvna_rx_append: add bytes read from the N2PK VNA to the status stream */
+extern int _n2pkvna_rx_append(n2pkvna_t *vnap, const unsigned char *data,
+	int length);
+
+/* _n2pkvna_rx_next: return the next complete status reply from the stream */
+extern int _n2pkvna_rx_next(n2pkvna_t *vnap, uint8_t opcode, int n,
+	double *values);
+
 /* _n2pkvna_read_status: read status from the N2PK VNA */
 extern int _n2pkvna_read_status(n2pkvna_t *vnap, uint8_t opcode,
 	int n, double *values);
@@ -121,15 +419,54 @@ extern double _n2pkvna_code_to_frequency(double f0, uint32_t code);
 /* _n2pkvna_phase_to_code: convert phase in degrees to DDS code (not shifted) */
 extern uint8_t _n2pkvna_phase_to_code(double phase);
 
+/* _n2pkvna_check_adc_mode: test if an ADC mode is valid */
+extern bool _n2pkvna_check_adc_mode(int adc_mode);
+
+/* _n2pkvna_encode_delay: set the start delay of a set DDS command */
+extern void _n2pkvna_encode_delay(unsigned char *buffer, double start_delay);
+
+/* _n2pkvna_encode_dds: encode a set DDS command */
+extern void _n2pkvna_encode_dds(unsigned char *buffer, bool measure,
+	double start_delay, int adc_mode, uint32_t lo_frequency_code,
+	uint32_t rf_frequency_code, uint8_t phase_code);
+
 /* _n2pkvna_set_dds: set the DDS */
 extern int _n2pkvna_set_dds(n2pkvna_t *vnap, bool measure, double start_delay,
 	uint32_t lo_frequency_code, uint32_t rf_frequency_code,
 	uint8_t phase_code);
 
+/* _n2pkvna_pipeline_run: send measure commands and collect results */
+extern int _n2pkvna_pipeline_run(n2pkvna_t *vnap, size_t count,
+	n2pkvna_command_fn_t *command_fn, n2pkvna_result_fn_t *result_fn,
+	void *arg);
+
+/* _n2pkvna_lock_idle: lock the handle unless a background sweep runs */
+extern int _n2pkvna_lock_idle(n2pkvna_t *vnap, const char *function);
+
+/* _n2pkvna_plan_run: run a planned scan */
+extern int _n2pkvna_plan_run(n2pkvna_plan_t *planp, double *frequency_vector,
+	double complex *detector1_vector, double complex *detector2_vector,
+	n2pkvna_point_fn_t *point_fn, void *point_arg);
+
 /* _n2pkvna_parse_config: parse an n2pkvna config file */
 extern int _n2pkvna_parse_config(n2pkvna_t *vnap,
 	n2pkvna_config_internal_t *ncip, bool create);
 
+/* _n2pkvna_index_load: read the configuration index */
+extern n2pkvna_index_t *_n2pkvna_index_load(n2pkvna_t *vnap,
+	const char *dotdir);
+
+/* _n2pkvna_index_list: find the configuration directories */
+extern int _n2pkvna_index_list(n2pkvna_t *vnap, n2pkvna_index_t *indexp,
+	n2pkvna_config_internal_t **ncip_vector, size_t *count);
+
+/* _n2pkvna_index_parse: get a configuration's address fields */
+extern int _n2pkvna_index_parse(n2pkvna_t *vnap, n2pkvna_index_t *indexp,
+	n2pkvna_config_internal_t *ncip, bool create);
+
+/* _n2pkvna_index_close: write the index if changed and free it */
+extern void _n2pkvna_index_close(n2pkvna_index_t *indexp);
+
 /* _n2pkvna_set_usb_errno: set errno based on the libusb error code */
 extern void _n2pkvna_set_usb_errno(int usb_error);
 
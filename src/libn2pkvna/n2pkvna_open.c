@@ -21,12 +21,12 @@
 #include <assert.h>
 #include <errno.h>
 #include <fcntl.h>
-#include <glob.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>	/* for mkdir and stat */
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "n2pkvna_internal.h"
@@ -58,7 +58,13 @@ const n2pkvna_address_t *n2pkvna_get_address(n2pkvna_t *vnap)
  */
 double n2pkvna_get_reference_frequency(const n2pkvna_t *vnap)
 {
-    return vnap->vna_config.nci_reference_frequency;
+    pthread_mutex_t *mutexp = (pthread_mutex_t *)&vnap->vna_mutex;
+    double frequency;
+
+    (void)pthread_mutex_lock(mutexp);
+    frequency = vnap->vna_config.nci_reference_frequency;
+    (void)pthread_mutex_unlock(mutexp);
+    return frequency;
 }
 
 /*
@@ -69,19 +75,184 @@ double n2pkvna_get_reference_frequency(const n2pkvna_t *vnap)
 int n2pkvna_set_reference_frequency(n2pkvna_t *vnap, double frequency)
 {
     if (frequency == 0.0) {
-	vnap->vna_config.nci_reference_frequency = AD9851_CLOCK;
-	return 0;
-    }
-    if (frequency < MIN_CLOCK || frequency > MAX_CLOCK) {
+	frequency = AD9851_CLOCK;
+    } else if (frequency < MIN_CLOCK || frequency > MAX_CLOCK) {
 	_n2pkvna_error(vnap,
 		"invalid reference frequency %f", frequency);
 	errno = EINVAL;
 	return -1;
     }
+    if (_n2pkvna_lock_idle(vnap, "n2pkvna_set_reference_frequency") == -1) {
+	return -1;
+    }
     vnap->vna_config.nci_reference_frequency = frequency;
+    (void)pthread_mutex_unlock(&vnap->vna_mutex);
+    return 0;
+}
+
+/*
+ * n2pkvna_get_adc_mode: return the ADC oversampling ratio and speed mode
+ *   @vnap: n2pkvna handle
+ */
+int n2pkvna_get_adc_mode(const n2pkvna_t *vnap)
+{
+    pthread_mutex_t *mutexp = (pthread_mutex_t *)&vnap->vna_mutex;
+    int adc_mode;
+
+    (void)pthread_mutex_lock(mutexp);
+    adc_mode = vnap->vna_config.nci_adc_mode;
+    (void)pthread_mutex_unlock(mutexp);
+    return adc_mode;
+}
+
+/*
+ * n2pkvna_set_adc_mode: set the ADC oversampling ratio and speed mode
+ *   @vnap: n2pkvna handle
+ *   @adc_mode: LTC2440 OSR code (1..9 or 15), plus N2PKVNA_ADC_2X for
+ *		double speed, or 0 to restore the default
+ *
+ * Plans capture the mode in effect when they are created.
+ */
+int n2pkvna_set_adc_mode(n2pkvna_t *vnap, int adc_mode)
+{
+    if (adc_mode == 0) {
+	adc_mode = DEFAULT_ADC_MODE;
+    } else if (!_n2pkvna_check_adc_mode(adc_mode)) {
+	_n2pkvna_error(vnap, "invalid ADC mode 0x%02x", adc_mode);
+	errno = EINVAL;
+	return -1;
+    }
+    if (_n2pkvna_lock_idle(vnap, "n2pkvna_set_adc_mode") == -1) {
+	return -1;
+    }
+    vnap->vna_config.nci_adc_mode = adc_mode;
+    (void)pthread_mutex_unlock(&vnap->vna_mutex);
     return 0;
 }
 
+/*
+ * n2pkvna_get_stats: return measurement statistics
+ *   @vnap: n2pkvna handle
+ *   @stats: caller-supplied structure to receive the statistics
+ */
+void n2pkvna_get_stats(const n2pkvna_t *vnap, n2pkvna_stats_t *stats)
+{
+    pthread_mutex_t *mutexp = (pthread_mutex_t *)&vnap->vna_mutex;
+
+    (void)pthread_mutex_lock(mutexp);
+    *stats = vnap->vna_stats;
+    (void)pthread_mutex_unlock(mutexp);
+}
+
+/*
+ * n2pkvna_get_open_times: return how long opening and reset took
+ *   @vnap: n2pkvna handle
+ *   @times: caller-supplied structure to receive the timings
+ */
+void n2pkvna_get_open_times(const n2pkvna_t *vnap,
+	n2pkvna_open_times_t *times)
+{
+    pthread_mutex_t *mutexp = (pthread_mutex_t *)&vnap->vna_mutex;
+
+    (void)pthread_mutex_lock(mutexp);
+    *times = vnap->vna_open_times;
+    (void)pthread_mutex_unlock(mutexp);
+}
+
+/*
+ * n2pkvna_reset_stats: zero the measurement statistics
+ *   @vnap: n2pkvna handle
+ */
+void n2pkvna_reset_stats(n2pkvna_t *vnap)
+{
+    (void)pthread_mutex_lock(&vnap->vna_mutex);
+    (void)memset((void *)&vnap->vna_stats, 0, sizeof(vnap->vna_stats));
+    (void)pthread_mutex_unlock(&vnap->vna_mutex);
+}
+
+/*
+ * n2pkvna_set_queue_depth: set how many requests the scan keeps in flight
+ *   @vnap: n2pkvna handle
+ *   @commands: maximum set DDS commands sent ahead of their results
+ *   @reads: maximum status reads in flight
+ *   @batch: maximum set DDS commands packed into each USB transfer
+ */
+int n2pkvna_set_queue_depth(n2pkvna_t *vnap, int commands, int reads,
+	int batch)
+{
+    if (commands < 1 || commands > MAX_QUEUE_DEPTH) {
+	_n2pkvna_error(vnap,
+		"invalid command queue depth %d", commands);
+	errno = EINVAL;
+	return -1;
+    }
+    if (reads < 1 || reads > commands) {
+	_n2pkvna_error(vnap,
+		"invalid read queue depth %d", reads);
+	errno = EINVAL;
+	return -1;
+    }
+    if (batch < 1 || batch > MAX_BATCH || batch > commands) {
+	_n2pkvna_error(vnap,
+		"invalid command batch size %d", batch);
+	errno = EINVAL;
+	return -1;
+    }
+    if (_n2pkvna_lock_idle(vnap, "n2pkvna_set_queue_depth") == -1) {
+	return -1;
+    }
+    vnap->vna_command_depth = commands;
+    vnap->vna_read_depth = reads;
+    vnap->vna_batch_size = batch;
+    (void)pthread_mutex_unlock(&vnap->vna_mutex);
+    return 0;
+}
+
+/*
+ * n2pkvna_set_retry: set how scans recover from transient errors
+ *   @vnap: n2pkvna handle
+ *   @point_retries: times to measure a failed point again before
+ *	marking it failed and moving on
+ *   @scan_errors: transient errors a scan survives before failing
+ */
+int n2pkvna_set_retry(n2pkvna_t *vnap, int point_retries, int scan_errors)
+{
+    if (point_retries < 0 || point_retries > MAX_POINT_RETRIES) {
+	_n2pkvna_error(vnap,
+		"invalid point retry count %d", point_retries);
+	errno = EINVAL;
+	return -1;
+    }
+    if (scan_errors < 0) {
+	_n2pkvna_error(vnap,
+		"invalid scan error count %d", scan_errors);
+	errno = EINVAL;
+	return -1;
+    }
+    if (_n2pkvna_lock_idle(vnap, "n2pkvna_set_retry") == -1) {
+	return -1;
+    }
+    vnap->vna_point_retries = point_retries;
+    vnap->vna_scan_errors = scan_errors;
+    (void)pthread_mutex_unlock(&vnap->vna_mutex);
+    return 0;
+}
+
+/*
+ * open_split: return the seconds since *mark and advance mark to now
+ *   @mark: start of the phase being timed
+ */
+static double open_split(struct timespec *mark)
+{
+    struct timespec now;
+    double elapsed;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = _n2pkvna_timespec_diff(&now, mark);
+    *mark = now;
+    return elapsed;
+}
+
 /*
  * n2pkvna_open: open and reset the n2pkvna device
  *   @name: optional N2PKVNA device name or path to device directory
@@ -98,6 +269,7 @@ n2pkvna_t *n2pkvna_open(const char *name, bool create, const char *unit,
     n2pkvna_t *vnap = NULL;
     static const char dotdir[] = ".n2pkvna";
     char *home = NULL;
+    n2pkvna_index_t *indexp = NULL;
     n2pkvna_config_internal_t *ncip_vector = NULL;
     size_t config_count = 0;
     n2pkvna_address_t address;
@@ -106,10 +278,14 @@ n2pkvna_t *n2pkvna_open(const char *name, bool create, const char *unit,
     size_t matching_addresss = 0;
     n2pkvna_config_internal_t *ncip_match = NULL;
     libusb_device **usb_device_vector = NULL;
-    ssize_t usb_device_count;
-    int rv;
+    ssize_t usb_device_count = 0;
+    bool want_sim = false;
     char *lock_filename = NULL;
     bool success = false;
+    struct timespec start, mark;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &start);
+    mark = start;
 
     /*
      * If config_vector was given, initialize the returned value to NULL.
@@ -132,7 +308,17 @@ n2pkvna_t *n2pkvna_open(const char *name, bool create, const char *unit,
         return NULL;
     }
     (void)memset((void *)vnap, 0, sizeof(n2pkvna_t));
+    (void)pthread_mutex_init(&vnap->vna_mutex, NULL);
+    (void)pthread_mutex_init(&vnap->vna_sweep_mutex, NULL);
     vnap->vna_lockfd = -1;
+    vnap->vna_command_depth = DEFAULT_COMMAND_DEPTH;
+    vnap->vna_read_depth = DEFAULT_READ_DEPTH;
+    vnap->vna_batch_size = FIRMWARE_BATCH;
+    vnap->vna_phase_steps = DEFAULT_PHASE_STEPS;
+    vnap->vna_point_retries = DEFAULT_POINT_RETRIES;
+    vnap->vna_scan_errors = DEFAULT_SCAN_ERRORS;
+    vnap->vna_switch = -1;
+    vnap->vna_attenuator = -1;
     vnap->vna_error_fn  = error_fn;
     vnap->vna_error_arg = error_arg;
 
@@ -187,74 +373,37 @@ n2pkvna_t *n2pkvna_open(const char *name, bool create, const char *unit,
     }
 
     /*
-     * If no config name was given, glob search ~/.n2pkvna for directories
-     * with config files.
+     * Load the index of configurations in ~/.n2pkvna.
      */
-    if (name == NULL) {
-	char *pattern;
-	glob_t dir_glob;
+    if (home != NULL) {
+	char *path = NULL;
 
-	if (home == NULL) {
-	    _n2pkvna_error(vnap, "no configuration name was given and HOME "
-		    "is not set");
-	    errno = ESRCH;
-	    goto out;
-	}
-	if (asprintf(&pattern, "%s/%s/*/config",
-		    home, dotdir) == -1) {
+	if (asprintf(&path, "%s/%s", home, dotdir) == -1) {
 	    _n2pkvna_error(vnap, "asprintf: %s", strerror(errno));
 	    goto out;
 	}
-	(void)memset((void *)&dir_glob, 0, sizeof(dir_glob));
-	switch (glob(pattern, 0, NULL, &dir_glob)) {
-	case 0:
-	    break;
-
-	case GLOB_NOMATCH:
-	    free((void *)pattern);
-	    pattern = NULL;
-	    goto get_addresss;
-
-	case GLOB_NOSPACE:
-	    free((void *)pattern);
-	    pattern = NULL;
-	    errno = ENOMEM;
-	    _n2pkvna_error(vnap, "glob: %s", strerror(errno));
+	indexp = _n2pkvna_index_load(vnap, path);
+	free((void *)path);
+	if (indexp == NULL) {
 	    goto out;
+	}
+    }
 
-        case GLOB_ABORTED:
-	default:
-	    free((void *)pattern);
-	    pattern = NULL;
-	    errno = EIO;
-	    _n2pkvna_error(vnap, "glob: %s", strerror(errno));
+    /*
+     * If no config name was given, find the directories in ~/.n2pkvna
+     * with config files.
+     */
+    if (name == NULL) {
+	if (home == NULL) {
+	    _n2pkvna_error(vnap, "no configuration name was given and HOME "
+		    "is not set");
+	    errno = ESRCH;
 	    goto out;
 	}
-	free((void *)pattern);
-	pattern = NULL;
-	ncip_vector = calloc(dir_glob.gl_pathc,
-		sizeof(n2pkvna_config_internal_t));
-	if (ncip_vector == NULL) {
-	    globfree(&dir_glob);
-	    _n2pkvna_error(vnap, "calloc: %s", strerror(errno));
+	if (_n2pkvna_index_list(vnap, indexp, &ncip_vector,
+		    &config_count) == -1) {
 	    goto out;
 	}
-	for (size_t s = 0; s < dir_glob.gl_pathc; ++s) {
-	    char *cp;
-	    n2pkvna_config_internal_t *ncip = &ncip_vector[s];
-
-	    if ((cp = strrchr(dir_glob.gl_pathv[s], '/')) != NULL) {
-		*cp = '\000';
-	    }
-	    ncip->nci_directory = strdup(dir_glob.gl_pathv[s]);
-	    if (ncip->nci_directory == NULL) {
-		globfree(&dir_glob);
-		_n2pkvna_error(vnap, "strdup: %s", strerror(errno));
-		goto out;
-	    }
-	}
-	config_count = dir_glob.gl_pathc;
-	globfree(&dir_glob);
 
     /*
      * The caller specified a config name.
@@ -294,8 +443,8 @@ n2pkvna_t *n2pkvna_open(const char *name, bool create, const char *unit,
     }
 
     /*
-     * For each device configuration, set the basename and parse the
-     * config file.
+     * For each device configuration, set the basename and get its
+     * address from the index or config file.
      */
     for (size_t s = 0; s < config_count; ++s) {
 	n2pkvna_config_internal_t *ncip = &ncip_vector[s];
@@ -306,36 +455,58 @@ n2pkvna_t *n2pkvna_open(const char *name, bool create, const char *unit,
 	} else {
 	    ncip->nci_basename = ncip->nci_directory;
 	}
-	if (_n2pkvna_parse_config(vnap, ncip, create) == -1) {
+	if (_n2pkvna_index_parse(vnap, indexp, ncip, create) == -1) {
 	    goto out;
 	}
     }
+    vnap->vna_open_times.ot_config = open_split(&mark);
+
+    /*
+     * The simulated device is present if the unit address asks for it,
+     * or if no unit address was given and a configuration uses it.
+     */
+    if (address.adr_type == N2PKVNA_ADR_SIM) {
+	want_sim = true;
+    } else if (address.adr_type == N2PKVNA_ADR_ANY) {
+	for (size_t s = 0; s < config_count; ++s) {
+	    if (ncip_vector[s].nci_type == N2PKVNA_ADR_SIM) {
+		want_sim = true;
+	    }
+	}
+    }
 
-get_addresss:
     /*
-     * Open the USB library, get the device list and create adripp_vector.
+     * Open the USB library, get the devices and create adripp_vector.
      * Note: if future interfaces are added (e.g. parallel), add the devices
      * here.  Those may be based on address information we parsed from the
      * device config files, information we can discover from the system, or
      * static addresses.
      */
-    if ((rv = libusb_init(&vnap->vna_ctxp)) < 0) {
-	_n2pkvna_error(vnap, "libusb_init: %s", libusb_error_name(rv));
-	_n2pkvna_set_usb_errno(rv);
-	goto out;
-    }
-    if ((usb_device_count = libusb_get_device_list(vnap->vna_ctxp,
-	    &usb_device_vector)) < 0) {
-	_n2pkvna_error(vnap, "libusb_get_device_list: %s",
-		libusb_error_name(usb_device_count));
-	_n2pkvna_set_usb_errno(usb_device_count);
-	goto out;
+    if (address.adr_type != N2PKVNA_ADR_SIM) {
+	if (_n2pkvna_context_acquire(vnap) == -1) {
+	    goto out;
+	}
+	if ((usb_device_count = _n2pkvna_context_get_devices(vnap,
+			address.adr_usb_vendor, &usb_device_vector)) == -1) {
+	    usb_device_count = 0;
+	    goto out;
+	}
     }
-    if ((adripp_vector = calloc(usb_device_count,
+    if ((adripp_vector = calloc(usb_device_count + 1,
 		    sizeof(n2pkvna_address_internal_t *))) == NULL) {
 	_n2pkvna_error(vnap, "calloc: %s", strerror(errno));
 	goto out;
     }
+    if (want_sim) {
+	n2pkvna_address_internal_t *adrip;
+
+	if ((adrip = calloc(1, sizeof(n2pkvna_address_internal_t))) == NULL) {
+	    _n2pkvna_error(vnap, "calloc: %s", strerror(errno));
+	    goto out;
+	}
+	adrip->adri_type = N2PKVNA_ADR_SIM;
+	adripp_vector[address_count++] = adrip;
+    }
     for (ssize_t i = 0; i < usb_device_count; ++i) {
 	libusb_device *device = usb_device_vector[i];
 	struct libusb_device_descriptor descriptor;
@@ -349,7 +520,7 @@ get_addresss:
 		continue;
 	    }
 	/* If the vendor wasn't given, use the default of 0x0547. */
-	} else if (descriptor.idVendor != 0x0547) {	/* Anchor Chips */
+	} else if (descriptor.idVendor != N2PKVNA_USB_VENDOR) {
 	    continue;
 	}
 	if (address.adr_usb_product != 0) {
@@ -401,25 +572,33 @@ get_addresss:
 	n2pkvna_address_internal_t *adrip = adripp_vector[0];
 	const char *home;
 
-	if (adrip->adri_type != N2PKVNA_ADR_USB)
-	    goto skip_special_case;
-
-	if (adrip->adri_usb_vendor != 0x0547)
-	    goto skip_special_case;
-
-	switch (adrip->adri_usb_product) {
-	case 0x100d:
-	    name = "n2pkvna-v5-500mA";
-	    break;
-	case 0x100b:
-	    name = "n2pkvna-v5-100mA";
-	    break;
-	case 0x1009:
-	    name = "n2pkvna-500mA";
+	switch (adrip->adri_type) {
+	case N2PKVNA_ADR_SIM:
+	    name = "n2pkvna-sim";
 	    break;
-	case 0x1005:
-	    name = "n2pkvna-100mA";
+
+	case N2PKVNA_ADR_USB:
+	    if (adrip->adri_usb_vendor != N2PKVNA_USB_VENDOR)
+		goto skip_special_case;
+
+	    switch (adrip->adri_usb_product) {
+	    case 0x100d:
+		name = "n2pkvna-v5-500mA";
+		break;
+	    case 0x100b:
+		name = "n2pkvna-v5-100mA";
+		break;
+	    case 0x1009:
+		name = "n2pkvna-500mA";
+		break;
+	    case 0x1005:
+		name = "n2pkvna-100mA";
+		break;
+	    default:
+		goto skip_special_case;
+	    }
 	    break;
+
 	default:
 	    goto skip_special_case;
 	}
@@ -439,6 +618,7 @@ get_addresss:
 	ncip_vector->nci_basename =
 	    strrchr(ncip_vector->nci_directory, '/') + 1;
         ncip_vector->nci_reference_frequency = AD9851_CLOCK;
+        ncip_vector->nci_adc_mode = DEFAULT_ADC_MODE;
 	config_count = 1;
     }
 skip_special_case:
@@ -473,6 +653,9 @@ skip_special_case:
 		    }
 		    break;
 
+		case N2PKVNA_ADR_SIM:
+		    break;
+
 		default:
 		    abort();
 		}
@@ -539,6 +722,7 @@ skip_special_case:
 		adrp->adr_type = adrip->adri_type;
 		switch (adrip->adri_type) {
 		case N2PKVNA_ADR_USB:
+		case N2PKVNA_ADR_SIM:
 		    *adrp = adrip->adri_address;
 		    break;
 
@@ -580,6 +764,7 @@ skip_special_case:
     assert(ncip_match->nci_count == 1);
     vnap->vna_address = *ncip_match->nci_addresses[0];
     /* nci_addresses and nci_count are unused and remain zero */
+    vnap->vna_open_times.ot_enumerate = open_split(&mark);
 
     /*
      * Lock the device.
@@ -659,6 +844,9 @@ skip_special_case:
 	    }
 	    break;
 
+	case N2PKVNA_ADR_SIM:
+	    break;
+
 	config_changed:
 	    _n2pkvna_error(vnap,
 		    "%s: device configuration changed after acquiring lock",
@@ -670,16 +858,27 @@ skip_special_case:
 	    abort();
 	}
     }
+    vnap->vna_open_times.ot_lock = open_split(&mark);
 
     /*
-     * Open the USB handle.
+     * Open the device and attach its transport.
      */
-    if ((rv = libusb_open(vnap->vna_address.adri_usb_devicep,
-		    &vnap->vna_udhp)) < 0) {
-	_n2pkvna_error(vnap, "%s: libusb_open: %s",
-	    vnap->vna_config.nci_basename, libusb_error_name(rv));
-	_n2pkvna_set_usb_errno(rv);
-	goto out;
+    switch (vnap->vna_address.adri_type) {
+    case N2PKVNA_ADR_USB:
+	if (_n2pkvna_usb_open(vnap) == -1) {
+	    goto out;
+	}
+	break;
+
+    case N2PKVNA_ADR_SIM:
+	if (_n2pkvna_sim_open(vnap, unit != NULL &&
+		    strncmp(unit, "replay:", 7) == 0 ? &unit[7] : NULL) == -1) {
+	    goto out;
+	}
+	break;
+
+    default:
+	abort();
     }
 
     /*
@@ -690,6 +889,8 @@ skip_special_case:
 	    goto out;
 	}
     }
+    vnap->vna_open_times.ot_device = open_split(&mark);
+    vnap->vna_open_times.ot_open = _n2pkvna_timespec_diff(&mark, &start);
     success = true;
 
 out:
@@ -712,10 +913,10 @@ out:
 	free((void *)adripp_vector);
 	adripp_vector = NULL;
     }
-    if (usb_device_vector != NULL) {
-	libusb_free_device_list(usb_device_vector, /*unref_devices=*/1);
-	usb_device_vector = NULL;
-    }
+    _n2pkvna_context_free_devices(usb_device_vector, usb_device_count);
+    usb_device_vector = NULL;
+    _n2pkvna_index_close(indexp);
+    indexp = NULL;
     if (!success) {
 	n2pkvna_close(vnap);
 	vnap = NULL;
@@ -751,19 +952,25 @@ void n2pkvna_free_config_vector(n2pkvna_config_t **vector)
  */
 void n2pkvna_close(n2pkvna_t *vnap)
 {
-    if (vnap->vna_udhp != NULL) {
-	libusb_close(vnap->vna_udhp);
-	vnap->vna_udhp = NULL;
+    if (vnap->vna_sweep != NULL) {
+	(void)n2pkvna_sweep_stop(vnap);
+    }
+    if (vnap->vna_recorder != NULL) {
+	(void)n2pkvna_record_stop(vnap);
     }
-    if (vnap->vna_ctxp != NULL) {
-	libusb_exit(vnap->vna_ctxp);
-	vnap->vna_ctxp = NULL;
+    if (vnap->vna_transport != NULL) {
+	(*vnap->vna_transport->nt_close)(vnap);
+	vnap->vna_transport = NULL;
     }
+    _n2pkvna_context_release(vnap);
     if (vnap->vna_lockfd != -1) {
+	_n2pkvna_save_sync_state(vnap);
 	(void)close(vnap->vna_lockfd);
 	vnap->vna_lockfd = -1;
     }
     free((void *)vnap->vna_config.nci_directory);
+    (void)pthread_mutex_destroy(&vnap->vna_sweep_mutex);
+    (void)pthread_mutex_destroy(&vnap->vna_mutex);
     free((void *)vnap);
     vnap = NULL;
 }
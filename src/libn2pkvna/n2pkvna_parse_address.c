@@ -176,6 +176,22 @@ int _n2pkvna_parse_address(n2pkvna_address_t *adrp, const char *unit)
     scan(&as);
     scan(&as);
 
+    /*
+     * The simulated device has the address "sim", or "replay:PATH"
+     * to play back a transcript from n2pkvna_record_start.
+     */
+    (void)memset((void *)adrp, 0, sizeof(*adrp));
+    if (strncmp(unit, "replay:", 7) == 0 && unit[7] != '\000') {
+	adrp->adr_type = N2PKVNA_ADR_SIM;
+	return 0;
+    }
+    if (as.as_token0 == T_WORD && as.as_token1 == T_EOF &&
+	    as.as_end0 - as.as_text0 == 3 &&
+	    strncmp(as.as_text0, "sim", 3) == 0) {
+	adrp->adr_type = N2PKVNA_ADR_SIM;
+	return 0;
+    }
+
     /*
      * Parse a USB address.  To support other than USB addresses,
      * handle them above this block.
@@ -201,7 +217,6 @@ int _n2pkvna_parse_address(n2pkvna_address_t *adrp, const char *unit)
      *
      * where vendor, product, bus, device and port are WORD
      */
-    (void)memset((void *)adrp, 0, sizeof(*adrp));
     adrp->adr_type = N2PKVNA_ADR_USB;
     for (;;) {
 	switch (as.as_token0) {
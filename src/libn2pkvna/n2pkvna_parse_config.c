@@ -146,6 +146,7 @@ int _n2pkvna_parse_config(n2pkvna_t *vnap,
     ncip->nci_type = '\000';
     (void)memset((void *)&ncip->u, 0, sizeof(ncip->u));
     ncip->nci_reference_frequency = AD9851_CLOCK;
+    ncip->nci_adc_mode = DEFAULT_ADC_MODE;
 
     /*
      * Load the config file.  If create is true, then it's not an error
@@ -206,6 +207,23 @@ int _n2pkvna_parse_config(n2pkvna_t *vnap,
     }
     for (const char **cpp = element_names; *cpp != NULL; ++cpp) {
 	switch (**cpp) {
+	case 'a':
+	    if (strcmp(*cpp, "adcMode") == 0) {
+		if (parse_int(vnap, filename, vnap->vna_property_root, *cpp,
+			    0, 0x3f, &i_temp) == -1) {
+		    goto out;
+		}
+		if (!_n2pkvna_check_adc_mode(i_temp)) {
+		    _n2pkvna_error(vnap,
+			    "%s: error: %s: invalid ADC mode 0x%02x",
+			    filename, *cpp, i_temp);
+		    goto out;
+		}
+		ncip->nci_adc_mode = i_temp;
+		continue;
+	    }
+	    break;
+
 	case 'p':
 	    if (strcmp(*cpp, "properties") == 0) {
 		continue;
@@ -223,6 +241,13 @@ int _n2pkvna_parse_config(n2pkvna_t *vnap,
 	    }
 	    break;
 
+	case 's':
+	    if (strcmp(*cpp, "simulator") == 0) {
+		ncip->nci_type = N2PKVNA_ADR_SIM;
+		continue;
+	    }
+	    break;
+
 	case 'u':
 	    if (strcmp(*cpp, "usbVendor") == 0) {
 		if (parse_int(vnap, filename, vnap->vna_property_root, *cpp,
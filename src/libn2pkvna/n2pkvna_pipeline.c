@@ -0,0 +1,595 @@
+/*
+ * N2PK Vector Network Analyzer
+ * Copyright © 2021-2022 D Scott Guthridge <scott_guthridge@rompromity.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A11 PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "archdep.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "n2pkvna_internal.h"
+
+/*
+ * pipeline_slot_t: a bulk transfer owned by the pipeline
+ */
+typedef struct pipeline_slot {
+    struct pipeline	       *ps_plp;		/* parent pointer */
+    struct libusb_transfer     *ps_transfer;	/* libusb transfer */
+    bool			ps_active;	/* submitted, not completed */
+    bool			ps_waiting;	/* waiting to be resubmitted */
+    struct timespec		ps_when;	/* when to resubmit */
+    struct timespec		ps_submitted;	/* when last submitted */
+    size_t			ps_first;	/* first command in batch */
+    size_t			ps_count;	/* commands in batch */
+    unsigned char		ps_buffer[USB_BUFSIZE];
+} pipeline_slot_t;
+
+/*
+ * pipeline_t: state of an asynchronous pipeline run
+ */
+typedef struct pipeline {
+    n2pkvna_t		       *pl_vnap;	/* n2pkvna handle */
+    size_t			pl_count;	/* commands to send */
+    size_t			pl_sent;	/* commands submitted */
+    size_t			pl_acked;	/* commands accepted by device */
+    size_t			pl_done;	/* results received */
+    n2pkvna_command_fn_t       *pl_command_fn;	/* command encoder */
+    n2pkvna_result_fn_t	       *pl_result_fn;	/* result receiver */
+    void		       *pl_arg;		/* argument to above */
+    pipeline_slot_t	       *pl_out;		/* OUT transfer slots */
+    int				pl_out_count;	/* number of OUT slots */
+    pipeline_slot_t	       *pl_in;		/* IN transfer slots */
+    int				pl_in_count;	/* number of IN slots */
+    int				pl_active;	/* transfers in flight */
+    struct timespec		pl_last;	/* deadline of last command */
+    struct timespec		pl_due[MAX_QUEUE_DEPTH]; /* result deadlines */
+    bool			pl_missed;	/* next result was polled early */
+    double			pl_backoff;	/* next re-poll interval (s) */
+    int				pl_errno;	/* first error or zero */
+} pipeline_t;
+
+/*
+ * pipeline_fail: record the first error of the run from errno
+ *   @plp: pipeline state
+ */
+static void pipeline_fail(pipeline_t *plp)
+{
+    if (plp->pl_errno == 0) {
+	plp->pl_errno = errno != 0 ? errno : EIO;
+    }
+}
+
+/*
+ * pipeline_count: add a finished transfer to the statistics
+ *   @psp: slot of the transfer
+ */
+static void pipeline_count(pipeline_slot_t *psp)
+{
+    struct libusb_transfer *transfer = psp->ps_transfer;
+    struct timespec now;
+
+    if (transfer->status == LIBUSB_TRANSFER_CANCELLED) {
+	return;
+    }
+    if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+	++psp->ps_plp->pl_vnap->vna_stats.ns_transfer_errors;
+	return;
+    }
+    (void)clock_gettime(CLOCK_MONOTONIC, &now);
+    _n2pkvna_count_transfer(psp->ps_plp->pl_vnap, transfer->endpoint,
+	    transfer->actual_length,
+	    _n2pkvna_timespec_diff(&now, &psp->ps_submitted));
+}
+
+/*
+ * out_callback: handle completion of a set DDS command transfer
+ *   @transfer: completed transfer
+ */
+static void LIBUSB_CALL out_callback(struct libusb_transfer *transfer)
+{
+    pipeline_slot_t *psp = transfer->user_data;
+    pipeline_t *plp = psp->ps_plp;
+    n2pkvna_t *vnap = plp->pl_vnap;
+    struct timespec now;
+
+    psp->ps_active = false;
+    --plp->pl_active;
+    pipeline_count(psp);
+    if (transfer->status == LIBUSB_TRANSFER_CANCELLED) {
+	return;
+    }
+    if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+	int rv = _n2pkvna_transfer_error(transfer->status);
+
+	_n2pkvna_error(vnap, "%s: libusb_submit_transfer: %s",
+		vnap->vna_config.nci_basename, libusb_error_name(rv));
+	_n2pkvna_set_usb_errno(rv);
+	pipeline_fail(plp);
+	return;
+    }
+    if (transfer->actual_length != transfer->length) {
+	_n2pkvna_error(vnap, "%s: libusb_submit_transfer: short write",
+		vnap->vna_config.nci_basename);
+	errno = EIO;
+	pipeline_fail(plp);
+	return;
+    }
+
+    /*
+     * The device runs the commands one after another.  Each result is
+     * due its measure time after the later of now and the deadline of
+     * the command before it.
+     */
+    (void)clock_gettime(CLOCK_MONOTONIC, &now);
+    for (size_t i = 0; i < psp->ps_count; ++i) {
+	size_t index = psp->ps_first + i;
+	struct timespec *due = &plp->pl_due[index % MAX_QUEUE_DEPTH];
+
+	*due = _n2pkvna_timespec_cmp(&plp->pl_last, &now) > 0 ?
+	    plp->pl_last : now;
+	_n2pkvna_timespec_add(due, _n2pkvna_measure_time(
+		    &psp->ps_buffer[i * DDS_COMMAND_SIZE]));
+	plp->pl_last = *due;
+    }
+    plp->pl_acked = psp->ps_first + psp->ps_count;
+}
+
+/*
+ * in_callback: handle completion of a status read
+ *   @transfer: completed transfer
+ */
+static void LIBUSB_CALL in_callback(struct libusb_transfer *transfer)
+{
+    pipeline_slot_t *psp = transfer->user_data;
+    pipeline_t *plp = psp->ps_plp;
+    n2pkvna_t *vnap = plp->pl_vnap;
+    double values[2];
+    int delivered = 0;
+
+    psp->ps_active = false;
+    --plp->pl_active;
+    pipeline_count(psp);
+    if (transfer->status == LIBUSB_TRANSFER_CANCELLED ||
+	    plp->pl_errno != 0) {
+	return;
+    }
+    if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+	int rv = _n2pkvna_transfer_error(transfer->status);
+
+	_n2pkvna_error(vnap, "%s: libusb_submit_transfer: %s",
+		vnap->vna_config.nci_basename, libusb_error_name(rv));
+	_n2pkvna_set_usb_errno(rv);
+	pipeline_fail(plp);
+	return;
+    }
+    if (_n2pkvna_rx_append(vnap, psp->ps_buffer,
+		transfer->actual_length) == -1) {
+	pipeline_fail(plp);
+	return;
+    }
+
+    /*
+     * Deliver every complete reply in the stream.  A single read may
+     * carry the results of several commands.
+     */
+    for (;;) {
+	switch (_n2pkvna_rx_next(vnap, 0x55, 2, values)) {
+	case -1:
+	    pipeline_fail(plp);
+	    return;
+
+	case 0:
+	    break;
+
+	default:
+	    /*
+	     * Ignore replies that don't belong to a command we sent.
+	     */
+	    if (plp->pl_done >= plp->pl_sent) {
+		++vnap->vna_stats.ns_discarded;
+		continue;
+	    }
+	    if ((*plp->pl_result_fn)(plp->pl_arg, plp->pl_done,
+			values) == -1) {
+		pipeline_fail(plp);
+		return;
+	    }
+	    ++plp->pl_done;
+	    ++vnap->vna_stats.ns_measurements;
+	    ++delivered;
+	    continue;
+	}
+	break;
+    }
+    if (delivered > 0) {
+	plp->pl_missed = false;
+	plp->pl_backoff = MIN_RETRY;
+	return;
+    }
+
+    /*
+     * The conversion isn't finished even though its deadline passed.
+     * Park this slot and poll again with exponential backoff.
+     */
+    ++vnap->vna_stats.ns_retries;
+    if (!plp->pl_missed) {
+	++vnap->vna_stats.ns_misses;
+	plp->pl_missed = true;
+    }
+    (void)clock_gettime(CLOCK_MONOTONIC, &psp->ps_when);
+    if (plp->pl_done < plp->pl_acked) {
+	struct timespec limit = plp->pl_due[plp->pl_done % MAX_QUEUE_DEPTH];
+
+	_n2pkvna_timespec_add(&limit, STATUS_TIMEOUT);
+	if (_n2pkvna_timespec_cmp(&psp->ps_when, &limit) > 0) {
+	    _n2pkvna_error(vnap, "%s: _n2pkvna_pipeline_run: too many tries",
+		    vnap->vna_config.nci_basename);
+	    errno = EIO;
+	    pipeline_fail(plp);
+	    return;
+	}
+    }
+    _n2pkvna_timespec_add(&psp->ps_when, plp->pl_backoff);
+    psp->ps_waiting = true;
+    ++vnap->vna_stats.ns_backoff_sleeps;
+    vnap->vna_stats.ns_backoff_time += plp->pl_backoff;
+    plp->pl_backoff *= 2.0;
+    if (plp->pl_backoff > MAX_RETRY) {
+	plp->pl_backoff = MAX_RETRY;
+    }
+}
+
+/*
+ * pipeline_submit: submit a filled transfer
+ *   @plp: pipeline state
+ *   @psp: slot to submit
+ */
+static int pipeline_submit(pipeline_t *plp, pipeline_slot_t *psp)
+{
+    n2pkvna_t *vnap = plp->pl_vnap;
+    int rv;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &psp->ps_submitted);
+    if ((rv = _n2pkvna_submit_transfer(vnap, psp->ps_transfer)) < 0) {
+	_n2pkvna_error(vnap, "%s: libusb_submit_transfer: %s",
+		vnap->vna_config.nci_basename, libusb_error_name(rv));
+	_n2pkvna_set_usb_errno(rv);
+	pipeline_fail(plp);
+	return -1;
+    }
+    psp->ps_active = true;
+    ++plp->pl_active;
+    return 0;
+}
+
+/*
+ * pipeline_fill: submit as many commands and reads as the queue allows
+ *   @plp: pipeline state
+ */
+static void pipeline_fill(pipeline_t *plp)
+{
+    n2pkvna_t *vnap = plp->pl_vnap;
+    struct timespec now;
+    size_t wanted;
+    size_t reading = 0;
+
+    /*
+     * Send commands in batches of up to vna_batch_size.  When packing
+     * more than one command per transfer, wait until the device's
+     * command queue has room for a batch, but no longer than until it
+     * has drained to half full, so that each bulk transfer carries
+     * many commands instead of topping up the queue one at a time.
+     */
+    for (int i = 0; i < plp->pl_out_count && plp->pl_errno == 0; ++i) {
+	pipeline_slot_t *psp = &plp->pl_out[i];
+	size_t depth = vnap->vna_command_depth;
+	size_t queued = plp->pl_sent - plp->pl_done;
+	size_t room = MIN((size_t)vnap->vna_batch_size, (depth + 1) / 2);
+	size_t batch;
+
+	if (psp->ps_active) {
+	    continue;
+	}
+	if (plp->pl_sent >= plp->pl_count) {
+	    break;
+	}
+	batch = MIN(depth - queued, plp->pl_count - plp->pl_sent);
+	if (batch < MIN(room, plp->pl_count - plp->pl_sent)) {
+	    break;
+	}
+	if (batch > (size_t)vnap->vna_batch_size) {
+	    batch = vnap->vna_batch_size;
+	}
+	for (size_t j = 0; j < batch; ++j) {
+	    (*plp->pl_command_fn)(plp->pl_arg, plp->pl_sent + j,
+		    &psp->ps_buffer[j * DDS_COMMAND_SIZE]);
+	}
+	psp->ps_first = plp->pl_sent;
+	psp->ps_count = batch;
+	libusb_fill_bulk_transfer(psp->ps_transfer, vnap->vna_udhp,
+		WRITE_ENDPOINT, psp->ps_buffer, batch * DDS_COMMAND_SIZE,
+		out_callback, psp, USB_TIMEOUT);
+	if (pipeline_submit(plp, psp) == -1) {
+	    return;
+	}
+	plp->pl_sent += batch;
+    }
+
+    /*
+     * Keep a read in flight for each result past its deadline, up to
+     * the number of read slots.  Slots parked after a not-ready reply
+     * count as reading until their backoff time expires.
+     */
+    (void)clock_gettime(CLOCK_MONOTONIC, &now);
+    wanted = 0;
+    for (size_t index = plp->pl_done; index < plp->pl_acked &&
+	    wanted < (size_t)plp->pl_in_count; ++index) {
+	if (_n2pkvna_timespec_cmp(&plp->pl_due[index % MAX_QUEUE_DEPTH],
+		    &now) > 0) {
+	    break;
+	}
+	++wanted;
+    }
+    for (int i = 0; i < plp->pl_in_count; ++i) {
+	pipeline_slot_t *psp = &plp->pl_in[i];
+
+	if (psp->ps_waiting && _n2pkvna_timespec_cmp(&psp->ps_when, &now) <= 0) {
+	    psp->ps_waiting = false;
+	}
+	if (psp->ps_active || psp->ps_waiting) {
+	    ++reading;
+	}
+    }
+    for (int i = 0; i < plp->pl_in_count && plp->pl_errno == 0 &&
+	    reading < wanted; ++i) {
+	pipeline_slot_t *psp = &plp->pl_in[i];
+
+	if (psp->ps_active || psp->ps_waiting) {
+	    continue;
+	}
+	libusb_fill_bulk_transfer(psp->ps_transfer, vnap->vna_udhp,
+		READ_ENDPOINT, psp->ps_buffer, USB_BUFSIZE,
+		in_callback, psp, USB_TIMEOUT);
+	if (pipeline_submit(plp, psp) == -1) {
+	    return;
+	}
+	++reading;
+    }
+}
+
+/*
+ * pipeline_wake_time: find when the pipeline next has timed work to do
+ *   @plp: pipeline state
+ *   @when: returned time
+ *
+ * Return:
+ *   true if there is a wake time, false if only USB events are pending
+ */
+static bool pipeline_wake_time(const pipeline_t *plp, struct timespec *when)
+{
+    bool found = false;
+    bool reading = false;
+
+    for (int i = 0; i < plp->pl_in_count; ++i) {
+	const pipeline_slot_t *psp = &plp->pl_in[i];
+
+	if (psp->ps_active) {
+	    reading = true;
+	}
+	if (psp->ps_waiting) {
+	    reading = true;
+	    if (!found || _n2pkvna_timespec_cmp(&psp->ps_when, when) < 0) {
+		*when = psp->ps_when;
+		found = true;
+	    }
+	}
+    }
+    if (!reading && plp->pl_done < plp->pl_acked) {
+	*when = plp->pl_due[plp->pl_done % MAX_QUEUE_DEPTH];
+	found = true;
+    }
+    return found;
+}
+
+/*
+ * pipeline_drain: cancel transfers in flight and wait for them to finish
+ *   @plp: pipeline state
+ */
+static void pipeline_drain(pipeline_t *plp)
+{
+    n2pkvna_t *vnap = plp->pl_vnap;
+
+    for (int i = 0; i < plp->pl_out_count; ++i) {
+	if (plp->pl_out[i].ps_active) {
+	    (void)_n2pkvna_cancel_transfer(vnap,
+		    plp->pl_out[i].ps_transfer);
+	}
+    }
+    for (int i = 0; i < plp->pl_in_count; ++i) {
+	if (plp->pl_in[i].ps_active) {
+	    (void)_n2pkvna_cancel_transfer(vnap,
+		    plp->pl_in[i].ps_transfer);
+	}
+    }
+    while (plp->pl_active > 0) {
+	struct timeval tv = { USB_TIMEOUT / 1000, 0 };
+	int rv;
+
+	rv = _n2pkvna_handle_events(vnap, &tv);
+	if (rv < 0 && rv != LIBUSB_ERROR_INTERRUPTED) {
+	    break;
+	}
+    }
+}
+
+/*
+ * pipeline_free_slots: free a vector of slots
+ *   @psp: vector of slots
+ *   @count: number of slots
+ *
+ * Transfers still in flight (only if pipeline_drain failed) are leaked
+ * rather than freed out from under libusb.
+ */
+static void pipeline_free_slots(pipeline_slot_t *psp, int count)
+{
+    if (psp != NULL) {
+	for (int i = 0; i < count; ++i) {
+	    if (psp[i].ps_transfer != NULL && !psp[i].ps_active) {
+		libusb_free_transfer(psp[i].ps_transfer);
+	    }
+	}
+	free((void *)psp);
+    }
+}
+
+/*
+ * pipeline_alloc_slots: allocate a vector of slots
+ *   @plp: pipeline state
+ *   @count: number of slots
+ */
+static pipeline_slot_t *pipeline_alloc_slots(pipeline_t *plp, int count)
+{
+    n2pkvna_t *vnap = plp->pl_vnap;
+    pipeline_slot_t *psp;
+
+    if ((psp = calloc(count, sizeof(pipeline_slot_t))) == NULL) {
+	_n2pkvna_error(vnap, "calloc: %s", strerror(errno));
+	return NULL;
+    }
+    for (int i = 0; i < count; ++i) {
+	psp[i].ps_plp = plp;
+	if ((psp[i].ps_transfer = libusb_alloc_transfer(0)) == NULL) {
+	    _n2pkvna_error(vnap, "libusb_alloc_transfer: %s",
+		    strerror(ENOMEM));
+	    pipeline_free_slots(psp, i);
+	    errno = ENOMEM;
+	    return NULL;
+	}
+    }
+    return psp;
+}
+
+/*
+ * _n2pkvna_pipeline_run: send measure commands and collect results
+ *   @vnap: n2pkvna handle
+ *   @count: number of commands
+ *   @command_fn: function to encode each command
+ *   @result_fn: function to receive the detector values of each command
+ *   @arg: argument passed through to command_fn and result_fn
+ *
+ * Each command must be a set DDS command that starts a measurement.
+ * Up to vna_command_depth commands and vna_read_depth status reads are
+ * kept in flight at once so that the device never waits on the host
+ * between conversions.  Commands are packed up to vna_batch_size per
+ * bulk OUT transfer.  Status reads are scheduled for when each result is
+ * due, computed from the command's delay code and ADC mode, rather
+ * than polled blindly.  Results are delivered in command order.
+ *
+ * Return:
+ *   0: success
+ *  -1: error (errno set)
+ */
+int _n2pkvna_pipeline_run(n2pkvna_t *vnap, size_t count,
+	n2pkvna_command_fn_t *command_fn, n2pkvna_result_fn_t *result_fn,
+	void *arg)
+{
+    pipeline_t pl;
+    int rc = -1;
+
+    (void)memset((void *)&pl, 0, sizeof(pl));
+    pl.pl_vnap = vnap;
+    pl.pl_count = count;
+    pl.pl_command_fn = command_fn;
+    pl.pl_result_fn = result_fn;
+    pl.pl_arg = arg;
+    pl.pl_backoff = MIN_RETRY;
+    if ((pl.pl_out = pipeline_alloc_slots(&pl,
+		    vnap->vna_command_depth)) == NULL) {
+	goto out;
+    }
+    pl.pl_out_count = vnap->vna_command_depth;
+    if ((pl.pl_in = pipeline_alloc_slots(&pl,
+		    vnap->vna_read_depth)) == NULL) {
+	goto out;
+    }
+    pl.pl_in_count = vnap->vna_read_depth;
+
+    /*
+     * Run the event loop until all results are in.
+     */
+    while (pl.pl_done < pl.pl_count) {
+	struct timespec when, now;
+	struct timeval tv;
+	int rv;
+
+	pipeline_fill(&pl);
+	if (pl.pl_errno != 0) {
+	    break;
+	}
+
+	/*
+	 * If nothing is in flight, sleep until the next result is due.
+	 * Otherwise, handle USB events until then.
+	 */
+	tv.tv_sec  = USB_TIMEOUT / 1000;
+	tv.tv_usec = (USB_TIMEOUT % 1000) * 1000;
+	if (pipeline_wake_time(&pl, &when)) {
+	    double delta;
+
+	    if (pl.pl_active == 0) {
+		while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+			    &when, NULL) == EINTR) {
+		    continue;
+		}
+		continue;
+	    }
+	    (void)clock_gettime(CLOCK_MONOTONIC, &now);
+	    delta = _n2pkvna_timespec_diff(&when, &now);
+	    if (delta < 0.0) {
+		delta = 0.0;
+	    }
+	    tv.tv_sec  = (time_t)delta;
+	    tv.tv_usec = (suseconds_t)((delta - (double)tv.tv_sec) * 1.0e+6);
+	}
+	rv = _n2pkvna_handle_events(vnap, &tv);
+	if (rv < 0 && rv != LIBUSB_ERROR_INTERRUPTED) {
+	    _n2pkvna_error(vnap, "%s: libusb_handle_events: %s",
+		    vnap->vna_config.nci_basename, libusb_error_name(rv));
+	    _n2pkvna_set_usb_errno(rv);
+	    pipeline_fail(&pl);
+	    break;
+	}
+	if (pl.pl_errno != 0) {
+	    break;
+	}
+    }
+    if (pl.pl_errno == 0) {
+	rc = 0;
+    }
+
+out:
+    pipeline_drain(&pl);
+    pipeline_free_slots(pl.pl_in, pl.pl_in_count);
+    pipeline_free_slots(pl.pl_out, pl.pl_out_count);
+    if (pl.pl_errno != 0) {
+	errno = pl.pl_errno;
+    }
+    return rc;
+}
@@ -0,0 +1,258 @@
+/*
+ * N2PK Vector Network Analyzer
+ * Copyright © 2021-2022 D Scott Guthridge <scott_guthridge@rompromity.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "archdep.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "n2pkvna_internal.h"
+
+/*
+ * n2pkvna_set_reconnect: set how long a scan waits for a lost device
+ *   @vnap: n2pkvna handle
+ *   @timeout: seconds to wait for the device to come back, or 0 to fail
+ *	immediately
+ */
+int n2pkvna_set_reconnect(n2pkvna_t *vnap, double timeout)
+{
+    if (!(timeout >= 0.0 && timeout <= MAX_RECONNECT_TIMEOUT)) {
+	_n2pkvna_error(vnap, "invalid reconnect timeout %g", timeout);
+	errno = EINVAL;
+	return -1;
+    }
+    if (_n2pkvna_lock_idle(vnap, "n2pkvna_set_reconnect") == -1) {
+	return -1;
+    }
+    vnap->vna_reconnect_timeout = timeout;
+    (void)pthread_mutex_unlock(&vnap->vna_mutex);
+    return 0;
+}
+
+/*
+ * match_device: test if a USB device is our VNA come back
+ *   @vnap: n2pkvna handle
+ *   @device: candidate device
+ *
+ * The device address changes when the device re-enumerates, but the
+ * bus and port it's plugged into don't.
+ */
+static bool match_device(n2pkvna_t *vnap, libusb_device *device)
+{
+    const n2pkvna_address_internal_t *adrip = &vnap->vna_address;
+    struct libusb_device_descriptor descriptor;
+
+    if (device == libusb_get_device(vnap->vna_udhp)) {
+	return false;
+    }
+    if (libusb_get_device_descriptor(device, &descriptor) < 0) {
+	return false;
+    }
+    if (descriptor.idVendor != adrip->adri_usb_vendor ||
+	    descriptor.idProduct != adrip->adri_usb_product) {
+	return false;
+    }
+    if (libusb_get_bus_number(device) != adrip->adri_usb_bus) {
+	return false;
+    }
+    if (adrip->adri_usb_port != 0 &&
+	    libusb_get_port_number(device) != adrip->adri_usb_port) {
+	return false;
+    }
+    return true;
+}
+
+/*
+ * device_present: test if the device we have open is still on the bus
+ *   @vnap: n2pkvna handle
+ *
+ * Return:
+ *   1: present
+ *   0: gone
+ *  -1: error (errno set)
+ */
+static int device_present(n2pkvna_t *vnap)
+{
+    libusb_device *device = libusb_get_device(vnap->vna_udhp);
+    libusb_device **usb_device_vector = NULL;
+    ssize_t usb_device_count;
+    int rv = 0;
+
+    if ((usb_device_count = _n2pkvna_context_get_devices(vnap,
+		    vnap->vna_address.adri_usb_vendor,
+		    &usb_device_vector)) == -1) {
+	return -1;
+    }
+    for (ssize_t i = 0; i < usb_device_count; ++i) {
+	if (usb_device_vector[i] == device) {
+	    rv = 1;
+	    break;
+	}
+    }
+    _n2pkvna_context_free_devices(usb_device_vector, usb_device_count);
+    return rv;
+}
+
+/*
+ * reopen: open a device and replace the lost one with it
+ *   @vnap: n2pkvna handle
+ *   @device: new device
+ *
+ * The old transport stays attached if the new device can't be opened
+ * so that the handle remains usable (failing with ENODEV) on error.
+ */
+static int reopen(n2pkvna_t *vnap, libusb_device *device)
+{
+    const n2pkvna_transport_t *old_transport = vnap->vna_transport;
+    void *old_state = vnap->vna_transport_state;
+    libusb_device_handle *old_udhp = vnap->vna_udhp;
+    const n2pkvna_transport_t *new_transport;
+    void *new_state;
+    libusb_device_handle *new_udhp;
+
+    vnap->vna_address.adri_usb_devicep = device;
+    vnap->vna_udhp = NULL;
+    if (_n2pkvna_usb_open(vnap) == -1) {
+	vnap->vna_transport = old_transport;
+	vnap->vna_transport_state = old_state;
+	vnap->vna_udhp = old_udhp;
+	return -1;
+    }
+    new_transport = vnap->vna_transport;
+    new_state = vnap->vna_transport_state;
+    new_udhp = vnap->vna_udhp;
+    vnap->vna_transport = old_transport;
+    vnap->vna_transport_state = old_state;
+    vnap->vna_udhp = old_udhp;
+    (*vnap->vna_transport->nt_close)(vnap);
+    vnap->vna_transport = new_transport;
+    vnap->vna_transport_state = new_state;
+    vnap->vna_udhp = new_udhp;
+    vnap->vna_address.adri_usb_device = libusb_get_device_address(device);
+    return 0;
+}
+
+/*
+ * _n2pkvna_reconnect: reopen a lost USB device and restore its state
+ *   @vnap: n2pkvna handle
+ *
+ * Called holding the handle lock after an operation failed with ENODEV
+ * or EIO.  Waits up to the reconnect timeout for the device to reappear
+ * on the same bus and port, reopens it, resets it, and restores the
+ * last switch and attenuator settings.  If reconnect is disabled or the
+ * device is simulated, returns -1 leaving errno unchanged.  After any
+ * error other than ENODEV, fails at once if the device is still on the
+ * bus: it isn't going to re-enumerate, so there's nothing to wait for.
+ *
+ * Return:
+ *   0: success
+ *  -1: error (errno set)
+ */
+int _n2pkvna_reconnect(n2pkvna_t *vnap)
+{
+    struct timespec deadline, next, now;
+    int saved_errno = errno;
+
+    if (vnap->vna_reconnect_timeout == 0.0 ||
+	    vnap->vna_address.adri_type != N2PKVNA_ADR_USB) {
+	return -1;
+    }
+    if (saved_errno != ENODEV) {
+	switch (device_present(vnap)) {
+	case -1:
+	    return -1;
+
+	case 0:
+	    break;
+
+	default:
+	    _n2pkvna_error(vnap, "%s: device is not responding",
+		    vnap->vna_config.nci_basename);
+	    errno = saved_errno;
+	    return -1;
+	}
+    }
+    (void)clock_gettime(CLOCK_MONOTONIC, &now);
+    deadline = now;
+    _n2pkvna_timespec_add(&deadline, vnap->vna_reconnect_timeout);
+    for (;;) {
+	libusb_device **usb_device_vector = NULL;
+	ssize_t usb_device_count;
+	bool opened = false;
+
+	/*
+	 * Look for the device and try to open it.  The device may show
+	 * up before it's ready to be opened; if so, keep trying.
+	 */
+	if ((usb_device_count = _n2pkvna_context_get_devices(vnap,
+			vnap->vna_address.adri_usb_vendor,
+			&usb_device_vector)) == -1) {
+	    return -1;
+	}
+	for (ssize_t i = 0; i < usb_device_count; ++i) {
+	    if (match_device(vnap, usb_device_vector[i]) &&
+		    reopen(vnap, usb_device_vector[i]) == 0) {
+		opened = true;
+		break;
+	    }
+	}
+	_n2pkvna_context_free_devices(usb_device_vector, usb_device_count);
+	if (opened) {
+	    break;
+	}
+
+	/*
+	 * Wait and poll again.
+	 */
+	(void)clock_gettime(CLOCK_MONOTONIC, &now);
+	if (_n2pkvna_timespec_cmp(&now, &deadline) >= 0) {
+	    _n2pkvna_error(vnap, "%s: device did not reconnect within %g s",
+		    vnap->vna_config.nci_basename,
+		    vnap->vna_reconnect_timeout);
+	    errno = saved_errno;
+	    return -1;
+	}
+	next = now;
+	_n2pkvna_timespec_add(&next, RECONNECT_INTERVAL);
+	if (_n2pkvna_timespec_cmp(&next, &deadline) > 0) {
+	    next = deadline;
+	}
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+		    &next, NULL) == EINTR) {
+	    continue;
+	}
+    }
+
+    /*
+     * Bring the device back to the state it was in.
+     */
+    if (_n2pkvna_reset(vnap) == -1) {
+	return -1;
+    }
+    if (vnap->vna_switch >= 0 || vnap->vna_attenuator >= 0) {
+	if (_n2pkvna_set_switch(vnap, vnap->vna_switch,
+		    vnap->vna_attenuator, vnap->vna_switch_delay) == -1) {
+	    return -1;
+	}
+    }
+    ++vnap->vna_stats.ns_reconnects;
+    return 0;
+}
@@ -0,0 +1,338 @@
+/*
+ * N2PK Vector Network Analyzer
+ * Copyright © 2021-2022 D Scott Guthridge <scott_guthridge@rompromity.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A11 PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "archdep.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "n2pkvna_internal.h"
+
+#define RECORD_MAX_PENDING	(2 * MAX_QUEUE_DEPTH)	/* transfers */
+
+/*
+ * record_slot_t: an asynchronous transfer in flight
+ */
+typedef struct record_slot {
+    struct n2pkvna_recorder    *rs_recp;	/* parent pointer */
+    struct libusb_transfer     *rs_transfer;	/* transfer or NULL if free */
+    libusb_transfer_cb_fn	rs_callback;	/* caller's callback */
+    void		       *rs_user_data;	/* caller's user data */
+    uint32_t			rs_id;		/* transfer serial number */
+} record_slot_t;
+
+/*
+ * n2pkvna_recorder_t: transcript recorder state
+ */
+struct n2pkvna_recorder {
+    n2pkvna_t		       *rec_vnap;	/* n2pkvna handle */
+    FILE		       *rec_fp;		/* transcript file */
+    char		       *rec_filename;	/* name of transcript file */
+    struct timespec		rec_start;	/* time recording started */
+    uint32_t			rec_next_id;	/* next transfer serial */
+    bool			rec_failed;	/* a write failed */
+    record_slot_t		rec_slot_vector[RECORD_MAX_PENDING];
+};
+
+/*
+ * record_elapsed: return nanoseconds from the start of recording to @tsp
+ *   @recp: recorder state
+ *   @tsp: monotonic time
+ */
+static uint64_t record_elapsed(const n2pkvna_recorder_t *recp,
+	const struct timespec *tsp)
+{
+    double seconds = _n2pkvna_timespec_diff(tsp, &recp->rec_start);
+
+    return seconds <= 0.0 ? 0 : (uint64_t)(seconds * 1.0e+9 + 0.5);
+}
+
+/*
+ * record_write: append a record to the transcript
+ *   @recp: recorder state
+ *   @type: RECORD_* type
+ *   @endpoint: USB endpoint
+ *   @transferred: bytes actually transferred
+ *   @result: libusb error code or transfer status
+ *   @when: time the operation started
+ *   @duration: time the operation took (s)
+ *   @id: transfer serial number or zero
+ *   @payload: bytes to save
+ *   @length: length of payload
+ */
+static void record_write(n2pkvna_recorder_t *recp, int type,
+	unsigned char endpoint, int transferred, int result,
+	const struct timespec *when, double duration, uint32_t id,
+	const unsigned char *payload, int length)
+{
+    unsigned char header[RECORD_HEADER_SIZE];
+
+    if (recp->rec_failed) {
+	return;
+    }
+    if (length < 0) {
+	length = 0;
+    }
+    header[0] = type;
+    header[1] = endpoint;
+    put16(&header[2], transferred < 0 ? 0 : transferred);
+    put32(&header[4], (uint32_t)result);
+    put64(&header[8], record_elapsed(recp, when));
+    put32(&header[16], duration <= 0.0 ? 0 :
+	    (uint32_t)(duration * 1.0e+9 + 0.5));
+    put32(&header[20], id);
+    put32(&header[24], length);
+    if (fwrite(header, sizeof(header), 1, recp->rec_fp) != 1 ||
+	    (length > 0 && fwrite(payload, length, 1, recp->rec_fp) != 1)) {
+	_n2pkvna_error(recp->rec_vnap, "%s: fwrite: %s",
+		recp->rec_filename, strerror(errno));
+	recp->rec_failed = true;
+    }
+}
+
+/*
+ * _n2pkvna_record_bulk_transfer: perform and record a synchronous transfer
+ *   @vnap: n2pkvna handle
+ *   @endpoint: WRITE_ENDPOINT or READ_ENDPOINT
+ *   @data: data to send or buffer to receive
+ *   @length: bytes to send or size of buffer
+ *   @transferred: returned number of bytes transferred
+ *   @timeout: timeout (ms)
+ */
+int _n2pkvna_record_bulk_transfer(n2pkvna_t *vnap, unsigned char endpoint,
+	unsigned char *data, int length, int *transferred,
+	unsigned int timeout)
+{
+    n2pkvna_recorder_t *recp = vnap->vna_recorder;
+    struct timespec start, end;
+    int rv;
+
+    *transferred = 0;
+    (void)clock_gettime(CLOCK_MONOTONIC, &start);
+    rv = (*vnap->vna_transport->nt_bulk_transfer)(vnap, endpoint,
+	    data, length, transferred, timeout);
+    (void)clock_gettime(CLOCK_MONOTONIC, &end);
+    record_write(recp, RECORD_BULK, endpoint, *transferred, rv, &start,
+	    _n2pkvna_timespec_diff(&end, &start), 0, data,
+	    endpoint == WRITE_ENDPOINT ? length : *transferred);
+    return rv;
+}
+
+/*
+ * record_callback: record completion of an asynchronous transfer
+ *   @transfer: completed transfer
+ */
+static void LIBUSB_CALL record_callback(struct libusb_transfer *transfer)
+{
+    record_slot_t *rsp = transfer->user_data;
+    n2pkvna_recorder_t *recp = rsp->rs_recp;
+    struct timespec now;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &now);
+    transfer->callback  = rsp->rs_callback;
+    transfer->user_data = rsp->rs_user_data;
+    rsp->rs_transfer = NULL;
+    record_write(recp, RECORD_COMPLETE, transfer->endpoint,
+	    transfer->actual_length, transfer->status, &now, 0.0, rsp->rs_id,
+	    transfer->buffer, transfer->endpoint == READ_ENDPOINT &&
+	    transfer->status == LIBUSB_TRANSFER_COMPLETED ?
+	    transfer->actual_length : 0);
+    (*transfer->callback)(transfer);
+}
+
+/*
+ * _n2pkvna_record_submit_transfer: record and submit an asynchronous transfer
+ *   @vnap: n2pkvna handle
+ *   @transfer: filled transfer
+ */
+int _n2pkvna_record_submit_transfer(n2pkvna_t *vnap,
+	struct libusb_transfer *transfer)
+{
+    n2pkvna_recorder_t *recp = vnap->vna_recorder;
+    record_slot_t *rsp = NULL;
+    struct timespec now;
+    int rv;
+
+    for (int i = 0; i < RECORD_MAX_PENDING; ++i) {
+	if (recp->rec_slot_vector[i].rs_transfer == NULL) {
+	    rsp = &recp->rec_slot_vector[i];
+	    break;
+	}
+    }
+    if (rsp == NULL) {
+	return LIBUSB_ERROR_BUSY;
+    }
+    rsp->rs_recp = recp;
+    rsp->rs_transfer = transfer;
+    rsp->rs_callback = transfer->callback;
+    rsp->rs_user_data = transfer->user_data;
+    rsp->rs_id = ++recp->rec_next_id;
+    transfer->callback = record_callback;
+    transfer->user_data = rsp;
+    (void)clock_gettime(CLOCK_MONOTONIC, &now);
+    rv = (*vnap->vna_transport->nt_submit_transfer)(vnap, transfer);
+    record_write(recp, RECORD_SUBMIT, transfer->endpoint, 0, rv, &now,
+	    0.0, rsp->rs_id, transfer->buffer,
+	    transfer->endpoint == WRITE_ENDPOINT ? transfer->length : 0);
+    if (rv < 0) {
+	transfer->callback = rsp->rs_callback;
+	transfer->user_data = rsp->rs_user_data;
+	rsp->rs_transfer = NULL;
+    }
+    return rv;
+}
+
+/*
+ * _n2pkvna_record_cancel_transfer: record and cancel an asynchronous transfer
+ *   @vnap: n2pkvna handle
+ *   @transfer: transfer in flight
+ */
+int _n2pkvna_record_cancel_transfer(n2pkvna_t *vnap,
+	struct libusb_transfer *transfer)
+{
+    n2pkvna_recorder_t *recp = vnap->vna_recorder;
+    uint32_t id = 0;
+    struct timespec now;
+    int rv;
+
+    for (int i = 0; i < RECORD_MAX_PENDING; ++i) {
+	if (recp->rec_slot_vector[i].rs_transfer == transfer) {
+	    id = recp->rec_slot_vector[i].rs_id;
+	    break;
+	}
+    }
+    (void)clock_gettime(CLOCK_MONOTONIC, &now);
+    rv = (*vnap->vna_transport->nt_cancel_transfer)(vnap, transfer);
+    record_write(recp, RECORD_CANCEL, transfer->endpoint, 0, rv, &now,
+	    0.0, id, NULL, 0);
+    return rv;
+}
+
+/*
+ * record_start: start recording holding the handle lock
+ *   @vnap: n2pkvna handle
+ *   @filename: transcript file to create
+ */
+static int record_start(n2pkvna_t *vnap, const char *filename)
+{
+    n2pkvna_recorder_t *recp;
+
+    if (vnap->vna_recorder != NULL) {
+	_n2pkvna_error(vnap, "%s: n2pkvna_record_start: already recording",
+		vnap->vna_config.nci_basename);
+	errno = EBUSY;
+	return -1;
+    }
+    if ((recp = calloc(1, sizeof(n2pkvna_recorder_t))) == NULL) {
+	_n2pkvna_error(vnap, "calloc: %s", strerror(errno));
+	return -1;
+    }
+    recp->rec_vnap = vnap;
+    if ((recp->rec_filename = strdup(filename)) == NULL) {
+	_n2pkvna_error(vnap, "strdup: %s", strerror(errno));
+	free((void *)recp);
+	return -1;
+    }
+    if ((recp->rec_fp = fopen(filename, "w")) == NULL) {
+	_n2pkvna_error(vnap, "fopen: %s: %s", filename, strerror(errno));
+	free((void *)recp->rec_filename);
+	free((void *)recp);
+	return -1;
+    }
+    if (fwrite(RECORD_MAGIC, RECORD_MAGIC_SIZE, 1, recp->rec_fp) != 1) {
+	_n2pkvna_error(vnap, "%s: fwrite: %s", filename, strerror(errno));
+	(void)fclose(recp->rec_fp);
+	free((void *)recp->rec_filename);
+	free((void *)recp);
+	return -1;
+    }
+    (void)clock_gettime(CLOCK_MONOTONIC, &recp->rec_start);
+    vnap->vna_recorder = recp;
+    return 0;
+}
+
+/*
+ * n2pkvna_record_start: log all device I/O to a transcript file
+ *   @vnap: n2pkvna handle
+ *   @filename: transcript file to create
+ *
+ * Return:
+ *   0: success
+ *  -1: error (errno set)
+ */
+int n2pkvna_record_start(n2pkvna_t *vnap, const char *filename)
+{
+    int rv;
+
+    if (_n2pkvna_lock_idle(vnap, "n2pkvna_record_start") == -1) {
+	return -1;
+    }
+    rv = record_start(vnap, filename);
+    (void)pthread_mutex_unlock(&vnap->vna_mutex);
+    return rv;
+}
+
+/*
+ * record_stop: stop recording holding the handle lock
+ *   @vnap: n2pkvna handle
+ */
+static int record_stop(n2pkvna_t *vnap)
+{
+    n2pkvna_recorder_t *recp = vnap->vna_recorder;
+    int rc = 0;
+
+    if (recp == NULL) {
+	return 0;
+    }
+    vnap->vna_recorder = NULL;
+    if (fclose(recp->rec_fp) == EOF && !recp->rec_failed) {
+	_n2pkvna_error(vnap, "%s: fclose: %s",
+		recp->rec_filename, strerror(errno));
+	recp->rec_failed = true;
+    }
+    if (recp->rec_failed) {
+	errno = EIO;
+	rc = -1;
+    }
+    free((void *)recp->rec_filename);
+    free((void *)recp);
+    return rc;
+}
+
+/*
+ * n2pkvna_record_stop: stop recording and close the transcript file
+ *   @vnap: n2pkvna handle
+ *
+ * Return:
+ *   0: success
+ *  -1: error (errno set), including an earlier failed write
+ */
+int n2pkvna_record_stop(n2pkvna_t *vnap)
+{
+    int rv;
+
+    if (_n2pkvna_lock_idle(vnap, "n2pkvna_record_stop") == -1) {
+	return -1;
+    }
+    rv = record_stop(vnap);
+    (void)pthread_mutex_unlock(&vnap->vna_mutex);
+    return rv;
+}
@@ -0,0 +1,511 @@
+/*
+ * N2PK Vector Network Analyzer
+ * Copyright © 2021-2022 D Scott Guthridge <scott_guthridge@rompromity.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A11 PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "archdep.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "n2pkvna_internal.h"
+
+/*
+ * replay_command_t: a command sent in the recorded session
+ */
+typedef struct replay_command {
+    size_t			rc_offset;	/* offset in rp_command_bytes */
+    int				rc_size;	/* bytes in command */
+    double			rc_time;	/* when the device got it (s) */
+    long			rc_reply;	/* index of its reply or -1 */
+} replay_command_t;
+
+/*
+ * replay_reply_t: a status reply received in the recorded session
+ */
+typedef struct replay_reply {
+    unsigned char		rr_bytes[5 + 4 * 2]; /* status and codes */
+    int				rr_size;	/* bytes in reply */
+    double			rr_time;	/* when the host got it (s) */
+} replay_reply_t;
+
+/*
+ * replay_pending_t: a reply waiting to be served
+ */
+typedef struct replay_pending {
+    long			rp_reply;	/* index into replies */
+    struct timespec		rp_when;	/* when it becomes readable */
+} replay_pending_t;
+
+/*
+ * n2pkvna_replay_t: recorded device behavior
+ */
+struct n2pkvna_replay {
+    char		       *rp_filename;	/* transcript file */
+    unsigned char	       *rp_command_bytes; /* all commands sent */
+    size_t			rp_command_length; /* bytes used */
+    size_t			rp_command_allocation; /* bytes allocated */
+    replay_command_t	       *rp_command_vector; /* command index */
+    size_t			rp_commands;	/* number of commands */
+    size_t			rp_command_vector_allocation;
+    replay_reply_t	       *rp_reply_vector; /* non-empty replies */
+    size_t			rp_replies;	/* number of replies */
+    size_t			rp_reply_vector_allocation;
+    unsigned char		rp_stream[RX_BUFSIZE]; /* partial replies */
+    int				rp_stream_length; /* bytes in rp_stream */
+    size_t			rp_unanswered;	/* oldest command awaiting reply */
+
+    /* replay state */
+    size_t			rp_next_command; /* next expected command */
+    uint8_t			rp_last_opcode;	/* opcode of last command */
+    replay_pending_t	       *rp_pending_vector; /* ring of replies due */
+    size_t			rp_pending_head; /* oldest pending */
+    size_t			rp_pending_count; /* queued replies */
+};
+
+/*
+ * replay_grow: make room for one more element in a vector
+ *   @vnap: n2pkvna handle
+ *   @vector: address of vector
+ *   @allocation: address of allocated element count
+ *   @count: elements in use
+ *   @size: element size
+ *   @needed: elements needed beyond count
+ */
+static int replay_grow(n2pkvna_t *vnap, void **vector, size_t *allocation,
+	size_t count, size_t size, size_t needed)
+{
+    size_t new_allocation;
+    void *new_vector;
+
+    if (count + needed <= *allocation) {
+	return 0;
+    }
+    new_allocation = *allocation == 0 ? 64 : *allocation;
+    while (new_allocation < count + needed) {
+	new_allocation *= 2;
+    }
+    if ((new_vector = realloc(*vector, new_allocation * size)) == NULL) {
+	_n2pkvna_error(vnap, "realloc: %s", strerror(errno));
+	return -1;
+    }
+    *vector = new_vector;
+    *allocation = new_allocation;
+    return 0;
+}
+
+/*
+ * replay_add_commands: add the commands of a recorded OUT transfer
+ *   @vnap: n2pkvna handle
+ *   @rp: replay state
+ *   @data: commands
+ *   @length: bytes in data
+ *   @when: when the device received them (s)
+ */
+static int replay_add_commands(n2pkvna_t *vnap, n2pkvna_replay_t *rp,
+	const unsigned char *data, int length, double when)
+{
+    int offset = 0;
+
+    while (offset < length) {
+	int size = _n2pkvna_command_size(&data[offset], length - offset);
+	replay_command_t *rcp;
+
+	if (size <= 0) {
+	    _n2pkvna_error(vnap, "%s: invalid command in recording",
+		    rp->rp_filename);
+	    errno = EINVAL;
+	    return -1;
+	}
+	if (replay_grow(vnap, (void **)&rp->rp_command_bytes,
+		    &rp->rp_command_allocation, rp->rp_command_length,
+		    1, size) == -1 ||
+	    replay_grow(vnap, (void **)&rp->rp_command_vector,
+		    &rp->rp_command_vector_allocation, rp->rp_commands,
+		    sizeof(replay_command_t), 1) == -1) {
+	    return -1;
+	}
+	rcp = &rp->rp_command_vector[rp->rp_commands++];
+	rcp->rc_offset = rp->rp_command_length;
+	rcp->rc_size = size;
+	rcp->rc_time = when;
+	rcp->rc_reply = -1;
+	(void)memcpy((void *)&rp->rp_command_bytes[rp->rp_command_length],
+		(const void *)&data[offset], size);
+	rp->rp_command_length += size;
+	offset += size;
+    }
+    return 0;
+}
+
+/*
+ * replay_pair: attach a reply to the command that produced it
+ *   @rp: replay state
+ *   @reply: index of the reply
+ *   @error: reply carries error flags and no values
+ */
+static void replay_pair(n2pkvna_replay_t *rp, size_t reply, bool error)
+{
+    for (size_t i = rp->rp_unanswered; i < rp->rp_commands; ++i) {
+	replay_command_t *rcp = &rp->rp_command_vector[i];
+	const unsigned char *command = &rp->rp_command_bytes[rcp->rc_offset];
+
+	if (command[0] == 0x55 && rcp->rc_size == DDS_COMMAND_SIZE &&
+		command[3] != 0 && rcp->rc_reply < 0) {
+	    rcp->rc_reply = reply;
+	    rp->rp_unanswered = error ? rp->rp_commands : i + 1;
+	    return;
+	}
+    }
+    rp->rp_unanswered = rp->rp_commands;
+    if (error && rp->rp_commands > 0 &&
+	    rp->rp_command_vector[rp->rp_commands - 1].rc_reply < 0) {
+	rp->rp_command_vector[rp->rp_commands - 1].rc_reply = reply;
+    }
+}
+
+/*
+ * replay_add_replies: add the status replies of a recorded IN transfer
+ *   @vnap: n2pkvna handle
+ *   @rp: replay state
+ *   @data: bytes received
+ *   @length: bytes in data
+ *   @when: when the host received them (s)
+ *
+ * Replies without values or error flags only say that nothing was
+ * ready; the replay generates those itself and they're dropped here.
+ * The device answers measurements in order, so each remaining reply
+ * belongs to the oldest measurement sent before it that hasn't been
+ * answered.  An error reply ends that measurement and every other one
+ * still in flight: the library flushes and sends them again.  An error
+ * reply with no measurement in flight is served after the last command
+ * sent before it.
+ */
+static int replay_add_replies(n2pkvna_t *vnap, n2pkvna_replay_t *rp,
+	const unsigned char *data, int length, double when)
+{
+    unsigned char *stream = rp->rp_stream;
+
+    if (length > RX_BUFSIZE - rp->rp_stream_length) {
+	length = RX_BUFSIZE - rp->rp_stream_length;
+    }
+    (void)memcpy((void *)&stream[rp->rp_stream_length], (const void *)data,
+	    length);
+    rp->rp_stream_length += length;
+    while (rp->rp_stream_length >= 5) {
+	int size = 5 + 4 * stream[4];
+	replay_reply_t *rrp;
+
+	if (size > rp->rp_stream_length) {
+	    break;
+	}
+	if (stream[4] != 0 || (stream[1] & 0xC8) != 0) {
+	    if (replay_grow(vnap, (void **)&rp->rp_reply_vector,
+			&rp->rp_reply_vector_allocation, rp->rp_replies,
+			sizeof(replay_reply_t), 1) == -1) {
+		return -1;
+	    }
+	    rrp = &rp->rp_reply_vector[rp->rp_replies++];
+	    rrp->rr_size = size < (int)sizeof(rrp->rr_bytes) ?
+		size : (int)sizeof(rrp->rr_bytes);
+	    (void)memcpy((void *)rrp->rr_bytes, (const void *)stream,
+		    rrp->rr_size);
+	    rrp->rr_bytes[4] = (rrp->rr_size - 5) / 4;
+	    rrp->rr_time = when;
+	    replay_pair(rp, rp->rp_replies - 1, stream[4] == 0);
+	}
+	rp->rp_stream_length -= size;
+	(void)memmove((void *)stream, (void *)&stream[size],
+		rp->rp_stream_length);
+    }
+    return 0;
+}
+
+/*
+ * _n2pkvna_replay_free: free a loaded recording
+ *   @rp: replay state
+ */
+void _n2pkvna_replay_free(n2pkvna_replay_t *rp)
+{
+    if (rp != NULL) {
+	free((void *)rp->rp_pending_vector);
+	free((void *)rp->rp_reply_vector);
+	free((void *)rp->rp_command_vector);
+	free((void *)rp->rp_command_bytes);
+	free((void *)rp->rp_filename);
+	free((void *)rp);
+    }
+}
+
+/*
+ * _n2pkvna_replay_load: load a transcript from n2pkvna_record_start
+ *   @vnap: n2pkvna handle
+ *   @filename: transcript file
+ *
+ * The recording is reduced to the sequence of commands the device
+ * received and the sequence of status replies it returned.  Each reply
+ * is paired with the command that produced it as it's read, and is
+ * served the same time after that command as it was recorded.
+ */
+n2pkvna_replay_t *_n2pkvna_replay_load(n2pkvna_t *vnap, const char *filename)
+{
+    n2pkvna_replay_t *rp = NULL;
+    FILE *fp = NULL;
+    unsigned char header[RECORD_HEADER_SIZE];
+    unsigned char payload[USB_BUFSIZE];
+    unsigned char *submitted[2 * MAX_QUEUE_DEPTH];
+    uint32_t submitted_id[2 * MAX_QUEUE_DEPTH];
+    int submitted_length[2 * MAX_QUEUE_DEPTH];
+    bool success = false;
+
+    (void)memset((void *)submitted, 0, sizeof(submitted));
+    if ((rp = calloc(1, sizeof(n2pkvna_replay_t))) == NULL) {
+	_n2pkvna_error(vnap, "calloc: %s", strerror(errno));
+	goto out;
+    }
+    if ((rp->rp_filename = strdup(filename)) == NULL) {
+	_n2pkvna_error(vnap, "strdup: %s", strerror(errno));
+	goto out;
+    }
+    if ((fp = fopen(filename, "r")) == NULL) {
+	_n2pkvna_error(vnap, "fopen: %s: %s", filename, strerror(errno));
+	goto out;
+    }
+    if (fread(payload, RECORD_MAGIC_SIZE, 1, fp) != 1 ||
+	    memcmp(payload, RECORD_MAGIC, RECORD_MAGIC_SIZE) != 0) {
+	_n2pkvna_error(vnap, "%s: not an n2pkvna recording", filename);
+	errno = EINVAL;
+	goto out;
+    }
+
+    /*
+     * Collect the commands and replies.  Asynchronous OUT transfers
+     * reach the device when they complete, so hold their payloads
+     * until then.
+     */
+    while (fread(header, sizeof(header), 1, fp) == 1) {
+	int type = header[0];
+	unsigned char endpoint = header[1];
+	int result = (int32_t)get32(&header[4]);
+	double when = 1.0e-9 * (double)get64(&header[8]);
+	double duration = 1.0e-9 * (double)get32(&header[16]);
+	uint32_t id = get32(&header[20]);
+	uint32_t length = get32(&header[24]);
+	int slot;
+
+	if (length > sizeof(payload) ||
+		(length > 0 && fread(payload, length, 1, fp) != 1)) {
+	    _n2pkvna_error(vnap, "%s: truncated or corrupt recording",
+		    filename);
+	    errno = EINVAL;
+	    goto out;
+	}
+	switch (type) {
+	case RECORD_BULK:
+	    if (result < 0) {
+		break;
+	    }
+	    if (endpoint == WRITE_ENDPOINT) {
+		if (replay_add_commands(vnap, rp, payload, get16(&header[2]),
+			    when + duration) == -1) {
+		    goto out;
+		}
+	    } else if (replay_add_replies(vnap, rp, payload, length,
+			when + duration) == -1) {
+		goto out;
+	    }
+	    break;
+
+	case RECORD_SUBMIT:
+	    if (result < 0 || endpoint != WRITE_ENDPOINT) {
+		break;
+	    }
+	    for (slot = 0; slot < 2 * MAX_QUEUE_DEPTH; ++slot) {
+		if (submitted[slot] == NULL) {
+		    break;
+		}
+	    }
+	    if (slot == 2 * MAX_QUEUE_DEPTH ||
+		    (submitted[slot] = malloc(length + 1)) == NULL) {
+		_n2pkvna_error(vnap, "%s: too many transfers in flight",
+			filename);
+		errno = ENOMEM;
+		goto out;
+	    }
+	    (void)memcpy((void *)submitted[slot], (const void *)payload,
+		    length);
+	    submitted_id[slot] = id;
+	    submitted_length[slot] = length;
+	    break;
+
+	case RECORD_COMPLETE:
+	    if (endpoint == WRITE_ENDPOINT) {
+		for (slot = 0; slot < 2 * MAX_QUEUE_DEPTH; ++slot) {
+		    if (submitted[slot] != NULL && submitted_id[slot] == id) {
+			break;
+		    }
+		}
+		if (slot == 2 * MAX_QUEUE_DEPTH) {
+		    break;
+		}
+		if (result == LIBUSB_TRANSFER_COMPLETED &&
+			replay_add_commands(vnap, rp, submitted[slot],
+			    submitted_length[slot], when) == -1) {
+		    goto out;
+		}
+		free((void *)submitted[slot]);
+		submitted[slot] = NULL;
+	    } else if (result == LIBUSB_TRANSFER_COMPLETED &&
+		    replay_add_replies(vnap, rp, payload, length,
+			when) == -1) {
+		goto out;
+	    }
+	    break;
+
+	default:
+	    break;
+	}
+    }
+    if (ferror(fp)) {
+	_n2pkvna_error(vnap, "fread: %s: %s", filename, strerror(errno));
+	goto out;
+    }
+
+    if ((rp->rp_pending_vector = calloc(rp->rp_replies + 1,
+		    sizeof(replay_pending_t))) == NULL) {
+	_n2pkvna_error(vnap, "calloc: %s", strerror(errno));
+	goto out;
+    }
+    rp->rp_last_opcode = 0x55;
+    success = true;
+
+out:
+    for (int i = 0; i < 2 * MAX_QUEUE_DEPTH; ++i) {
+	free((void *)submitted[i]);
+    }
+    if (fp != NULL) {
+	(void)fclose(fp);
+    }
+    if (!success) {
+	_n2pkvna_replay_free(rp);
+	rp = NULL;
+    }
+    return rp;
+}
+
+/*
+ * _n2pkvna_replay_write: check commands against the recording
+ *   @vnap: n2pkvna handle
+ *   @rp: replay state
+ *   @data: commands
+ *   @length: bytes in data
+ *   @time_scale: multiplier on recorded reply times (0 = immediate)
+ *
+ * Return:
+ *   0 or a negative LIBUSB_ERROR code
+ */
+int _n2pkvna_replay_write(n2pkvna_t *vnap, n2pkvna_replay_t *rp,
+	const unsigned char *data, int length, double time_scale)
+{
+    struct timespec now;
+    int offset = 0;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &now);
+    while (offset < length) {
+	int size = _n2pkvna_command_size(&data[offset], length - offset);
+	const replay_command_t *rcp;
+
+	if (size <= 0) {
+	    _n2pkvna_error(vnap, "%s: replay: invalid command",
+		    vnap->vna_config.nci_basename);
+	    return LIBUSB_ERROR_IO;
+	}
+	if (rp->rp_next_command >= rp->rp_commands) {
+	    _n2pkvna_error(vnap, "%s: replay: end of recording %s",
+		    vnap->vna_config.nci_basename, rp->rp_filename);
+	    return LIBUSB_ERROR_NO_DEVICE;
+	}
+	rcp = &rp->rp_command_vector[rp->rp_next_command];
+	if (rcp->rc_size != size ||
+		memcmp(&rp->rp_command_bytes[rcp->rc_offset],
+		    &data[offset], size) != 0) {
+	    _n2pkvna_error(vnap, "%s: replay: command %zu differs from "
+		    "the recording", vnap->vna_config.nci_basename,
+		    rp->rp_next_command);
+	    return LIBUSB_ERROR_IO;
+	}
+	if (rcp->rc_reply >= 0) {
+	    const replay_reply_t *rrp = &rp->rp_reply_vector[rcp->rc_reply];
+	    replay_pending_t *ppp;
+	    double delay = rrp->rr_time - rcp->rc_time;
+
+	    ppp = &rp->rp_pending_vector[(rp->rp_pending_head +
+		    rp->rp_pending_count++) % (rp->rp_replies + 1)];
+	    ppp->rp_reply = rcp->rc_reply;
+	    ppp->rp_when = now;
+	    if (delay > 0.0) {
+		_n2pkvna_timespec_add(&ppp->rp_when, time_scale * delay);
+	    }
+	}
+	rp->rp_last_opcode = data[offset];
+	++rp->rp_next_command;
+	offset += size;
+    }
+    return 0;
+}
+
+/*
+ * _n2pkvna_replay_read: serve the recorded replies that are due
+ *   @vnap: n2pkvna handle
+ *   @rp: replay state
+ *   @buffer: receive buffer
+ *   @length: size of buffer
+ *
+ * Returns the number of bytes placed in buffer.  If no recorded reply
+ * is due, the reply is an empty status for the last command.
+ */
+int _n2pkvna_replay_read(n2pkvna_t *vnap, n2pkvna_replay_t *rp,
+	unsigned char *buffer, int length)
+{
+    struct timespec now;
+    int used = 0;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &now);
+    while (rp->rp_pending_count > 0) {
+	replay_pending_t *ppp = &rp->rp_pending_vector[rp->rp_pending_head];
+	const replay_reply_t *rrp = &rp->rp_reply_vector[ppp->rp_reply];
+
+	if (_n2pkvna_timespec_cmp(&ppp->rp_when, &now) > 0 ||
+		rrp->rr_size > length - used) {
+	    break;
+	}
+	(void)memcpy((void *)&buffer[used], (const void *)rrp->rr_bytes,
+		rrp->rr_size);
+	used += rrp->rr_size;
+	rp->rp_pending_head = (rp->rp_pending_head + 1) %
+	    (rp->rp_replies + 1);
+	--rp->rp_pending_count;
+    }
+    if (used == 0 && length >= 5) {
+	(void)memset((void *)buffer, 0, 5);
+	buffer[0] = rp->rp_last_opcode;
+	used = 5;
+    }
+    return used;
+}
@@ -22,18 +22,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "n2pkvna_internal.h"
 
 /*
- * n2pkvna_reset: reset an N2PK VNA
+ * _n2pkvna_reset: reset an N2PK VNA holding the handle lock
  *   @vnap: n2pkvna handle
- *
- * Return:
- *   0: success
- *  -1: error (errno set)
  */
-int n2pkvna_reset(n2pkvna_t *vnap)
+int _n2pkvna_reset(n2pkvna_t *vnap)
 {
     unsigned char buffer[32];
     int transferred;
@@ -52,7 +50,7 @@ int n2pkvna_reset(n2pkvna_t *vnap)
     buffer[1] = 0xC0;	/* set OSR override, minDelay */
     buffer[2] = 0xFF;	/* disable OSR override */
     buffer[3] = 0x04;	/* minDelay set to 4us default */
-    if ((rv = libusb_bulk_transfer(vnap->vna_udhp, WRITE_ENDPOINT, buffer, 4,
+    if ((rv = _n2pkvna_bulk_transfer(vnap, WRITE_ENDPOINT, buffer, 4,
 					&transferred, USB_TIMEOUT)) < 0) {
 	_n2pkvna_error(vnap,
 		"%s: n2pkvna_reset: libusb_bulk_transfer: %s",
@@ -74,7 +72,7 @@ int n2pkvna_reset(n2pkvna_t *vnap)
     (void)memset((void *)buffer, 0, sizeof(buffer));
     buffer[0] = 0x55;
     buffer[1] = 0x80;	/* reset */
-    if ((rv = libusb_bulk_transfer(vnap->vna_udhp, WRITE_ENDPOINT, buffer, 15,
+    if ((rv = _n2pkvna_bulk_transfer(vnap, WRITE_ENDPOINT, buffer, 15,
 					&transferred, USB_TIMEOUT)) < 0) {
 	_n2pkvna_error(vnap,
 		"%s: n2pkvna_reset: libusb_bulk_transfer: %s",
@@ -95,6 +93,155 @@ int n2pkvna_reset(n2pkvna_t *vnap)
      * the first flush.
      */
     _n2pkvna_flush_input(vnap);
+    vnap->vna_synchronized = true;
 
     return 0;
 }
+
+/*
+ * n2pkvna_reset: reset an N2PK VNA
+ *   @vnap: n2pkvna handle
+ *
+ * Return:
+ *   0: success
+ *  -1: error (errno set)
+ */
+int n2pkvna_reset(n2pkvna_t *vnap)
+{
+    struct timespec start, end;
+    int rv;
+
+    if (_n2pkvna_lock_idle(vnap, "n2pkvna_reset") == -1) {
+	return -1;
+    }
+    (void)clock_gettime(CLOCK_MONOTONIC, &start);
+    rv = _n2pkvna_reset(vnap);
+    (void)clock_gettime(CLOCK_MONOTONIC, &end);
+    vnap->vna_open_times.ot_reset = _n2pkvna_timespec_diff(&end, &start);
+    vnap->vna_open_times.ot_warm = false;
+    (void)pthread_mutex_unlock(&vnap->vna_mutex);
+    return rv;
+}
+
+/*
+ * sync_marker: format the config.lck contents for a device left in sync
+ *   @vnap: n2pkvna handle
+ *   @buffer: receives the marker
+ *   @size: size of buffer
+ *
+ * The marker names the USB bus and device number, which change each
+ * time the device is re-enumerated, e.g. after being unplugged.
+ */
+static int sync_marker(const n2pkvna_t *vnap, char *buffer, size_t size)
+{
+    const n2pkvna_address_internal_t *adrip = &vnap->vna_address;
+
+    return snprintf(buffer, size, "synchronized usb %u.%u\n",
+	    (unsigned int)adrip->adri_usb_bus,
+	    (unsigned int)adrip->adri_usb_device);
+}
+
+/*
+ * _n2pkvna_save_sync_state: record in config.lck if the device is in sync
+ *   @vnap: n2pkvna handle
+ *
+ * Called from n2pkvna_close while still holding the lock.  The next
+ * n2pkvna_reset_warm trusts the device only if this process reset it
+ * and didn't change the relative phase of the DDSs afterward.
+ */
+void _n2pkvna_save_sync_state(n2pkvna_t *vnap)
+{
+    char marker[64];
+    int length;
+
+    if (vnap->vna_lockfd == -1) {
+	return;
+    }
+    (void)ftruncate(vnap->vna_lockfd, 0);
+    if (vnap->vna_address.adri_type != N2PKVNA_ADR_USB ||
+	    !vnap->vna_synchronized) {
+	return;
+    }
+    length = sync_marker(vnap, marker, sizeof(marker));
+    (void)pwrite(vnap->vna_lockfd, marker, length, 0);
+}
+
+/*
+ * check_idle: drain input with short timeouts and test for an idle device
+ *   @vnap: n2pkvna handle
+ *
+ * The device is idle if, once any leftover results are drained, its
+ * status reply shows a set DDS or reset as the last command, with no
+ * results pending and no error bits.
+ */
+static bool check_idle(n2pkvna_t *vnap)
+{
+    unsigned char buffer[USB_BUFSIZE];
+
+    for (int i = 0; i < WARM_DRAIN_READS; ++i) {
+	int transferred;
+
+	if (_n2pkvna_bulk_transfer(vnap, READ_ENDPOINT, buffer,
+		    sizeof(buffer), &transferred, WARM_TIMEOUT) < 0) {
+	    return false;
+	}
+	++vnap->vna_stats.ns_flush_reads;
+	if (transferred < 5) {
+	    return false;
+	}
+	if (buffer[4] != 0) {
+	    continue;		/* leftover results */
+	}
+	vnap->vna_rx_length = 0;
+	return buffer[0] == 0x55 && (buffer[1] & 0xC8) == 0;
+    }
+    return false;
+}
+
+/*
+ * n2pkvna_reset_warm: reset only if the device isn't idle and in sync
+ *   @vnap: n2pkvna handle
+ *
+ * Skips the configure and reset commands if the last process to use
+ * this USB device left it reset and in sync, and the device now
+ * reports an idle, error-free status.  Otherwise does a full reset.
+ *
+ * Return:
+ *   0: success
+ *  -1: error (errno set)
+ */
+int n2pkvna_reset_warm(n2pkvna_t *vnap)
+{
+    struct timespec start, end;
+    bool warm = false;
+    int rv = 0;
+
+    if (_n2pkvna_lock_idle(vnap, "n2pkvna_reset_warm") == -1) {
+	return -1;
+    }
+    (void)clock_gettime(CLOCK_MONOTONIC, &start);
+    if (vnap->vna_address.adri_type == N2PKVNA_ADR_USB &&
+	    vnap->vna_lockfd != -1) {
+	char expected[64], found[64];
+	int length = sync_marker(vnap, expected, sizeof(expected));
+
+	/*
+	 * Consume the marker so that a crash before n2pkvna_close
+	 * forces the next open to do a full reset.
+	 */
+	warm = pread(vnap->vna_lockfd, found, sizeof(found), 0) == length &&
+	    memcmp(found, expected, length) == 0;
+	(void)ftruncate(vnap->vna_lockfd, 0);
+    }
+    if (warm && check_idle(vnap)) {
+	vnap->vna_synchronized = true;
+    } else {
+	warm = false;
+	rv = _n2pkvna_reset(vnap);
+    }
+    (void)clock_gettime(CLOCK_MONOTONIC, &end);
+    vnap->vna_open_times.ot_reset = _n2pkvna_timespec_diff(&end, &start);
+    vnap->vna_open_times.ot_warm = warm;
+    (void)pthread_mutex_unlock(&vnap->vna_mutex);
+    return rv;
+}
@@ -39,6 +39,9 @@ int n2pkvna_save(n2pkvna_t *vnap)
     FILE *fp = NULL;
     int rv = -1;
 
+    if (_n2pkvna_lock_idle(vnap, "n2pkvna_save") == -1) {
+	return -1;
+    }
     if (asprintf(&cur_filename, "%s/config",
 		vnap->vna_config.nci_directory) == -1) {
        _n2pkvna_error(vnap, "%s: malloc: %s",
@@ -65,25 +68,41 @@ int n2pkvna_save(n2pkvna_t *vnap)
     }
 
     /*
-     * Add usbVendor
+     * Add the device address: usbVendor and usbProduct for USB, or
+     * a simulator section for the simulated device.
      */
-    if (vnaproperty_set(&vnap->vna_property_root, "usbVendor=0x%04x",
-		vnap->vna_address.adri_usb_vendor) == -1) {
-       _n2pkvna_error(vnap, "%s: vnaproperty_set: %s: %s",
-		vnap->vna_config.nci_basename, new_filename,
-		strerror(errno));
-	goto out;
-    }
+    switch (vnap->vna_address.adri_type) {
+    case N2PKVNA_ADR_USB:
+	if (vnaproperty_set(&vnap->vna_property_root, "usbVendor=0x%04x",
+		    vnap->vna_address.adri_usb_vendor) == -1) {
+	   _n2pkvna_error(vnap, "%s: vnaproperty_set: %s: %s",
+		    vnap->vna_config.nci_basename, new_filename,
+		    strerror(errno));
+	    goto out;
+	}
+	if (vnaproperty_set(&vnap->vna_property_root, "usbProduct=0x%04x",
+		    vnap->vna_address.adri_usb_product) == -1) {
+	   _n2pkvna_error(vnap, "%s: vnaproperty_set: %s: %s",
+		    vnap->vna_config.nci_basename, new_filename,
+		    strerror(errno));
+	    goto out;
+	}
+	break;
 
-    /*
-     * Add usbProduct
-     */
-    if (vnaproperty_set(&vnap->vna_property_root, "usbProduct=0x%04x",
-		vnap->vna_address.adri_usb_product) == -1) {
-       _n2pkvna_error(vnap, "%s: vnaproperty_set: %s: %s",
-		vnap->vna_config.nci_basename, new_filename,
-		strerror(errno));
-	goto out;
+    case N2PKVNA_ADR_SIM:
+	if (vnaproperty_get_subtree(vnap->vna_property_root,
+		    "simulator") == NULL &&
+		vnaproperty_set(&vnap->vna_property_root,
+		    "simulator.dut=series") == -1) {
+	   _n2pkvna_error(vnap, "%s: vnaproperty_set: %s: %s",
+		    vnap->vna_config.nci_basename, new_filename,
+		    strerror(errno));
+	    goto out;
+	}
+	break;
+
+    default:
+	break;
     }
 
     /*
@@ -97,6 +116,21 @@ int n2pkvna_save(n2pkvna_t *vnap)
 	goto out;
     }
 
+    /*
+     * Add adcMode if not the default
+     */
+    if (vnap->vna_config.nci_adc_mode != DEFAULT_ADC_MODE) {
+	if (vnaproperty_set(&vnap->vna_property_root, "adcMode=0x%02x",
+		    vnap->vna_config.nci_adc_mode) == -1) {
+	   _n2pkvna_error(vnap, "%s: vnaproperty_set: %s: %s",
+		    vnap->vna_config.nci_basename, new_filename,
+		    strerror(errno));
+	    goto out;
+	}
+    } else {
+	(void)vnaproperty_delete(&vnap->vna_property_root, "adcMode");
+    }
+
     /*
      * Write and update the file
      */
@@ -142,5 +176,6 @@ out:
     free((void *)bak_filename);
     free((void *)new_filename);
     free((void *)cur_filename);
+    (void)pthread_mutex_unlock(&vnap->vna_mutex);
     return rv;
 }
@@ -19,6 +19,7 @@
 #include "archdep.h"
 
 #include <errno.h>
+#include <limits.h>
 #include <math.h>
 #include <stdlib.h>
 #include <string.h>
@@ -27,259 +28,678 @@
 
 
 /*
- * n2pkvna_scan: run a frequency scan and collect detector voltages
- *   @vnap: n2pkvna handle
- *   @f0: starting frequency (Hz)
- *   @ff: ending frequency (Hz)
- *   @n: number of points in scan
- *   @linear: true for linear spacing, false for logarithmic
- *   @frequency: recevies frequency vector if non-NULL
- *   @detector1: recevies detector1 values if non-NULL
- *   @detector2: recevies detector2 values if non-NULL
+ * phase_modes: supported LO phase step counts
  *
- * Return:
- *   0: success
- *  -1: error (errno set)
+ * The AD9851 phase code has 32 steps of 11.25 degrees.  Each mode steps
+ * the LO phase by stride codes around the circle.  The 2-step mode is
+ * the exception: it measures only at 0 and 90 degrees (quadrature),
+ * trading rejection of detector offset for speed.  Summing the
+ * projections of N evenly spaced steps yields N/2 times the detector
+ * vector; the quadrature pair yields it directly.
+ */
+static const struct phase_mode {
+    int		pm_steps;		/* number of phase steps */
+    int		pm_stride;		/* phase codes per step */
+    double	pm_divisor;		/* normalizes the sum */
+} phase_modes[] = {
+    {  2, 8,  1.0 },
+    {  4, 8,  2.0 },
+    {  8, 4,  4.0 },
+    { 16, 2,  8.0 },
+    { 32, 1, 16.0 },
+};
+#define N_PHASE_MODES	(sizeof(phase_modes) / sizeof(phase_modes[0]))
+
+/*
+ * find_phase_mode: return the phase mode for a step count
+ *   @steps: number of phase steps
+ */
+static const struct phase_mode *find_phase_mode(int steps)
+{
+    for (size_t i = 0; i < N_PHASE_MODES; ++i) {
+	if (phase_modes[i].pm_steps == steps) {
+	    return &phase_modes[i];
+	}
+    }
+    return NULL;
+}
+
+/*
+ * plan_run_t: state of one execution of a plan
+ */
+typedef struct plan_run {
+    const n2pkvna_plan_t       *pr_plan;		/* plan being run */
+    size_t			pr_base;		/* first command of run */
+    unsigned int		pr_point;		/* current point */
+    unsigned int		pr_retries;		/* retries of pr_point */
+    double complex		pr_v1;			/* detector 1 sum */
+    double complex		pr_v2;			/* detector 2 sum */
+    double complex	       *pr_detector1_vector;	/* caller's vectors */
+    double complex	       *pr_detector2_vector;
+    n2pkvna_point_fn_t	       *pr_point_fn;		/* per-point callback */
+    void		       *pr_point_arg;		/* arg to above */
+    bool			pr_stopped;		/* point_fn stopped run */
+} plan_run_t;
+
+/*
+ * plan_command: copy out the precomputed set DDS command
+ *   @arg: plan run state
+ *   @index: command index
+ *   @buffer: buffer to receive the command
+ */
+static void plan_command(void *arg, size_t index, unsigned char *buffer)
+{
+    plan_run_t *prp = arg;
+
+    (void)memcpy((void *)buffer, (void *)&prp->pr_plan->pn_command_vector[
+	    (prp->pr_base + index) * DDS_COMMAND_SIZE], DDS_COMMAND_SIZE);
+
+    /*
+     * When resuming after a reset or reconnect, the DDS has just been
+     * reset, so give the first measurement the full settling time.
+     */
+    if (index == 0 && prp->pr_base != 0) {
+	_n2pkvna_encode_delay(buffer, HOLD_DELAY0);
+    }
+}
+
+/*
+ * plan_deliver: store a completed point and pass it to the callback
+ *   @prp: plan run state
+ *   @point: point with the detector values and quality filled in
+ */
+static int plan_deliver(plan_run_t *prp, n2pkvna_point_t *point)
+{
+    point->np_index = prp->pr_point;
+    point->np_frequency = prp->pr_plan->pn_frequency_vector[prp->pr_point];
+    point->np_retries = prp->pr_retries;
+    if (prp->pr_detector1_vector != NULL) {
+	prp->pr_detector1_vector[prp->pr_point] = point->np_detector1;
+    }
+    if (prp->pr_detector2_vector != NULL) {
+	prp->pr_detector2_vector[prp->pr_point] = point->np_detector2;
+    }
+    ++prp->pr_point;
+    prp->pr_retries = 0;
+
+    /*
+     * Pass the point to the callback, stopping if it asks.
+     */
+    if (prp->pr_point_fn != NULL &&
+	    (*prp->pr_point_fn)(point, prp->pr_point_arg) != 0) {
+	prp->pr_stopped = true;
+	errno = ECANCELED;
+	return -1;
+    }
+    return 0;
+}
+
+/*
+ * plan_result: demodulate the detector values for a phase step
+ *   @arg: plan run state
+ *   @index: command index
+ *   @values: detector 1 and detector 2 voltages
  *
- * Caller can free the memory of the returned vectors by a call to free.
+ * The phase detectors both return the negative of the product.  But
+ * the local oscillator signal into detector 2 is also inverted, so the
+ * signal from detector 1 is negative while the signal from detector 2
+ * is double negative or positive.  At each phase step, LO 1 leads RF
+ * by the step angle; if RF out through the DUT is in phase with LO 1,
+ * it contributes along the weight for that step.
  */
-int n2pkvna_scan(n2pkvna_t *vnap, double f0, double ff,
-	unsigned int n, bool linear,
-	double *frequency_vector,
-	double complex *detector1_vector,
-	double complex *detector2_vector)
+static int plan_result(void *arg, size_t index, const double *values)
 {
-    double values[2];
-    double frequency;
-    double step_size;
-    uint32_t frequency_code;
-    double f_reference = vnap->vna_config.nci_reference_frequency;
+    plan_run_t *prp = arg;
+    const n2pkvna_plan_t *planp = prp->pr_plan;
+    const n2pkvna_plan_point_t *ppp = &planp->pn_point_vector[prp->pr_point];
+    uint8_t phase_code;
+    double complex weight;
 
-    if (n < 1) {
-	_n2pkvna_error(vnap,
-		"invalid number of frequencies: %d", n);
+    index += prp->pr_base;
+    phase_code = planp->pn_command_vector[index * DDS_COMMAND_SIZE
+	+ 5] >> 3;
+    weight = planp->pn_circle[phase_code];
+
+    if (index == ppp->pp_first) {
+	prp->pr_v1 = 0.0;
+	prp->pr_v2 = 0.0;
+    }
+    prp->pr_v1 -= weight * values[0];
+    prp->pr_v2 += weight * values[1];
+    if (index == ppp->pp_first + ppp->pp_count - 1) {
+	n2pkvna_point_t point;
+
+	point.np_detector1 = prp->pr_v1 / ppp->pp_divisor;
+	point.np_detector2 = prp->pr_v2 / ppp->pp_divisor;
+	point.np_quality = prp->pr_retries == 0 ?
+	    N2PKVNA_POINT_OK : N2PKVNA_POINT_RETRIED;
+	return plan_deliver(prp, &point);
+    }
+    return 0;
+}
+
+/*
+ * plan_give_up: deliver the current point as failed
+ *   @prp: plan run state
+ */
+static int plan_give_up(plan_run_t *prp)
+{
+    n2pkvna_point_t point;
+
+    point.np_detector1 = NAN;
+    point.np_detector2 = NAN;
+    point.np_quality = N2PKVNA_POINT_FAILED;
+    return plan_deliver(prp, &point);
+}
+
+/*
+ * n2pkvna_set_phase_steps: set the number of LO phase steps per point
+ *   @vnap: n2pkvna handle
+ *   @steps: 2 (quadrature), 4, 8 (default), 16 or 32
+ */
+int n2pkvna_set_phase_steps(n2pkvna_t *vnap, int steps)
+{
+    if (find_phase_mode(steps) == NULL) {
+	_n2pkvna_error(vnap, "invalid number of phase steps: %d", steps);
 	errno = EINVAL;
 	return -1;
     }
-    if (f0 < 0.0 || f0 > f_reference / 2.0) {
+    if (_n2pkvna_lock_idle(vnap, "n2pkvna_set_phase_steps") == -1) {
+	return -1;
+    }
+    vnap->vna_phase_steps = steps;
+    (void)pthread_mutex_unlock(&vnap->vna_mutex);
+    return 0;
+}
+
+/*
+ * check_frequency: validate a scan frequency
+ *   @vnap: n2pkvna handle
+ *   @frequency: frequency (Hz)
+ */
+static int check_frequency(n2pkvna_t *vnap, double frequency)
+{
+    if (isnan(frequency) || frequency < 0.0 ||
+	    frequency > vnap->vna_config.nci_reference_frequency / 2.0) {
 	_n2pkvna_error(vnap,
-		"invalid frequency value %f", f0);
+		"invalid frequency value %f", frequency);
 	errno = EINVAL;
 	return -1;
     }
-    if (ff < 0.0 || ff > f_reference / 2.0) {
-	_n2pkvna_error(vnap,
-		"invalid frequency value %f", ff);
+    return 0;
+}
+
+/*
+ * check_timing: validate the hold delays against an ADC mode
+ *   @vnap: n2pkvna handle
+ *   @adc_mode: ADC mode
+ *
+ * Each hold delay must fit the set DDS delay code, must not be shorter
+ * than the minDelay configured by n2pkvna_reset, and together with the
+ * conversion time of the mode must finish within STATUS_TIMEOUT, after
+ * which the result is given up for lost.
+ */
+static int check_timing(n2pkvna_t *vnap, int adc_mode)
+{
+    static const double hold_delays[] = {
+	HOLD_DELAY0, HOLD_DELAY1, HOLD_DELAY2
+    };
+
+    if (!_n2pkvna_check_adc_mode(adc_mode)) {
+	_n2pkvna_error(vnap, "invalid ADC mode 0x%02x", adc_mode);
 	errno = EINVAL;
 	return -1;
     }
+    for (size_t i = 0; i < sizeof(hold_delays) / sizeof(double); ++i) {
+	double delay = hold_delays[i];
+	double total = delay + _n2pkvna_conversion_time(adc_mode);
 
-    /*
-     * Flush any unread data from the input queue.
-     */
-    if (_n2pkvna_flush_input(vnap) == -1) {
-	goto error;
+	if (delay < MIN_DELAY || delay > 255.0e-3 ||
+		total >= STATUS_TIMEOUT) {
+	    _n2pkvna_error(vnap, "hold delay %g s is not valid with "
+		    "ADC mode 0x%02x", delay, adc_mode);
+	    errno = EINVAL;
+	    return -1;
+	}
     }
+    return 0;
+}
 
-    /*
-     * Set DDS for the first measurement to prime the pipeline.  Throughout
-     * the scan, we maintain two outstanding requests and read behind.
-     */
-    frequency = f0;
-    frequency_code = _n2pkvna_frequency_to_code(f_reference, frequency);
-    if (_n2pkvna_set_dds(vnap, true, HOLD_DELAY0, frequency_code,
-		frequency_code, _n2pkvna_phase_to_code(0.0)) == -1) {
+/*
+ * plan_alloc: allocate a plan
+ *   @vnap: n2pkvna handle
+ *   @points: number of frequency points
+ *   @commands: number of set DDS commands
+ */
+static n2pkvna_plan_t *plan_alloc(n2pkvna_t *vnap, unsigned int points,
+	size_t commands)
+{
+    n2pkvna_plan_t *planp;
+
+    if ((planp = calloc(1, sizeof(n2pkvna_plan_t))) == NULL) {
+	_n2pkvna_error(vnap, "calloc: %s", strerror(errno));
+	return NULL;
+    }
+    planp->pn_vnap = vnap;
+    if ((planp->pn_frequency_vector = calloc(points,
+		    sizeof(double))) == NULL) {
+	_n2pkvna_error(vnap, "calloc: %s", strerror(errno));
 	goto error;
     }
+    if ((planp->pn_point_vector = calloc(points,
+		    sizeof(n2pkvna_plan_point_t))) == NULL) {
+	_n2pkvna_error(vnap, "calloc: %s", strerror(errno));
+	goto error;
+    }
+    if ((planp->pn_command_vector = malloc(commands *
+		    DDS_COMMAND_SIZE)) == NULL) {
+	_n2pkvna_error(vnap, "malloc: %s", strerror(errno));
+	goto error;
+    }
+    for (int code = 0; code < MAX_PHASE_STEPS; ++code) {
+	planp->pn_circle[code] = cexp(I * M_PI / 16.0 * code);
+    }
+    return planp;
+
+error:
+    n2pkvna_plan_free(planp);
+    return NULL;
+}
+
+/*
+ * plan_add_point: append the commands for one frequency point
+ *   @planp: plan
+ *   @frequency: requested frequency (Hz)
+ *   @pmp: phase mode
+ *   @average: number of times to repeat the phase cycle
+ *   @adc_mode: ADC mode
+ *
+ * The first measurement of the plan waits HOLD_DELAY0 for the hardware
+ * to settle.  Each new frequency waits HOLD_DELAY2, and each phase
+ * change within a frequency waits HOLD_DELAY1.
+ */
+static void plan_add_point(n2pkvna_plan_t *planp, double frequency,
+	const struct phase_mode *pmp, int average, int adc_mode)
+{
+    double f_reference = planp->pn_vnap->vna_config.nci_reference_frequency;
+    n2pkvna_plan_point_t *ppp = &planp->pn_point_vector[planp->pn_points];
+    uint32_t code = _n2pkvna_frequency_to_code(f_reference, frequency);
+
+    planp->pn_frequency_vector[planp->pn_points] =
+	_n2pkvna_code_to_frequency(f_reference, code);
+    ppp->pp_first = planp->pn_commands;
+    ppp->pp_count = (size_t)pmp->pm_steps * average;
+    ppp->pp_divisor = pmp->pm_divisor * average;
+    for (int r = 0; r < average; ++r) {
+	for (int k = 0; k < pmp->pm_steps; ++k) {
+	    double delay;
+
+	    if (planp->pn_commands == 0) {
+		delay = HOLD_DELAY0;
+	    } else if (r == 0 && k == 0) {
+		delay = HOLD_DELAY2;
+	    } else {
+		delay = HOLD_DELAY1;
+	    }
+	    _n2pkvna_encode_dds(&planp->pn_command_vector[
+		    planp->pn_commands * DDS_COMMAND_SIZE], true, delay,
+		    adc_mode, code, code, k * pmp->pm_stride);
+	    ++planp->pn_commands;
+	}
+    }
+    ++planp->pn_points;
+}
+
+/*
+ * plan_create_segments: precompute a segmented scan holding the handle lock
+ *   @vnap: n2pkvna handle
+ *   @segment_vector: vector of scan segments
+ *   @segments: number of segments
+ */
+static n2pkvna_plan_t *plan_create_segments(n2pkvna_t *vnap,
+	const n2pkvna_segment_t *segment_vector, int segments)
+{
+    n2pkvna_plan_t *planp;
+    unsigned int points = 0;
+    size_t commands = 0;
 
     /*
-     * Sweep over the range of frequencies.  For each frequency, change
-     * the phase of the local oscillator in 45 degree steps around the
-     * circle, measuring the detector values and summing the projections
-     * into complex voltages v1 and v2.
+     * Validate the segments and count points and commands.
      */
-    if (n < 2) {
-	step_size = 0.0;
-    } else if (linear) {
-	step_size = (ff - f0) / (double)(n - 1);
-    } else {
-	step_size = log(ff / f0) / (double)(n - 1);
-    }
-    for (int i = 0; i < n; ++i) {
-	double complex v1 = 0.0;
-	double complex v2 = 0.0;
-
-	/*
-	 * Save the actual frequency, if requested.
-	 */
-	if (frequency_vector != NULL)
-	    frequency_vector[i] = _n2pkvna_code_to_frequency(f_reference,
-					frequency_code);
-
-	/*
-	 * Set 45 degrees.
-	 */
-	if (_n2pkvna_set_dds(vnap, true, HOLD_DELAY1, frequency_code,
-		    frequency_code, _n2pkvna_phase_to_code(45.0)) < 0) {
-	    return -1;
-	}
+    if (segments < 1) {
+	_n2pkvna_error(vnap, "invalid number of segments: %d", segments);
+	errno = EINVAL;
+	return NULL;
+    }
+    for (int s = 0; s < segments; ++s) {
+	const n2pkvna_segment_t *segp = &segment_vector[s];
+	int steps = segp->seg_phase_steps != 0 ?
+	    segp->seg_phase_steps : vnap->vna_phase_steps;
+	int average = segp->seg_average != 0 ? segp->seg_average : 1;
+	int adc_mode = segp->seg_adc_mode != 0 ?
+	    segp->seg_adc_mode : vnap->vna_config.nci_adc_mode;
 
-	/*
-	 * Read 0 degrees.
-	 *   The phase detectors both return the negative of the product.  But
-	 *   the local oscillator signal into detector 2 is also inverted, so
-	 *   the signal from detector 1 is negative while the signal from
-	 *   detector 2 is double negative or positive.
-	 */
-	if (_n2pkvna_read_status(vnap, 0x55, 2, values) < 0) {
-	    return -1;
+	if (segp->seg_n < 1 || segp->seg_n > UINT_MAX - points) {
+	    _n2pkvna_error(vnap,
+		    "invalid number of frequencies: %u", segp->seg_n);
+	    errno = EINVAL;
+	    return NULL;
 	}
-	v1 -= values[0];
-	v2 += values[1];
-
-	/*
-	 * Set 90 degrees.
-	 */
-	if (_n2pkvna_set_dds(vnap, true, HOLD_DELAY1, frequency_code,
-		    frequency_code, _n2pkvna_phase_to_code(90.0)) < 0) {
-	    return -1;
+	if (check_frequency(vnap, segp->seg_f0) == -1 ||
+		check_frequency(vnap, segp->seg_ff) == -1) {
+	    return NULL;
 	}
-
-	/*
-	 * Read 45 degrees.
-	 *   LO 1 leads RF by 45 degrees.  If RF out through the DUT is
-	 *   in phase with LO 1, then it contributes +I, with the same
-	 *   sign reversals above.
-	 */
-	if (_n2pkvna_read_status(vnap, 0x55, 2, values) < 0) {
-	    return -1;
+	if (!segp->seg_linear && segp->seg_n > 1 && (segp->seg_f0 <= 0.0 ||
+		    segp->seg_ff <= 0.0)) {
+	    _n2pkvna_error(vnap,
+		    "log spaced segment cannot include zero frequency");
+	    errno = EINVAL;
+	    return NULL;
 	}
-	v1 -= (1.0 / SQRT2 + I / SQRT2) * values[0];
-	v2 += (1.0 / SQRT2 + I / SQRT2) * values[1];
-
-	/*
-	 * Set 135 degrees.
-	 */
-	if (_n2pkvna_set_dds(vnap, true, HOLD_DELAY1, frequency_code,
-		    frequency_code, _n2pkvna_phase_to_code(135.0)) < 0) {
-	    return -1;
+	if (find_phase_mode(steps) == NULL) {
+	    _n2pkvna_error(vnap, "invalid number of phase steps: %d", steps);
+	    errno = EINVAL;
+	    return NULL;
 	}
-
-	/*
-	 * Read 90 degrees.
-	 */
-	if (_n2pkvna_read_status(vnap, 0x55, 2, values) < 0) {
-	    return -1;
+	if (average < 1) {
+	    _n2pkvna_error(vnap, "invalid average count: %d", average);
+	    errno = EINVAL;
+	    return NULL;
 	}
-	v1 -= I * values[0];
-	v2 += I * values[1];
-
-	/*
-	 * Set 180 degrees.
-	 */
-	if (_n2pkvna_set_dds(vnap, true, HOLD_DELAY1, frequency_code,
-		    frequency_code, _n2pkvna_phase_to_code(180.0)) < 0) {
-	    return -1;
+	if (check_timing(vnap, adc_mode) == -1) {
+	    return NULL;
 	}
+	points += segp->seg_n;
+	commands += (size_t)segp->seg_n * steps * average;
+    }
 
-	/*
-	 * Read 135 degrees.
-	 */
-	if (_n2pkvna_read_status(vnap, 0x55, 2, values) < 0) {
-	    return -1;
-	}
-	v1 -= (-1.0 / SQRT2 + I / SQRT2) * values[0];
-	v2 += (-1.0 / SQRT2 + I / SQRT2) * values[1];
-
-	/*
-	 * Set 225 degrees
-	 */
-	if (_n2pkvna_set_dds(vnap, true, HOLD_DELAY1, frequency_code,
-		    frequency_code, _n2pkvna_phase_to_code(225.0)) < 0) {
-	    return -1;
+    /*
+     * Build the plan.
+     */
+    if ((planp = plan_alloc(vnap, points, commands)) == NULL) {
+	return NULL;
+    }
+    for (int s = 0; s < segments; ++s) {
+	const n2pkvna_segment_t *segp = &segment_vector[s];
+	const struct phase_mode *pmp = find_phase_mode(
+		segp->seg_phase_steps != 0 ?
+		segp->seg_phase_steps : vnap->vna_phase_steps);
+	int average = segp->seg_average != 0 ? segp->seg_average : 1;
+	int adc_mode = segp->seg_adc_mode != 0 ?
+	    segp->seg_adc_mode : vnap->vna_config.nci_adc_mode;
+	double f0 = segp->seg_f0;
+	double ff = segp->seg_ff;
+	unsigned int n = segp->seg_n;
+	double step_size;
+
+	if (n < 2) {
+	    step_size = 0.0;
+	} else if (segp->seg_linear) {
+	    step_size = (ff - f0) / (double)(n - 1);
+	} else {
+	    step_size = log(ff / f0) / (double)(n - 1);
 	}
+	for (unsigned int i = 0; i < n; ++i) {
+	    double frequency;
 
-	/*
-	 * Read 180 degrees.
-	 *	Signs are opposite the 0 degree case.
-	 */
-	if (_n2pkvna_read_status(vnap, 0x55, 2, values) < 0) {
-	    return -1;
+	    if (segp->seg_linear) {
+		frequency = f0 + (double)i * step_size;
+	    } else {
+		frequency = f0 * exp((double)i * step_size);
+	    }
+	    plan_add_point(planp, frequency, pmp, average, adc_mode);
 	}
-	v1 -= -1.0 * values[0];
-	v2 += -1.0 * values[1];
-
-	/*
-	 * Set 270 degrees
-	 */
-	if (_n2pkvna_set_dds(vnap, true, HOLD_DELAY1, frequency_code,
-		    frequency_code, _n2pkvna_phase_to_code(270.0)) < 0) {
-	    return -1;
+    }
+    return planp;
+}
+
+/*
+ * n2pkvna_plan_create_segments: precompute a segmented frequency scan
+ *   @vnap: n2pkvna handle
+ *   @segment_vector: vector of scan segments
+ *   @segments: number of segments
+ *
+ * The plan captures the current reference frequency, and the phase
+ * step count and ADC mode of segments that use the device defaults.
+ * Create a new plan if any of these change.
+ *
+ * Return:
+ *   new plan on success; NULL on error (errno set)
+ */
+n2pkvna_plan_t *n2pkvna_plan_create_segments(n2pkvna_t *vnap,
+	const n2pkvna_segment_t *segment_vector, int segments)
+{
+    n2pkvna_plan_t *planp;
+
+    (void)pthread_mutex_lock(&vnap->vna_mutex);
+    planp = plan_create_segments(vnap, segment_vector, segments);
+    (void)pthread_mutex_unlock(&vnap->vna_mutex);
+    return planp;
+}
+
+/*
+ * plan_create_list: precompute a list scan holding the handle lock
+ *   @vnap: n2pkvna handle
+ *   @frequency_vector: frequencies to measure (Hz)
+ *   @n: number of frequencies
+ */
+static n2pkvna_plan_t *plan_create_list(n2pkvna_t *vnap,
+	const double *frequency_vector, unsigned int n)
+{
+    const struct phase_mode *pmp = find_phase_mode(vnap->vna_phase_steps);
+    n2pkvna_plan_t *planp;
+
+    if (n < 1) {
+	_n2pkvna_error(vnap,
+		"invalid number of frequencies: %u", n);
+	errno = EINVAL;
+	return NULL;
+    }
+    for (unsigned int i = 0; i < n; ++i) {
+	if (check_frequency(vnap, frequency_vector[i]) == -1) {
+	    return NULL;
 	}
+    }
+    if (check_timing(vnap, vnap->vna_config.nci_adc_mode) == -1) {
+	return NULL;
+    }
+    if ((planp = plan_alloc(vnap, n, (size_t)n * pmp->pm_steps)) == NULL) {
+	return NULL;
+    }
+    for (unsigned int i = 0; i < n; ++i) {
+	plan_add_point(planp, frequency_vector[i], pmp, 1,
+		vnap->vna_config.nci_adc_mode);
+    }
+    return planp;
+}
 
-	/*
-	 * Read 225 degrees.
-	 */
-	if (_n2pkvna_read_status(vnap, 0x55, 2, values) < 0) {
-	    return -1;
+/*
+ * n2pkvna_plan_create_list: precompute a scan of a list of frequencies
+ *   @vnap: n2pkvna handle
+ *   @frequency_vector: frequencies to measure (Hz)
+ *   @n: number of frequencies
+ *
+ * Return:
+ *   new plan on success; NULL on error (errno set)
+ */
+n2pkvna_plan_t *n2pkvna_plan_create_list(n2pkvna_t *vnap,
+	const double *frequency_vector, unsigned int n)
+{
+    n2pkvna_plan_t *planp;
+
+    (void)pthread_mutex_lock(&vnap->vna_mutex);
+    planp = plan_create_list(vnap, frequency_vector, n);
+    (void)pthread_mutex_unlock(&vnap->vna_mutex);
+    return planp;
+}
+
+/*
+ * plan_create: precompute a frequency scan holding the handle lock
+ *   @vnap: n2pkvna handle
+ *   @f0: starting frequency (Hz)
+ *   @ff: ending frequency (Hz)
+ *   @n: number of points in scan
+ *   @linear: true for linear spacing, false for logarithmic
+ */
+static n2pkvna_plan_t *plan_create(n2pkvna_t *vnap, double f0, double ff,
+	unsigned int n, bool linear)
+{
+    n2pkvna_segment_t segment;
+
+    (void)memset((void *)&segment, 0, sizeof(segment));
+    segment.seg_f0 = f0;
+    segment.seg_ff = ff;
+    segment.seg_n = n;
+    segment.seg_linear = linear;
+    return plan_create_segments(vnap, &segment, 1);
+}
+
+/*
+ * n2pkvna_plan_create: precompute the commands of a frequency scan
+ *   @vnap: n2pkvna handle
+ *   @f0: starting frequency (Hz)
+ *   @ff: ending frequency (Hz)
+ *   @n: number of points in scan
+ *   @linear: true for linear spacing, false for logarithmic
+ *
+ * The plan captures the current reference frequency, phase step count
+ * and ADC mode.  Create a new plan if any of these change.
+ *
+ * Return:
+ *   new plan on success; NULL on error (errno set)
+ */
+n2pkvna_plan_t *n2pkvna_plan_create(n2pkvna_t *vnap, double f0, double ff,
+	unsigned int n, bool linear)
+{
+    n2pkvna_plan_t *planp;
+
+    (void)pthread_mutex_lock(&vnap->vna_mutex);
+    planp = plan_create(vnap, f0, ff, n, linear);
+    (void)pthread_mutex_unlock(&vnap->vna_mutex);
+    return planp;
+}
+
+/*
+ * _n2pkvna_plan_run: run a planned scan
+ *   @planp: plan from n2pkvna_plan_create
+ *   @frequency_vector: receives frequency vector if non-NULL
+ *   @detector1_vector: receives detector1 values if non-NULL
+ *   @detector2_vector: receives detector2 values if non-NULL
+ *   @point_fn: if non-NULL, called with each point as it completes;
+ *		returning non-zero stops the run
+ *   @point_arg: argument to point_fn
+ *
+ * Return:
+ *   1: stopped by point_fn
+ *   0: success
+ *  -1: error (errno set)
+ */
+int _n2pkvna_plan_run(n2pkvna_plan_t *planp, double *frequency_vector,
+	double complex *detector1_vector, double complex *detector2_vector,
+	n2pkvna_point_fn_t *point_fn, void *point_arg)
+{
+    n2pkvna_t *vnap = planp->pn_vnap;
+    unsigned int reconnects = 0;
+    int errors = 0;
+    plan_run_t pr;
+
+    /*
+     * Flush any unread data from the input queue.
+     */
+    if (_n2pkvna_flush_input(vnap) == -1) {
+	return -1;
+    }
+
+    /*
+     * Run the precomputed commands, summing the projections of each
+     * phase step into complex voltages v1 and v2.  The pipeline keeps
+     * the device's command queue full while reading results behind.
+     *
+     * On a transient error, e.g. an ADC time-out, a bad conversion
+     * code, a short read, or a result that never arrives, reset the
+     * device to clear its command queue and measure the failed point
+     * again.  Once the point has used up its retries, a streaming
+     * caller gets it as failed and the scan goes on to the next; the
+     * other callers can't tell a failed point from a measured one, so
+     * for them the scan fails.  The scan also fails if it sees more
+     * transient errors than vna_scan_errors.
+     *
+     * If the device drops off the bus (e.g. the USB link resets) and
+     * reconnect is enabled, wait for it to come back, and resume from
+     * the first point not yet completed.  Give up if it keeps failing
+     * without completing any more points.
+     */
+    (void)memset((void *)&pr, 0, sizeof(pr));
+    pr.pr_plan = planp;
+    pr.pr_detector1_vector = detector1_vector;
+    pr.pr_detector2_vector = detector2_vector;
+    pr.pr_point_fn = point_fn;
+    pr.pr_point_arg = point_arg;
+    for (;;) {
+	unsigned int point = pr.pr_point;
+
+	if (point >= planp->pn_points) {
+	    break;
 	}
-	v1 -= (-1.0 / SQRT2 + -I / SQRT2) * values[0];
-	v2 += (-1.0 / SQRT2 + -I / SQRT2) * values[1];
-
-	/*
-	 * Set 315 degrees
-	 */
-	if (_n2pkvna_set_dds(vnap, true, HOLD_DELAY1, frequency_code,
-		    frequency_code, _n2pkvna_phase_to_code(315.0)) < 0) {
-	    return -1;
+	pr.pr_base = planp->pn_point_vector[point].pp_first;
+	if (_n2pkvna_pipeline_run(vnap, planp->pn_commands - pr.pr_base,
+		    plan_command, plan_result, &pr) == 0) {
+	    break;
 	}
-
-	/*
-	 * Read 270 degrees.
-	 */
-	if (_n2pkvna_read_status(vnap, 0x55, 2, values) < 0) {
-	    return -1;
+	if (pr.pr_stopped) {
+	    (void)_n2pkvna_set_dds(vnap, false, 0.0, 0, 0, 0);
+	    return 1;
+	}
+	if (pr.pr_point != point) {
+	    reconnects = 0;
 	}
-	v1 -= -I * values[0];
-	v2 += -I * values[1];
-
-	if (i + 1 < n) {
-	    /*
-	     * Calculate the next frequency
-	     */
-	    if (linear) {
-		frequency = f0 + (double)(i + 1) * step_size;
+	if (errno != ENODEV) {
+	    if (errno != EIO && errno != ETIMEDOUT) {
+		return -1;
+	    }
+	    if (++errors > vnap->vna_scan_errors) {
+		return -1;
+	    }
+	    if (pr.pr_retries < (unsigned int)vnap->vna_point_retries) {
+		++pr.pr_retries;
+		++vnap->vna_stats.ns_point_retries;
+	    } else if (point_fn == NULL) {
+		_n2pkvna_error(vnap, "%s: point %u failed after %u retries",
+			vnap->vna_config.nci_basename, pr.pr_point,
+			pr.pr_retries);
+		++vnap->vna_stats.ns_failed_points;
+		(void)_n2pkvna_set_dds(vnap, false, 0.0, 0, 0, 0);
+		errno = EIO;
+		return -1;
 	    } else {
-		frequency = f0 * exp((double)(i + 1) * step_size);
+		_n2pkvna_error(vnap, "%s: warning: giving up on point %u "
+			"after %u retries", vnap->vna_config.nci_basename,
+			pr.pr_point, pr.pr_retries);
+		++vnap->vna_stats.ns_failed_points;
+		if (plan_give_up(&pr) == -1) {
+		    (void)_n2pkvna_set_dds(vnap, false, 0.0, 0, 0, 0);
+		    return 1;
+		}
+	    }
+	    if (_n2pkvna_reset(vnap) == 0) {
+		continue;
 	    }
-	    frequency_code = _n2pkvna_frequency_to_code(f_reference,
-							frequency);
-
-	    /*
-	     * Set 0 degrees.
-	     */
-	    if (_n2pkvna_set_dds(vnap, true, HOLD_DELAY2, frequency_code,
-			frequency_code, _n2pkvna_phase_to_code(0.0)) < 0) {
+	    if (errno != ENODEV && errno != EIO) {
 		return -1;
 	    }
 	}
-
-	/*
-	 * Read 315 degrees.
-	 */
-	if (_n2pkvna_read_status(vnap, 0x55, 2, values) < 0) {
+	if (++reconnects > RECONNECT_RETRIES ||
+		_n2pkvna_reconnect(vnap) == -1) {
 	    return -1;
 	}
-	v1 -= (1.0 / SQRT2 - I / SQRT2) * values[0];
-	v2 += (1.0 / SQRT2 - I / SQRT2) * values[1];
-
-	/*
-	 * Copy requested values to caller's vectors.
-	 */
-	if (detector1_vector != NULL)
-	    detector1_vector[i] = v1 / 4.0;
-	if (detector2_vector != NULL)
-	    detector2_vector[i] = v2 / 4.0;
+	_n2pkvna_error(vnap, "%s: warning: device reconnected; "
+		"resuming at point %u", vnap->vna_config.nci_basename,
+		pr.pr_point);
+    }
+    if (frequency_vector != NULL) {
+	(void)memcpy((void *)frequency_vector,
+		(void *)planp->pn_frequency_vector,
+		planp->pn_points * sizeof(double));
     }
 
     /*
@@ -288,7 +708,216 @@ int n2pkvna_scan(n2pkvna_t *vnap, double f0, double ff,
     (void)_n2pkvna_set_dds(vnap, false, 0.0, 0, 0, 0);
 
     return 0;
+}
 
-error:
-    return -1;
+/*
+ * n2pkvna_plan_execute: run a planned scan and collect detector voltages
+ *   @planp: plan from n2pkvna_plan_create
+ *   @frequency_vector: receives frequency vector if non-NULL
+ *   @detector1_vector: receives detector1 values if non-NULL
+ *   @detector2_vector: receives detector2 values if non-NULL
+ *
+ * Return:
+ *   0: success
+ *  -1: error (errno set)
+ */
+int n2pkvna_plan_execute(n2pkvna_plan_t *planp, double *frequency_vector,
+	double complex *detector1_vector, double complex *detector2_vector)
+{
+    n2pkvna_t *vnap = planp->pn_vnap;
+    int rc;
+
+    if (_n2pkvna_lock_idle(vnap, "n2pkvna_plan_execute") == -1) {
+	return -1;
+    }
+    rc = _n2pkvna_plan_run(planp, frequency_vector,
+	    detector1_vector, detector2_vector, NULL, NULL);
+    (void)pthread_mutex_unlock(&vnap->vna_mutex);
+    return rc;
+}
+
+/*
+ * n2pkvna_plan_execute_stream: run a planned scan, streaming each point
+ *   @planp: plan from n2pkvna_plan_create
+ *   @point_fn: called with each point as soon as it's demodulated;
+ *		returning non-zero stops the scan
+ *   @arg: argument passed through to point_fn
+ *
+ * Return:
+ *   1: stopped by point_fn
+ *   0: success
+ *  -1: error (errno set)
+ */
+int n2pkvna_plan_execute_stream(n2pkvna_plan_t *planp,
+	n2pkvna_point_fn_t *point_fn, void *arg)
+{
+    n2pkvna_t *vnap = planp->pn_vnap;
+    int rc;
+
+    if (_n2pkvna_lock_idle(vnap, "n2pkvna_plan_execute_stream") == -1) {
+	return -1;
+    }
+    rc = _n2pkvna_plan_run(planp, NULL, NULL, NULL, point_fn, arg);
+    (void)pthread_mutex_unlock(&vnap->vna_mutex);
+    return rc;
+}
+
+/*
+ * n2pkvna_plan_free: free a plan
+ *   @planp: plan from n2pkvna_plan_create, or NULL
+ */
+void n2pkvna_plan_free(n2pkvna_plan_t *planp)
+{
+    if (planp != NULL) {
+	free((void *)planp->pn_command_vector);
+	free((void *)planp->pn_point_vector);
+	free((void *)planp->pn_frequency_vector);
+	free((void *)planp);
+    }
+}
+
+/*
+ * n2pkvna_scan: run a frequency scan and collect detector voltages
+ *   @vnap: n2pkvna handle
+ *   @f0: starting frequency (Hz)
+ *   @ff: ending frequency (Hz)
+ *   @n: number of points in scan
+ *   @linear: true for linear spacing, false for logarithmic
+ *   @frequency: recevies frequency vector if non-NULL
+ *   @detector1: recevies detector1 values if non-NULL
+ *   @detector2: recevies detector2 values if non-NULL
+ *
+ * Return:
+ *   0: success
+ *  -1: error (errno set)
+ */
+int n2pkvna_scan(n2pkvna_t *vnap, double f0, double ff,
+	unsigned int n, bool linear,
+	double *frequency_vector,
+	double complex *detector1_vector,
+	double complex *detector2_vector)
+{
+    n2pkvna_plan_t *planp;
+    int rc;
+
+    if (_n2pkvna_lock_idle(vnap, "n2pkvna_scan") == -1) {
+	return -1;
+    }
+    if ((planp = plan_create(vnap, f0, ff, n, linear)) == NULL) {
+	(void)pthread_mutex_unlock(&vnap->vna_mutex);
+	return -1;
+    }
+    rc = _n2pkvna_plan_run(planp, frequency_vector,
+	    detector1_vector, detector2_vector, NULL, NULL);
+    (void)pthread_mutex_unlock(&vnap->vna_mutex);
+    n2pkvna_plan_free(planp);
+    return rc;
+}
+
+/*
+ * n2pkvna_scan_list: measure at each frequency of a list
+ *   @vnap: n2pkvna handle
+ *   @frequency_vector: frequencies to measure (Hz)
+ *   @n: number of frequencies
+ *   @actual_frequency_vector: receives frequencies generated if non-NULL
+ *   @detector1: receives detector1 values if non-NULL
+ *   @detector2: receives detector2 values if non-NULL
+ *
+ * Return:
+ *   0: success
+ *  -1: error (errno set)
+ */
+int n2pkvna_scan_list(n2pkvna_t *vnap, const double *frequency_vector,
+	unsigned int n, double *actual_frequency_vector,
+	double complex *detector1_vector,
+	double complex *detector2_vector)
+{
+    n2pkvna_plan_t *planp;
+    int rc;
+
+    if (_n2pkvna_lock_idle(vnap, "n2pkvna_scan_list") == -1) {
+	return -1;
+    }
+    if ((planp = plan_create_list(vnap, frequency_vector, n)) == NULL) {
+	(void)pthread_mutex_unlock(&vnap->vna_mutex);
+	return -1;
+    }
+    rc = _n2pkvna_plan_run(planp, actual_frequency_vector,
+	    detector1_vector, detector2_vector, NULL, NULL);
+    (void)pthread_mutex_unlock(&vnap->vna_mutex);
+    n2pkvna_plan_free(planp);
+    return rc;
+}
+
+/*
+ * n2pkvna_scan_segments: run a segmented frequency scan
+ *   @vnap: n2pkvna handle
+ *   @segment_vector: vector of scan segments
+ *   @segments: number of segments
+ *   @frequency: receives frequency vector if non-NULL
+ *   @detector1: receives detector1 values if non-NULL
+ *   @detector2: receives detector2 values if non-NULL
+ *
+ * The output vectors have one entry per point of all segments.
+ *
+ * Return:
+ *   0: success
+ *  -1: error (errno set)
+ */
+int n2pkvna_scan_segments(n2pkvna_t *vnap,
+	const n2pkvna_segment_t *segment_vector, int segments,
+	double *frequency_vector, double complex *detector1_vector,
+	double complex *detector2_vector)
+{
+    n2pkvna_plan_t *planp;
+    int rc;
+
+    if (_n2pkvna_lock_idle(vnap, "n2pkvna_scan_segments") == -1) {
+	return -1;
+    }
+    if ((planp = plan_create_segments(vnap, segment_vector,
+		    segments)) == NULL) {
+	(void)pthread_mutex_unlock(&vnap->vna_mutex);
+	return -1;
+    }
+    rc = _n2pkvna_plan_run(planp, frequency_vector,
+	    detector1_vector, detector2_vector, NULL, NULL);
+    (void)pthread_mutex_unlock(&vnap->vna_mutex);
+    n2pkvna_plan_free(planp);
+    return rc;
+}
+
+/*
+ * n2pkvna_scan_stream: run a frequency scan, streaming each point
+ *   @vnap: n2pkvna handle
+ *   @f0: starting frequency (Hz)
+ *   @ff: ending frequency (Hz)
+ *   @n: number of points in scan
+ *   @linear: true for linear spacing, false for logarithmic
+ *   @point_fn: called with each point as soon as it's demodulated;
+ *		returning non-zero stops the scan
+ *   @arg: argument passed through to point_fn
+ *
+ * Return:
+ *   1: stopped by point_fn
+ *   0: success
+ *  -1: error (errno set)
+ */
+int n2pkvna_scan_stream(n2pkvna_t *vnap, double f0, double ff,
+	unsigned int n, bool linear, n2pkvna_point_fn_t *point_fn, void *arg)
+{
+    n2pkvna_plan_t *planp;
+    int rc;
+
+    if (_n2pkvna_lock_idle(vnap, "n2pkvna_scan_stream") == -1) {
+	return -1;
+    }
+    if ((planp = plan_create(vnap, f0, ff, n, linear)) == NULL) {
+	(void)pthread_mutex_unlock(&vnap->vna_mutex);
+	return -1;
+    }
+    rc = _n2pkvna_plan_run(planp, NULL, NULL, NULL, point_fn, arg);
+    (void)pthread_mutex_unlock(&vnap->vna_mutex);
+    n2pkvna_plan_free(planp);
+    return rc;
 }
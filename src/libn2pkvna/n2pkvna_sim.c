@@ -0,0 +1,787 @@
+/*
+ * N2PK Vector Network Analyzer
+ * Copyright © 2021-2022 D Scott Guthridge <scott_guthridge@rompromity.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A11 PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "archdep.h"
+
+#include <arpa/inet.h>
+#include <complex.h>
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include <vnadata.h>
+
+#include "n2pkvna_internal.h"
+
+#define SIM_MAX_PENDING		(2 * MAX_QUEUE_DEPTH)	/* transfers */
+#define SIM_MAX_RESULTS		(2 * MAX_QUEUE_DEPTH)	/* conversions */
+#define SIM_REPLY_SIZE		13			/* status + 2 codes */
+#define SIM_Z0			50.0			/* ohms */
+
+/*
+ * sim_dut_type_t: kind of simulated device under test
+ */
+typedef enum sim_dut_type {
+    SIM_DUT_SERIES,			/* series RLC between the ports */
+    SIM_DUT_SHUNT,			/* shunt RLC across the ports */
+    SIM_DUT_TOUCHSTONE			/* S parameters from a file */
+} sim_dut_type_t;
+
+/*
+ * sim_result_t: a conversion queued in the simulated firmware
+ */
+typedef struct sim_result {
+    struct timespec		sr_when;	/* when the result is ready */
+    double			sr_values[2];	/* detector voltages */
+} sim_result_t;
+
+/*
+ * sim_pending_t: an asynchronous transfer in flight
+ */
+typedef struct sim_pending {
+    struct libusb_transfer     *sp_transfer;	/* submitted transfer */
+    struct timespec		sp_when;	/* when it completes */
+    bool			sp_cancelled;	/* cancel was requested */
+} sim_pending_t;
+
+/*
+ * sim_t: simulated N2PK VNA
+ */
+typedef struct sim {
+    /* model parameters from the simulator section of the config file */
+    double			sim_time_scale;	/* conversion time multiplier */
+    double			sim_usb_latency; /* per-transfer latency (s) */
+    double			sim_amplitude;	/* detector signal (V) */
+    double			sim_noise;	/* RMS detector noise (V) */
+    unsigned int		sim_seed;	/* noise generator state */
+    sim_dut_type_t		sim_dut;	/* kind of DUT */
+    double			sim_resistance;	/* ohms or 0 */
+    double			sim_inductance;	/* henries or 0 */
+    double			sim_capacitance; /* farads or 0 */
+    int				sim_frequencies; /* touchstone frequencies */
+    double		       *sim_frequency_vector; /* touchstone Hz */
+    double complex	       *sim_s_vector[4]; /* touchstone S11 S12 S21 S22 */
+    n2pkvna_replay_t	       *sim_replay;	/* recorded device or NULL */
+
+    /* firmware state */
+    uint8_t			sim_last_opcode; /* opcode of last command */
+    uint8_t			sim_osr_override; /* 0xFF for none */
+    double			sim_min_delay;	/* minimum delay (s) */
+    uint32_t			sim_lo_code;	/* LO frequency code */
+    uint32_t			sim_rf_code;	/* RF frequency code */
+    uint8_t			sim_phase_code;	/* LO phase code */
+    uint8_t			sim_switch;	/* switch value */
+    uint8_t			sim_attenuator;	/* attenuator value */
+    struct timespec		sim_busy_until;	/* end of last conversion */
+    sim_result_t		sim_result_vector[SIM_MAX_RESULTS];
+    int				sim_result_head; /* oldest result */
+    int				sim_result_count; /* queued results */
+
+    /* asynchronous transfers in submission order */
+    sim_pending_t		sim_pending_vector[SIM_MAX_PENDING];
+    int				sim_pending_count;
+} sim_t;
+
+/*
+ * sim_sleep_until: sleep until the given monotonic time
+ *   @when: time to wake
+ */
+static void sim_sleep_until(const struct timespec *when)
+{
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+		when, NULL) == EINTR) {
+	continue;
+    }
+}
+
+/*
+ * sim_gaussian: return a normally distributed random number
+ *   @simp: simulator state
+ */
+static double sim_gaussian(sim_t *simp)
+{
+    double u1, u2;
+
+    do {
+	u1 = (double)rand_r(&simp->sim_seed) / ((double)RAND_MAX + 1.0);
+    } while (u1 == 0.0);
+    u2 = (double)rand_r(&simp->sim_seed) / ((double)RAND_MAX + 1.0);
+    return sqrt(-2.0 * log(u1)) * cos(2.0 * M_PI * u2);
+}
+
+/*
+ * sim_s_parameters: find the DUT's S parameters at a frequency
+ *   @simp: simulator state
+ *   @frequency: frequency (Hz)
+ *   @s: returned S11, S12, S21, S22
+ */
+static void sim_s_parameters(const sim_t *simp, double frequency,
+	double complex *s)
+{
+    double complex s_omega = 2.0 * M_PI * frequency * I;
+
+    switch (simp->sim_dut) {
+    case SIM_DUT_SERIES:
+	{
+	    double complex z = simp->sim_resistance;
+
+	    z += s_omega * simp->sim_inductance;
+	    if (simp->sim_capacitance != 0.0 && frequency != 0.0) {
+		z += 1.0 / (s_omega * simp->sim_capacitance);
+	    }
+	    s[0] = s[3] = z / (z + 2.0 * SIM_Z0);
+	    s[1] = s[2] = 2.0 * SIM_Z0 / (z + 2.0 * SIM_Z0);
+	}
+	return;
+
+    case SIM_DUT_SHUNT:
+	{
+	    double complex y = s_omega * simp->sim_capacitance;
+
+	    if (simp->sim_resistance != 0.0) {
+		y += 1.0 / simp->sim_resistance;
+	    }
+	    if (simp->sim_inductance != 0.0 && frequency != 0.0) {
+		y += 1.0 / (s_omega * simp->sim_inductance);
+	    }
+	    s[0] = s[3] = -y * SIM_Z0 / (2.0 + y * SIM_Z0);
+	    s[1] = s[2] = 2.0 / (2.0 + y * SIM_Z0);
+	}
+	return;
+
+    case SIM_DUT_TOUCHSTONE:
+	{
+	    const double *fv = simp->sim_frequency_vector;
+	    int n = simp->sim_frequencies;
+	    int low = 0, high = n - 1;
+	    double t;
+
+	    /*
+	     * Interpolate linearly, holding the end values outside of
+	     * the file's frequency range.
+	     */
+	    if (n == 1 || frequency <= fv[0]) {
+		high = 0;
+	    } else if (frequency >= fv[n - 1]) {
+		low = n - 1;
+	    } else {
+		while (high - low > 1) {
+		    int mid = (low + high) / 2;
+
+		    if (fv[mid] <= frequency) {
+			low = mid;
+		    } else {
+			high = mid;
+		    }
+		}
+	    }
+	    t = high == low ? 0.0 :
+		(frequency - fv[low]) / (fv[high] - fv[low]);
+	    for (int i = 0; i < 4; ++i) {
+		const double complex *v = simp->sim_s_vector[i];
+
+		s[i] = (1.0 - t) * v[low] + t * v[high];
+	    }
+	}
+	return;
+    }
+}
+
+/*
+ * sim_encode_ltc2440: convert a voltage to a big-endian LTC2440 code
+ *   @value: voltage
+ *   @ucp: four byte buffer to receive the code
+ */
+static void sim_encode_ltc2440(double value, unsigned char *ucp)
+{
+    double scaled = rint(value / (LTC2440_REF / 2.0 / LTC2440_FULL));
+    uint32_t code;
+
+    if (scaled < -0x10000000) {
+	scaled = -0x10000000;
+    } else if (scaled > 0x10000000) {
+	scaled = 0x10000000;
+    }
+    code = (uint32_t)(0x20000000 + (int32_t)scaled);
+    *(uint32_t *)ucp = htonl(code);
+}
+
+/*
+ * sim_set_dds: run a set DDS command
+ *   @vnap: n2pkvna handle
+ *   @simp: simulator state
+ *   @command: DDS_COMMAND_SIZE byte command
+ *   @now: time the device received the command
+ *
+ * The detector outputs are modeled as the real part of the DUT's
+ * reflection (detector 1) and transmission (detector 2) against the
+ * LO phase, with the same sign conventions as the real hardware.
+ */
+static int sim_set_dds(n2pkvna_t *vnap, sim_t *simp,
+	const unsigned char *command, const struct timespec *now)
+{
+    double complex s[4], v1, v2, lo;
+    double frequency, delay;
+    uint8_t adc_mode;
+    sim_result_t *srp;
+
+    simp->sim_lo_code = ntohl(*(const uint32_t *)&command[6]);
+    simp->sim_rf_code = ntohl(*(const uint32_t *)&command[11]);
+    simp->sim_phase_code = command[5] >> 3;
+    if (command[3] == 0) {
+	return 0;
+    }
+    if (simp->sim_result_count == SIM_MAX_RESULTS) {
+	_n2pkvna_error(vnap, "%s: simulator: conversion queue overflow",
+		vnap->vna_config.nci_basename);
+	return LIBUSB_ERROR_OVERFLOW;
+    }
+
+    /*
+     * Conversions run one after another.
+     */
+    adc_mode = simp->sim_osr_override != 0xFF ?
+	simp->sim_osr_override : command[4];
+    delay = (double)command[2] * ((command[1] & 0x20) ? 8.0e-6 : 1.0e-3);
+    if (delay < simp->sim_min_delay) {
+	delay = simp->sim_min_delay;
+    }
+    if (_n2pkvna_timespec_cmp(&simp->sim_busy_until, now) < 0) {
+	simp->sim_busy_until = *now;
+    }
+    _n2pkvna_timespec_add(&simp->sim_busy_until, simp->sim_time_scale *
+	    (delay + _n2pkvna_conversion_time(adc_mode)));
+
+    /*
+     * Find the detector voltages.  Switch position 1 reverses the DUT.
+     */
+    frequency = _n2pkvna_code_to_frequency(
+	    vnap->vna_config.nci_reference_frequency, simp->sim_rf_code);
+    sim_s_parameters(simp, frequency, s);
+    if (simp->sim_switch & 1) {
+	v1 = s[3];
+	v2 = s[1];
+    } else {
+	v1 = s[0];
+	v2 = s[2];
+    }
+    if (simp->sim_rf_code == 0) {
+	v1 = 0.0;
+	v2 = 0.0;
+    }
+    lo = cexp(I * M_PI / 16.0 * simp->sim_phase_code);
+    srp = &simp->sim_result_vector[(simp->sim_result_head +
+	    simp->sim_result_count++) % SIM_MAX_RESULTS];
+    srp->sr_when = simp->sim_busy_until;
+    srp->sr_values[0] = -creal(simp->sim_amplitude * v1 * conj(lo));
+    srp->sr_values[1] =  creal(simp->sim_amplitude * v2 * conj(lo));
+    if (simp->sim_noise != 0.0) {
+	srp->sr_values[0] += simp->sim_noise * sim_gaussian(simp);
+	srp->sr_values[1] += simp->sim_noise * sim_gaussian(simp);
+    }
+    return 0;
+}
+
+/*
+ * sim_write: run the commands of an OUT transfer
+ *   @vnap: n2pkvna handle
+ *   @data: commands
+ *   @length: bytes in data
+ *
+ * Return:
+ *   0 or a negative LIBUSB_ERROR code
+ */
+static int sim_write(n2pkvna_t *vnap, const unsigned char *data, int length)
+{
+    sim_t *simp = vnap->vna_transport_state;
+    struct timespec now;
+    int offset = 0;
+
+    if (simp->sim_replay != NULL) {
+	return _n2pkvna_replay_write(vnap, simp->sim_replay, data, length,
+		simp->sim_time_scale);
+    }
+    (void)clock_gettime(CLOCK_MONOTONIC, &now);
+    while (offset < length) {
+	const unsigned char *command = &data[offset];
+	int size = _n2pkvna_command_size(command, length - offset);
+	int rv;
+
+	if (size <= 0) {
+	    _n2pkvna_error(vnap, "%s: simulator: %s 0x%02x command",
+		    vnap->vna_config.nci_basename,
+		    size == 0 ? "truncated" : "unknown", command[0]);
+	    return LIBUSB_ERROR_IO;
+	}
+	switch (command[0]) {
+	case 0x55:
+	    if (command[1] & 0x80) {		/* reset */
+		simp->sim_lo_code = 0;
+		simp->sim_rf_code = 0;
+		simp->sim_phase_code = 0;
+		simp->sim_result_count = 0;
+		simp->sim_busy_until = now;
+		break;
+	    }
+	    if ((rv = sim_set_dds(vnap, simp, command, &now)) < 0) {
+		return rv;
+	    }
+	    break;
+
+	case 0x5A:				/* raw */
+	    if (command[1] & 0x08) {
+		simp->sim_switch = command[6];
+	    }
+	    if (command[1] & 0x20) {
+		simp->sim_attenuator = command[4];
+	    }
+	    break;
+
+	case 0xA5:				/* configure */
+	    if (command[1] & 0x80) {
+		simp->sim_osr_override = command[2];
+	    }
+	    if (command[1] & 0x40) {
+		simp->sim_min_delay = (double)command[3] * 1.0e-6;
+	    }
+	    break;
+	}
+	simp->sim_last_opcode = command[0];
+	offset += size;
+    }
+    return 0;
+}
+
+/*
+ * sim_read: fill an IN transfer with status replies
+ *   @vnap: n2pkvna handle
+ *   @buffer: receive buffer
+ *   @length: size of buffer
+ *
+ * Returns one reply for each finished conversion that fits, or if
+ * none are ready, a reply with no values for the last command.
+ */
+static int sim_read(n2pkvna_t *vnap, unsigned char *buffer, int length)
+{
+    sim_t *simp = vnap->vna_transport_state;
+    struct timespec now;
+    int used = 0;
+
+    if (simp->sim_replay != NULL) {
+	return _n2pkvna_replay_read(vnap, simp->sim_replay, buffer, length);
+    }
+    (void)clock_gettime(CLOCK_MONOTONIC, &now);
+    while (simp->sim_result_count > 0 && length - used >= SIM_REPLY_SIZE) {
+	sim_result_t *srp = &simp->sim_result_vector[simp->sim_result_head];
+	unsigned char *reply = &buffer[used];
+
+	if (_n2pkvna_timespec_cmp(&srp->sr_when, &now) > 0) {
+	    break;
+	}
+	(void)memset((void *)reply, 0, 5);
+	reply[0] = 0x55;
+	reply[1] = 0x20;	/* values present */
+	reply[4] = 2;
+	sim_encode_ltc2440(srp->sr_values[0], &reply[5]);
+	sim_encode_ltc2440(srp->sr_values[1], &reply[9]);
+	simp->sim_result_head = (simp->sim_result_head + 1) % SIM_MAX_RESULTS;
+	--simp->sim_result_count;
+	used += SIM_REPLY_SIZE;
+    }
+    if (used == 0 && length >= 5) {
+	(void)memset((void *)buffer, 0, 5);
+	buffer[0] = simp->sim_last_opcode;
+	used = 5;
+    }
+    return used;
+}
+
+/*
+ * sim_transfer: perform the data phase of a transfer
+ *   @vnap: n2pkvna handle
+ *   @endpoint: WRITE_ENDPOINT or READ_ENDPOINT
+ *   @data: data to send or buffer to receive
+ *   @length: bytes to send or size of buffer
+ *   @transferred: returned number of bytes transferred
+ */
+static int sim_transfer(n2pkvna_t *vnap, unsigned char endpoint,
+	unsigned char *data, int length, int *transferred)
+{
+    int rv;
+
+    *transferred = 0;
+    switch (endpoint) {
+    case WRITE_ENDPOINT:
+	if ((rv = sim_write(vnap, data, length)) < 0) {
+	    return rv;
+	}
+	*transferred = length;
+	return 0;
+
+    case READ_ENDPOINT:
+	*transferred = sim_read(vnap, data, length);
+	return 0;
+
+    default:
+	return LIBUSB_ERROR_PIPE;
+    }
+}
+
+/*
+ * sim_bulk_transfer: perform a synchronous transfer with the simulator
+ *   @vnap: n2pkvna handle
+ *   @endpoint: WRITE_ENDPOINT or READ_ENDPOINT
+ *   @data: data to send or buffer to receive
+ *   @length: bytes to send or size of buffer
+ *   @transferred: returned number of bytes transferred
+ *   @timeout: timeout (ms), ignored
+ */
+static int sim_bulk_transfer(n2pkvna_t *vnap, unsigned char endpoint,
+	unsigned char *data, int length, int *transferred,
+	unsigned int timeout)
+{
+    sim_t *simp = vnap->vna_transport_state;
+
+    if (simp->sim_usb_latency > 0.0) {
+	struct timespec when;
+
+	(void)clock_gettime(CLOCK_MONOTONIC, &when);
+	_n2pkvna_timespec_add(&when, simp->sim_usb_latency);
+	sim_sleep_until(&when);
+    }
+    return sim_transfer(vnap, endpoint, data, length, transferred);
+}
+
+/*
+ * sim_submit_transfer: queue an asynchronous transfer
+ *   @vnap: n2pkvna handle
+ *   @transfer: filled transfer
+ */
+static int sim_submit_transfer(n2pkvna_t *vnap,
+	struct libusb_transfer *transfer)
+{
+    sim_t *simp = vnap->vna_transport_state;
+    sim_pending_t *spp;
+
+    if (simp->sim_pending_count == SIM_MAX_PENDING) {
+	return LIBUSB_ERROR_BUSY;
+    }
+    spp = &simp->sim_pending_vector[simp->sim_pending_count++];
+    spp->sp_transfer = transfer;
+    (void)clock_gettime(CLOCK_MONOTONIC, &spp->sp_when);
+    _n2pkvna_timespec_add(&spp->sp_when, simp->sim_usb_latency);
+    spp->sp_cancelled = false;
+    return 0;
+}
+
+/*
+ * sim_cancel_transfer: cancel an asynchronous transfer
+ *   @vnap: n2pkvna handle
+ *   @transfer: transfer in flight
+ */
+static int sim_cancel_transfer(n2pkvna_t *vnap,
+	struct libusb_transfer *transfer)
+{
+    sim_t *simp = vnap->vna_transport_state;
+
+    for (int i = 0; i < simp->sim_pending_count; ++i) {
+	sim_pending_t *spp = &simp->sim_pending_vector[i];
+
+	if (spp->sp_transfer == transfer) {
+	    spp->sp_cancelled = true;
+	    (void)clock_gettime(CLOCK_MONOTONIC, &spp->sp_when);
+	    return 0;
+	}
+    }
+    return LIBUSB_ERROR_NOT_FOUND;
+}
+
+/*
+ * sim_handle_events: complete asynchronous transfers that are due
+ *   @vnap: n2pkvna handle
+ *   @tv: maximum time to wait
+ *
+ * Sleeps until the first pending transfer completes or @tv passes,
+ * then completes every transfer that is due, in submission order.
+ */
+static int sim_handle_events(n2pkvna_t *vnap, struct timeval *tv)
+{
+    sim_t *simp = vnap->vna_transport_state;
+    struct timespec limit, now;
+    bool found = false;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &limit);
+    _n2pkvna_timespec_add(&limit, (double)tv->tv_sec +
+	    1.0e-6 * (double)tv->tv_usec);
+    for (int i = 0; i < simp->sim_pending_count; ++i) {
+	const sim_pending_t *spp = &simp->sim_pending_vector[i];
+
+	if (_n2pkvna_timespec_cmp(&spp->sp_when, &limit) < 0) {
+	    limit = spp->sp_when;
+	    found = true;
+	}
+    }
+    sim_sleep_until(&limit);
+    if (!found) {
+	return 0;
+    }
+    (void)clock_gettime(CLOCK_MONOTONIC, &now);
+    for (int i = 0; i < simp->sim_pending_count; /*EMPTY*/) {
+	sim_pending_t sp = simp->sim_pending_vector[i];
+	struct libusb_transfer *transfer = sp.sp_transfer;
+
+	if (_n2pkvna_timespec_cmp(&sp.sp_when, &now) > 0) {
+	    ++i;
+	    continue;
+	}
+	--simp->sim_pending_count;
+	(void)memmove((void *)&simp->sim_pending_vector[i],
+		(void *)&simp->sim_pending_vector[i + 1],
+		(simp->sim_pending_count - i) * sizeof(sim_pending_t));
+	if (sp.sp_cancelled) {
+	    transfer->status = LIBUSB_TRANSFER_CANCELLED;
+	    transfer->actual_length = 0;
+	} else if (sim_transfer(vnap, transfer->endpoint, transfer->buffer,
+		    transfer->length, &transfer->actual_length) < 0) {
+	    transfer->status = LIBUSB_TRANSFER_ERROR;
+	} else {
+	    transfer->status = LIBUSB_TRANSFER_COMPLETED;
+	}
+	(*transfer->callback)(transfer);
+    }
+    return 0;
+}
+
+/*
+ * sim_close: free the simulator
+ *   @vnap: n2pkvna handle
+ */
+static void sim_close(n2pkvna_t *vnap)
+{
+    sim_t *simp = vnap->vna_transport_state;
+
+    if (simp != NULL) {
+	for (int i = 0; i < 4; ++i) {
+	    free((void *)simp->sim_s_vector[i]);
+	}
+	free((void *)simp->sim_frequency_vector);
+	_n2pkvna_replay_free(simp->sim_replay);
+	free((void *)simp);
+	vnap->vna_transport_state = NULL;
+    }
+}
+
+/*
+ * sim_transport: transport for the simulated N2PK VNA
+ */
+static const n2pkvna_transport_t sim_transport = {
+    .nt_name		= "sim",
+    .nt_bulk_transfer	= sim_bulk_transfer,
+    .nt_submit_transfer	= sim_submit_transfer,
+    .nt_cancel_transfer	= sim_cancel_transfer,
+    .nt_handle_events	= sim_handle_events,
+    .nt_close		= sim_close,
+};
+
+/*
+ * sim_get_double: get an optional number from the simulator section
+ *   @vnap: n2pkvna handle
+ *   @key: key under simulator
+ *   @min: minimum allowed value
+ *   @max: maximum allowed value
+ *   @result: address of result, unchanged if the key is absent
+ */
+static int sim_get_double(n2pkvna_t *vnap, const char *key,
+	double min, double max, double *result)
+{
+    const char *string;
+    double value;
+    char c;
+
+    if ((string = vnaproperty_get(vnap->vna_property_root,
+		    "simulator.%s", key)) == NULL) {
+	return 0;
+    }
+    if (sscanf(string, "%lf %c", &value, &c) != 1 ||
+	    value < min || value > max) {
+	_n2pkvna_error(vnap, "%s: error: simulator.%s: \"%s\": value must "
+		"be a number in range %g .. %g",
+		vnap->vna_config.nci_basename, key, string, min, max);
+	errno = EINVAL;
+	return -1;
+    }
+    *result = value;
+    return 0;
+}
+
+/*
+ * sim_load_touchstone: load the DUT's S parameters from a file
+ *   @vnap: n2pkvna handle
+ *   @simp: simulator state
+ *   @filename: Touchstone file
+ */
+static int sim_load_touchstone(n2pkvna_t *vnap, sim_t *simp,
+	const char *filename)
+{
+    vnadata_t *vdp = NULL;
+    int ports, frequencies;
+    int rv = -1;
+
+    if ((vdp = vnadata_alloc(_n2pkvna_libvna_errfn, vnap)) == NULL) {
+	goto out;
+    }
+    if (vnadata_load(vdp, filename) == -1) {
+	goto out;
+    }
+    if (vnadata_convert(vdp, vdp, VPT_S) == -1) {
+	goto out;
+    }
+    ports = vnadata_get_rows(vdp);
+    frequencies = vnadata_get_frequencies(vdp);
+    if (ports < 1 || ports > 2 || vnadata_get_columns(vdp) != ports ||
+	    frequencies < 1) {
+	_n2pkvna_error(vnap, "%s: error: %s: expected 1 or 2 port S "
+		"parameters", vnap->vna_config.nci_basename, filename);
+	errno = EINVAL;
+	goto out;
+    }
+    if ((simp->sim_frequency_vector = calloc(frequencies,
+		    sizeof(double))) == NULL) {
+	_n2pkvna_error(vnap, "calloc: %s", strerror(errno));
+	goto out;
+    }
+    (void)memcpy((void *)simp->sim_frequency_vector,
+	    (const void *)vnadata_get_frequency_vector(vdp),
+	    frequencies * sizeof(double));
+    for (int i = 0; i < 4; ++i) {
+	int row = i / 2, column = i % 2;
+
+	if ((simp->sim_s_vector[i] = calloc(frequencies,
+			sizeof(double complex))) == NULL) {
+	    _n2pkvna_error(vnap, "calloc: %s", strerror(errno));
+	    goto out;
+	}
+
+	/*
+	 * A one port DUT reflects on both ports and passes nothing.
+	 */
+	if (ports == 1) {
+	    if (row == column) {
+		(void)vnadata_get_to_vector(vdp, 0, 0, simp->sim_s_vector[i]);
+	    }
+	    continue;
+	}
+	if (vnadata_get_to_vector(vdp, row, column,
+		    simp->sim_s_vector[i]) == -1) {
+	    goto out;
+	}
+    }
+    simp->sim_frequencies = frequencies;
+    rv = 0;
+
+out:
+    if (vdp != NULL) {
+	vnadata_free(vdp);
+    }
+    return rv;
+}
+
+/*
+ * _n2pkvna_sim_open: attach the simulated device transport
+ *   @vnap: n2pkvna handle
+ *
+ * Model parameters come from the optional simulator section of the
+ * config file:
+ *   timeScale:   multiplier on delay and conversion times (0 = instant)
+ *   usbLatency:  time for each bulk transfer to complete (s)
+ *   amplitude:   detector voltage for a full-scale signal (V)
+ *   noise:       RMS gaussian noise added to each detector (V)
+ *   seed:        noise generator seed
+ *   dut:         series, shunt or the name of a Touchstone file
+ *   resistance, inductance, capacitance: RLC values (0 = absent)
+ *   replay:      transcript from n2pkvna_record_start to play back
+ *		  in place of the DUT model
+ *
+ * A @replay_file from the unit address overrides the replay key.
+ */
+int _n2pkvna_sim_open(n2pkvna_t *vnap, const char *replay_file)
+{
+    sim_t *simp;
+    const char *dut;
+    double seed = 1.0;
+
+    if ((simp = calloc(1, sizeof(sim_t))) == NULL) {
+	_n2pkvna_error(vnap, "calloc: %s", strerror(errno));
+	return -1;
+    }
+    vnap->vna_transport = &sim_transport;
+    vnap->vna_transport_state = simp;
+    simp->sim_time_scale = 1.0;
+    simp->sim_usb_latency = 125e-6;
+    simp->sim_amplitude = 1.0;
+    simp->sim_dut = SIM_DUT_SERIES;
+    simp->sim_last_opcode = 0x55;
+    simp->sim_osr_override = 0xFF;
+    simp->sim_min_delay = MIN_DELAY;
+    if (sim_get_double(vnap, "timeScale", 0.0, 1.0e+3,
+		&simp->sim_time_scale) == -1 ||
+	sim_get_double(vnap, "usbLatency", 0.0, 1.0,
+		&simp->sim_usb_latency) == -1 ||
+	sim_get_double(vnap, "amplitude", 0.0, LTC2440_REF / 2.0,
+		&simp->sim_amplitude) == -1 ||
+	sim_get_double(vnap, "noise", 0.0, LTC2440_REF / 2.0,
+		&simp->sim_noise) == -1 ||
+	sim_get_double(vnap, "seed", 0.0, 4294967295.0, &seed) == -1 ||
+	sim_get_double(vnap, "resistance", 0.0, 1.0e+12,
+		&simp->sim_resistance) == -1 ||
+	sim_get_double(vnap, "inductance", 0.0, 1.0e+3,
+		&simp->sim_inductance) == -1 ||
+	sim_get_double(vnap, "capacitance", 0.0, 1.0e+3,
+		&simp->sim_capacitance) == -1) {
+	return -1;
+    }
+    simp->sim_seed = (unsigned int)seed;
+    if ((dut = vnaproperty_get(vnap->vna_property_root,
+		    "simulator.dut")) != NULL) {
+	if (strcmp(dut, "series") == 0) {
+	    simp->sim_dut = SIM_DUT_SERIES;
+	} else if (strcmp(dut, "shunt") == 0) {
+	    simp->sim_dut = SIM_DUT_SHUNT;
+	} else {
+	    simp->sim_dut = SIM_DUT_TOUCHSTONE;
+	    if (sim_load_touchstone(vnap, simp, dut) == -1) {
+		return -1;
+	    }
+	}
+    }
+    if (replay_file == NULL) {
+	replay_file = vnaproperty_get(vnap->vna_property_root,
+		"simulator.replay");
+    }
+    if (replay_file != NULL) {
+	if ((simp->sim_replay = _n2pkvna_replay_load(vnap,
+			replay_file)) == NULL) {
+	    return -1;
+	}
+    }
+    (void)clock_gettime(CLOCK_MONOTONIC, &simp->sim_busy_until);
+    return 0;
+}
@@ -0,0 +1,333 @@
+/*
+ * N2PK Vector Network Analyzer
+ * Copyright © 2021-2022 D Scott Guthridge <scott_guthridge@rompromity.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A11 PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "archdep.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "n2pkvna_internal.h"
+
+/*
+ * n2pkvna_sweep_t: background sweep state
+ *
+ * The acquisition thread scans into the back buffer, then swaps it
+ * with the front buffer under vna_sweep_mutex.  Readers copy out of the
+ * front buffer under the same mutex, so they never see a partial sweep
+ * and never wait for more than a copy.  The thread holds vna_mutex for
+ * the duration of each pass; calls that would use the device are
+ * refused by _n2pkvna_lock_idle rather than run between passes.
+ */
+typedef struct n2pkvna_sweep {
+    n2pkvna_plan_t	       *sw_planp;	/* plan to run */
+    pthread_t			sw_thread;	/* acquisition thread */
+    bool			sw_stop;	/* stop requested */
+    int				sw_errno;	/* error that ended the thread */
+    uint64_t			sw_sequence;	/* completed sweeps */
+    int				sw_front;	/* buffer with latest sweep */
+    double complex	       *sw_detector1[2]; /* detector 1 buffers */
+    double complex	       *sw_detector2[2]; /* detector 2 buffers */
+} n2pkvna_sweep_t;
+
+/*
+ * sweep_point: stop the sweep early if requested
+ *   @point: completed point (unused)
+ *   @arg: n2pkvna handle
+ */
+static int sweep_point(const n2pkvna_point_t *point, void *arg)
+{
+    n2pkvna_t *vnap = arg;
+    bool stop;
+
+    (void)pthread_mutex_lock(&vnap->vna_sweep_mutex);
+    stop = vnap->vna_sweep->sw_stop;
+    (void)pthread_mutex_unlock(&vnap->vna_sweep_mutex);
+    return stop;
+}
+
+/*
+ * sweep_thread: run the plan repeatedly, publishing each result
+ *   @arg: sweep state
+ */
+static void *sweep_thread(void *arg)
+{
+    n2pkvna_sweep_t *swp = arg;
+    n2pkvna_t *vnap = swp->sw_planp->pn_vnap;
+
+    for (;;) {
+	int back = 1 - swp->sw_front;	/* only this thread changes it */
+	int rv;
+
+	(void)pthread_mutex_lock(&vnap->vna_mutex);
+	rv = _n2pkvna_plan_run(swp->sw_planp, NULL,
+		swp->sw_detector1[back], swp->sw_detector2[back],
+		sweep_point, vnap);
+	(void)pthread_mutex_unlock(&vnap->vna_mutex);
+	(void)pthread_mutex_lock(&vnap->vna_sweep_mutex);
+	if (rv != 0) {
+	    if (rv == -1) {
+		swp->sw_errno = errno;
+	    }
+	    (void)pthread_mutex_unlock(&vnap->vna_sweep_mutex);
+	    break;
+	}
+	swp->sw_front = back;
+	++swp->sw_sequence;
+	if (swp->sw_stop) {
+	    (void)pthread_mutex_unlock(&vnap->vna_sweep_mutex);
+	    break;
+	}
+	(void)pthread_mutex_unlock(&vnap->vna_sweep_mutex);
+    }
+    return NULL;
+}
+
+/*
+ * sweep_free: free the sweep state
+ *   @swp: sweep state
+ */
+static void sweep_free(n2pkvna_sweep_t *swp)
+{
+    for (int i = 0; i < 2; ++i) {
+	free((void *)swp->sw_detector2[i]);
+	free((void *)swp->sw_detector1[i]);
+    }
+    free((void *)swp);
+}
+
+/*
+ * _n2pkvna_lock_idle: lock the handle unless a background sweep runs
+ *   @vnap: n2pkvna handle
+ *   @function: name of the public function for error messages
+ *
+ * Calls other than those that only read statistics or the sweep
+ * results are refused while a sweep runs.  Check first under
+ * vna_sweep_mutex so that the call fails without waiting for the pass
+ * in progress, then again under vna_mutex in case a sweep started in
+ * between.
+ *
+ * Return:
+ *   0: success, vna_mutex held
+ *  -1: error (errno set)
+ */
+int _n2pkvna_lock_idle(n2pkvna_t *vnap, const char *function)
+{
+    bool busy;
+
+    (void)pthread_mutex_lock(&vnap->vna_sweep_mutex);
+    busy = vnap->vna_sweep != NULL;
+    (void)pthread_mutex_unlock(&vnap->vna_sweep_mutex);
+    if (!busy) {
+	(void)pthread_mutex_lock(&vnap->vna_mutex);
+	if (vnap->vna_sweep == NULL) {
+	    return 0;
+	}
+	(void)pthread_mutex_unlock(&vnap->vna_mutex);
+    }
+    _n2pkvna_error(vnap, "%s: %s: background sweep is running",
+	    vnap->vna_config.nci_basename, function);
+    errno = EBUSY;
+    return -1;
+}
+
+/*
+ * sweep_start: start the background sweep holding the handle lock
+ *   @planp: plan from n2pkvna_plan_create
+ */
+static int sweep_start(n2pkvna_plan_t *planp)
+{
+    n2pkvna_t *vnap = planp->pn_vnap;
+    n2pkvna_sweep_t *swp;
+    int rv;
+
+    if ((swp = calloc(1, sizeof(n2pkvna_sweep_t))) == NULL) {
+	_n2pkvna_error(vnap, "calloc: %s", strerror(errno));
+	return -1;
+    }
+    swp->sw_planp = planp;
+    for (int i = 0; i < 2; ++i) {
+	if ((swp->sw_detector1[i] = calloc(planp->pn_points,
+			sizeof(double complex))) == NULL ||
+		(swp->sw_detector2[i] = calloc(planp->pn_points,
+			sizeof(double complex))) == NULL) {
+	    _n2pkvna_error(vnap, "calloc: %s", strerror(errno));
+	    sweep_free(swp);
+	    return -1;
+	}
+    }
+
+    /*
+     * Publish the sweep before starting the thread: the thread finds
+     * its stop flag through the handle, and can't begin a pass until
+     * we drop vna_mutex.
+     */
+    (void)pthread_mutex_lock(&vnap->vna_sweep_mutex);
+    vnap->vna_sweep = swp;
+    (void)pthread_mutex_unlock(&vnap->vna_sweep_mutex);
+    if ((rv = pthread_create(&swp->sw_thread, NULL, sweep_thread,
+		    swp)) != 0) {
+	_n2pkvna_error(vnap, "pthread_create: %s", strerror(rv));
+	(void)pthread_mutex_lock(&vnap->vna_sweep_mutex);
+	vnap->vna_sweep = NULL;
+	(void)pthread_mutex_unlock(&vnap->vna_sweep_mutex);
+	sweep_free(swp);
+	errno = rv;
+	return -1;
+    }
+    return 0;
+}
+
+/*
+ * n2pkvna_sweep_start: run a plan continuously on a background thread
+ *   @planp: plan from n2pkvna_plan_create
+ *
+ * Return:
+ *   0: success
+ *  -1: error (errno set)
+ */
+int n2pkvna_sweep_start(n2pkvna_plan_t *planp)
+{
+    n2pkvna_t *vnap = planp->pn_vnap;
+    int rv;
+
+    if (_n2pkvna_lock_idle(vnap, "n2pkvna_sweep_start") == -1) {
+	return -1;
+    }
+    rv = sweep_start(planp);
+    (void)pthread_mutex_unlock(&vnap->vna_mutex);
+    return rv;
+}
+
+/*
+ * n2pkvna_sweep_get_latest: copy out the most recent complete sweep
+ *   @vnap: n2pkvna handle
+ *   @sequence: receives the number of the sweep returned if non-NULL
+ *   @frequency_vector: receives frequency vector if non-NULL
+ *   @detector1_vector: receives detector1 values if non-NULL
+ *   @detector2_vector: receives detector2 values if non-NULL
+ *
+ * Sweeps are numbered from 1.  Callers can compare sequence numbers to
+ * tell whether a new sweep has completed since the last call.  This
+ * function takes only the sweep lock, so it never waits for a pass.
+ *
+ * Return:
+ *   0: success
+ *  -1: error (errno set); EAGAIN if no sweep has completed yet
+ */
+int n2pkvna_sweep_get_latest(n2pkvna_t *vnap, uint64_t *sequence,
+	double *frequency_vector, double complex *detector1_vector,
+	double complex *detector2_vector)
+{
+    n2pkvna_sweep_t *swp;
+    n2pkvna_plan_t *planp;
+    int rc = -1;
+
+    (void)pthread_mutex_lock(&vnap->vna_sweep_mutex);
+    if ((swp = vnap->vna_sweep) == NULL) {
+	_n2pkvna_error(vnap, "%s: n2pkvna_sweep_get_latest: "
+		"no background sweep is running",
+		vnap->vna_config.nci_basename);
+	errno = EINVAL;
+	goto out;
+    }
+    planp = swp->sw_planp;
+    if (swp->sw_errno != 0) {
+	errno = swp->sw_errno;
+	goto out;
+    }
+    if (swp->sw_sequence == 0) {
+	errno = EAGAIN;
+	goto out;
+    }
+    if (sequence != NULL) {
+	*sequence = swp->sw_sequence;
+    }
+    if (frequency_vector != NULL) {
+	(void)memcpy((void *)frequency_vector,
+		(void *)planp->pn_frequency_vector,
+		planp->pn_points * sizeof(double));
+    }
+    if (detector1_vector != NULL) {
+	(void)memcpy((void *)detector1_vector,
+		(void *)swp->sw_detector1[swp->sw_front],
+		planp->pn_points * sizeof(double complex));
+    }
+    if (detector2_vector != NULL) {
+	(void)memcpy((void *)detector2_vector,
+		(void *)swp->sw_detector2[swp->sw_front],
+		planp->pn_points * sizeof(double complex));
+    }
+    rc = 0;
+
+out:
+    (void)pthread_mutex_unlock(&vnap->vna_sweep_mutex);
+    return rc;
+}
+
+/*
+ * n2pkvna_sweep_stop: stop the background sweep
+ *   @vnap: n2pkvna handle
+ *
+ * Return:
+ *   0: success
+ *  -1: error (errno set); if the acquisition thread stopped on error,
+ *	errno is that error
+ */
+int n2pkvna_sweep_stop(n2pkvna_t *vnap)
+{
+    n2pkvna_sweep_t *swp;
+    int error;
+
+    /*
+     * Ask the thread to stop.  Don't take vna_mutex here: the thread
+     * holds it for a whole pass, and sweep_point is what lets the pass
+     * end early.
+     */
+    (void)pthread_mutex_lock(&vnap->vna_sweep_mutex);
+    if ((swp = vnap->vna_sweep) == NULL || swp->sw_stop) {
+	_n2pkvna_error(vnap, "%s: n2pkvna_sweep_stop: "
+		"no background sweep is running",
+		vnap->vna_config.nci_basename);
+	(void)pthread_mutex_unlock(&vnap->vna_sweep_mutex);
+	errno = EINVAL;
+	return -1;
+    }
+    swp->sw_stop = true;
+    (void)pthread_mutex_unlock(&vnap->vna_sweep_mutex);
+    (void)pthread_join(swp->sw_thread, NULL);
+
+    /*
+     * Detach the sweep and disable output in case the scan was
+     * interrupted.
+     */
+    (void)pthread_mutex_lock(&vnap->vna_mutex);
+    (void)pthread_mutex_lock(&vnap->vna_sweep_mutex);
+    vnap->vna_sweep = NULL;
+    (void)pthread_mutex_unlock(&vnap->vna_sweep_mutex);
+    (void)_n2pkvna_set_dds(vnap, false, 0.0, 0, 0, 0);
+    (void)pthread_mutex_unlock(&vnap->vna_mutex);
+    error = swp->sw_errno;
+    sweep_free(swp);
+    if (error != 0) {
+	errno = error;
+	return -1;
+    }
+    return 0;
+}
@@ -27,18 +27,16 @@
 #include "n2pkvna_internal.h"
 
 /*
- * n2pkvna_switch: change VNA switch settings
+ * _n2pkvna_set_switch: change VNA switch settings holding the handle lock
  *   @vnap: n2pkvna handle
  *   @switch_value: new switch setting [0..3], or -1 for no change
  *   @attentuator_value: new attenuator setting [0..7], or -1 for no change
  *   @delay: delay time in s for the new settings to settle
  *
- * Return:
- *   0: success
- *  -1: error (errno set)
+ * Remembers the settings so that _n2pkvna_reconnect can restore them.
  */
-int n2pkvna_switch(n2pkvna_t *vnap, int switch_value, int attenuator_value,
-	double delay)
+int _n2pkvna_set_switch(n2pkvna_t *vnap, int switch_value,
+	int attenuator_value, double delay)
 {
     unsigned char cmd[7];
     int transferred;
@@ -86,7 +84,7 @@ int n2pkvna_switch(n2pkvna_t *vnap, int switch_value, int attenuator_value,
 	cmd[1] |= 0x20;
 	cmd[4] = (unsigned char)attenuator_value;
     }
-    if ((rv = libusb_bulk_transfer(vnap->vna_udhp, WRITE_ENDPOINT, cmd, 7,
+    if ((rv = _n2pkvna_bulk_transfer(vnap, WRITE_ENDPOINT, cmd, 7,
 					&transferred, USB_TIMEOUT)) < 0) {
 	_n2pkvna_error(vnap,
 		"%s: n2pkvna_switch: libusb_bulk_transfer: %s",
@@ -104,6 +102,13 @@ int n2pkvna_switch(n2pkvna_t *vnap, int switch_value, int attenuator_value,
     if (_n2pkvna_read_status(vnap, 0x5A, 0, NULL)) {
 	return -1;
     }
+    if (switch_value >= 0) {
+	vnap->vna_switch = switch_value;
+    }
+    if (attenuator_value >= 0) {
+	vnap->vna_attenuator = attenuator_value;
+    }
+    vnap->vna_switch_delay = delay;
 
     /*
      * Delay.
@@ -117,6 +122,31 @@ int n2pkvna_switch(n2pkvna_t *vnap, int switch_value, int attenuator_value,
 	tv.tv_nsec = (long)floor(1.0e+9 * fractional);
 	while (nanosleep(&tv, &tv) == -1 && errno == EINTR)
 	    /*NULL*/;
+	vnap->vna_stats.ns_settle_time += delay;
     }
     return 0;
 }
+
+/*
+ * n2pkvna_switch: change VNA switch settings
+ *   @vnap: n2pkvna handle
+ *   @switch_value: new switch setting [0..3], or -1 for no change
+ *   @attentuator_value: new attenuator setting [0..7], or -1 for no change
+ *   @delay: delay time in s for the new settings to settle
+ *
+ * Return:
+ *   0: success
+ *  -1: error (errno set)
+ */
+int n2pkvna_switch(n2pkvna_t *vnap, int switch_value, int attenuator_value,
+	double delay)
+{
+    int rv;
+
+    if (_n2pkvna_lock_idle(vnap, "n2pkvna_switch") == -1) {
+	return -1;
+    }
+    rv = _n2pkvna_set_switch(vnap, switch_value, attenuator_value, delay);
+    (void)pthread_mutex_unlock(&vnap->vna_mutex);
+    return rv;
+}
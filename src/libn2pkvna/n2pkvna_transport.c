@@ -0,0 +1,363 @@
+/*
+ * N2PK Vector Network Analyzer
+ * Copyright © 2021-2022 D Scott Guthridge <scott_guthridge@rompromity.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A11 PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "archdep.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+
+#include "n2pkvna_internal.h"
+
+#define USB_MAX_PENDING		(2 * MAX_QUEUE_DEPTH)	/* transfers */
+
+/*
+ * usb_slot_t: asynchronous transfer submitted through libusb
+ */
+typedef struct usb_slot {
+    struct usb_state	       *us_state;	/* parent pointer */
+    struct libusb_transfer     *us_transfer;	/* transfer or NULL if free */
+    libusb_transfer_cb_fn	us_callback;	/* submitter's callback */
+    void		       *us_user_data;	/* submitter's user_data */
+    struct usb_slot	       *us_next;	/* next completed transfer */
+} usb_slot_t;
+
+/*
+ * usb_state_t: USB transport private data
+ *
+ * libusb completes transfers on the shared event thread.  The event
+ * thread only queues them here; usb_handle_events runs their callbacks
+ * on the thread that submitted them, so that the callbacks never race
+ * with the code that is waiting for them.
+ */
+typedef struct usb_state {
+    pthread_mutex_t		ust_mutex;	/* protects the queue */
+    pthread_cond_t		ust_cond;	/* signaled on completion */
+    usb_slot_t		       *ust_head;	/* completed transfers */
+    usb_slot_t		      **ust_tail;	/* end of completed list */
+    usb_slot_t			ust_slot_vector[USB_MAX_PENDING];
+} usb_state_t;
+
+/*
+ * usb_bulk_transfer: perform a synchronous bulk transfer through libusb
+ *   @vnap: n2pkvna handle
+ *   @endpoint: WRITE_ENDPOINT or READ_ENDPOINT
+ *   @data: data to send or buffer to receive
+ *   @length: bytes to send or size of buffer
+ *   @transferred: returned number of bytes transferred
+ *   @timeout: timeout (ms)
+ */
+static int usb_bulk_transfer(n2pkvna_t *vnap, unsigned char endpoint,
+	unsigned char *data, int length, int *transferred,
+	unsigned int timeout)
+{
+    return libusb_bulk_transfer(vnap->vna_udhp, endpoint, data, length,
+	    transferred, timeout);
+}
+
+/*
+ * usb_callback: queue a completed transfer for usb_handle_events
+ *   @transfer: completed transfer
+ *
+ * Called on the shared event thread.
+ */
+static void LIBUSB_CALL usb_callback(struct libusb_transfer *transfer)
+{
+    usb_slot_t *usp = transfer->user_data;
+    usb_state_t *ustp = usp->us_state;
+
+    (void)pthread_mutex_lock(&ustp->ust_mutex);
+    usp->us_next = NULL;
+    *ustp->ust_tail = usp;
+    ustp->ust_tail = &usp->us_next;
+    (void)pthread_cond_signal(&ustp->ust_cond);
+    (void)pthread_mutex_unlock(&ustp->ust_mutex);
+}
+
+/*
+ * usb_submit_transfer: submit an asynchronous transfer to libusb
+ *   @vnap: n2pkvna handle
+ *   @transfer: filled transfer
+ */
+static int usb_submit_transfer(n2pkvna_t *vnap,
+	struct libusb_transfer *transfer)
+{
+    usb_state_t *ustp = vnap->vna_transport_state;
+    usb_slot_t *usp = NULL;
+    int rv;
+
+    for (int i = 0; i < USB_MAX_PENDING; ++i) {
+	if (ustp->ust_slot_vector[i].us_transfer == NULL) {
+	    usp = &ustp->ust_slot_vector[i];
+	    break;
+	}
+    }
+    if (usp == NULL) {
+	return LIBUSB_ERROR_BUSY;
+    }
+    usp->us_state = ustp;
+    usp->us_transfer = transfer;
+    usp->us_callback = transfer->callback;
+    usp->us_user_data = transfer->user_data;
+    transfer->callback = usb_callback;
+    transfer->user_data = usp;
+    if ((rv = libusb_submit_transfer(transfer)) < 0) {
+	transfer->callback = usp->us_callback;
+	transfer->user_data = usp->us_user_data;
+	usp->us_transfer = NULL;
+    }
+    return rv;
+}
+
+/*
+ * usb_cancel_transfer: ask libusb to cancel an asynchronous transfer
+ *   @vnap: n2pkvna handle
+ *   @transfer: transfer in flight
+ */
+static int usb_cancel_transfer(n2pkvna_t *vnap,
+	struct libusb_transfer *transfer)
+{
+    return libusb_cancel_transfer(transfer);
+}
+
+/*
+ * usb_handle_events: run the callbacks of completed transfers
+ *   @vnap: n2pkvna handle
+ *   @tv: maximum time to wait for a transfer to complete
+ */
+static int usb_handle_events(n2pkvna_t *vnap, struct timeval *tv)
+{
+    usb_state_t *ustp = vnap->vna_transport_state;
+    struct timespec deadline;
+    usb_slot_t *list;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &deadline);
+    _n2pkvna_timespec_add(&deadline,
+	    (double)tv->tv_sec + (double)tv->tv_usec * 1.0e-6);
+    (void)pthread_mutex_lock(&ustp->ust_mutex);
+    while (ustp->ust_head == NULL) {
+	if (pthread_cond_timedwait(&ustp->ust_cond, &ustp->ust_mutex,
+		    &deadline) == ETIMEDOUT) {
+	    break;
+	}
+    }
+    list = ustp->ust_head;
+    ustp->ust_head = NULL;
+    ustp->ust_tail = &ustp->ust_head;
+    (void)pthread_mutex_unlock(&ustp->ust_mutex);
+    while (list != NULL) {
+	usb_slot_t *usp = list;
+	struct libusb_transfer *transfer = usp->us_transfer;
+
+	list = usp->us_next;
+	transfer->callback = usp->us_callback;
+	transfer->user_data = usp->us_user_data;
+	usp->us_transfer = NULL;
+	(*transfer->callback)(transfer);
+    }
+    return 0;
+}
+
+/*
+ * usb_close: close the libusb device handle
+ *   @vnap: n2pkvna handle
+ */
+static void usb_close(n2pkvna_t *vnap)
+{
+    usb_state_t *ustp = vnap->vna_transport_state;
+
+    if (vnap->vna_udhp != NULL) {
+	libusb_close(vnap->vna_udhp);
+	vnap->vna_udhp = NULL;
+    }
+    if (ustp != NULL) {
+	(void)pthread_cond_destroy(&ustp->ust_cond);
+	(void)pthread_mutex_destroy(&ustp->ust_mutex);
+	free((void *)ustp);
+	vnap->vna_transport_state = NULL;
+    }
+}
+
+/*
+ * usb_transport: transport for N2PK VNAs attached through libusb
+ */
+static const n2pkvna_transport_t usb_transport = {
+    .nt_name		= "usb",
+    .nt_bulk_transfer	= usb_bulk_transfer,
+    .nt_submit_transfer	= usb_submit_transfer,
+    .nt_cancel_transfer	= usb_cancel_transfer,
+    .nt_handle_events	= usb_handle_events,
+    .nt_close		= usb_close,
+};
+
+/*
+ * _n2pkvna_usb_open: open the USB device and attach the USB transport
+ *   @vnap: n2pkvna handle with vna_address set
+ *
+ * Return:
+ *   0: success
+ *  -1: error (errno set)
+ */
+int _n2pkvna_usb_open(n2pkvna_t *vnap)
+{
+    usb_state_t *ustp;
+    pthread_condattr_t attr;
+    int rv;
+
+    if ((ustp = calloc(1, sizeof(usb_state_t))) == NULL) {
+	_n2pkvna_error(vnap, "calloc: %s", strerror(errno));
+	return -1;
+    }
+    if ((rv = libusb_open(vnap->vna_address.adri_usb_devicep,
+		    &vnap->vna_udhp)) < 0) {
+	_n2pkvna_error(vnap, "%s: libusb_open: %s",
+	    vnap->vna_config.nci_basename, libusb_error_name(rv));
+	_n2pkvna_set_usb_errno(rv);
+	free((void *)ustp);
+	return -1;
+    }
+    (void)pthread_mutex_init(&ustp->ust_mutex, NULL);
+    (void)pthread_condattr_init(&attr);
+    (void)pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    (void)pthread_cond_init(&ustp->ust_cond, &attr);
+    (void)pthread_condattr_destroy(&attr);
+    ustp->ust_tail = &ustp->ust_head;
+    vnap->vna_transport = &usb_transport;
+    vnap->vna_transport_state = ustp;
+    return 0;
+}
+
+/*
+ * _n2pkvna_count_transfer: add a completed transfer to the statistics
+ *   @vnap: n2pkvna handle
+ *   @endpoint: WRITE_ENDPOINT or READ_ENDPOINT
+ *   @transferred: number of bytes transferred
+ *   @elapsed: time from start to completion (s)
+ */
+void _n2pkvna_count_transfer(n2pkvna_t *vnap, unsigned char endpoint,
+	int transferred, double elapsed)
+{
+    n2pkvna_stats_t *nsp = &vnap->vna_stats;
+    double microseconds = elapsed * 1.0e+6;
+    int bucket = 0;
+
+    ++nsp->ns_transfers;
+    if (transferred > 0) {
+	if (endpoint == READ_ENDPOINT) {
+	    nsp->ns_bytes_in += transferred;
+	} else {
+	    nsp->ns_bytes_out += transferred;
+	}
+    }
+    nsp->ns_transfer_time += elapsed;
+    while (microseconds >= 2.0 && bucket < N2PKVNA_STATS_BUCKETS - 1) {
+	microseconds /= 2.0;
+	++bucket;
+    }
+    ++nsp->ns_transfer_histogram[bucket];
+}
+
+/*
+ * _n2pkvna_bulk_transfer: perform a synchronous bulk transfer
+ *   @vnap: n2pkvna handle
+ *   @endpoint: WRITE_ENDPOINT or READ_ENDPOINT
+ *   @data: data to send or buffer to receive
+ *   @length: bytes to send or size of buffer
+ *   @transferred: returned number of bytes transferred
+ *   @timeout: timeout (ms)
+ *
+ * Return:
+ *   0 or a negative LIBUSB_ERROR code
+ */
+int _n2pkvna_bulk_transfer(n2pkvna_t *vnap, unsigned char endpoint,
+	unsigned char *data, int length, int *transferred,
+	unsigned int timeout)
+{
+    struct timespec start, end;
+    int rv;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &start);
+    if (vnap->vna_recorder != NULL) {
+	rv = _n2pkvna_record_bulk_transfer(vnap, endpoint, data, length,
+		transferred, timeout);
+    } else {
+	rv = (*vnap->vna_transport->nt_bulk_transfer)(vnap, endpoint,
+		data, length, transferred, timeout);
+    }
+    (void)clock_gettime(CLOCK_MONOTONIC, &end);
+    if (rv < 0) {
+	++vnap->vna_stats.ns_transfer_errors;
+    } else {
+	_n2pkvna_count_transfer(vnap, endpoint, *transferred,
+		_n2pkvna_timespec_diff(&end, &start));
+    }
+    return rv;
+}
+
+/*
+ * _n2pkvna_submit_transfer: submit an asynchronous transfer
+ *   @vnap: n2pkvna handle
+ *   @transfer: transfer filled by libusb_fill_bulk_transfer
+ *
+ * The transfer's callback is invoked from _n2pkvna_handle_events.
+ * The callback must count the transfer with _n2pkvna_count_transfer.
+ */
+int _n2pkvna_submit_transfer(n2pkvna_t *vnap,
+	struct libusb_transfer *transfer)
+{
+    if (vnap->vna_recorder != NULL) {
+	return _n2pkvna_record_submit_transfer(vnap, transfer);
+    }
+    return (*vnap->vna_transport->nt_submit_transfer)(vnap, transfer);
+}
+
+/*
+ * _n2pkvna_cancel_transfer: cancel an asynchronous transfer
+ *   @vnap: n2pkvna handle
+ *   @transfer: transfer in flight
+ *
+ * The callback is still invoked, with LIBUSB_TRANSFER_CANCELLED status.
+ */
+int _n2pkvna_cancel_transfer(n2pkvna_t *vnap,
+	struct libusb_transfer *transfer)
+{
+    if (vnap->vna_recorder != NULL) {
+	return _n2pkvna_record_cancel_transfer(vnap, transfer);
+    }
+    return (*vnap->vna_transport->nt_cancel_transfer)(vnap, transfer);
+}
+
+/*
+ * _n2pkvna_handle_events: complete asynchronous transfers
+ *   @vnap: n2pkvna handle
+ *   @tv: maximum time to wait for a transfer to complete
+ */
+int _n2pkvna_handle_events(n2pkvna_t *vnap, struct timeval *tv)
+{
+    struct timespec start, end;
+    int rv;
+
+    (void)clock_gettime(CLOCK_MONOTONIC, &start);
+    rv = (*vnap->vna_transport->nt_handle_events)(vnap, tv);
+    (void)clock_gettime(CLOCK_MONOTONIC, &end);
+    vnap->vna_stats.ns_event_time += _n2pkvna_timespec_diff(&end, &start);
+    return rv;
+}
@@ -38,8 +38,10 @@
 #include "measurement.h"
 #include "message.h"
 #include "n2pkvna.h"
+#include "parallel.h"
 #include "properties.h"
 #include "setup.h"
+#include "stats.h"
 #include "switch.h"
 
 /*
@@ -56,23 +58,28 @@ global_state_t gs = {
     .gs_command		= NULL,
     .gs_need_ack	= false,
     .gs_setups		= NULL,
-    .gs_mstep		= NULL
+    .gs_mstep		= NULL,
+    .gs_jobs		= 0
 };
 
 /*
  * global options
  */
 char *progname;
-static const char short_options[] = "+a:hN:U:Y";
+static const char short_options[] = "+a:hj:N:R:U:WY";
 static const struct option long_options[] = {
     { "attenuation",		1, NULL, 'a' },
     { "help",			0, NULL, 'h' },
+    { "jobs",			1, NULL, 'j' },
     { "name",			1, NULL, 'N' },
+    { "record",			1, NULL, 'R' },
     { "unit",		        1, NULL, 'U' },
+    { "warm",			0, NULL, 'W' },
     { NULL,			0, NULL,  0  }
 };
 static const char *const usage[] = {
-    "[-a attenuation] [-N name] [-U unit] [command command-options...]",
+    "[-a attenuation] [-j jobs] [-N name] [-R transcript] [-U unit] [-W]",
+    "    [command command-options...]",
     "-h",
     NULL
 };
@@ -80,11 +87,16 @@ static const char *const help[] = {
     "Options",
     " -a|--attenuation=attenuation  set the attentuation in dB",
     " -h|--help                     print this help message",
+    " -j|--jobs=jobs                threads for post-processing, 0 for one",
+    "                               per CPU",
     " -N|--name=name                select the VNA configuration directory",
+    " -R|--record=transcript        record all device I/O to a file",
     " -U|--unit=unit-address        select the VNA device by USB address",
+    " -W|--warm                     skip the reset if the VNA is still in sync",
     " where:",
     "    attenuation is: 0, 10, 20, 30, 40, 50, 60 or 70",
-    "    unit-address is: vendor:product | bus.device | bus/port",
+    "    unit-address is: vendor:product | bus.device | bus/port | sim |",
+    "        replay:transcript",
     "",
     "Commands",
     "  a|attenuate attenuation_dB",
@@ -112,6 +124,9 @@ static const char *const help[] = {
     "",
     "  setup [command [args...]]        set up the VNA",
     "",
+    "  stats [-r]",
+    "    Show scan and USB transfer statistics.",
+    "",
     "  sw|switch [0-3]",
     "    Manually set the VNA switches.",
     "",
@@ -176,8 +191,11 @@ static int print_help(int argc, char **argv)
 /*
  * open_device: open an n2pkvna device
  *   @create: create the config file if it doesn't already exist
+ *   @record: file to record device I/O to, or NULL
+ *   @warm: skip the reset if the device was left idle and in sync
  */
-static n2pkvna_t *open_device(const char *device, const char *unit, bool create)
+static n2pkvna_t *open_device(const char *device, const char *unit,
+	bool create, const char *record, bool warm)
 {
     n2pkvna_t *vnap;
     n2pkvna_config_t **config_vector = NULL;
@@ -185,7 +203,15 @@ static n2pkvna_t *open_device(const char *device, const char *unit, bool create)
     if ((vnap = n2pkvna_open(device, create, unit, &config_vector,
 		    print_error, NULL)) != NULL) {
 	n2pkvna_free_config_vector(config_vector);
-	if (n2pkvna_reset(vnap) == -1) {
+	if (record != NULL && n2pkvna_record_start(vnap, record) == -1) {
+	    n2pkvna_close(vnap);
+	    return NULL;
+	}
+	if (n2pkvna_set_reconnect(vnap, RECONNECT_TIMEOUT) == -1) {
+	    n2pkvna_close(vnap);
+	    return NULL;
+	}
+	if ((warm ? n2pkvna_reset_warm(vnap) : n2pkvna_reset(vnap)) == -1) {
 	    n2pkvna_close(vnap);
 	    return NULL;
 	}
@@ -211,15 +237,20 @@ static n2pkvna_t *open_device(const char *device, const char *unit, bool create)
 	    for (size_t s = 0; s < ncp->nc_count; ++s) {
 		n2pkvna_address_t *adrp = ncp->nc_addresses[s];
 
-		assert(adrp->adr_type == N2PKVNA_ADR_USB);
+		assert(adrp->adr_type == N2PKVNA_ADR_USB ||
+			adrp->adr_type == N2PKVNA_ADR_SIM);
 		assert(multiple_configs || ncp->nc_count > 1);
 		(void)fprintf(stderr, "%s:  ", progname);
 		if (multiple_configs) {
 		    (void)fprintf(stderr, " -c %s", config_name);
 		}
 		if (ncp->nc_count > 1) {
-		    (void)fprintf(stderr, " -u %d.%d",
-			    adrp->adr_usb_bus, adrp->adr_usb_device);
+		    if (adrp->adr_type == N2PKVNA_ADR_SIM) {
+			(void)fprintf(stderr, " -u sim");
+		    } else {
+			(void)fprintf(stderr, " -u %d.%d",
+				adrp->adr_usb_bus, adrp->adr_usb_device);
+		    }
 		}
 		(void)fprintf(stderr, "\n");
 	    }
@@ -255,6 +286,23 @@ int parse_attenuation(const char *arg)
     return -1;
 }
 
+/*
+ * parse_jobs: parse and validate the number of worker threads
+ *   @arg: jobs string
+ */
+static int parse_jobs(const char *arg)
+{
+    char *end;
+    long int li;
+
+    li = strtol(arg, &end, 10);
+    if (end > arg && *end == '\000' && li >= 0 && li <= MAX_JOBS) {
+	return (int)li;
+    }
+    message_error("jobs value must be 0 to %d\n", MAX_JOBS);
+    return -1;
+}
+
 /*
  * main_commands: main command table
  *   Must be sorted in LANG=C order.
@@ -274,6 +322,7 @@ static command_t main_commands[] = {
     { "m",		measure_main	},
     { "measure",	measure_main	},
     { "setup",		setup_main	},
+    { "stats",		stats_main	},
     { "sw",		switch_main	},
     { "switch",		switch_main	},
 };
@@ -285,8 +334,11 @@ static command_t main_commands[] = {
 int main(int argc, char **argv)
 {
     int   opt_a = -1;
+    int   opt_j = -1;
     char *opt_N = NULL;
+    char *opt_R = NULL;
     char *opt_U = NULL;
+    bool  opt_W = false;
 
     /*
      * Parse options.
@@ -311,14 +363,28 @@ int main(int argc, char **argv)
 	    print_usage(usage, help);
 	    exit(0);
 
+	case 'j':
+	    if ((opt_j = parse_jobs(optarg)) == -1) {
+		exit(N2PKVNA_EXIT_USAGE);
+	    }
+	    continue;
+
 	case 'N':
 	    opt_N = optarg;
 	    continue;
 
+	case 'R':
+	    opt_R = optarg;
+	    continue;
+
 	case 'U':
 	    opt_U = optarg;
 	    continue;
 
+	case 'W':
+	    opt_W = true;
+	    continue;
+
 	case 'Y':
 	    gs.gs_opt_Y = true;
 	    continue;
@@ -335,7 +401,7 @@ int main(int argc, char **argv)
     /*
      * Open the VNA
      */
-    if ((gs.gs_vnap = open_device(opt_N, opt_U, true)) == NULL) {
+    if ((gs.gs_vnap = open_device(opt_N, opt_U, true, opt_R, opt_W)) == NULL) {
 	exit(N2PKVNA_EXIT_VNAOP);
     }
 
@@ -346,6 +412,9 @@ int main(int argc, char **argv)
 	gs.gs_exitcode = N2PKVNA_EXIT_ERROR;
 	goto out;
     }
+    if (opt_j >= 0) {
+	gs.gs_jobs = opt_j;
+    }
 
     /*
      * If -Y, include device configuration information in the open
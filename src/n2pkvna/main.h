@@ -26,6 +26,7 @@
 #include "measurement.h"
 
 #define SWITCH_DELAY	0.1		/* switch delay, seconds */
+#define RECONNECT_TIMEOUT 30.0	/* wait for a lost device, seconds */
 
 /*
  * Exit Codes
@@ -53,6 +54,7 @@ typedef struct global_state {
     bool		gs_need_ack;	/* need acknowledgement from user */
     setup_t	       *gs_setups;	/* configured measurement setup list */
     mstep_t	       *gs_mstep;	/* measurement step name (or NULL) */
+    int			gs_jobs;	/* worker threads, 0 for one per CPU */
 } global_state_t;
 
 
@@ -36,6 +36,7 @@
 #include "measure.h"
 #include "measurement.h"
 #include "message.h"
+#include "parallel.h"
 #include "properties.h"
 
 /*
@@ -100,6 +101,375 @@ static const char *const help[] = {
     NULL
 };
 
+/*
+ * average_range: average symmetric measurements over a frequency range
+ *   @arg: 2x2 B matrix
+ *   @chunk: (unused)
+ *   @start: first frequency index
+ *   @end: one past the last frequency index
+ */
+static void average_range(void *arg, int chunk, int start, int end)
+{
+    double complex **m = (double complex **)arg;
+
+    for (int findex = start; findex < end; ++findex) {
+	m[0][findex] += m[3][findex];
+	m[0][findex] /= 2.0;
+	m[3][findex] =  m[0][findex];
+	m[1][findex] += m[2][findex];
+	m[1][findex] /= 2.0;
+	m[2][findex] =  m[1][findex];
+    }
+}
+
+/*
+ * apply_chunk_t: one piece of a calibration applied in parallel
+ */
+typedef struct apply_chunk {
+    vnadata_t		       *ac_vdp;		/* result for this piece */
+    int				ac_start;	/* first frequency index */
+    int				ac_end;		/* one past last index */
+    int				ac_rc;		/* vnacal_apply return */
+} apply_chunk_t;
+
+/*
+ * apply_args_t: arguments to apply_calibration passed to apply_range
+ */
+typedef struct apply_args {
+    const vnacal_t	       *aa_vcp;
+    int				aa_calset;
+    const double	       *aa_frequency_vector;
+    double complex *const      *aa_a_matrix;
+    int				aa_a_rows;
+    int				aa_a_columns;
+    double complex *const      *aa_b_matrix;
+    int				aa_b_rows;
+    int				aa_b_columns;
+    apply_chunk_t	       *aa_chunks;
+} apply_args_t;
+
+/*
+ * apply_range: apply the calibration over a frequency range
+ *   @arg: apply_args_t structure
+ *   @chunk: index into aa_chunks
+ *   @start: first frequency index
+ *   @end: one past the last frequency index
+ */
+static void apply_range(void *arg, int chunk, int start, int end)
+{
+    const apply_args_t *aap = (apply_args_t *)arg;
+    apply_chunk_t *acp = &aap->aa_chunks[chunk];
+    double complex *a_matrix[4] = { NULL, NULL, NULL, NULL };
+    double complex *b_matrix[4] = { NULL, NULL, NULL, NULL };
+
+    if (aap->aa_a_matrix != NULL) {
+	for (int i = 0; i < aap->aa_a_rows * aap->aa_a_columns; ++i) {
+	    a_matrix[i] = &aap->aa_a_matrix[i][start];
+	}
+    }
+    for (int i = 0; i < aap->aa_b_rows * aap->aa_b_columns; ++i) {
+	b_matrix[i] = &aap->aa_b_matrix[i][start];
+    }
+    acp->ac_start = start;
+    acp->ac_end   = end;
+    acp->ac_rc = vnacal_apply(aap->aa_vcp, aap->aa_calset,
+	    &aap->aa_frequency_vector[start], end - start,
+	    aap->aa_a_matrix != NULL ? a_matrix : NULL,
+	    aap->aa_a_rows, aap->aa_a_columns,
+	    b_matrix, aap->aa_b_rows, aap->aa_b_columns, acp->ac_vdp);
+}
+
+/*
+ * gather_chunk: copy one piece of an applied calibration into the output
+ *   @vdp: output data
+ *   @frequencies: total number of frequencies
+ *   @acp: piece to copy
+ *
+ * The piece starting at frequency zero sizes the output and sets its
+ * reference impedances, so it must be gathered first.
+ */
+static int gather_chunk(vnadata_t *vdp, int frequencies,
+	const apply_chunk_t *acp)
+{
+    const double *frequency_vector;
+    int rows, columns;
+
+    rows    = vnadata_get_rows(acp->ac_vdp);
+    columns = vnadata_get_columns(acp->ac_vdp);
+    if (acp->ac_start == 0) {
+	if (vnadata_init(vdp, VPT_S, rows, columns, frequencies) == -1) {
+	    return -1;
+	}
+	if (vnadata_set_z0_vector(vdp,
+		    vnadata_get_z0_vector(acp->ac_vdp)) == -1) {
+	    return -1;
+	}
+    }
+    frequency_vector = vnadata_get_frequency_vector(acp->ac_vdp);
+    for (int findex = acp->ac_start; findex < acp->ac_end; ++findex) {
+	(void)vnadata_set_frequency(vdp, findex,
+		frequency_vector[findex - acp->ac_start]);
+	for (int row = 0; row < rows; ++row) {
+	    for (int column = 0; column < columns; ++column) {
+		(void)vnadata_set_cell(vdp, findex, row, column,
+			vnadata_get_cell(acp->ac_vdp,
+			    findex - acp->ac_start, row, column));
+	    }
+	}
+    }
+    return 0;
+}
+
+/*
+ * apply_calibration: vnacal_apply split across worker threads
+ *   @vcp: calibration structure
+ *   @calset: calibration index
+ *   @frequency_vector: measured frequencies
+ *   @frequencies: number of frequencies
+ *   @a_matrix: A matrix or NULL
+ *   @a_rows: rows in A
+ *   @a_columns: columns in A
+ *   @b_matrix: B matrix
+ *   @b_rows: rows in B
+ *   @b_columns: columns in B
+ *   @vdp: output data
+ *
+ * The calibration is interpolated and applied independently at each
+ * frequency, so applying it piecewise into separate vnadata_t
+ * structures and gathering the results gives the same values as a
+ * single call.
+ */
+static int apply_calibration(const vnacal_t *vcp, int calset,
+	const double *frequency_vector, int frequencies,
+	double complex *const *a_matrix, int a_rows, int a_columns,
+	double complex *const *b_matrix, int b_rows, int b_columns,
+	vnadata_t *vdp)
+{
+    const int chunks = parallel_chunks(frequencies);
+    apply_chunk_t chunk_vector[chunks];
+    apply_args_t aa;
+    int rc = -1;
+
+    if (chunks == 1) {
+	return vnacal_apply(vcp, calset, frequency_vector, frequencies,
+		a_matrix, a_rows, a_columns, b_matrix, b_rows, b_columns,
+		vdp);
+    }
+    (void)memset((void *)chunk_vector, 0, sizeof(chunk_vector));
+    for (int i = 0; i < chunks; ++i) {
+	if ((chunk_vector[i].ac_vdp = vnadata_alloc(&print_libvna_error,
+			NULL)) == NULL) {
+	    message_error("vnadata_alloc: %s\n", strerror(errno));
+	    goto out;
+	}
+    }
+    aa.aa_vcp		   = vcp;
+    aa.aa_calset	   = calset;
+    aa.aa_frequency_vector = frequency_vector;
+    aa.aa_a_matrix	   = a_matrix;
+    aa.aa_a_rows	   = a_rows;
+    aa.aa_a_columns	   = a_columns;
+    aa.aa_b_matrix	   = b_matrix;
+    aa.aa_b_rows	   = b_rows;
+    aa.aa_b_columns	   = b_columns;
+    aa.aa_chunks	   = chunk_vector;
+    parallel_run(frequencies, apply_range, (void *)&aa);
+    for (int i = 0; i < chunks; ++i) {
+	if (chunk_vector[i].ac_rc == -1) {
+	    goto out;
+	}
+    }
+
+    /*
+     * Gather the pieces.
+     */
+    for (int i = 0; i < chunks; ++i) {
+	if (gather_chunk(vdp, frequencies, &chunk_vector[i]) == -1) {
+	    goto out;
+	}
+    }
+    rc = 0;
+
+out:
+    for (int i = 0; i < chunks; ++i) {
+	vnadata_free(chunk_vector[i].ac_vdp);
+    }
+    return rc;
+}
+
+/*
+ * measure_stream_t: state for applying the calibration as results arrive
+ */
+typedef struct measure_stream {
+    const vnacal_t	       *mst_vcp;	/* calibration */
+    int				mst_calset;	/* calibration index */
+    bool			mst_colsys;	/* uses column systems */
+    bool			mst_opt_y;	/* DUT is symmetric */
+    int				mst_frequencies; /* frequencies in sweep */
+    vnadata_t		       *mst_vdp;	/* output data */
+    apply_chunk_t		mst_chunk;	/* piece being applied */
+    bool			mst_started;	/* matrices set up */
+    bool			mst_average;	/* average diagonally */
+    double complex	       *mst_a_matrix[2][2];
+    double complex	       *mst_b_matrix[2][2];
+    double complex	      **mst_app;	/* A matrix or NULL */
+    int				mst_a_rows;
+    int				mst_a_columns;
+    int				mst_b_rows;
+    int				mst_b_columns;
+} measure_stream_t;
+
+/*
+ * stream_matrices: set up the A and B matrices for vnacal_apply
+ *   @mstp: measure stream structure
+ *   @mrp: measurement result
+ */
+static void stream_matrices(measure_stream_t *mstp,
+	const measurement_result_t *mrp)
+{
+    /*
+     * Handle the A matrix if it exists.
+     */
+    if (mrp->mr_a_matrix != NULL) {
+	/*
+	 * If the calibration type uses column systems, then the
+	 * measured A matrix should already be a row vector; use
+	 * it as-is.
+	 */
+	if (mstp->mst_colsys) {
+	    assert(mrp->mr_a_rows == 1);
+	    mstp->mst_app       = mrp->mr_a_matrix;
+	    mstp->mst_a_rows    = mrp->mr_a_rows;
+	    mstp->mst_a_columns = mrp->mr_a_columns;
+
+	} else {
+	    /*
+	     * Get the square A matrix.
+	     */
+	    mstp->mst_app = &mstp->mst_a_matrix[0][0];
+	    if (mrp->mr_a_rows == 2 && mrp->mr_a_columns == 2) {
+#if 0
+		/*
+		 * ZZ: TODO: If symmetrical, multiply B * A^-1
+		 * here then set app to NULL and fall into the code
+		 * below to average the resulting B's diagonally,
+		 * using the apply_m API below.  For now, ignore
+		 * symmetric if we're using A-B.
+		 */
+		if (mstp->mst_opt_y) {
+		}
+#endif
+		mstp->mst_app       = mrp->mr_a_matrix;
+		mstp->mst_a_rows    = 2;
+		mstp->mst_a_columns = 2;
+
+	    } else if ((mrp->mr_a_rows == 1 && mrp->mr_a_columns == 2) ||
+		       (mrp->mr_a_rows == 2 && mrp->mr_a_columns == 1)) {
+		mstp->mst_a_matrix[0][0] = mstp->mst_a_matrix[1][1] =
+		    mrp->mr_a_matrix[0];
+		mstp->mst_a_matrix[0][1] = mstp->mst_a_matrix[1][0] =
+		    mrp->mr_a_matrix[1];
+		mstp->mst_a_rows    = 2;
+		mstp->mst_a_columns = 2;
+
+	    } else if (mrp->mr_a_rows == 1 && mrp->mr_a_columns == 1) {
+		mstp->mst_a_matrix[0][0] = mrp->mr_a_matrix[0];
+		mstp->mst_a_rows    = 1;
+		mstp->mst_a_columns = 1;
+
+	    } else {
+		abort();
+	    }
+	}
+    }
+
+    /*
+     * Get the square B matrix.
+     */
+    if (mrp->mr_b_rows == 2 && mrp->mr_b_columns == 2) {
+	/*
+	 * If symmetrical and no A matrix, average the measurements
+	 * diagonally.
+	 */
+	mstp->mst_average = mstp->mst_opt_y && mstp->mst_app == NULL;
+	mstp->mst_b_matrix[0][0] = mrp->mr_b_matrix[0];
+	mstp->mst_b_matrix[0][1] = mrp->mr_b_matrix[1];
+	mstp->mst_b_matrix[1][0] = mrp->mr_b_matrix[2];
+	mstp->mst_b_matrix[1][1] = mrp->mr_b_matrix[3];
+	mstp->mst_b_rows    = 2;
+	mstp->mst_b_columns = 2;
+
+    } else if ((mrp->mr_b_rows == 2 && mrp->mr_b_columns == 1) ||
+	       (mrp->mr_b_rows == 1 && mrp->mr_b_columns == 2)) {
+	mstp->mst_b_matrix[0][0] = mstp->mst_b_matrix[1][1] =
+	    mrp->mr_b_matrix[0];
+	mstp->mst_b_matrix[0][1] = mstp->mst_b_matrix[1][0] =
+	    mrp->mr_b_matrix[1];
+	mstp->mst_b_rows    = 2;
+	mstp->mst_b_columns = 2;
+
+    } else if (mrp->mr_b_rows == 1 && mrp->mr_b_columns == 1) {
+	mstp->mst_b_matrix[0][0] = mrp->mr_b_matrix[0];
+	mstp->mst_b_rows    = 1;
+	mstp->mst_b_columns = 1;
+
+    } else {
+	abort();
+    }
+}
+
+/*
+ * stream_chunk: apply the calibration to a range of measured results
+ *   @mrp: measurement result
+ *   @start: first frequency index
+ *   @end: one past the last frequency index
+ *   @arg: measure stream structure
+ *
+ * Called from make_measurements as the last scan comes in, so that
+ * applying the calibration overlaps the scan.  If all frequencies come
+ * at once, apply them with apply_calibration instead.
+ */
+static int stream_chunk(const measurement_result_t *mrp, int start, int end,
+	void *arg)
+{
+    measure_stream_t *mstp = (measure_stream_t *)arg;
+    apply_args_t aa;
+
+    if (!mstp->mst_started) {
+	stream_matrices(mstp, mrp);
+	mstp->mst_started = true;
+    }
+    if (start == 0 && end == mstp->mst_frequencies) {
+	if (mstp->mst_average) {
+	    parallel_run(end, average_range, (void *)mrp->mr_b_matrix);
+	}
+	return apply_calibration(mstp->mst_vcp, mstp->mst_calset,
+		mrp->mr_frequency_vector, end,
+		mstp->mst_app, mstp->mst_a_rows, mstp->mst_a_columns,
+		&mstp->mst_b_matrix[0][0],
+		mstp->mst_b_rows, mstp->mst_b_columns, mstp->mst_vdp);
+    }
+    if (mstp->mst_average) {
+	average_range((void *)mrp->mr_b_matrix, 0, start, end);
+    }
+    aa.aa_vcp		   = mstp->mst_vcp;
+    aa.aa_calset	   = mstp->mst_calset;
+    aa.aa_frequency_vector = mrp->mr_frequency_vector;
+    aa.aa_a_matrix	   = mstp->mst_app;
+    aa.aa_a_rows	   = mstp->mst_a_rows;
+    aa.aa_a_columns	   = mstp->mst_a_columns;
+    aa.aa_b_matrix	   = &mstp->mst_b_matrix[0][0];
+    aa.aa_b_rows	   = mstp->mst_b_rows;
+    aa.aa_b_columns	   = mstp->mst_b_columns;
+    aa.aa_chunks	   = &mstp->mst_chunk;
+    apply_range((void *)&aa, 0, start, end);
+    if (mstp->mst_chunk.ac_rc == -1) {
+	return -1;
+    }
+    return gather_chunk(mstp->mst_vdp, mstp->mst_frequencies,
+	    &mstp->mst_chunk);
+}
+
 /*
  * measure_main
  */
@@ -393,125 +763,36 @@ int measure_main(int argc, char **argv)
      */
     gs.gs_need_ack = opt_P;
     if (c_rows == c_columns || opt_y) {
-	double complex *a_matrix[2][2] = {{ NULL, NULL }, { NULL, NULL }};
-	double complex *b_matrix[2][2] = {{ NULL, NULL }, { NULL, NULL }};
-	double complex **app = NULL;
-	int a_rows = 0, a_columns = 0;
-	int b_rows = 0, b_columns = 0;
+	measure_stream_t mst;
 	measurement_result_t mr;
-
-	if (make_measurements(&ma, &mr) == -1) {
-	    goto out;
-	}
-	assert(mr.mr_b_rows    == c_rows);
-	assert(mr.mr_b_columns == c_columns);
+	int rv;
 
 	/*
-	 * Handle the A matrix if it exists.
+	 * Apply the calibration as the results come in.
 	 */
-	if (mr.mr_a_matrix != NULL) {
-	    /*
-	     * If the calibration type uses column systems, then the
-	     * measured A matrix should already be a row vector; use
-	     * it as-is.
-	     */
-	    if (ma.ma_colsys) {
-		assert(mr.mr_a_rows == 1);
-		app       = mr.mr_a_matrix;
-		a_rows    = mr.mr_a_rows;
-		a_columns = mr.mr_a_columns;
-
-	    } else {
-		/*
-		 * Get the square A matrix.
-		 */
-		app = &a_matrix[0][0];
-		if (mr.mr_a_rows == 2 && mr.mr_a_columns == 2) {
-#if 0
-		    /*
-		     * ZZ: TODO: If symmetrical, multiply B * A^-1
-		     * here then set app to NULL and fall into the code
-		     * below to average the resulting B's diagonally,
-		     * using the apply_m API below.  For now, ignore
-		     * symmetric if we're using A-B.
-		     */
-		    if (opt_y) {
-		    }
-#endif
-		    app = mr.mr_a_matrix;
-		    a_rows    = 2;
-		    a_columns = 2;
-
-		} else if ((mr.mr_a_rows == 1 && mr.mr_a_columns == 2) ||
-			   (mr.mr_a_rows == 2 && mr.mr_a_columns == 1)) {
-		    a_matrix[0][0] = a_matrix[1][1] = mr.mr_a_matrix[0];
-		    a_matrix[0][1] = a_matrix[1][0] = mr.mr_a_matrix[1];
-		    a_rows    = 2;
-		    a_columns = 2;
-
-		} else if (mr.mr_a_rows == 1 && mr.mr_a_columns == 1) {
-		    a_matrix[0][0] = mr.mr_a_matrix[0];
-		    a_rows    = 1;
-		    a_columns = 1;
-
-		} else {
-		    abort();
-		}
-	    }
-	}
-
-	/*
-	 * Get the square B matrix.
-	 */
-	if (mr.mr_b_rows == 2 && mr.mr_b_columns == 2) {
-	    /*
-	     * If symmetrical and no A matrix, average the measurements
-	     * diagonally.
-	     */
-	    if (opt_y && app == NULL) {
-		for (int findex = 0; findex < opt_n; ++findex) {
-		    double complex **m = mr.mr_b_matrix;
-
-		    m[0][findex] += m[3][findex];
-		    m[0][findex] /= 2.0;
-		    m[3][findex] =  m[0][findex];
-		    m[1][findex] += m[2][findex];
-		    m[1][findex] /= 2.0;
-		    m[2][findex] =  m[1][findex];
-		}
-	    }
-	    b_matrix[0][0] = mr.mr_b_matrix[0];
-	    b_matrix[0][1] = mr.mr_b_matrix[1];
-	    b_matrix[1][0] = mr.mr_b_matrix[2];
-	    b_matrix[1][1] = mr.mr_b_matrix[3];
-	    b_rows    = 2;
-	    b_columns = 2;
-
-	} else if ((mr.mr_b_rows == 2 && mr.mr_b_columns == 1) ||
-		   (mr.mr_b_rows == 1 && mr.mr_b_columns == 2)) {
-	    b_matrix[0][0] = b_matrix[1][1] = mr.mr_b_matrix[0];
-	    b_matrix[0][1] = b_matrix[1][0] = mr.mr_b_matrix[1];
-	    b_rows    = 2;
-	    b_columns = 2;
-
-	} else if (mr.mr_b_rows == 1 && mr.mr_b_columns == 1) {
-	    b_matrix[0][0] = mr.mr_b_matrix[0];
-	    b_rows    = 1;
-	    b_columns = 1;
-
-	} else {
-	    abort();
+	(void)memset((void *)&mst, 0, sizeof(mst));
+	mst.mst_vcp		= vcp;
+	mst.mst_calset		= calset;
+	mst.mst_colsys		= ma.ma_colsys;
+	mst.mst_opt_y		= opt_y;
+	mst.mst_frequencies	= opt_n;
+	mst.mst_vdp		= vdp;
+	if ((mst.mst_chunk.ac_vdp = vnadata_alloc(&print_libvna_error,
+			NULL)) == NULL) {
+	    message_error("vnadata_alloc: %s\n", strerror(errno));
+	    goto out;
 	}
-
-	/*
-	 * Apply the calibration.
-	 */
-	if (vnacal_apply(vcp, calset, mr.mr_frequency_vector, opt_n,
-		    app, a_rows, a_columns,
-		    &b_matrix[0][0], b_rows, b_columns,
-		    vdp) == -1) {
+	ma.ma_chunk_fn	= stream_chunk;
+	ma.ma_chunk_arg	= (void *)&mst;
+	rv = make_measurements(&ma, &mr);
+	ma.ma_chunk_fn	= NULL;
+	ma.ma_chunk_arg	= NULL;
+	vnadata_free(mst.mst_chunk.ac_vdp);
+	if (rv == -1) {
 	    goto out;
 	}
+	assert(mr.mr_b_rows    == c_rows);
+	assert(mr.mr_b_columns == c_columns);
 	measurement_result_free(&mr);
 
     } else {
@@ -604,16 +885,16 @@ int measure_main(int argc, char **argv)
 	    b_matrix[1][0] = mr2.mr_b_matrix[1];
 	    b_matrix[1][1] = mr2.mr_b_matrix[0];
 	}
-	if (vnacal_apply(vcp, calset,
+	if (apply_calibration(vcp, calset,
 		    mr1.mr_frequency_vector, opt_n,
 		    app, a_rows, a_columns,
 		    &b_matrix[0][0], 2, 2, vdp) == -1) {
 	    measurement_result_free(&mr1);
-	    measurement_result_free(&mr1);
+	    measurement_result_free(&mr2);
 	    goto out;
 	}
 	measurement_result_free(&mr1);
-	measurement_result_free(&mr1);
+	measurement_result_free(&mr2);
     }
 
     /*
@@ -22,8 +22,11 @@
 #include <errno.h>
 #include <getopt.h>
 #include <limits.h>
+#include <math.h>
 #include <n2pkvna.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -35,6 +38,7 @@
 #include "main.h"
 #include "measure.h"
 #include "message.h"
+#include "parallel.h"
 
 //TODO: Make the vnacommon_* functions officially public so we don't have
 //      to do use this clandestine method.
@@ -59,16 +63,101 @@ typedef struct measurement_cell {
     measurement_mask_t		mc_mask;
     int				mc_count;
     measurement_vector_t       *mc_vectors;
+    int				mc_n;		/* V/I unknowns, or 0 if a/b */
+    double complex	       *mc_p;		/* factored V/I system */
+    double complex	       *mc_a_vector;	/* a result or NULL */
+    double complex	       *mc_b_vector;	/* b result */
+    int				mc_a_count;	/* a measurements to average */
+    int				mc_b_count;	/* b measurements to average */
 } measurement_cell_t;
 
 /*
  * measurement_matrix_t: collection of all measurement vectors
+ *
+ * Everything a measurement needs, the frequency vector, the measured
+ * and result vectors, the cells, list nodes, factored V/I systems and
+ * result matrices, lives
+ * in a single arena allocation sized up front from the setup.  The
+ * result matrices point into the arena, which passes to the
+ * measurement_result_t on success.
  */
 typedef struct measurement_matrix {
     measurement_cell_t	       *mm_matrix;
     const measurement_args_t   *mm_map;
+    char		       *mm_arena;	/* single backing allocation */
+    double		       *mm_frequency_vector; /* in arena */
+    double complex	       *mm_vectors;	/* next free vector */
+    int				mm_vector_count; /* free vectors left */
+    measurement_vector_t       *mm_nodes;	/* next free list node */
+    int				mm_node_count;	/* free nodes left */
+    double complex	       *mm_coefficients; /* next free V/I matrix */
+    double complex	      **mm_a_matrix;	/* result pointer arrays */
+    double complex	      **mm_b_matrix;
 } measurement_matrix_t;
 
+/*
+ * ARENA_ALIGN: round an arena offset up to suit any object type
+ */
+#define ARENA_ALIGN(offset) \
+    (((offset) + _Alignof(max_align_t) - 1) & ~(_Alignof(max_align_t) - 1))
+
+/*
+ * schedule_entry_t: best way to finish measuring from one state
+ */
+typedef struct schedule_entry {
+    size_t			se_key;		/* schedule_key or 0 if free */
+    uint16_t			se_cost;	/* step and switch cost to finish */
+    uint16_t			se_scans;	/* scans to finish */
+    uint16_t			se_next;	/* index of next measurement */
+} schedule_entry_t;
+
+/*
+ * schedule_t: optimal measurement order for a setup and dimensions
+ *
+ * Before each scan, the state is the mask of vectors still needed,
+ * the current manual step and the current switch setting.  For each
+ * state, sc_table holds the least cost to finish, counting 2 for each
+ * change of manual step and 1 for each change of switch, with ties
+ * broken by fewest scans, and the measurement to make next.  Only the
+ * states actually reached are stored, in an open-addressed hash table
+ * that grows as entries are added, and the table is kept on the setup
+ * for later measurements.
+ */
+typedef struct schedule {
+    measurement_mask_t		sc_needed;	/* vectors to measure */
+    int				sc_measurement_count;
+    measurement_t	      **sc_measurements; /* useful measurements */
+    int			       *sc_mstep_states; /* mstep state of each */
+    int				sc_mstep_count;	/* named msteps */
+    mstep_t		      **sc_msteps;	/* named msteps */
+    schedule_entry_t	       *sc_table;	/* hash of solved states */
+    size_t			sc_table_size;	/* slots, a power of 2 */
+    size_t			sc_table_used;	/* occupied slots */
+} schedule_t;
+
+/*
+ * Schedule manual step states: no step yet, a step from another
+ * setup, or SCHEDULE_MSTEP_NAMED plus the index into sc_msteps.
+ */
+#define SCHEDULE_MSTEP_NONE	0
+#define SCHEDULE_MSTEP_OTHER	1
+#define SCHEDULE_MSTEP_NAMED	2
+
+/*
+ * SCHEDULE_SWITCHES: switch states: unknown (-1) and 0-3
+ */
+#define SCHEDULE_SWITCHES	5
+
+/*
+ * SCHEDULE_UNKNOWN: cost greater than that of any real schedule
+ */
+#define SCHEDULE_UNKNOWN	UINT16_MAX
+
+/*
+ * SCHEDULE_TABLE_SIZE: initial number of slots in sc_table
+ */
+#define SCHEDULE_TABLE_SIZE	64
+
 /*
  * vector_names: table of measurement names in enum order
  */
@@ -109,7 +198,6 @@ measurement_t default_RB_measurement = {
     .m_switch = -1,
     .m_detectors = { VC_B11, VC_B21 },
     .m_mask = DEFAULT_RB_MASK,
-    .m_used = false,
     .m_mstep = &default_RB_mstep,
     .m_next = NULL
 };
@@ -139,6 +227,7 @@ setup_t default_RB_setup = {
     .su_fosc = 0.0,
     .su_steps = &default_RB_mstep,
     .su_mask = DEFAULT_RB_MASK,
+    .su_schedules = { NULL, NULL, NULL, NULL },
     .su_next = NULL
 };
 
@@ -216,21 +305,65 @@ vector_code_t vector_name_to_code(const char *name)
  * measurement_matrix_init: init the measurmenet_matrix_t structure
  *   @mmp: measurement matrix structure
  *   @map: measurement argument structure
+ *   @vectors: most vectors the scans can measure
+ *
+ * Besides the measured vectors, reserve an a and b result vector
+ * for each cell, and room to factor a V/I system of up to two
+ * unknowns for each measured vector.
  */
 static int measurement_matrix_init(measurement_matrix_t *mmp,
-	const measurement_args_t *map)
+	const measurement_args_t *map, int vectors)
 {
+    const int cells = map->ma_rows * map->ma_columns;
+    const int results = 2 * cells;
+    size_t vector_size = map->ma_frequencies * sizeof(double complex);
+    size_t frequency_offset, matrix_offset, node_offset;
+    size_t coefficient_offset, a_offset, b_offset, size;
+
     (void)memset((void *)mmp, 0, sizeof(*mmp));
-    if ((mmp->mm_matrix = calloc(map->ma_rows * map->ma_columns,
-		    sizeof(measurement_matrix_t))) == NULL) {
+    frequency_offset = ARENA_ALIGN((vectors + results) * vector_size);
+    matrix_offset = ARENA_ALIGN(frequency_offset +
+	    map->ma_frequencies * sizeof(double));
+    node_offset = ARENA_ALIGN(matrix_offset +
+	    cells * sizeof(measurement_cell_t));
+    coefficient_offset = ARENA_ALIGN(node_offset +
+	    vectors * sizeof(measurement_vector_t));
+    a_offset = ARENA_ALIGN(coefficient_offset +
+	    2 * vectors * sizeof(double complex));
+    b_offset = a_offset + cells * sizeof(double complex *);
+    size = b_offset + cells * sizeof(double complex *);
+    if ((mmp->mm_arena = calloc(1, size)) == NULL) {
 	(void)fprintf(stderr, "%s: calloc: %s\n",
 		progname, strerror(errno));
 	exit(N2PKVNA_EXIT_SYSTEM);
     }
     mmp->mm_map = map;
+    mmp->mm_vectors = (double complex *)mmp->mm_arena;
+    mmp->mm_vector_count = vectors + results;
+    mmp->mm_frequency_vector = (double *)&mmp->mm_arena[frequency_offset];
+    mmp->mm_matrix = (measurement_cell_t *)&mmp->mm_arena[matrix_offset];
+    mmp->mm_nodes = (measurement_vector_t *)&mmp->mm_arena[node_offset];
+    mmp->mm_node_count = vectors;
+    mmp->mm_coefficients = (double complex *)&mmp->mm_arena[coefficient_offset];
+    mmp->mm_a_matrix = (double complex **)&mmp->mm_arena[a_offset];
+    mmp->mm_b_matrix = (double complex **)&mmp->mm_arena[b_offset];
     return 0;
 }
 
+/*
+ * measurement_matrix_vector: take the next vector from the arena
+ *   @mmp: measurement matrix structure
+ */
+static double complex *measurement_matrix_vector(measurement_matrix_t *mmp)
+{
+    double complex *vector = mmp->mm_vectors;
+
+    assert(mmp->mm_vector_count > 0);
+    mmp->mm_vectors += mmp->mm_map->ma_frequencies;
+    --mmp->mm_vector_count;
+    return vector;
+}
+
 /*
  * measurement_matrix_add: add new vectors to the measurement matrix
  *   @mmp:     measurement matrix structure
@@ -260,12 +393,9 @@ static int measurement_matrix_add(measurement_matrix_t *mmp,
 	}
 	mask = VC_MASK(code);
 	mcp = &mmp->mm_matrix[map->ma_columns * m_row + m_column];
-	if ((mvp = malloc(sizeof(measurement_vector_t))) == NULL) {
-	    (void)fprintf(stderr, "%s: malloc: %s\n",
-		    progname, strerror(errno));
-	    exit(N2PKVNA_EXIT_SYSTEM);
-	}
-	(void)memset((void *)mvp, 0, sizeof(*mvp));
+	assert(mmp->mm_node_count > 0);
+	mvp = mmp->mm_nodes++;
+	--mmp->mm_node_count;
 	mvp->mv_code = code;
 	mvp->mv_vector = vectors[i];
 	vectors[i] = NULL;
@@ -282,11 +412,221 @@ static int measurement_matrix_add(measurement_matrix_t *mmp,
 }
 
 /*
- * measurement_matrix_solve: create the measurement result matrix
+ * cell_factor: factor the coefficient matrix of a V/I cell
+ *   @map: measurement arguments
+ *   @mcp: measurement cell
+ *   @row: row of the cell
+ *   @column: column of the cell
+ *   @n: 2 to solve for a and b, or 1 to solve for b alone
+ *   @p: n x mc_count matrix receiving the (pseudo-)inverse
+ *
+ * Row i of the coefficient matrix gives the a and b coefficients of
+ * the i'th vector in mc_vectors.
+ */
+static int cell_factor(const measurement_args_t *map,
+	const measurement_cell_t *mcp, int row, int column, int n,
+	double complex *p)
+{
+    const int m = mcp->mc_count;
+    double complex a[m][n];
+    double complex identity[m][m];
+    double K = 1.0 / sqrt(cabs(creal(map->ma_z0)));
+    double complex KV1 = conj(map->ma_z0) / (K * creal(map->ma_z0));
+    double complex KV2 =      map->ma_z0  / (K * creal(map->ma_z0));
+    double complex KI1 =  1.0             / (K * creal(map->ma_z0));
+    double complex KI2 = -1.0             / (K * creal(map->ma_z0));
+    int i = 0;
+
+    assert(m >= n);
+    for (const measurement_vector_t *mvp = mcp->mc_vectors; mvp != NULL;
+	    mvp = mvp->mv_next, ++i) {
+	double complex coefficients[2];
+
+	switch (VC_TO_11(mvp->mv_code, row, column)) {
+	case VC_A11:
+	    coefficients[0] = 1.0;
+	    coefficients[1] = 0.0;
+	    break;
+	case VC_B11:
+	    coefficients[0] = 0.0;
+	    coefficients[1] = 1.0;
+	    break;
+	case VC_V11:
+	    coefficients[0] = KV1;
+	    coefficients[1] = KV2;
+	    break;
+	case VC_I11:
+	    coefficients[0] = KI1;
+	    coefficients[1] = KI2;
+	    break;
+	default:
+	    abort();
+	}
+	for (int j = 0; j < n; ++j) {
+	    a[i][j] = coefficients[2 - n + j];
+	}
+	for (int k = 0; k < m; ++k) {
+	    identity[i][k] = i == k ? 1.0 : 0.0;
+	}
+    }
+
+    /*
+     * Solve A P = I.  If A is square, P is its inverse; otherwise, P
+     * is the least-squares pseudo-inverse.
+     */
+    if (m == n) {
+	if (_vnacommon_mldivide(p, &a[0][0], &identity[0][0], m, m) == 0.0) {
+	    (void)fprintf(stderr, "%s: singular matrix\n", progname);
+	    return -1;
+	}
+    } else {
+	if (_vnacommon_qrsolve(p, &a[0][0], &identity[0][0], m, n, m) < n) {
+	    (void)fprintf(stderr, "%s: singular matrix\n", progname);
+	    return -1;
+	}
+    }
+    return 0;
+}
+
+/*
+ * cell_apply: apply a factored V/I cell to a range of frequencies
+ *   @mcp: measurement cell
+ *   @x_vectors: mc_n vectors receiving the solution at each frequency
+ *   @start: first frequency index
+ *   @end: one past the last frequency index
+ */
+static void cell_apply(const measurement_cell_t *mcp,
+	double complex *const *x_vectors, int start, int end)
+{
+    const int m = mcp->mc_count;
+    const int n = mcp->mc_n;
+    int i = 0;
+
+    for (const measurement_vector_t *mvp = mcp->mc_vectors; mvp != NULL;
+	    mvp = mvp->mv_next, ++i) {
+	const double complex *v = mvp->mv_vector;
+
+	for (int j = 0; j < n; ++j) {
+	    const double complex pji = mcp->mc_p[j * m + i];
+	    double complex *x = x_vectors[j];
+
+	    if (i == 0) {
+		for (int k = start; k < end; ++k) {
+		    x[k] = pji * v[k];
+		}
+	    } else {
+		for (int k = start; k < end; ++k) {
+		    x[k] += pji * v[k];
+		}
+	    }
+	}
+    }
+}
+
+/*
+ * cell_average: average the a and b measurements of a cell
+ *   @mcp: measurement cell
+ *   @row: row of the cell
+ *   @column: column of the cell
+ *   @start: first frequency index
+ *   @end: one past the last frequency index
+ *
+ * The first a and b vectors in mc_vectors serve as the sums.
+ */
+static void cell_average(const measurement_cell_t *mcp, int row, int column,
+	int start, int end)
+{
+    double complex *a_vector = mcp->mc_a_vector;
+    double complex *b_vector = mcp->mc_b_vector;
+
+    for (const measurement_vector_t *mvp = mcp->mc_vectors; mvp != NULL;
+	    mvp = mvp->mv_next) {
+	switch (VC_TO_11(mvp->mv_code, row, column)) {
+	case VC_A11:
+	    if (mvp->mv_vector != a_vector) {
+		for (int k = start; k < end; ++k) {
+		    a_vector[k] += mvp->mv_vector[k];
+		}
+	    }
+	    continue;
+
+	case VC_B11:
+	    if (mvp->mv_vector != b_vector) {
+		for (int k = start; k < end; ++k) {
+		    b_vector[k] += mvp->mv_vector[k];
+		}
+	    }
+	    continue;
+
+	default:
+	    abort();
+	}
+    }
+    if (mcp->mc_a_count > 1) {
+	for (int k = start; k < end; ++k) {
+	    a_vector[k] /= mcp->mc_a_count;
+	}
+    }
+    if (mcp->mc_b_count > 1) {
+	for (int k = start; k < end; ++k) {
+	    b_vector[k] /= mcp->mc_b_count;
+	}
+    }
+}
+
+/*
+ * solve_range: compute the result vectors over a range of frequencies
+ *   @arg: measurement matrix structure
+ *   @chunk: (unused)
+ *   @start: first frequency index
+ *   @end: one past the last frequency index
+ *
+ * Called with the cells already planned by measurement_matrix_plan.
+ */
+static void solve_range(void *arg, int chunk, int start, int end)
+{
+    const measurement_matrix_t *mmp = (measurement_matrix_t *)arg;
+    const int columns = mmp->mm_map->ma_columns;
+
+    for (int cell = 0; cell < mmp->mm_map->ma_rows * columns; ++cell) {
+	const measurement_cell_t *mcp = &mmp->mm_matrix[cell];
+	const int row = cell / columns;
+	const int column = cell % columns;
+
+	if (mcp->mc_n == 0) {
+	    cell_average(mcp, row, column, start, end);
+	} else if (mcp->mc_n == 2) {
+	    double complex *x_vectors[2] = {
+		mcp->mc_a_vector, mcp->mc_b_vector
+	    };
+
+	    cell_apply(mcp, x_vectors, start, end);
+	} else {
+	    cell_apply(mcp, &mcp->mc_b_vector, start, end);
+	}
+
+	/*
+	 * Fill in the identity for cells with only b measurements.
+	 */
+	if (mcp->mc_a_vector != NULL && mcp->mc_a_count == 0) {
+	    for (int k = start; k < end; ++k) {
+		mcp->mc_a_vector[k] = row == column ? 1.0 : 0.0;
+	    }
+	}
+    }
+}
+
+/*
+ * measurement_matrix_plan: set up the measurement result matrix
  *   @mmp: measurement matrix structure
  *   @mrp: measurement result structure
+ *
+ * Decide, for each cell, which vectors are summed or factored into
+ * which results, and point the result matrices at them.  Needs only
+ * the vectors, not their contents, so it can run before the last scan.
+ * Afterward, solve_range fills in the results for any frequency range.
  */
-static int measurement_matrix_solve(measurement_matrix_t *mmp,
+static int measurement_matrix_plan(measurement_matrix_t *mmp,
 	measurement_result_t *mrp)
 {
     const measurement_args_t *map = mmp->mm_map;
@@ -311,314 +651,603 @@ static int measurement_matrix_solve(measurement_matrix_t *mmp,
     }
 
     /*
-     * Allocate the result matrices.
+     * Set up the result matrices.
      */
     if (need_a_matrix) {
-	if ((mrp->mr_a_matrix = calloc(a_rows * columns,
-			sizeof(double complex *))) == NULL) {
-	    (void)fprintf(stderr, "%s: calloc: %s\n",
-		    progname, strerror(errno));
-	    exit(N2PKVNA_EXIT_SYSTEM);
-	}
+	mrp->mr_a_matrix  = mmp->mm_a_matrix;
 	mrp->mr_a_rows    = a_rows;
 	mrp->mr_a_columns = columns;
     }
-    if ((mrp->mr_b_matrix = calloc(rows * columns,
-			sizeof(double complex *))) == NULL) {
-	(void)fprintf(stderr, "%s: calloc: %s\n",
-		progname, strerror(errno));
-	exit(N2PKVNA_EXIT_SYSTEM);
-    }
+    mrp->mr_b_matrix  = mmp->mm_b_matrix;
     mrp->mr_b_rows    = rows;
     mrp->mr_b_columns = columns;
 
     /*
-     * Main loop
+     * Plan each cell.
      */
     for (int row = 0; row < rows; ++row) {
 	for (int column = 0; column < columns; ++column) {
 	    int cell = columns * row + column;
 	    measurement_cell_t *mcp = &mmp->mm_matrix[cell];
-	    if ((mcp->mc_mask & 0xCCCC) == 0) {
-		double complex *a_vector = NULL, *b_vector = NULL;
-		int a_count = 0, b_count = 0;
-		measurement_vector_t *mvp;
 
-		while ((mvp = mcp->mc_vectors) != NULL) {
-		    mcp->mc_vectors = mvp->mv_next;
+	    if ((mcp->mc_mask & 0xCCCC) == 0) {
+		/*
+		 * Average the a and b measurements in place, summing
+		 * into the first vector of each.
+		 */
+		mcp->mc_n = 0;
+		for (measurement_vector_t *mvp = mcp->mc_vectors; mvp != NULL;
+			mvp = mvp->mv_next) {
 		    switch (VC_TO_11(mvp->mv_code, row, column)) {
 		    case VC_A11:
-			if (a_vector == NULL) {
-			    a_vector = mvp->mv_vector;
-			} else {
-			    for (int k = 0; k < map->ma_frequencies; ++k) {
-				a_vector[k] += mvp->mv_vector[k];
-			    }
-			    free((void *)mvp->mv_vector);
+			if (mcp->mc_a_vector == NULL) {
+			    mcp->mc_a_vector = mvp->mv_vector;
 			}
-			mvp->mv_vector = NULL;
-			++a_count;
+			++mcp->mc_a_count;
 			continue;
 
 		    case VC_B11:
-			if (b_vector == NULL) {
-			    b_vector = mvp->mv_vector;
-			} else {
-			    for (int k = 0; k < map->ma_frequencies; ++k) {
-				b_vector[k] += mvp->mv_vector[k];
-			    }
-			    free((void *)mvp->mv_vector);
+			if (mcp->mc_b_vector == NULL) {
+			    mcp->mc_b_vector = mvp->mv_vector;
 			}
-			mvp->mv_vector = NULL;
-			++b_count;
+			++mcp->mc_b_count;
 			continue;
 
 		    default:
 			abort();
 		    }
 		}
-		if (a_count > 1) {
-		    for (int k = 0; k < map->ma_frequencies; ++k) {
-			a_vector[k] /= a_count;
-		    }
-		} else if (a_vector == NULL && need_a_matrix &&
-			(row == column || !map->ma_colsys)) {
-		    if ((a_vector = malloc(map->ma_frequencies *
-				    sizeof(double complex))) == NULL) {
-			(void)fprintf(stderr, "%s: malloc: %s\n",
-				progname, strerror(errno));
-			exit(N2PKVNA_EXIT_SYSTEM);
-		    }
-		    for (int k = 0; k < map->ma_frequencies; ++k) {
-			a_vector[k] = row == column ? 1.0 : 0.0;
-		    }
-		}
-		assert(b_count > 0);
-		if (b_count > 1) {
-		    for (int k = 0; k < map->ma_frequencies; ++k) {
-			b_vector[k] /= b_count;
-		    }
-		}
-		if (a_vector != NULL) {
-		    if (map->ma_colsys) {
-			if (row != column) {
-			    free((void *)a_vector);
-			    a_vector = NULL;
-			} else {
-			    mrp->mr_a_matrix[column] = a_vector;
-			}
-		    } else {
-			mrp->mr_a_matrix[columns * row + column] = a_vector;
-		    }
-		}
-		mrp->mr_b_matrix[columns * row + column] = b_vector;
-
-	    } else if ((mcp->mc_mask & (mcp->mc_mask - 1)) == 0) {
-		double complex a[mcp->mc_count];
-		double complex b[mcp->mc_count];
-		double complex *b_vector = NULL;
-		double K = 1.0 / sqrt(cabs(creal(map->ma_z0)));
-		double complex KV = map->ma_z0 / (K * creal(map->ma_z0));
-		double complex KI =       -1.0 / (K * creal(map->ma_z0));
-
-		if ((b_vector = malloc(map->ma_frequencies *
-				sizeof(double complex))) == NULL) {
-		    (void)fprintf(stderr, "%s: malloc: %s\n",
-			    progname, strerror(errno));
-		    exit(N2PKVNA_EXIT_SYSTEM);
-		}
-		for (int findex = 0; findex < map->ma_frequencies; ++findex) {
-		    int row = 0;
-
-		    for (measurement_vector_t *mvp = mcp->mc_vectors;
-			    mvp != NULL; mvp = mvp->mv_next, ++row) {
-
-			switch (VC_TO_11(mvp->mv_code, row, column)) {
-			case VC_B11:
-			    a[row] = 1.0;
-			    break;
-			case VC_V11:
-			    a[row] = KV;
-			    break;
-			case VC_I11:
-			    a[row] = KI;
-			    break;
-			default:
-			    abort();
-			}
-			b[row] = mvp->mv_vector[findex];
-		    }
-		    assert(row >= 1);
-		    if (row == 1) {
-			b_vector[findex] = b[0] / a[0];
-		    } else {
-			int rank = _vnacommon_qrsolve(&b_vector[findex],
-				a, b, row, 1, 1);
-			if (rank == 0) {
-			    (void)fprintf(stderr, "%s: singular matrix\n",
-				    progname);
-			    free((void *)b_vector);
-			    return -1;
-			}
-		    }
-		}
-		mrp->mr_b_matrix[columns * row + column] = b_vector;
+		assert(mcp->mc_b_count > 0);
 
 	    } else {
-		double complex a[mcp->mc_count][2];
-		double complex b[mcp->mc_count];
-		double complex *a_vector = NULL;
-		double complex *b_vector = NULL;
-		double K = 1.0 / sqrt(cabs(creal(map->ma_z0)));
-		double complex KV1 = conj(map->ma_z0) / (K * creal(map->ma_z0));
-		double complex KV2 =      map->ma_z0  / (K * creal(map->ma_z0));
-		double complex KI1 =  1.0             / (K * creal(map->ma_z0));
-		double complex KI2 = -1.0             / (K * creal(map->ma_z0));
-
-		if ((b_vector = malloc(map->ma_frequencies *
-				sizeof(double complex))) == NULL) {
-		    (void)fprintf(stderr, "%s: malloc: %s\n",
-			    progname, strerror(errno));
-		    exit(N2PKVNA_EXIT_SYSTEM);
+		/*
+		 * Each V or I measurement is a combination of the a and
+		 * b waves with constant coefficients.  If the cell has
+		 * more than one measurement type, solve for both a and
+		 * b; otherwise, solve for b alone.  The coefficients
+		 * don't depend on frequency, so factor the system once
+		 * here and apply the result to every frequency.
+		 */
+		mcp->mc_n = (mcp->mc_mask & (mcp->mc_mask - 1)) == 0 ? 1 : 2;
+		mcp->mc_p = mmp->mm_coefficients;
+		mmp->mm_coefficients += mcp->mc_n * mcp->mc_count;
+		if (cell_factor(map, mcp, row, column, mcp->mc_n,
+			    mcp->mc_p) == -1) {
+		    return -1;
 		}
-		for (int findex = 0; findex < map->ma_frequencies; ++findex) {
-		    int row = 0;
-		    double complex x[2];
-
-		    for (measurement_vector_t *mvp = mcp->mc_vectors;
-			    mvp != NULL; mvp = mvp->mv_next, ++row) {
-
-			switch (VC_TO_11(mvp->mv_code, row, column)) {
-			case VC_A11:
-			    a[row][0] = 1.0;
-			    a[row][1] = 0.0;
-			    break;
-			case VC_B11:
-			    a[row][0] = 0.0;
-			    a[row][1] = 1.0;
-			    break;
-			case VC_V11:
-			    a[row][0] = KV1;
-			    a[row][1] = KV2;
-			    break;
-			case VC_I11:
-			    a[row][0] = KI1;
-			    a[row][1] = KI2;
-			    break;
-			default:
-			    abort();
-			}
-			b[row] = mvp->mv_vector[findex];
-		    }
-		    assert(row >= 2);
-		    if (row == 2) {
-			double complex d;
-
-			d = _vnacommon_mldivide(x, &a[0][0], b, 2, 1);
-			if (d == 0.0) {
-			    (void)fprintf(stderr, "%s: singular matrix\n",
-				    progname);
-			    free((void *)a_vector);
-			    free((void *)b_vector);
-			    return -1;
-			}
-
-		    } else {
-			int rank;
-
-			rank = _vnacommon_qrsolve(x, &a[0][0], b, row, 2, 1);
-			if (rank == 0) {
-			    (void)fprintf(stderr, "%s: singular matrix\n",
-				    progname);
-			    free((void *)a_vector);
-			    free((void *)b_vector);
-			    return -1;
-			}
-		    }
-		    a_vector[findex] = x[0];
-		    b_vector[findex] = x[1];
+		if (mcp->mc_n == 2) {
+		    mcp->mc_a_vector = measurement_matrix_vector(mmp);
+		    mcp->mc_a_count = 1;
 		}
-		if (map->ma_colsys) {
-		    if (row != column) {
-			free((void *)a_vector);
-			a_vector = NULL;
-		    } else {
-			mrp->mr_a_matrix[column] = a_vector;
-		    }
-		} else {
-		    mrp->mr_a_matrix[columns * row + column] = a_vector;
+		mcp->mc_b_vector = measurement_matrix_vector(mmp);
+	    }
+
+	    /*
+	     * If we need an A matrix but the cell has no a values,
+	     * use the identity.
+	     */
+	    if (mcp->mc_a_vector == NULL && need_a_matrix &&
+		    (row == column || !map->ma_colsys)) {
+		mcp->mc_a_vector = measurement_matrix_vector(mmp);
+	    }
+	    if (mcp->mc_a_vector != NULL) {
+		if (!map->ma_colsys) {
+		    mrp->mr_a_matrix[columns * row + column] = mcp->mc_a_vector;
+		} else if (row == column) {
+		    mrp->mr_a_matrix[column] = mcp->mc_a_vector;
 		}
-		mrp->mr_b_matrix[2 * row + column] = b_vector;
 	    }
+	    mrp->mr_b_matrix[columns * row + column] = mcp->mc_b_vector;
 	}
     }
     return 0;
 }
 
+/*
+ * measurement_matrix_solve: create the measurement result matrix
+ *   @mmp: measurement matrix structure
+ *   @mrp: measurement result structure
+ *
+ * Since every frequency is independent, split the per-frequency work
+ * across threads.
+ */
+static int measurement_matrix_solve(measurement_matrix_t *mmp,
+	measurement_result_t *mrp)
+{
+    if (measurement_matrix_plan(mmp, mrp) == -1) {
+	return -1;
+    }
+    parallel_run(mmp->mm_map->ma_frequencies, solve_range, (void *)mmp);
+
+    /*
+     * The results point into the arena; hand it to the result.
+     */
+    mrp->mr_arena = mmp->mm_arena;
+    mmp->mm_arena = NULL;
+    return 0;
+}
+
 /*
  * measurement_matrix_free: free measurement matrix resources
  *   @mmp: measurement matrix structure
  */
 static void measurement_matrix_free(measurement_matrix_t *mmp)
 {
-    const measurement_args_t *map = mmp->mm_map;
-    int cells = map->ma_rows * map->ma_columns;
+    free((void *)mmp->mm_arena);
+    (void)memset((void *)mmp, 0, sizeof(*mmp));
+}
 
-    for (int cell = 0; cell < cells; ++cell) {
-	measurement_cell_t *mcp = &mmp->mm_matrix[cell];
-	while (mcp->mc_vectors != NULL) {
-	    measurement_vector_t *mvp = mcp->mc_vectors;
+/*
+ * count_vectors: return the most vectors make_measurements can measure
+ *   @setup: VNA setup in-use
+ *   @remaining_mask: mask of measurements needed
+ *
+ * Each scan covers at least one needed vector and uses a measurement
+ * at most once, so the count is bounded both by the detectors of the
+ * measurements that cover needed vectors and by two per needed vector.
+ */
+static int count_vectors(const setup_t *setup,
+	measurement_mask_t remaining_mask)
+{
+    int needed = 0, available = 0;
 
-	    mcp->mc_vectors = mvp->mv_next;
-	    free((void *)mvp->mv_vector);
-	    free((void *)mvp);
+    for (measurement_mask_t mask = remaining_mask; mask != 0;
+	    mask &= mask - 1) {
+	++needed;
+    }
+    for (mstep_t *msp = setup->su_steps; msp != NULL; msp = msp->ms_next) {
+	for (measurement_t *mp = msp->ms_measurements; mp != NULL;
+		mp = mp->m_next) {
+	    if (!(mp->m_mask & remaining_mask)) {
+		continue;
+	    }
+	    for (int i = 0; i < 2; ++i) {
+		if (mp->m_detectors[i] != VC_NONE) {
+		    ++available;
+		}
+	    }
 	}
     }
+    return available < 2 * needed ? available : 2 * needed;
 }
 
 /*
- * find_best_measurement: choose the next measurement
+ * schedule_alloc: allocate a measurement schedule
  *   @setup: VNA setup in-use
- *   @remaining_mask: mask of measurements remaining
+ *   @needed: mask of vectors to measure
  */
-static measurement_t *find_best_measurement(setup_t *setup,
-	const measurement_mask_t remaining_mask)
+static schedule_t *schedule_alloc(const setup_t *setup,
+	measurement_mask_t needed)
 {
-    measurement_t *best_measurement = NULL;
-    int best_cost = INT_MAX;
+    schedule_t *scp;
 
-    if (remaining_mask == 0) {
-	return NULL;
+    if ((scp = calloc(1, sizeof(schedule_t))) == NULL) {
+	(void)fprintf(stderr, "%s: calloc: %s\n",
+		progname, strerror(errno));
+	exit(N2PKVNA_EXIT_SYSTEM);
     }
-    assert((remaining_mask & ~setup->su_mask) == 0);
+    scp->sc_needed = needed;
+
+    /*
+     * Collect the named steps and the measurements that measure any
+     * needed vector, keeping the order from the setup.
+     */
+    for (const mstep_t *msp = setup->su_steps; msp != NULL;
+	    msp = msp->ms_next) {
+	if (msp->ms_name != NULL) {
+	    ++scp->sc_mstep_count;
+	}
+	for (const measurement_t *mp = msp->ms_measurements; mp != NULL;
+		mp = mp->m_next) {
+	    if (mp->m_mask & needed) {
+		++scp->sc_measurement_count;
+	    }
+	}
+    }
+    if ((scp->sc_measurements = calloc(scp->sc_measurement_count + 1,
+		    sizeof(measurement_t *))) == NULL ||
+	    (scp->sc_mstep_states = calloc(scp->sc_measurement_count + 1,
+		    sizeof(int))) == NULL ||
+	    (scp->sc_msteps = calloc(scp->sc_mstep_count + 1,
+		    sizeof(mstep_t *))) == NULL) {
+	(void)fprintf(stderr, "%s: calloc: %s\n",
+		progname, strerror(errno));
+	exit(N2PKVNA_EXIT_SYSTEM);
+    }
+    scp->sc_measurement_count = 0;
+    scp->sc_mstep_count = 0;
     for (mstep_t *msp = setup->su_steps; msp != NULL; msp = msp->ms_next) {
+	int mstep_state = -1;
+
+	if (msp->ms_name != NULL) {
+	    mstep_state = SCHEDULE_MSTEP_NAMED + scp->sc_mstep_count;
+	    scp->sc_msteps[scp->sc_mstep_count++] = msp;
+	}
 	for (measurement_t *mp = msp->ms_measurements; mp != NULL;
 		mp = mp->m_next) {
-	    int cost = 0;
-
-	    if (mp->m_used) {
-		continue;
+	    if (mp->m_mask & needed) {
+		scp->sc_measurements[scp->sc_measurement_count] = mp;
+		scp->sc_mstep_states[scp->sc_measurement_count] = mstep_state;
+		++scp->sc_measurement_count;
 	    }
-	    if (!(mp->m_mask & remaining_mask)) {
-		mp->m_used = true;
-		continue;
+	}
+    }
+
+    /*
+     * Start with a small, empty hash table; schedule_insert grows it.
+     */
+    if ((scp->sc_table = calloc(SCHEDULE_TABLE_SIZE,
+		    sizeof(schedule_entry_t))) == NULL) {
+	(void)fprintf(stderr, "%s: calloc: %s\n",
+		progname, strerror(errno));
+	exit(N2PKVNA_EXIT_SYSTEM);
+    }
+    scp->sc_table_size = SCHEDULE_TABLE_SIZE;
+    return scp;
+}
+
+/*
+ * schedule_free: free a measurement schedule
+ *   @scp: schedule to free
+ */
+static void schedule_free(schedule_t *scp)
+{
+    if (scp != NULL) {
+	free((void *)scp->sc_table);
+	free((void *)scp->sc_msteps);
+	free((void *)scp->sc_mstep_states);
+	free((void *)scp->sc_measurements);
+	free((void *)scp);
+    }
+}
+
+/*
+ * schedule_key: return the hash key for a state
+ *   @scp: schedule
+ *   @remaining_mask: mask of vectors still needed
+ *   @mstep_state: manual step state
+ *   @switch_code: switch setting 0-3 or unknown -1
+ *
+ * The key packs remaining_mask with the bits not in sc_needed squeezed
+ * out, the manual step state and the switch state, plus one so that
+ * zero can mark a free slot.
+ */
+static size_t schedule_key(const schedule_t *scp,
+	measurement_mask_t remaining_mask, int mstep_state, int switch_code)
+{
+    size_t key = 0;
+    int bit = 0;
+
+    for (measurement_mask_t mask = scp->sc_needed; mask != 0;
+	    mask &= mask - 1, ++bit) {
+	if (remaining_mask & mask & ~(mask - 1)) {
+	    key |= (size_t)1 << bit;
+	}
+    }
+    key = key * (SCHEDULE_MSTEP_NAMED + scp->sc_mstep_count) + mstep_state;
+    return key * SCHEDULE_SWITCHES + (switch_code + 1) + 1;
+}
+
+/*
+ * schedule_slot: find the slot holding key, or the free slot for it
+ *   @table: hash table
+ *   @size: slots in table, a power of 2
+ *   @key: key from schedule_key
+ */
+static schedule_entry_t *schedule_slot(schedule_entry_t *table, size_t size,
+	size_t key)
+{
+    size_t hash = key * 0x9e3779b9U;
+    size_t i = (hash ^ hash >> 16) & (size - 1);
+
+    while (table[i].se_key != 0 && table[i].se_key != key) {
+	i = (i + 1) & (size - 1);
+    }
+    return &table[i];
+}
+
+/*
+ * schedule_insert: add a solved state, growing the table if needed
+ *   @scp: schedule
+ *   @entry: entry to add, with se_key set
+ *
+ * The table is kept at most half full.  Entries may move, so pointers
+ * into sc_table are invalid after a call.
+ */
+static const schedule_entry_t *schedule_insert(schedule_t *scp,
+	const schedule_entry_t *entry)
+{
+    schedule_entry_t *sep;
+
+    if (2 * (scp->sc_table_used + 1) > scp->sc_table_size) {
+	size_t new_size = 2 * scp->sc_table_size;
+	schedule_entry_t *new_table;
+
+	if ((new_table = calloc(new_size,
+			sizeof(schedule_entry_t))) == NULL) {
+	    (void)fprintf(stderr, "%s: calloc: %s\n",
+		    progname, strerror(errno));
+	    exit(N2PKVNA_EXIT_SYSTEM);
+	}
+	for (size_t i = 0; i < scp->sc_table_size; ++i) {
+	    if (scp->sc_table[i].se_key != 0) {
+		*schedule_slot(new_table, new_size,
+			scp->sc_table[i].se_key) = scp->sc_table[i];
 	    }
-	    if (mp->m_mstep->ms_name != NULL && gs.gs_mstep != NULL &&
-		    mp->m_mstep != gs.gs_mstep) {
+	}
+	free((void *)scp->sc_table);
+	scp->sc_table = new_table;
+	scp->sc_table_size = new_size;
+    }
+    sep = schedule_slot(scp->sc_table, scp->sc_table_size, entry->se_key);
+    assert(sep->se_key == 0);
+    *sep = *entry;
+    ++scp->sc_table_used;
+    return sep;
+}
+
+/*
+ * schedule_solve: find the cheapest way to finish from a state
+ *   @scp: schedule
+ *   @remaining_mask: mask of vectors still needed
+ *   @mstep_state: manual step state
+ *   @switch_code: switch setting 0-3 or unknown -1
+ *
+ * Each measurement removes at least one vector from remaining_mask,
+ * so the recursion is no deeper than the number of needed vectors.
+ * The returned entry is valid only until the next call.
+ */
+static const schedule_entry_t *schedule_solve(schedule_t *scp,
+	measurement_mask_t remaining_mask, int mstep_state, int switch_code)
+{
+    static const schedule_entry_t done = { 0, 0, 0, 0 };
+    schedule_entry_t best = { 0, SCHEDULE_UNKNOWN, 0, 0 };
+    const schedule_entry_t *sep;
+
+    if (remaining_mask == 0) {
+	return &done;
+    }
+    best.se_key = schedule_key(scp, remaining_mask, mstep_state, switch_code);
+    sep = schedule_slot(scp->sc_table, scp->sc_table_size, best.se_key);
+    if (sep->se_key != 0) {
+	return sep;
+    }
+    for (int i = 0; i < scp->sc_measurement_count; ++i) {
+	const measurement_t *mp = scp->sc_measurements[i];
+	const schedule_entry_t *rest;
+	int next_mstep_state = mstep_state;
+	int next_switch_code = switch_code;
+	int cost = 0;
+
+	if (!(mp->m_mask & remaining_mask)) {
+	    continue;
+	}
+	if (scp->sc_mstep_states[i] != -1) {
+	    if (mstep_state != SCHEDULE_MSTEP_NONE &&
+		    mstep_state != scp->sc_mstep_states[i]) {
 		cost += 2;
 	    }
-	    if (mp->m_switch >= 0 && gs.gs_switch >= 0 &&
-		    mp->m_switch != gs.gs_switch) {
+	    next_mstep_state = scp->sc_mstep_states[i];
+	}
+	if (mp->m_switch >= 0) {
+	    if (switch_code >= 0 && mp->m_switch != switch_code) {
 		cost += 1;
 	    }
-	    if (cost < best_cost) {
-		best_cost = cost;
-		best_measurement = mp;
+	    next_switch_code = mp->m_switch;
+	}
+	rest = schedule_solve(scp, remaining_mask & ~mp->m_mask,
+		next_mstep_state, next_switch_code);
+	cost += rest->se_cost;
+	if (cost < best.se_cost ||
+		(cost == best.se_cost && rest->se_scans + 1 < best.se_scans)) {
+	    best.se_cost  = cost;
+	    best.se_scans = rest->se_scans + 1;
+	    best.se_next  = i;
+	}
+    }
+    assert(best.se_cost != SCHEDULE_UNKNOWN);
+    return schedule_insert(scp, &best);
+}
+
+/*
+ * schedule_next: choose the next measurement
+ *   @scp: schedule
+ *   @remaining_mask: mask of vectors still needed
+ *
+ * Start from the manual step and switch setting the VNA is in now,
+ * which may have been left by an earlier measurement.
+ */
+static measurement_t *schedule_next(schedule_t *scp,
+	measurement_mask_t remaining_mask)
+{
+    int mstep_state = SCHEDULE_MSTEP_NONE;
+
+    if (remaining_mask == 0) {
+	return NULL;
+    }
+    assert((remaining_mask & ~scp->sc_needed) == 0);
+    if (gs.gs_mstep != NULL) {
+	mstep_state = SCHEDULE_MSTEP_OTHER;
+	for (int i = 0; i < scp->sc_mstep_count; ++i) {
+	    if (scp->sc_msteps[i] == gs.gs_mstep) {
+		mstep_state = SCHEDULE_MSTEP_NAMED + i;
+		break;
 	    }
 	}
     }
-    assert(best_measurement != NULL);
-    return best_measurement;
+    return scp->sc_measurements[schedule_solve(scp, remaining_mask,
+	    mstep_state, gs.gs_switch)->se_next];
+}
+
+/*
+ * setup_flush_schedules: discard cached schedules after a setup change
+ *   @sup: setup_t structure
+ */
+static void setup_flush_schedules(setup_t *sup)
+{
+    for (int i = 0; i < 4; ++i) {
+	schedule_free(sup->su_schedules[i]);
+	sup->su_schedules[i] = NULL;
+    }
+}
+
+/*
+ * scan_stream_t: state shared by a streamed scan and its solver thread
+ */
+typedef struct scan_stream {
+    measurement_matrix_t       *ss_mmp;		/* measurement matrix */
+    measurement_result_t       *ss_mrp;		/* measurement result */
+    double		       *ss_frequency_vector; /* to fill or NULL */
+    double complex	       *ss_vectors[2];	/* detector vectors or NULL */
+    pthread_mutex_t		ss_mutex;	/* protects the members below */
+    pthread_cond_t		ss_cond;	/* signals progress */
+    int				ss_received;	/* points received */
+    bool			ss_done;	/* scan finished */
+    bool			ss_failed;	/* scan or ma_chunk_fn failed */
+} scan_stream_t;
+
+/*
+ * stream_point: receive a point of the last scan
+ *   @point: scan point
+ *   @arg: scan_stream_t structure
+ */
+static int stream_point(const n2pkvna_point_t *point, void *arg)
+{
+    scan_stream_t *ssp = (scan_stream_t *)arg;
+    bool failed;
+
+    /*
+     * Don't let a point the library gave up on into the results.
+     */
+    if (point->np_quality == N2PKVNA_POINT_FAILED) {
+	(void)pthread_mutex_lock(&ssp->ss_mutex);
+	ssp->ss_failed = true;
+	(void)pthread_cond_signal(&ssp->ss_cond);
+	(void)pthread_mutex_unlock(&ssp->ss_mutex);
+	gs.gs_exitcode = N2PKVNA_EXIT_VNAOP;
+	return 1;
+    }
+    if (ssp->ss_frequency_vector != NULL) {
+	ssp->ss_frequency_vector[point->np_index] = point->np_frequency;
+    }
+    if (ssp->ss_vectors[0] != NULL) {
+	ssp->ss_vectors[0][point->np_index] = point->np_detector1;
+    }
+    if (ssp->ss_vectors[1] != NULL) {
+	ssp->ss_vectors[1][point->np_index] = point->np_detector2;
+    }
+    (void)pthread_mutex_lock(&ssp->ss_mutex);
+    ssp->ss_received = point->np_index + 1;
+    failed = ssp->ss_failed;
+    (void)pthread_cond_signal(&ssp->ss_cond);
+    (void)pthread_mutex_unlock(&ssp->ss_mutex);
+    return failed ? 1 : 0;
+}
+
+/*
+ * stream_solve: solver thread start routine
+ *   @arg: scan_stream_t structure
+ *
+ * Solve and pass on every point received since the last pass, so
+ * the pieces grow if the consumer falls behind the scan.
+ */
+static void *stream_solve(void *arg)
+{
+    scan_stream_t *ssp = (scan_stream_t *)arg;
+    const measurement_args_t *map = ssp->ss_mmp->mm_map;
+    int solved = 0;
+
+    (void)pthread_mutex_lock(&ssp->ss_mutex);
+    for (;;) {
+	int received;
+
+	while (ssp->ss_received == solved && !ssp->ss_done) {
+	    (void)pthread_cond_wait(&ssp->ss_cond, &ssp->ss_mutex);
+	}
+	if (ssp->ss_failed || (received = ssp->ss_received) == solved) {
+	    break;
+	}
+	(void)pthread_mutex_unlock(&ssp->ss_mutex);
+	solve_range((void *)ssp->ss_mmp, 0, solved, received);
+	if ((*map->ma_chunk_fn)(ssp->ss_mrp, solved, received,
+		    map->ma_chunk_arg) == -1) {
+	    (void)pthread_mutex_lock(&ssp->ss_mutex);
+	    ssp->ss_failed = true;
+	    break;
+	}
+	solved = received;
+	(void)pthread_mutex_lock(&ssp->ss_mutex);
+    }
+    (void)pthread_mutex_unlock(&ssp->ss_mutex);
+    return NULL;
+}
+
+/*
+ * scan_stream: make the last scan, passing on results as points arrive
+ *   @mmp: measurement matrix structure
+ *   @mrp: measurement result structure
+ *   @mp: measurement to make
+ *   @vectors: detector vectors for the scan
+ *   @frequency_vector: frequency vector to fill, or NULL
+ *
+ * Once the last scan starts, every vector is in the matrix, so the
+ * result cells can be planned up front.  A separate thread then solves
+ * each range of points and gives it to ma_chunk_fn while the scan goes
+ * on, keeping the work out of the USB event loop.  If the thread can't
+ * be created, scan first and pass on all of the results at once.
+ */
+static int scan_stream(measurement_matrix_t *mmp, measurement_result_t *mrp,
+	measurement_t *mp, double complex **vectors, double *frequency_vector)
+{
+    const measurement_args_t *map = mmp->mm_map;
+    scan_stream_t ss;
+    pthread_t thread;
+    int rc;
+
+    (void)memset((void *)&ss, 0, sizeof(ss));
+    ss.ss_mmp = mmp;
+    ss.ss_mrp = mrp;
+    ss.ss_frequency_vector = frequency_vector;
+    ss.ss_vectors[0] = vectors[0];
+    ss.ss_vectors[1] = vectors[1];
+    if (measurement_matrix_add(mmp, mp, vectors) == -1) {
+	return -1;
+    }
+    if (measurement_matrix_plan(mmp, mrp) == -1) {
+	return -1;
+    }
+    (void)pthread_mutex_init(&ss.ss_mutex, NULL);
+    (void)pthread_cond_init(&ss.ss_cond, NULL);
+    if (pthread_create(&thread, NULL, stream_solve, (void *)&ss) != 0) {
+	if (n2pkvna_scan(gs.gs_vnap, map->ma_fmin, map->ma_fmax,
+		    map->ma_frequencies, map->ma_linear, frequency_vector,
+		    ss.ss_vectors[0], ss.ss_vectors[1]) == -1) {
+	    gs.gs_exitcode = N2PKVNA_EXIT_VNAOP;
+	    rc = -1;
+	    goto out;
+	}
+	parallel_run(map->ma_frequencies, solve_range, (void *)mmp);
+	rc = (*map->ma_chunk_fn)(mrp, 0, map->ma_frequencies,
+		map->ma_chunk_arg);
+	goto out;
+    }
+    rc = n2pkvna_scan_stream(gs.gs_vnap, map->ma_fmin, map->ma_fmax,
+	    map->ma_frequencies, map->ma_linear, stream_point, (void *)&ss);
+    (void)pthread_mutex_lock(&ss.ss_mutex);
+    if (rc == -1) {
+	gs.gs_exitcode = N2PKVNA_EXIT_VNAOP;
+	ss.ss_failed = true;
+    }
+    ss.ss_done = true;
+    (void)pthread_cond_signal(&ss.ss_cond);
+    (void)pthread_mutex_unlock(&ss.ss_mutex);
+    (void)pthread_join(thread, NULL);
+    rc = ss.ss_failed ? -1 : 0;
+
+out:
+    (void)pthread_cond_destroy(&ss.ss_cond);
+    (void)pthread_mutex_destroy(&ss.ss_mutex);
+    return rc;
 }
 
 /*
@@ -630,9 +1259,12 @@ int make_measurements(const measurement_args_t *map, measurement_result_t *mrp)
 {
     setup_t *setup = map->ma_setup;
     measurement_mask_t remaining_mask;
+    int dimensions;
+    schedule_t *scp;
     double *frequency_vector = NULL;
     double complex *vectors[2] = { NULL, NULL };
     bool measuring = false;
+    bool streamed = false;
     measurement_matrix_t mm;
     int rc = -1;
 
@@ -663,21 +1295,22 @@ int make_measurements(const measurement_args_t *map, measurement_result_t *mrp)
        /*(map->ma_rows == 2 && map->ma_columns == 2)*/ 0xFFFF);
 
     /*
-     * Init the measurement matrix.
+     * Find the cached schedule for these dimensions or start one.
      */
-    if (measurement_matrix_init(&mm, map) == -1) {
-	goto out;
+    dimensions = 2 * (map->ma_rows - 1) + map->ma_columns - 1;
+    if ((scp = setup->su_schedules[dimensions]) == NULL) {
+	scp = schedule_alloc(setup, remaining_mask);
+	setup->su_schedules[dimensions] = scp;
     }
 
     /*
-     * Allocate the frequency vector.
+     * Init the measurement matrix, allocating all storage at once.
      */
-    if ((frequency_vector = calloc(map->ma_frequencies,
-		    sizeof(double))) == NULL) {
-	(void)fprintf(stderr, "%s: calloc: %s\n",
-		progname, strerror(errno));
-	exit(N2PKVNA_EXIT_SYSTEM);
+    if (measurement_matrix_init(&mm, map,
+		count_vectors(setup, remaining_mask)) == -1) {
+	goto out;
     }
+    frequency_vector = mm.mm_frequency_vector;
     mrp->mr_frequency_vector = frequency_vector;
 
     /*
@@ -687,7 +1320,7 @@ int make_measurements(const measurement_args_t *map, measurement_result_t *mrp)
 	measurement_t *mp;
 	mstep_t *msp;
 
-	mp = find_best_measurement(setup, remaining_mask);
+	mp = schedule_next(scp, remaining_mask);
 	if (mp == NULL) {
 	    break;
 	}
@@ -734,17 +1367,12 @@ int make_measurements(const measurement_args_t *map, measurement_result_t *mrp)
 	}
 
 	/*
-	 * Allocate measurement vectors, run the VNA scan, and add
-	 * the vectors to the mcells structure.
+	 * Take measurement vectors from the arena, run the VNA scan,
+	 * and add the vectors to the mcells structure.
 	 */
 	for (int i = 0; i < 2; ++i) {
 	    if (mp->m_detectors[i] != VC_NONE) {
-		if ((vectors[i] = calloc(map->ma_frequencies,
-				sizeof(double complex))) == NULL) {
-		    (void)fprintf(stderr, "%s: calloc: %s\n",
-			    progname, strerror(errno));
-		    exit(N2PKVNA_EXIT_SYSTEM);
-		}
+		vectors[i] = measurement_matrix_vector(&mm);
 	    }
 	}
 	if (!measuring) {
@@ -753,22 +1381,29 @@ int make_measurements(const measurement_args_t *map, measurement_result_t *mrp)
 	    }
 	    measuring = true;
 	}
-	if (n2pkvna_scan(gs.gs_vnap, map->ma_fmin, map->ma_fmax,
-		    map->ma_frequencies, map->ma_linear, frequency_vector,
-		    vectors[0], vectors[1]) == -1) {
-	    gs.gs_exitcode = N2PKVNA_EXIT_VNAOP;
-	    goto out;
-	}
-	if (measurement_matrix_add(&mm, mp, vectors) == -1) {
-	    goto out;
+	if (map->ma_chunk_fn != NULL &&
+		(remaining_mask & ~mp->m_mask) == 0) {
+	    if (scan_stream(&mm, mrp, mp, vectors, frequency_vector) == -1) {
+		goto out;
+	    }
+	    streamed = true;
+
+	} else {
+	    if (n2pkvna_scan(gs.gs_vnap, map->ma_fmin, map->ma_fmax,
+			map->ma_frequencies, map->ma_linear, frequency_vector,
+			vectors[0], vectors[1]) == -1) {
+		gs.gs_exitcode = N2PKVNA_EXIT_VNAOP;
+		goto out;
+	    }
+	    if (measurement_matrix_add(&mm, mp, vectors) == -1) {
+		goto out;
+	    }
 	}
 	frequency_vector = NULL;	/* pass only first time */
 
 	/*
-	 * Mark this measurement as used and remove the vectors
-	 * we just measured from the remaining mask.
+	 * Remove the vectors we just measured from the remaining mask.
 	 */
-	mp->m_used = true;
 	remaining_mask &= ~mp->m_mask;
     }
     if (measuring) {
@@ -777,21 +1412,27 @@ int make_measurements(const measurement_args_t *map, measurement_result_t *mrp)
 	}
 	measuring = false;
     }
-    if (measurement_matrix_solve(&mm, mrp) == -1) {
-	goto out;
+
+    /*
+     * If the last scan was streamed, the results are already solved
+     * and passed on.  Otherwise, solve now.
+     */
+    if (streamed) {
+	mrp->mr_arena = mm.mm_arena;
+	mm.mm_arena = NULL;
+    } else {
+	if (measurement_matrix_solve(&mm, mrp) == -1) {
+	    goto out;
+	}
+	if (map->ma_chunk_fn != NULL && (*map->ma_chunk_fn)(mrp, 0,
+		    map->ma_frequencies, map->ma_chunk_arg) == -1) {
+	    goto out;
+	}
     }
     rc = 0;
 
 out:
     measurement_matrix_free(&mm);
-    for (mstep_t *msp = setup->su_steps; msp != NULL; msp = msp->ms_next) {
-	for (measurement_t *mp = msp->ms_measurements; mp != NULL;
-		mp = mp->m_next) {
-	    for (int i = 0; i < 2; ++i) {
-		mp->m_used = false;
-	    }
-	}
-    }
     if (rc != 0) {
 	measurement_result_free(mrp);
     }
@@ -803,26 +1444,8 @@ out:
  */
 void measurement_result_free(measurement_result_t *mrp)
 {
-    free((void *)mrp->mr_frequency_vector);
-    mrp->mr_frequency_vector = NULL;
-    if (mrp->mr_a_matrix != NULL) {
-	for (int cell = 0; cell < mrp->mr_a_rows * mrp->mr_a_columns; ++cell) {
-	    free((void *)mrp->mr_a_matrix[cell]);
-	}
-	free((void *)mrp->mr_a_matrix);
-	mrp->mr_a_matrix = NULL;
-	mrp->mr_a_rows = 0;
-	mrp->mr_a_columns = 0;
-    }
-    if (mrp->mr_b_matrix != NULL) {
-	for (int cell = 0; cell < mrp->mr_b_rows * mrp->mr_b_columns; ++cell) {
-	    free((void *)mrp->mr_b_matrix[cell]);
-	}
-	free((void *)mrp->mr_b_matrix);
-	mrp->mr_b_matrix = NULL;
-	mrp->mr_b_rows = 0;
-	mrp->mr_b_columns = 0;
-    }
+    free((void *)mrp->mr_arena);
+    (void)memset((void *)mrp, 0, sizeof(*mrp));
 }
 
 /*
@@ -889,6 +1512,7 @@ measurement_t *mstep_add_measurement(mstep_t *msp, int switch_value,
     *mpp = mp;
     msp->ms_mask |= mp->m_mask;
     msp->ms_setup->su_mask |= mp->m_mask;
+    setup_flush_schedules(msp->ms_setup);
 
     return mp;
 }
@@ -956,6 +1580,7 @@ mstep_t *setup_add_mstep(setup_t *sup, const char *name, const char *text)
 	mspp = &(*mspp)->ms_next;
     }
     *mspp = msp;
+    setup_flush_schedules(sup);
 
     return msp;
 }
@@ -973,6 +1598,7 @@ void setup_free(setup_t *sup)
 	    sup->su_steps = msp->ms_next;
 	    mstep_free(msp);
 	}
+	setup_flush_schedules(sup);
 	free((void *)sup->su_name);
 	free((void *)sup);
     }
@@ -72,7 +72,6 @@ typedef struct measurement {
     int			m_switch;		/* key: 0-3 or -1 */
     vector_code_t	m_detectors[2];		/* vectors detectors measure */
     measurement_mask_t	m_mask;			/* vectors bitmask */
-    bool		m_used;			/* no longer avialable */
     struct mstep       *m_mstep;		/* parent pointer */
     struct measurement *m_next;			/* next measurement */
 } measurement_t;
@@ -102,9 +101,25 @@ typedef struct setup {
     double		su_fosc;		/* transferter osc. or 0.0 */
     mstep_t	       *su_steps;		/* list of steps */
     measurement_mask_t	su_mask;		/* vectors bitmask */
+    struct schedule    *su_schedules[4];	/* cached orders by dimension */
     struct setup       *su_next;		/* next setup */
 } setup_t;
 
+struct measurement_result;
+
+/*
+ * measurement_chunk_fn_t: receive results for frequencies start to end - 1
+ *   @mrp: measurement result; only indices below end are valid yet
+ *   @start: first frequency index
+ *   @end: one past the last frequency index
+ *   @arg: ma_chunk_arg
+ *
+ * Called on a separate thread while the last scan continues.  Return
+ * -1 to stop the measurement.
+ */
+typedef int measurement_chunk_fn_t(const struct measurement_result *mrp,
+	int start, int end, void *arg);
+
 /*
  * measurement_args_t: options for make_measurements
  */
@@ -118,6 +133,8 @@ typedef struct measurement_args {
     bool		ma_linear;		/* true for linear f spacing */
     bool		ma_colsys;		/* true for column systems */
     double complex      ma_z0;			/* reference impedance */
+    measurement_chunk_fn_t *ma_chunk_fn;	/* pipelined results or NULL */
+    void	       *ma_chunk_arg;		/* argument to ma_chunk_fn */
 } measurement_args_t;
 
 /*
@@ -131,6 +148,7 @@ typedef struct measurement_result {
     double	       *mr_frequency_vector;	/* resulting frequency vector */
     double complex    **mr_a_matrix;		/* resulting A matrix */
     double complex    **mr_b_matrix;		/* resulting B matrix */
+    void	       *mr_arena;		/* storage for all of the above */
 } measurement_result_t;
 
 extern const char *vector_code_to_name(vector_code_t code);
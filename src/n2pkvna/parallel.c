@@ -0,0 +1,136 @@
+/*
+ * N2PK Vector Network Analyzer
+ * Copyright © 2021-2022 D Scott Guthridge <scott_guthridge@rompromity.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "archdep.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <unistd.h>
+
+#include "main.h"
+#include "parallel.h"
+
+/*
+ * parallel_worker_t: one contiguous piece of the frequency range
+ */
+typedef struct parallel_worker {
+    pthread_t			pw_thread;	/* thread running the piece */
+    bool			pw_started;	/* pw_thread was created */
+    parallel_function_t	       *pw_function;	/* work function */
+    void		       *pw_arg;		/* argument to pw_function */
+    int				pw_chunk;	/* index of this piece */
+    int				pw_start;	/* first frequency index */
+    int				pw_end;		/* one past last index */
+} parallel_worker_t;
+
+/*
+ * parallel_jobs: return the number of worker threads to use
+ */
+static int parallel_jobs(void)
+{
+    long cpus;
+
+    if (gs.gs_jobs > 0) {
+	return gs.gs_jobs;
+    }
+    if ((cpus = sysconf(_SC_NPROCESSORS_ONLN)) < 1) {
+	return 1;
+    }
+    return cpus > MAX_JOBS ? MAX_JOBS : (int)cpus;
+}
+
+/*
+ * parallel_chunks: return the number of pieces parallel_run uses
+ *   @count: number of frequencies
+ *
+ * Small sweeps aren't worth the cost of starting threads, so each
+ * piece gets at least PARALLEL_MIN_CHUNK frequencies.
+ */
+int parallel_chunks(int count)
+{
+    int chunks = count / PARALLEL_MIN_CHUNK;
+    int jobs = parallel_jobs();
+
+    if (chunks > jobs) {
+	chunks = jobs;
+    }
+    return chunks < 1 ? 1 : chunks;
+}
+
+/*
+ * parallel_start: thread start routine
+ *   @arg: parallel_worker_t structure
+ */
+static void *parallel_start(void *arg)
+{
+    parallel_worker_t *pwp = (parallel_worker_t *)arg;
+
+    (*pwp->pw_function)(pwp->pw_arg, pwp->pw_chunk,
+	    pwp->pw_start, pwp->pw_end);
+    return NULL;
+}
+
+/*
+ * parallel_run: split a frequency range across worker threads
+ *   @count: number of frequencies
+ *   @function: function to call on each piece
+ *   @arg: user argument passed through to function
+ *
+ * Divide 0 to count - 1 into parallel_chunks(count) contiguous pieces
+ * and call function on each in its own thread, running the first
+ * piece in the calling thread.  Returns when all pieces are done.
+ * Every frequency is computed by the same operations as a serial loop
+ * would use, so the results don't depend on the number of threads.
+ * If a thread can't be created, its piece runs in the caller.
+ */
+void parallel_run(int count, parallel_function_t *function, void *arg)
+{
+    const int chunks = parallel_chunks(count);
+    parallel_worker_t workers[chunks];
+
+    if (chunks == 1) {
+	(*function)(arg, 0, 0, count);
+	return;
+    }
+    for (int i = 0; i < chunks; ++i) {
+	parallel_worker_t *pwp = &workers[i];
+
+	pwp->pw_started  = false;
+	pwp->pw_function = function;
+	pwp->pw_arg      = arg;
+	pwp->pw_chunk    = i;
+	pwp->pw_start    = (int)((long long)count *  i      / chunks);
+	pwp->pw_end      = (int)((long long)count * (i + 1) / chunks);
+    }
+    for (int i = 1; i < chunks; ++i) {
+	parallel_worker_t *pwp = &workers[i];
+
+	pwp->pw_started = pthread_create(&pwp->pw_thread, NULL,
+		parallel_start, (void *)pwp) == 0;
+    }
+    (void)parallel_start((void *)&workers[0]);
+    for (int i = 1; i < chunks; ++i) {
+	parallel_worker_t *pwp = &workers[i];
+
+	if (pwp->pw_started) {
+	    (void)pthread_join(pwp->pw_thread, NULL);
+	} else {
+	    (void)parallel_start((void *)pwp);
+	}
+    }
+}
@@ -0,0 +1,38 @@
+/*
+ * N2PK Vector Network Analyzer
+ * Copyright © 2021-2022 D Scott Guthridge <scott_guthridge@rompromity.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A11 PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#define MAX_JOBS		256	/* most worker threads */
+#define PARALLEL_MIN_CHUNK	1024	/* fewest frequencies per thread */
+
+/*
+ * parallel_function_t: process frequency indices start to end - 1
+ *   @arg: user argument passed through from parallel_run
+ *   @chunk: index of this piece, 0 to parallel_chunks() - 1
+ *   @start: first frequency index
+ *   @end: one past the last frequency index
+ */
+typedef void parallel_function_t(void *arg, int chunk, int start, int end);
+
+extern int parallel_chunks(int count);
+extern void parallel_run(int count, parallel_function_t *function,
+	void *arg);
+
+#endif /* PARALLEL_H */
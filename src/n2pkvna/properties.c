@@ -27,6 +27,7 @@
 #include "measurement.h"
 #include "message.h"
 #include "n2pkvna.h"
+#include "parallel.h"
 #include "properties.h"
 
 /*
@@ -678,6 +679,30 @@ int properties_load()
     }
     for (const char **cpp = property_names; *cpp != NULL; ++cpp) {
 	switch (**cpp) {
+	case 'j':
+	    if (strcmp(*cpp, "jobs") == 0) {
+		const char *value;
+		char *end;
+		long int li;
+
+		if ((value = vnaproperty_get(root, "jobs")) == NULL) {
+		    message_error("%s/config: jobs: must be a scalar\n",
+			    n2pkvna_get_directory(gs.gs_vnap));
+		    goto out;
+		}
+		li = strtol(value, &end, 10);
+		if (end == value || *end != '\000' ||
+			li < 0 || li > MAX_JOBS) {
+		    message_error("%s/config: jobs: value %s: "
+			    "must be 0 to %d\n",
+			    n2pkvna_get_directory(gs.gs_vnap), value, MAX_JOBS);
+		    goto out;
+		}
+		gs.gs_jobs = (int)li;
+		continue;
+	    }
+	    break;
+
 	case 's':
 	    if (strcmp(*cpp, "setups") == 0) {
 		vnaproperty_t *setup_root;
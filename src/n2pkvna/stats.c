@@ -0,0 +1,266 @@
+/*
+ * N2PK Vector Network Analyzer
+ * Copyright © 2021-2022 D Scott Guthridge <scott_guthridge@rompromity.net>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published
+ * by the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "archdep.h"
+
+#include <errno.h>
+#include <getopt.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vnaproperty.h>
+
+#include "main.h"
+#include "message.h"
+#include "stats.h"
+
+/*
+ * n2pkvna stats options
+ */
+static const char short_options[] = "hr";
+static const struct option long_options[] = {
+    { "help",			0, NULL, 'h' },
+    { "reset",			0, NULL, 'r' },
+    { NULL,			0, NULL,  0  }
+};
+static const char *const usage[] = {
+    "[-r]",
+    NULL
+};
+static const char *const help[] = {
+    " -h|--help   print this help message",
+    " -r|--reset  zero the statistics after showing them",
+    NULL
+};
+
+/*
+ * stats_field_t: a scalar member of n2pkvna_stats_t
+ */
+typedef struct stats_field {
+    const char *sf_name;		/* YAML key */
+    size_t	sf_offset;		/* offset in n2pkvna_stats_t */
+    bool	sf_seconds;		/* double in seconds, else uint64_t */
+} stats_field_t;
+
+#define STATS_COUNT(name, member) \
+    { name, offsetof(n2pkvna_stats_t, member), false }
+#define STATS_TIME(name, member) \
+    { name, offsetof(n2pkvna_stats_t, member), true  }
+
+static const stats_field_t stats_fields[] = {
+    STATS_COUNT("measurements",		ns_measurements),
+    STATS_COUNT("misses",		ns_misses),
+    STATS_COUNT("retries",		ns_retries),
+    STATS_COUNT("transfers",		ns_transfers),
+    STATS_COUNT("transfer_errors",	ns_transfer_errors),
+    STATS_COUNT("bytes_out",		ns_bytes_out),
+    STATS_COUNT("bytes_in",		ns_bytes_in),
+    STATS_TIME ("transfer_time",	ns_transfer_time),
+    STATS_TIME ("event_time",		ns_event_time),
+    STATS_COUNT("backoff_sleeps",	ns_backoff_sleeps),
+    STATS_TIME ("backoff_time",		ns_backoff_time),
+    STATS_COUNT("discarded",		ns_discarded),
+    STATS_COUNT("flush_reads",		ns_flush_reads),
+    STATS_TIME ("settle_time",		ns_settle_time),
+    STATS_COUNT("reconnects",		ns_reconnects),
+    STATS_COUNT("point_retries",	ns_point_retries),
+    STATS_COUNT("failed_points",	ns_failed_points),
+};
+#define N_STATS_FIELDS	(sizeof(stats_fields) / sizeof(stats_field_t))
+
+/*
+ * open_field_t: a member of n2pkvna_open_times_t
+ */
+typedef struct open_field {
+    const char *of_name;		/* YAML key */
+    size_t	of_offset;		/* offset in n2pkvna_open_times_t */
+} open_field_t;
+
+#define OPEN_TIME(name, member) \
+    { name, offsetof(n2pkvna_open_times_t, member) }
+
+static const open_field_t open_fields[] = {
+    OPEN_TIME("config",			ot_config),
+    OPEN_TIME("enumerate",		ot_enumerate),
+    OPEN_TIME("lock",			ot_lock),
+    OPEN_TIME("device",			ot_device),
+    OPEN_TIME("open",			ot_open),
+    OPEN_TIME("reset",			ot_reset),
+};
+#define N_OPEN_FIELDS	(sizeof(open_fields) / sizeof(open_field_t))
+
+/*
+ * stats_yaml: add the statistics to the -Y response
+ *   @stats: statistics to report
+ *   @times: open and reset times to report
+ */
+static void stats_yaml(const n2pkvna_stats_t *stats,
+	const n2pkvna_open_times_t *times)
+{
+    vnaproperty_t **root;
+
+    if ((root = vnaproperty_set_subtree(&gs.gs_messages,
+		    "stats.{}")) == NULL) {
+	(void)fprintf(stderr, "%s: vnaproperty_set_subtree: %s\n",
+		progname, strerror(errno));
+	exit(N2PKVNA_EXIT_SYSTEM);
+    }
+    for (size_t i = 0; i < N_STATS_FIELDS; ++i) {
+	const stats_field_t *sfp = &stats_fields[i];
+	const char *base = (const char *)stats + sfp->sf_offset;
+	int rv;
+
+	if (sfp->sf_seconds) {
+	    rv = vnaproperty_set(root, "%s=%.6f", sfp->sf_name,
+		    *(const double *)base);
+	} else {
+	    rv = vnaproperty_set(root, "%s=%llu", sfp->sf_name,
+		    (unsigned long long)*(const uint64_t *)base);
+	}
+	if (rv == -1) {
+	    (void)fprintf(stderr, "%s: vnaproperty_set: %s\n",
+		    progname, strerror(errno));
+	    exit(N2PKVNA_EXIT_SYSTEM);
+	}
+    }
+    for (int i = 0; i < N2PKVNA_STATS_BUCKETS; ++i) {
+	if (vnaproperty_set(root, "transfer_histogram[+]=%llu",
+		    (unsigned long long)stats->ns_transfer_histogram[i]) == -1) {
+	    (void)fprintf(stderr, "%s: vnaproperty_set: %s\n",
+		    progname, strerror(errno));
+	    exit(N2PKVNA_EXIT_SYSTEM);
+	}
+    }
+    for (size_t i = 0; i < N_OPEN_FIELDS; ++i) {
+	const open_field_t *ofp = &open_fields[i];
+
+	if (vnaproperty_set(root, "open_times.%s=%.6f", ofp->of_name,
+		    *(const double *)((const char *)times +
+			ofp->of_offset)) == -1) {
+	    (void)fprintf(stderr, "%s: vnaproperty_set: %s\n",
+		    progname, strerror(errno));
+	    exit(N2PKVNA_EXIT_SYSTEM);
+	}
+    }
+    if (vnaproperty_set(root, "open_times.warm=%s",
+		times->ot_warm ? "true" : "false") == -1) {
+	(void)fprintf(stderr, "%s: vnaproperty_set: %s\n",
+		progname, strerror(errno));
+	exit(N2PKVNA_EXIT_SYSTEM);
+    }
+}
+
+/*
+ * stats_print: print the statistics as text
+ *   @stats: statistics to report
+ *   @times: open and reset times to report
+ */
+static void stats_print(const n2pkvna_stats_t *stats,
+	const n2pkvna_open_times_t *times)
+{
+    for (size_t i = 0; i < N_STATS_FIELDS; ++i) {
+	const stats_field_t *sfp = &stats_fields[i];
+	const char *base = (const char *)stats + sfp->sf_offset;
+
+	if (sfp->sf_seconds) {
+	    (void)printf("%-16s %.6f s\n", sfp->sf_name,
+		    *(const double *)base);
+	} else {
+	    (void)printf("%-16s %llu\n", sfp->sf_name,
+		    (unsigned long long)*(const uint64_t *)base);
+	}
+    }
+    (void)printf("transfer time histogram:\n");
+    for (int i = 0; i < N2PKVNA_STATS_BUCKETS; ++i) {
+	if (i == N2PKVNA_STATS_BUCKETS - 1) {
+	    (void)printf("  >= %-6lu us    %llu\n", 1UL << i,
+		    (unsigned long long)stats->ns_transfer_histogram[i]);
+	} else {
+	    (void)printf("  %6lu-%-6lu us %llu\n", i == 0 ? 0UL : 1UL << i,
+		    1UL << (i + 1),
+		    (unsigned long long)stats->ns_transfer_histogram[i]);
+	}
+    }
+    (void)printf("open times:\n");
+    for (size_t i = 0; i < N_OPEN_FIELDS; ++i) {
+	const open_field_t *ofp = &open_fields[i];
+
+	(void)printf("  %-14s %.6f s\n", ofp->of_name,
+		*(const double *)((const char *)times + ofp->of_offset));
+    }
+    (void)printf("  %-14s %s\n", "warm", times->ot_warm ? "yes" : "no");
+}
+
+/*
+ * stats_main
+ */
+int stats_main(int argc, char **argv)
+{
+    bool opt_r = false;
+    n2pkvna_stats_t stats;
+    n2pkvna_open_times_t times;
+
+    /*
+     * Parse options.
+     */
+    for (;;) {
+	switch (getopt_long(argc, argv, short_options, long_options, NULL)) {
+	case -1:
+	    break;
+
+	case 'h':
+	    print_usage(usage, help);
+	    gs.gs_exitcode = N2PKVNA_EXIT_USAGE;
+	    return -1;
+
+	case 'r':
+	    opt_r = true;
+	    continue;
+
+	default:
+	    print_usage(usage, help);
+	    gs.gs_exitcode = N2PKVNA_EXIT_USAGE;
+	    return -1;
+	}
+	break;
+    }
+    argc -= optind;
+    argv += optind;
+    if (argc != 0) {
+	print_usage(usage, help);
+	gs.gs_exitcode = N2PKVNA_EXIT_USAGE;
+	return -1;
+    }
+
+    /*
+     * Report the statistics.
+     */
+    n2pkvna_get_stats(gs.gs_vnap, &stats);
+    n2pkvna_get_open_times(gs.gs_vnap, &times);
+    if (gs.gs_opt_Y) {
+	stats_yaml(&stats, &times);
+    } else {
+	stats_print(&stats, &times);
+    }
+    if (opt_r) {
+	n2pkvna_reset_stats(gs.gs_vnap);
+    }
+    return 0;
+}